@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+
+''' MQ Server Benchmark: publish/retrieve throughput and delivery latency
+
+Usage: bench_mq_server.py [URL] [MESSAGES] [SAMPLES] [QUEUES]
+
+QUEUES idle queues, each subscribed to a topic nobody publishes to, are
+created first, so publishing pays for every queue the server scans.
+'''
+
+import sys
+import threading
+import time
+
+import requests
+
+# Constants
+
+BODY  = 'x' * 64
+QUEUE = 'bench_mq_server'
+TOPIC = 'bench_mq_server'
+
+# Benchmarks
+
+def throughput(session, url, messages):
+    ''' Publish messages and then retrieve them, returning rate of each. '''
+    start = time.time()
+    for _ in range(messages):
+        session.put(url + '/topic/' + TOPIC, data=BODY).raise_for_status()
+    published = time.time() - start
+
+    start = time.time()
+    for _ in range(messages):
+        session.get(url + '/queue/' + QUEUE).raise_for_status()
+    retrieved = time.time() - start
+
+    return messages / published, messages / retrieved
+
+def latency(session, url, samples):
+    ''' Publish while a retrieve is already waiting, returning average delivery latency. '''
+    total = 0
+
+    for _ in range(samples):
+        delivered = []
+        waiter    = threading.Thread(target=lambda: delivered.append(
+            (requests.get(url + '/queue/' + QUEUE), time.time())
+        ))
+        waiter.start()
+        time.sleep(0.05)
+
+        start = time.time()
+        session.put(url + '/topic/' + TOPIC, data=BODY).raise_for_status()
+        waiter.join()
+        total += delivered[0][1] - start
+
+    return total / samples
+
+# Main execution
+
+if __name__ == '__main__':
+    url      = sys.argv[1] if len(sys.argv) > 1 else 'http://localhost:9620'
+    messages = int(sys.argv[2]) if len(sys.argv) > 2 else 1000
+    samples  = int(sys.argv[3]) if len(sys.argv) > 3 else 16
+    queues   = int(sys.argv[4]) if len(sys.argv) > 4 else 0
+    session  = requests.Session()
+
+    session.put(url + '/subscription/{}/{}'.format(QUEUE, TOPIC)).raise_for_status()
+    for queue in range(queues):
+        session.put(url + '/subscription/{}.{}/{}.{}'.format(QUEUE, queue, TOPIC, queue)).raise_for_status()
+
+    published, retrieved = throughput(session, url, messages)
+    print('Publish  {:12.1f} messages/s'.format(published))
+    print('Retrieve {:12.1f} messages/s'.format(retrieved))
+    print('Latency  {:12.1f} us'.format(latency(session, url, samples) * 1e6))
+
+    session.delete(url + '/subscription/{}/{}'.format(QUEUE, TOPIC)).raise_for_status()
+    for queue in range(queues):
+        session.delete(url + '/subscription/{}.{}/{}.{}'.format(QUEUE, queue, TOPIC, queue)).raise_for_status()
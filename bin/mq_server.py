@@ -5,21 +5,30 @@
 This Message Queue Server supports the following REST API:
 
     PUT     /topic/$topic               Publish message to $topic.
+    PUT     /batch                      Publish batch of messages to topics.
 
     GET     /queue/$queue               Retrieve one message from $queue.
+    GET     /queue/$queue?max=$n        Retrieve up to $n messages from $queue.
+    GET     /stream/$queue              Stream messages from $queue as published.
 
     PUT     /subscription/$queue/$topic Subscribe $queue to $topic.
     DELETE  /subscription/$queue/$topic Unsubscribe $queue from $topic.
 '''
 
 import collections
+import errno
 import logging
+import os
 import signal
 import socket
 import sys
 import time
 
 import tornado.gen
+import tornado.httpserver
+import tornado.iostream
+import tornado.locks
+import tornado.netutil
 import tornado.options
 import tornado.web
 
@@ -43,12 +52,7 @@ class TopicHandler(BaseHandler):
     def put(self, topic):
         ''' Publish message (request body) to each queue that is subscribed to topic. '''
         message     = self.request.body
-        subscribers = 0
-
-        for queue, topics in self.application.subscriptions.items():
-            if topic in topics:
-                self.application.queues[queue].append(message)
-                subscribers += 1
+        subscribers = self.application.publish(topic, message)
 
         if subscribers:
             self.write('Published message ({} bytes) to {} subscribers of {}\n'.format(
@@ -59,24 +63,136 @@ class TopicHandler(BaseHandler):
         else:
             raise tornado.web.HTTPError(404, 'There are no subscribers for topic: {}'.format(topic))
 
+# Batch Handler
+
+class BatchHandler(BaseHandler):
+    def put(self):
+        ''' Publish each message in batch (request body) to its topic.
+
+        The batch is a sequence of records:
+
+            $TOPIC $LENGTH\\n
+            $BODY
+
+        Nothing is published unless every record is whole.  The response has
+        one line per record in the same order:
+
+            $STATUS $MESSAGE\\n
+        '''
+        batch   = self.request.body
+        offset  = 0
+        records = []
+
+        while offset < len(batch):
+            try:
+                newline       = batch.index(b'\n', offset)
+                topic, length = batch[offset:newline].decode().split(' ')
+                length        = int(length)
+                if length < 0 or newline + 1 + length > len(batch):
+                    raise ValueError
+            except ValueError:
+                raise tornado.web.HTTPError(400, 'Invalid batch record at offset: {}'.format(offset))
+
+            records.append((topic, batch[newline + 1:newline + 1 + length]))
+            offset = newline + 1 + length
+
+        for topic, message in records:
+            subscribers = self.application.publish(topic, message)
+
+            if subscribers:
+                self.write('200 Published message ({} bytes) to {} subscribers of {}\n'.format(
+                    len(message),
+                    subscribers,
+                    topic,
+                ))
+            else:
+                self.write('404 There are no subscribers for topic: {}\n'.format(topic))
+
 # Queue Handler
 
 class QueueHandler(BaseHandler):
     @tornado.gen.coroutine
     def get(self, queue):
-        ''' Retrieve one message from queue (wait until one is available). '''
+        ''' Retrieve one message from queue (wait until one is available).
+
+        If the max argument is given, up to max messages are retrieved and
+        each one is written as a record:
+
+            $TOPIC $LENGTH\\n
+            $BODY
+        '''
 
         if queue not in self.application.queues:
             raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
 
-        while not self.application.queues[queue] and not self.request.connection.stream.closed():
-            yield tornado.gen.sleep(1)
+        try:
+            maximum = int(self.get_argument('max', 0))
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid max: {}'.format(self.get_argument('max')))
+
+        messages  = self.application.queues[queue]
+        published = self.application.published[queue]
 
-        if self.application.queues[queue]:
-            self.write_response(self.application.queues[queue].pop(0))
-        else:
+        while not messages and not self.request.connection.stream.closed():
+            yield published.wait()
+
+        if not messages:
             raise tornado.web.HTTPError(404, 'There are no messages for queue: {}'.format(queue))
 
+        if not maximum:
+            topic, message = messages.popleft()
+            self.write_response(message)
+            return
+
+        count = min(maximum, len(messages))
+        for _ in range(count):
+            topic, message = messages.popleft()
+            self.write('{} {}\n'.format(topic, len(message)).encode())
+            self.write(message)
+        self.application.logger.info('Retrieved {} messages from {}'.format(count, queue))
+
+    def on_connection_close(self):
+        self.application.published[self.path_args[0]].notify_all()
+
+# Stream Handler
+
+class StreamHandler(BaseHandler):
+    @tornado.gen.coroutine
+    def get(self, queue):
+        ''' Stream messages from queue as they are published.
+
+        The response body is chunked and each message is written as a record
+        as soon as it is available:
+
+            $TOPIC $LENGTH\\n
+            $BODY
+        '''
+
+        if queue not in self.application.queues:
+            raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
+
+        self.closed = False
+        messages    = self.application.queues[queue]
+        published   = self.application.published[queue]
+
+        try:
+            while not self.closed:
+                while messages:
+                    topic, message = messages.popleft()
+                    self.write('{} {}\n'.format(topic, len(message)).encode())
+                    self.write(message)
+                yield self.flush()
+
+                # Messages published while flushing are already queued
+                while not messages and not self.closed:
+                    yield published.wait()
+        except tornado.iostream.StreamClosedError:
+            pass
+
+    def on_connection_close(self):
+        self.closed = True
+        self.application.published[self.path_args[0]].notify_all()
+
 # Subscription Handler
 
 class SubscriptionHandler(BaseHandler):
@@ -84,6 +200,7 @@ class SubscriptionHandler(BaseHandler):
         ''' Subscribe queue to topic. '''
         try:
             self.application.subscriptions[queue].add(topic)
+            self.application.subscribers[topic].add(queue)
             if queue not in self.application.queues:
                 self.application.queues[queue]
         except KeyError:
@@ -95,6 +212,7 @@ class SubscriptionHandler(BaseHandler):
         ''' Unsubscribe queue from topic. '''
         try:
             self.application.subscriptions[queue].remove(topic)
+            self.application.subscribers[topic].discard(queue)
         except KeyError:
             raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
 
@@ -105,6 +223,7 @@ class SubscriptionHandler(BaseHandler):
 class MessageQueue(tornado.web.Application):
     DEFAULT_ADDRESS = '0.0.0.0'
     DEFAULT_PORT    = 9620
+    UNIX_PREFIX     = 'unix:'
 
     def __init__(self, **settings):
         tornado.web.Application.__init__(self, **settings)
@@ -113,18 +232,55 @@ class MessageQueue(tornado.web.Application):
         self.address       = settings.get('address', self.DEFAULT_ADDRESS)
         self.port          = settings.get('port'   , self.DEFAULT_PORT)
         self.ioloop        = tornado.ioloop.IOLoop.instance()
-        self.queues        = collections.defaultdict(list)
+        self.queues        = collections.defaultdict(collections.deque)
         self.subscriptions = collections.defaultdict(set)
+        self.subscribers   = collections.defaultdict(set)
+        self.published     = collections.defaultdict(tornado.locks.Condition)
 
         self.add_handlers('.*', (
             ('.*/topic/(.*)'            , TopicHandler),
+            ('/batch'                   , BatchHandler),
             ('.*/queue/(.*)'            , QueueHandler),
+            ('.*/stream/(.*)'           , StreamHandler),
             ('.*/subscription/(.*)/(.*)', SubscriptionHandler),
         ))
 
+    def publish(self, topic, message):
+        ''' Append message to each queue subscribed to topic and return number of subscribers. '''
+        subscribers = 0
+
+        for queue in self.subscribers.get(topic, ()):
+            self.queues[queue].append((topic, message))
+            self.published[queue].notify_all()
+            subscribers += 1
+
+        return subscribers
+
+    def unix_socket_free(self, path):
+        ''' Return whether path is free to bind: nothing is there, or connecting
+        to the socket there is refused (a previous server left it behind). '''
+        probe = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        probe.setblocking(False)
+        try:
+            probe.connect(path)
+        except (ConnectionRefusedError, FileNotFoundError):
+            return True
+        except socket.error:
+            pass
+        finally:
+            probe.close()
+        return False
+
     def run(self):
         try:
-            self.listen(self.port, self.address)
+            if self.address.startswith(self.UNIX_PREFIX):
+                path = self.address[len(self.UNIX_PREFIX):]
+                if not self.unix_socket_free(path):
+                    raise socket.error(errno.EADDRINUSE, os.strerror(errno.EADDRINUSE))
+                server = tornado.httpserver.HTTPServer(self)
+                server.add_socket(tornado.netutil.bind_unix_socket(path))
+            else:
+                self.listen(self.port, self.address)
         except socket.error as e:
             self.logger.fatal('Unable to listen on {}:{} = {}'.format(self.address, self.port, e))
             sys.exit(1)
@@ -135,7 +291,7 @@ class MessageQueue(tornado.web.Application):
 
 if __name__ == '__main__':
     tornado.options.define('debug'  , default=False, help='Enable debugging mode')
-    tornado.options.define('address', default=MessageQueue.DEFAULT_ADDRESS, help='Address to listen on.')
+    tornado.options.define('address', default=MessageQueue.DEFAULT_ADDRESS, help='Address (or unix:/path) to listen on.')
     tornado.options.define('port'   , default=MessageQueue.DEFAULT_PORT   , help='Port to listen on.')
     tornado.options.parse_command_line()
 
@@ -0,0 +1,73 @@
+#!/bin/bash
+
+FUNCTIONAL=test_cluster_client
+WORKSPACE=/tmp/$FUNCTIONAL.$(id -u)
+FAILURES=0
+
+error() {
+    echo "$@"
+    [ -r $WORKSPACE/test ] && (echo; cat $WORKSPACE/test; echo)
+    FAILURES=$((FAILURES + 1))
+}
+
+find_port() {
+    for port in $(seq 9000 9999); do
+    	if ! ss -H4tlpn | awk '{print $4}' | cut -d : -f 2 | grep -q $port; then
+    	    echo $port
+    	    break
+	fi
+    done
+}
+
+wait_for() {
+    for attempt in $(seq 100); do
+    	if [ -S "$1" ] || ss -H4tln | awk '{print $4}' | cut -d : -f 2 | grep -qx "$1"; then
+    	    return 0
+	fi
+	sleep 0.1
+    done
+    return 1
+}
+
+cleanup() {
+    STATUS=${1:-$FAILURES}
+    kill $SERVERPID
+    rm -fr $WORKSPACE
+    exit $STATUS
+}
+
+mkdir $WORKSPACE
+
+trap "cleanup" EXIT
+trap "cleanup 1" INT TERM
+
+echo
+printf "%-40s ... " "Testing $FUNCTIONAL"
+
+if [ ! -x bin/$FUNCTIONAL ]; then
+    echo "Failure: bin/$FUNCTIONAL is not executable!"
+    exit 1
+fi
+
+# Three mq_server.py brokers: two on TCP ports of their own and one on a Unix
+# domain socket
+ENDPOINTS=
+for broker in 1 2; do
+    PORT=$(find_port)
+    ./bin/mq_server.py --port=$PORT > /dev/null 2>&1 &
+    SERVERPID="$SERVERPID $!"
+    ENDPOINTS="$ENDPOINTS localhost:$PORT"
+    wait_for $PORT || error "Failure: broker on port $PORT did not start"
+done
+
+./bin/mq_server.py --address=unix:$WORKSPACE/mq.sock > /dev/null 2>&1 &
+SERVERPID="$SERVERPID $!"
+ENDPOINTS="$ENDPOINTS unix:$WORKSPACE/mq.sock"
+wait_for $WORKSPACE/mq.sock || error "Failure: broker on $WORKSPACE/mq.sock did not start"
+
+valgrind --leak-check=full bin/$FUNCTIONAL $ENDPOINTS &> $WORKSPACE/test
+if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
@@ -50,3 +50,16 @@ if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0
 else
     echo "Success"
 fi
+
+printf "%-40s ... " "Testing $FUNCTIONAL (unix socket)"
+
+./bin/mq_server.py --address=unix:$WORKSPACE/mq.sock > /dev/null 2>&1 &
+SERVERPID="$SERVERPID $!"
+sleep 1
+
+valgrind --leak-check=full bin/$FUNCTIONAL unix:$WORKSPACE/mq.sock 0 &> $WORKSPACE/test
+if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
@@ -1,5 +1,6 @@
 #!/usr/bin/env python3
 
+import socket
 import unittest
 import requests
 
@@ -51,6 +52,63 @@ class ServerTestCase(unittest.TestCase):
 
         self.test_00_publish_without_subscribers()
 
+    def test_07_publish_batch(self):
+        self.test_02_subscribe()
+
+        batch = ''.join('_topic {}\n{}'.format(len(self.BODY), self.BODY) for _ in range(2))
+        batch += '_other {}\n{}'.format(len(self.BODY), self.BODY)
+        r = requests.put(self.URL + '/batch', data=batch)
+        self.assertEqual(r.status_code  , 200)
+        self.assertEqual(r.text.splitlines(), [
+            '200 Published message ({} bytes) to 1 subscribers of _topic'.format(len(self.BODY)),
+            '200 Published message ({} bytes) to 1 subscribers of _topic'.format(len(self.BODY)),
+            '404 There are no subscribers for topic: _other',
+        ])
+
+        self.test_04_retrieve()
+        self.test_04_retrieve()
+        self.test_06_unsubscribe()
+
+    def test_08_retrieve_max(self):
+        self.test_02_subscribe()
+        self.test_03_publish()
+        self.test_03_publish()
+        self.test_03_publish()
+
+        record = '_topic {}\n{}'.format(len(self.BODY), self.BODY)
+        r = requests.get(self.URL + '/queue/_queue?max=2')
+        self.assertEqual(r.status_code, 200)
+        self.assertEqual(r.text       , record * 2)
+
+        r = requests.get(self.URL + '/queue/_queue?max=2')
+        self.assertEqual(r.status_code, 200)
+        self.assertEqual(r.text       , record)
+
+        self.test_06_unsubscribe()
+
+    def test_09_stream(self):
+        self.test_02_subscribe()
+        self.test_03_publish()
+
+        record = '_topic {}\n{}'.format(len(self.BODY), self.BODY)
+        with requests.get(self.URL + '/stream/_queue', stream=True, timeout=2) as r:
+            self.assertEqual(r.status_code, 200)
+            self.assertEqual(r.headers['Transfer-Encoding'], 'chunked')
+
+            chunks = r.iter_content(chunk_size=len(record))
+            self.assertEqual(next(chunks).decode(), record)
+
+            self.test_03_publish()
+            self.assertEqual(next(chunks).decode(), record)
+
+        self.test_06_unsubscribe()
+
+    def test_10_invalid_content_length(self):
+        for length in ('abc', '-5', '12x', ''):
+            with socket.create_connection(('localhost', 9620)) as s:
+                s.sendall('PUT /topic/_topic HTTP/1.1\r\nHost: localhost\r\nContent-Length: {}\r\n\r\n'.format(length).encode())
+                self.assertTrue(s.recv(4096).startswith(b'HTTP/1.1 400 '))
+
 # Main execution
 
 if __name__ == '__main__':
@@ -31,7 +31,7 @@ fi
 
 TESTS=$(bin/$UNIT 2>&1 | tail -n 1 | awk '{print $1}')
 for t in $(seq 0 $TESTS); do
-    desc=$(bin/$UNIT 2>&1 | awk "/$t\./ { \$1=\$2=\"\"; print \$0 }")
+    desc=$(bin/$UNIT 2>&1 | awk "/ $t\./ { \$1=\$2=\"\"; print \$0 }")
 
     printf "%-40s ... " "$desc"
     valgrind --leak-check=full bin/$UNIT $t &> $WORKSPACE/test
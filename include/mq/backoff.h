@@ -0,0 +1,48 @@
+/* backoff.h: Reconnect policy (jittered exponential backoff and circuit breaker) */
+
+#ifndef BACKOFF_H
+#define BACKOFF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define BACKOFF_MIN_MS		100	/* First wait after a failed connect */
+#define BACKOFF_MAX_MS		5000	/* Longest wait between connects */
+#define BACKOFF_THRESHOLD	10	/* Failed connects in a row that open the circuit */
+#define BACKOFF_COOLDOWN_MS	10000	/* Wait before trying an open circuit again */
+
+/* Structures */
+
+typedef enum {
+    BACKOFF_CLOSED,			// Connecting normally (backing off after failures)
+    BACKOFF_OPEN,			// Too many failures: wait out the cooldown
+    BACKOFF_HALF_OPEN,			// Cooldown over: one trial connect decides
+} BackoffState;
+
+typedef struct Backoff Backoff;
+struct Backoff {
+    int		 min_ms;		// First wait after a failure
+    int		 max_ms;		// Longest wait while the circuit is closed
+    size_t	 threshold;		// Failures that open the circuit (0 never opens)
+    int		 cooldown_ms;		// Wait while the circuit is open
+
+    BackoffState state;
+    size_t	 failures;		// Failed connects since the last success
+    uint64_t	 retry_at;		// When the next connect may start (monotonic ms)
+    unsigned	 seed;			// State of jitter
+};
+
+/* Functions */
+
+void	    backoff_init(Backoff *b, int min_ms, int max_ms, size_t threshold, int cooldown_ms);
+int	    backoff_remaining(Backoff *b, uint64_t now);
+int	    backoff_failure(Backoff *b, uint64_t now, const char *host, const char *port);
+void	    backoff_success(Backoff *b, const char *host, const char *port);
+uint64_t    backoff_now();
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,86 @@
+/* broker.h: Message Queue Broker (topics, queues, and subscriptions) */
+
+#ifndef BROKER_H
+#define BROKER_H
+
+#include "mq/table.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Structures */
+
+typedef struct Payload Payload;
+struct Payload {
+    size_t	refs;		// References from queues (updated atomically)
+    size_t	length;		// Length of body
+    size_t	topic_length;	// Length of topic
+    const char *topic;		// Topic message was published to (stored after body)
+    char	body[];		// Message body (immutable once published)
+};
+
+typedef struct Message Message;
+struct Message {
+    Payload *	payload;	// Body shared by every subscriber queue
+    Message *	next;
+};
+
+typedef struct BrokerQueue BrokerQueue;
+
+typedef struct Waiter Waiter;
+struct Waiter {
+    BrokerQueue *queue;		// Queue being waited on (NULL if not waiting)
+    Waiter *	 prev;
+    Waiter *	 next;
+};
+
+struct BrokerQueue {
+    char *	name;
+    Message *	head;
+    Message *	tail;
+    size_t	size;
+    Waiter *	waiters;	// Retrieves waiting for a message (oldest first)
+};
+
+typedef struct Topic Topic;
+struct Topic {
+    char *	    name;
+    BrokerQueue **  subscribers;
+    size_t	    nsubscribers;
+    size_t	    capacity;
+};
+
+typedef struct Broker Broker;
+struct Broker {
+    Table * topics;		// Topic name -> Topic
+    Table * queues;		// Queue name -> BrokerQueue
+
+    void  (*notify)(BrokerQueue *q, void *arg);	// Called when queue has a new message
+    void *  arg;
+};
+
+/* Functions */
+
+Payload *	payload_create(const char *topic, const char *body, size_t length);
+Payload *	payload_retain(Payload *p);
+void		payload_release(Payload *p);
+
+void		message_delete(Message *m);
+
+Broker *	broker_create();
+void		broker_delete(Broker *b);
+
+BrokerQueue *	broker_queue(Broker *b, const char *name);
+bool		broker_subscribed(Broker *b, const char *queue, const char *topic);
+bool		broker_subscribe(Broker *b, const char *queue, const char *topic);
+bool		broker_unsubscribe(Broker *b, const char *queue, const char *topic);
+size_t		broker_publish(Broker *b, const char *topic, const char *body, size_t length);
+size_t		broker_publish_payload(Broker *b, Payload *p);
+
+Message *	broker_queue_pop(BrokerQueue *q);
+void		broker_queue_wait(BrokerQueue *q, Waiter *w);
+void		broker_queue_unwait(Waiter *w);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,81 @@
+/* bus.h: Shared-memory message bus (multi-producer rings with futex wakeups) */
+
+#ifndef BUS_H
+#define BUS_H
+
+#include "mq/request.h"
+#include "mq/thread.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define BUS_PREFIX	"shm:"		/* Host prefix of shared-memory endpoints */
+#define BUS_QUEUES	64		/* Queues per bus */
+#define BUS_TOPICS	32		/* Topics each queue can subscribe to */
+#define BUS_NAME	64		/* Size of queue and topic names (with NUL) */
+#define BUS_RING_SIZE	(1<<20)		/* Bytes in each queue's ring */
+#define BUS_FULL_MS	1000		/* Longest wait for room in a full ring */
+
+/* Structures */
+
+typedef struct BusRing BusRing;
+struct BusRing {
+    uint64_t head __attribute__((aligned(64)));	// Offset of next record (only advanced by owner)
+    uint32_t consumed;			// Futex bumped whenever head advances
+    uint32_t blocked;			// Number of producers waiting for room
+
+    uint64_t tail __attribute__((aligned(64)));	// Offset past last reserved record
+    uint32_t published;			// Futex bumped whenever a record is committed
+    uint32_t waiting;			// Number of threads waiting for records
+};
+
+typedef struct BusSlot BusSlot;
+struct BusSlot {
+    char     name[BUS_NAME];		// Queue name (empty if slot is free)
+    int32_t  owner;			// Process consuming queue (0 if detached)
+    uint32_t ntopics;
+    char     topics[BUS_TOPICS][BUS_NAME];
+    BusRing  ring;
+};
+
+typedef struct BusHeader BusHeader;
+struct BusHeader {
+    uint32_t magic;			// Set once segment is initialized
+    uint32_t lock;			// Futex mutex held while changing slots
+    uint32_t version;			// Odd while slots are changing (seqlock)
+    BusSlot  slots[BUS_QUEUES];
+};
+
+typedef struct Bus Bus;
+struct Bus {
+    BusHeader *header;			// Mapping of shared segment
+    char *     rings;			// Data of each slot's ring
+    size_t     size;
+    int	       slot;			// Slot of our queue (-1 if we only publish)
+    bool       stopped;			// Set by bus_stop to end retrieves
+    size_t     dropped;			// Messages that did not fit
+    int	       fd;			// Eventfd readable while our ring holds records (-1 until bus_fd)
+    Thread     watcher;			// Thread making fd readable as records arrive
+};
+
+/* Functions */
+
+Bus *	    bus_create(const char *path, const char *queue);
+void	    bus_delete(Bus *b);
+bool	    bus_remove(const char *path);
+void	    bus_stop(Bus *b);
+
+bool	    bus_subscribe(Bus *b, const char *topic);
+bool	    bus_unsubscribe(Bus *b, const char *topic);
+
+size_t	    bus_publish(Bus *b, const char *topic, const void *data, size_t length, bool wait);
+bool	    bus_wait(Bus *b, int timeout);
+Request *   bus_retrieve(Bus *b, int timeout);
+int	    bus_fd(Bus *b);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,13 +3,24 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include "mq/bus.h"
+#include "mq/cluster.h"
+#include "mq/connection.h"
+#include "mq/engine.h"
 #include "mq/queue.h"
 
 #include <netdb.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define MQ_BATCH    64	    /* Requests moved between a queue and a thread at once */
 
 /* Structures */
 
+typedef Request MQMessage;	// Received message (body, topic and timestamp)
+
 typedef struct MessageQueue MessageQueue;
 struct MessageQueue {
     char    name[NI_MAXHOST];	// Name of message queue
@@ -19,19 +30,67 @@ struct MessageQueue {
     Queue*  outgoing;		// Requests to be sent to server
     Queue*  incoming;		// Requests received from server
     bool    shutdown;		// Whether or not to shutdown
+    bool    keepalive;		// Whether or not to reuse server connections
+    size_t  window;		// Maximum number of pipelined publish requests
+    int     linger_ms;		// Milliseconds to wait for a batch to fill
+    size_t  max_batch_bytes;	// Maximum size of batched publishes (0 disables)
+    size_t  retrieve_max;	// Maximum number of messages per retrieve request
+    bool    streaming;		// Whether or not server pushes messages on one stream
+
+    int     reconnect_min_ms;	// First wait after a failed connect (doubles per failure)
+    int     reconnect_max_ms;	// Longest wait between connects
+    size_t  breaker_threshold;	// Failed connects that open the circuit (0 never opens)
+    int     breaker_cooldown_ms;	// Wait between trial connects while the circuit is open
+
+    Connection *push_connection;	// Connection used by pusher thread
+    Connection *pull_connection;	// Connection used by puller thread
 
     // TODO: Add any necessary thread and synchronization primitives
     Thread pusher;
     Thread puller;
 
     Mutex lock_stop_mq;
+    Cond  stopped;		// Signaled by mq_stop (ends reconnect waits)
+
+    Request *inbox;		// Messages popped from incoming but not yet retrieved
+    Request *inbox_tail;
+    size_t   inbox_waiters;	// Retrieves waiting for incoming without inbox_lock
+    Mutex    inbox_lock;
+
+    Request *outbox[MQ_BATCH];	// Requests popped from outgoing but not yet sent
+    size_t   outbox_next;
+    size_t   outbox_size;
+
+    MQEngine *     engine;	// Shared I/O engine (NULL runs a pusher and puller thread)
+    EngineSession *session;	// State of Message Queue in engine
+
+    Bus *   bus;		// Shared-memory bus used instead of a server (shm:/name host)
+
+    Cluster *      cluster;	// Ring choosing broker of each topic (NULL for one server)
+    MessageQueue **brokers;	// Message Queue of each broker (sharing incoming)
+    size_t         nbrokers;
 };
 
 MessageQueue *	mq_create(const char *name, const char *host, const char *port);
+MessageQueue *	mq_create_with_queues(const char *name, const char *host, const char *port,
+                                      QueueType outgoing, QueueType incoming, size_t capacity);
+MessageQueue *	mq_create_bounded(const char *name, const char *host, const char *port,
+                                  size_t capacity, size_t max_bytes, QueuePolicy policy);
+MessageQueue *	mq_create_cluster(const char *name, const char *endpoints[]);
 void		mq_delete(MessageQueue *mq);
 
 void		mq_publish(MessageQueue *mq, const char *topic, const char *body);
+void		mq_publish_bytes(MessageQueue *mq, const char *topic, const void *data, size_t length);
+bool		mq_try_publish(MessageQueue *mq, const char *topic, const char *body);
+size_t		mq_dropped(MessageQueue *mq, size_t *outgoing, size_t *incoming);
 char *	mq_retrieve(MessageQueue *mq);
+char *	mq_try_retrieve(MessageQueue *mq);
+char *	mq_retrieve_timed(MessageQueue *mq, int timeout);
+MQMessage *	mq_retrieve_msg(MessageQueue *mq);
+MQMessage *	mq_retrieve_msg_timed(MessageQueue *mq, int timeout);
+MQMessage *	mq_try_retrieve_msg(MessageQueue *mq, bool *sentinel);
+size_t		mq_retrieve_batch(MessageQueue *mq, char *out[], size_t max);
+int		mq_fd(MessageQueue *mq);
 
 void		mq_subscribe(MessageQueue *mq, const char *topic);
 void		mq_unsubscribe(MessageQueue *mq, const char *topic);
@@ -41,6 +100,12 @@ void		mq_stop(MessageQueue *mq);
 
 bool		mq_shutdown(MessageQueue *mq);
 
+const char *	mq_message_body(const MQMessage *m);
+size_t		mq_message_length(const MQMessage *m);
+const char *	mq_message_topic(const MQMessage *m);
+uint64_t	mq_message_timestamp(const MQMessage *m);
+void		mq_message_release(MQMessage *m);
+
 #endif
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
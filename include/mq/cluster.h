@@ -0,0 +1,38 @@
+/* cluster.h: Consistent hash ring choosing a broker for each topic */
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define CLUSTER_REPLICAS    128		/* Points of each node on the ring */
+
+/* Structures */
+
+typedef struct ClusterPoint ClusterPoint;
+struct ClusterPoint {
+    uint64_t	hash;			// Position on the ring
+    size_t	node;			// Index of node owning the arc ending here
+};
+
+typedef struct Cluster Cluster;
+struct Cluster {
+    ClusterPoint *points;		// Points of every node (sorted by hash)
+    size_t	  npoints;
+    size_t	  nnodes;
+};
+
+/* Functions */
+
+Cluster *   cluster_create(const char *nodes[], size_t nnodes);
+void	    cluster_delete(Cluster *c);
+
+size_t	    cluster_lookup(Cluster *c, const char *key);
+uint64_t    cluster_hash(const char *key);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
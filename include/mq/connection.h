@@ -0,0 +1,57 @@
+/* connection.h: Persistent connection to Message Queue server */
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include "mq/backoff.h"
+#include "mq/parser.h"
+#include "mq/request.h"
+#include "mq/socket.h"
+
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define CONNECTION_BUFFER   (1<<16)	/* Size of read buffer and request scratch buffer */
+
+/* Structures */
+
+typedef struct Connection Connection;
+struct Connection {
+    char    host[NI_MAXHOST];	// Host of server
+    char    port[NI_MAXSERV];	// Port of server
+    char    authority[SOCKET_AUTHORITY];	// Value of Host header
+
+    int     fd;			// Socket file descriptor (-1 if disconnected)
+    bool    keepalive;		// Whether or not to reuse socket across requests
+    size_t  connects;		// Number of connections established
+    size_t  sent;		// Requests written in full by the last connection_send
+    Backoff backoff;		// When to retry after failed connects or requests
+
+    Parser  parser;		// State of response being read (status, framing)
+    char    input[CONNECTION_BUFFER];	// Data read from socket but not yet consumed
+    size_t  input_start;
+    size_t  input_end;
+    char    output[CONNECTION_BUFFER];	// Request heads waiting to be written
+};
+
+/* Functions */
+
+Connection *	connection_create(const char *host, const char *port, bool keepalive);
+void		connection_delete(Connection *c);
+
+int		connection_open(Connection *c);
+void		connection_close(Connection *c);
+void		connection_release(Connection *c);
+
+int		connection_send(Connection *c, Request *head);
+int		connection_read_head(Connection *c);
+ssize_t		connection_read_body(Connection *c, const char **data);
+int		connection_read_response(Connection *c, char **body, size_t *length);
+int		connection_request(Connection *c, Request *r, char **body, size_t *length);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,46 @@
+/* engine.h: Shared epoll (or io_uring) I/O engine for Message Queue clients */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "mq/thread.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Structures */
+
+struct MessageQueue;
+
+typedef struct EngineLoop EngineLoop;
+typedef struct EngineSession EngineSession;
+
+typedef enum {
+    ENGINE_EPOLL,		// Wait for readiness with epoll, then read and write
+    ENGINE_URING,		// Submit sends and receives in batches with io_uring
+} EngineBackend;
+
+typedef struct MQEngine MQEngine;
+struct MQEngine {
+    EngineLoop *    loops;	// Event loop run by each thread
+    size_t          nloops;
+    size_t          next;	// Loop the next Message Queue is attached to
+    EngineBackend   backend;	// Backend of every loop (ENGINE_EPOLL if any fell back)
+
+    Mutex           lock;
+    Cond            detached;	// Broadcast whenever a Message Queue finishes
+};
+
+/* Functions */
+
+MQEngine *  mq_engine_create(size_t nthreads);
+MQEngine *  mq_engine_create_backend(size_t nthreads, EngineBackend backend);
+void	    mq_engine_delete(MQEngine *e);
+size_t	    mq_engine_syscalls(MQEngine *e);
+
+void	    engine_attach(MQEngine *e, struct MessageQueue *mq);
+void	    engine_detach(MQEngine *e, struct MessageQueue *mq);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,9 +3,11 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <pthread.h>
 
@@ -22,6 +24,31 @@
 #define error(M, ...) \
     fprintf(stderr, "[%09lu] ERROR " M "\n", pthread_self(), ##__VA_ARGS__)
 
+#ifndef LOG_INTERVAL_MS
+#define LOG_INTERVAL_MS	1000	/* Least time between errors logged by error_limited */
+#endif
+
+/* Log error at most once per LOG_INTERVAL_MS from each call site (for errors
+ * that repeat while a server is down), counting the ones left out */
+#define error_limited(M, ...) do { \
+    static uint64_t logged_at_; \
+    static size_t   suppressed_; \
+    struct timespec now_; \
+    clock_gettime(CLOCK_MONOTONIC, &now_); \
+    uint64_t ms_   = now_.tv_sec * 1000ULL + now_.tv_nsec / 1000000 + LOG_INTERVAL_MS; \
+    uint64_t last_ = __atomic_load_n(&logged_at_, __ATOMIC_RELAXED); \
+    if (ms_ - last_ >= LOG_INTERVAL_MS && \
+        __atomic_compare_exchange_n(&logged_at_, &last_, ms_, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { \
+        size_t n_ = __atomic_exchange_n(&suppressed_, 0, __ATOMIC_RELAXED); \
+        if (n_) \
+            error(M " (%zu more suppressed)", ##__VA_ARGS__, n_); \
+        else \
+            error(M, ##__VA_ARGS__); \
+    } else { \
+        __atomic_add_fetch(&suppressed_, 1, __ATOMIC_RELAXED); \
+    } \
+} while (0)
+
 #endif
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,31 @@
+/* mailbox.h: Lock-free multi-producer, single-consumer mailbox */
+
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdbool.h>
+
+/* Structures */
+
+typedef struct Mail Mail;
+struct Mail {
+    Mail *  next;		// Embed as first member of each message
+};
+
+typedef struct Mailbox Mailbox;
+struct Mailbox {
+    Mail *  head;		// Most recently sent mail (updated atomically)
+    int	    fd;			// Event file descriptor (readable when mail arrives)
+};
+
+/* Functions */
+
+Mailbox *   mailbox_create();
+void	    mailbox_delete(Mailbox *m);
+
+void	    mailbox_send(Mailbox *m, Mail *mail);
+Mail *	    mailbox_receive(Mailbox *m);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
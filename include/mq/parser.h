@@ -0,0 +1,61 @@
+/* parser.h: Incremental HTTP/1.1 response parser */
+
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define PARSER_LINE	BUFSIZ	    /* Longest status, header or chunk size line */
+
+/* Enumerations */
+
+typedef enum {
+    PARSER_MORE,		// All input consumed without finishing response
+    PARSER_HEAD,		// Status line and headers have been parsed
+    PARSER_BODY,		// Piece of body (pointing into input) is available
+    PARSER_DONE,		// Response is complete (ready for the next one)
+    PARSER_ERROR,		// Response is invalid (parser stays in error)
+} ParserEvent;
+
+typedef enum {
+    PARSER_STATUS,
+    PARSER_HEADER,
+    PARSER_LENGTH,		// Body delimited by Content-Length
+    PARSER_CLOSE,		// Body delimited by end of stream
+    PARSER_CHUNK_SIZE,
+    PARSER_CHUNK_DATA,
+    PARSER_CHUNK_END,
+    PARSER_TRAILER,
+    PARSER_INVALID,
+} ParserState;
+
+/* Structures */
+
+typedef struct Parser Parser;
+struct Parser {
+    ParserState state;
+    size_t      remaining;	// Bytes left in body or chunk
+
+    int         status;		// HTTP status code of current response
+    bool        persistent;	// Whether server keeps stream open after response
+    bool        chunked;	// Whether body is chunked
+    long        content_length;	// Length of body (-1 if unknown)
+
+    char        line[PARSER_LINE];  // Partial line split across inputs
+    size_t      line_length;
+};
+
+/* Functions */
+
+void		parser_init(Parser *p);
+ParserEvent	parser_execute(Parser *p, const char *input, size_t size, size_t *consumed,
+			       const char **data, size_t *length);
+ParserEvent	parser_finish(Parser *p);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,6 +3,7 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,25 +11,82 @@
 #include "mq/request.h"
 #include "mq/thread.h"
 
+/* Constants */
+
+#define CACHE_LINE  64
+
 /* Structures */
 
+typedef enum {
+    QUEUE_LIST,		// Linked list under a mutex (any number of producers and consumers)
+    QUEUE_MPSC,		// Bounded lock-free ring (many producers, one consumer)
+    QUEUE_SPSC,		// Bounded lock-free ring (one producer, one consumer)
+} QueueType;
+
+typedef enum {
+    QUEUE_BLOCK,	// Push waits for room
+    QUEUE_FAIL,		// Push is refused while full
+    QUEUE_DROP_OLDEST,	// Push discards requests from the front to make room
+    QUEUE_DROP_NEWEST,	// Push discards the request being pushed
+} QueuePolicy;
+
+typedef struct Slot Slot;
+struct Slot {
+    size_t   sequence;	// Position slot is ready for (QUEUE_MPSC)
+    Request *request;
+};
+
 typedef struct Queue Queue;
 struct Queue {
-    Request *head;
+    QueueType type;
+
+    Request *head;	// QUEUE_LIST only
     Request *tail;
     size_t   size;
+    size_t   bytes;	// Total length of bodies in list
+
+    size_t      capacity;	// Maximum number of requests in list (0 is unbounded)
+    size_t      max_bytes;	// Maximum bytes of bodies in list (0 is unbounded)
+    QueuePolicy policy;		// What a push does while list is full
+    size_t      dropped;	// Requests discarded by QUEUE_DROP_* policies
+    size_t      rejected;	// Requests refused by QUEUE_FAIL or a try push
 
-    Mutex lock;
+    Mutex lock;		// Protects list (rings only use it to park)
     Cond  produced;
+    Cond  consumed;
+
+    Slot *   slots;	// Rings only
+    size_t   mask;	// Capacity of ring - 1
+    size_t   sleepers;	// Consumers parked on produced
+    size_t   blocked;	// Producers parked on consumed
+
+    int      fd;	// Eventfd readable while non-empty (-1 until queue_fd)
+    bool     signalled;	// Whether ring has made fd readable
+
+    size_t   enqueue __attribute__((aligned(CACHE_LINE)));  // Next position to fill
+    size_t   dequeue __attribute__((aligned(CACHE_LINE)));  // Next position to take
 };
 
 /* Functions */
 
 Queue *	    queue_create();
+Queue *	    queue_create_ring(QueueType type, size_t capacity);
+Queue *	    queue_create_bounded(size_t capacity, size_t max_bytes, QueuePolicy policy);
 void        queue_delete(Queue *q);
 
-void	      queue_push(Queue *q, Request *r);
+bool	    queue_push(Queue *q, Request *r);
+bool	    queue_try_push(Queue *q, Request *r);
+void	    queue_push_force(Queue *q, Request *r);
+size_t	    queue_push_batch(Queue *q, Request *head);
+Request *   queue_try_push_batch(Queue *q, Request *head);
 Request *   queue_pop(Queue *q);
+size_t      queue_pop_batch(Queue *q, Request **out, size_t max, int timeout);
+Request *   queue_try_pop(Queue *q);
+Request *   queue_pop_timed(Queue *q, int timeout);
+
+int	    queue_fd(Queue *q);
+size_t	    queue_dropped(Queue *q);
+size_t	    queue_rejected(Queue *q);
 
 #endif
 
@@ -3,8 +3,14 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
+/* Constants */
+
+#define REQUEST_CLASSES     13	    /* Pooled allocation sizes (128 B to 512 KiB) */
+
 /* Structures */
 
 typedef struct Request Request;
@@ -12,15 +18,25 @@ struct Request {
     char *	method;
     char *	uri;
     char *	body;
+    size_t	length;		// Length of body
 
     Request *	next;
+    size_t	capacity;	// Size of allocation holding Request and its strings
+    uint64_t	timestamp;	// When message was received (ns since epoch)
+    bool	forced;		// Pushed by queue_push_force (never dropped for room)
 };
 
 /* Functions */
 
 Request *   request_create(const char *method, const char *uri, const char *body);
+Request *   request_create_bytes(const char *method, const char *uri, const void *body, size_t length);
+Request *   request_reserve(const char *method, const char *uri, size_t length);
 void	      request_delete(Request *r);
-void        request_write(Request *r, FILE *fs);
+char *      request_take_body(Request *r);
+size_t      request_head(Request *r, const char *host, char *buffer, size_t size);
+void        request_write(Request *r, const char *host, FILE *fs);
+
+size_t      request_allocations();
 
 #endif
 
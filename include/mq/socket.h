@@ -3,11 +3,46 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
-#include <stdio.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+/* Constants */
+
+#define SOCKET_UNIX_PREFIX	"unix:"	/* Host prefix of Unix domain socket endpoints */
+#define SOCKET_ADDRESSES	16	/* Most addresses kept for a host */
+#define SOCKET_CACHE_TTL	30000	/* Milliseconds resolved addresses are reused */
+#define SOCKET_ATTEMPT_DELAY	250	/* Milliseconds before racing the next address */
+#define SOCKET_CONNECT_TIMEOUT	5000	/* Milliseconds to wait for any address to connect */
+#define SOCKET_AUTHORITY	(NI_MAXHOST + NI_MAXSERV + 3)	/* Size of [host]:port */
+
+/* Structures */
+
+typedef struct SocketAddress SocketAddress;
+struct SocketAddress {
+    struct sockaddr_storage address;
+    socklen_t               length;
+};
 
 /* Functions */
 
-FILE *  socket_connect(const char *host, const char *port);
+struct sockaddr_un;
+
+int     socket_connect(const char *host, const char *port);
+int     socket_connect_nonblocking(const char *host, const char *port);
+
+const char * socket_unix_path(const char *host);
+bool    socket_unix_address(struct sockaddr_un *address, const char *path);
+void    socket_authority(const char *host, const char *port, char *buffer, size_t size);
+bool    socket_endpoint(const char *endpoint, char *host, size_t hostlen, char *port, size_t portlen);
+
+size_t  socket_resolve(const char *host, const char *port, SocketAddress *addresses, size_t max);
+int     socket_race(const SocketAddress *addresses, size_t naddresses, int timeout, size_t *winner);
+void    socket_prefer(const char *host, const char *port, const SocketAddress *address);
+void    socket_failed(const char *host, const char *port);
+int     socket_cache_ttl(int ttl);
+size_t  socket_lookups();
 
 #endif
 
@@ -0,0 +1,39 @@
+/* table.h: Hash Table of strings to values */
+
+#ifndef TABLE_H
+#define TABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Structures */
+
+typedef struct Entry Entry;
+struct Entry {
+    char *  key;
+    void *  value;
+    Entry * next;
+};
+
+typedef struct Table Table;
+struct Table {
+    Entry **buckets;
+    size_t  capacity;
+    size_t  size;
+};
+
+/* Functions */
+
+Table *	    table_create(size_t capacity);
+void        table_delete(Table *t, void (*delete_value)(void *));
+
+void        table_insert(Table *t, const char *key, void *value);
+void *      table_search(Table *t, const char *key);
+void *      table_remove(Table *t, const char *key);
+
+size_t      table_hash(const char *key);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -38,6 +38,15 @@ typedef pthread_cond_t              Cond;
 #define cond_init(c, a)             PTHREAD_CHECK(pthread_cond_init(c, a))
 #define cond_wait(c, l)             PTHREAD_CHECK(pthread_cond_wait(c, l))
 #define cond_signal(c)              PTHREAD_CHECK(pthread_cond_signal(c))
+#define cond_broadcast(c)           PTHREAD_CHECK(pthread_cond_broadcast(c))
+
+/* Reader-Writer Locks */
+
+typedef pthread_rwlock_t            RWLock;
+#define rwlock_init(l, a)           PTHREAD_CHECK(pthread_rwlock_init(l, a))
+#define rwlock_rdlock(l)            PTHREAD_CHECK(pthread_rwlock_rdlock(l))
+#define rwlock_wrlock(l)            PTHREAD_CHECK(pthread_rwlock_wrlock(l))
+#define rwlock_unlock(l)            PTHREAD_CHECK(pthread_rwlock_unlock(l))
 
 #endif
 
@@ -0,0 +1,62 @@
+/* uring.h: Minimal io_uring interface (raw system calls, no liburing) */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Structures */
+
+typedef struct Uring Uring;
+struct Uring {
+    int	                  fd;
+    unsigned              features;	// IORING_FEAT_* supported by kernel
+    size_t                enters;	// Calls to io_uring_enter
+
+    unsigned *            sq_head;	// Submission queue (shared with kernel)
+    unsigned *            sq_tail;
+    unsigned *            sq_array;
+    unsigned              sq_mask;
+    unsigned              sq_entries;
+    unsigned              sq_local;	// Tail including entries not yet published
+    unsigned              sq_pending;	// Entries published but not yet submitted
+    struct io_uring_sqe * sqes;
+
+    unsigned *            cq_head;	// Completion queue (shared with kernel)
+    unsigned *            cq_tail;
+    unsigned              cq_mask;
+    struct io_uring_cqe * cqes;
+
+    void *                ring;		// Mapping of both queue rings
+    size_t                ring_size;
+    size_t                sqes_size;
+
+    struct io_uring_buf_ring *buffers;	// Provided buffer ring (registered with kernel)
+    size_t                buffers_size;
+    unsigned              nbuffers;
+    size_t                buffer_size;
+    unsigned short        buffer_tail;
+    unsigned short        buffer_group;
+    char *                buffer_data;
+};
+
+/* Functions */
+
+int	    uring_init(Uring *u, unsigned entries);
+void	    uring_exit(Uring *u);
+
+struct io_uring_sqe * uring_sqe(Uring *u);
+int	    uring_enter(Uring *u, bool wait, int timeout);
+struct io_uring_cqe * uring_cqe(Uring *u);
+void	    uring_seen(Uring *u);
+
+int	    uring_buffers(Uring *u, unsigned nbuffers, size_t size, unsigned short group);
+char *	    uring_buffer(Uring *u, unsigned id);
+void	    uring_recycle(Uring *u, unsigned id);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
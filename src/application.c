@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <poll.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -61,9 +62,39 @@ void show_options() {
     printf("    quit\n\n");
 }
 
+// Print one message from the server
+void print_message(const char *body) {
+    char name[BUFSIZ], topic[BUFSIZ], message[BUFSIZ];
+    int scan_status = sscanf(body, "%s %s %[^\t\n]", name, topic, message);
+
+    if (scan_status != 3) {
+        printf("\n%s\n", body);
+    }
+    else {
+        printf("\r%-80s", ""); // Erase line
+        printf("\r%s> %s: %s\n", name, topic, message);
+    }
+}
+
+// Print every message that has arrived from the server (going past the
+// SENTINEL of another client quitting, since messages behind it would not
+// make mq_fd readable again)
+void print_messages(MessageQueue *mq) {
+    MQMessage *m;
+    bool sentinel;
+
+    while ((m = mq_try_retrieve_msg(mq, &sentinel)) || sentinel) {
+        if (m) {
+            print_message(mq_message_body(m));
+            mq_message_release(m);
+        }
+    }
+}
+
 /* Threads */
 
-// Run background thread to retrieve and print messages from the server
+// Run background thread to retrieve and print messages from the server (when
+// there is no mq_fd to poll)
 void *background_thread(void *arg) {
     MessageQueue *mq = (MessageQueue *)arg;
 
@@ -71,19 +102,8 @@ void *background_thread(void *arg) {
     while (!mq_shutdown(mq)) {
         char *body = mq_retrieve(mq);
 
-        // Print message
         if (body) {
-            char name[BUFSIZ], topic[BUFSIZ], message[BUFSIZ];
-            int scan_status = sscanf(body, "%s %s %[^\t\n]", name, topic, message);
-
-            if (scan_status != 3) {
-                printf("\n%s\n", body);
-            }
-            else {
-                printf("\r%-80s", ""); // Erase line
-                printf("\r%s> %s: %s\n", name, topic, message);
-            }
-
+            print_message(body);
             free(body);
         }
     }
@@ -151,18 +171,36 @@ int main(int argc, char *argv[]) {
 
     toggle_raw_mode();
 
-    // Background thread
+    // Wait for input and messages on the same thread, or fall back to a
+    // background thread printing messages if there is no mq_fd to poll
+    struct pollfd fds[] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = mq_fd(mq)   , .events = POLLIN },
+    };
+    nfds_t nfds = 2;
+
     Thread background;
-    thread_create(&background, NULL, background_thread, (void *)mq);
+    if (fds[1].fd < 0) {
+        fprintf(stderr, "Unable to poll for messages, printing them from a background thread\n");
+        thread_create(&background, NULL, background_thread, (void *)mq);
+        nfds = 1;
+    }
 
-    // Foreground thread
     char   input_buffer[BUFSIZ] = "";
     size_t input_index = 0;
 
     // Receive input commands until the program terminates
     while (true) {
 	     char input_char = 0;
-    	 read(STDIN_FILENO, &input_char, 1);
+	     if (poll(fds, nfds, -1) < 0) {
+	        continue;
+	     }
+	     if (nfds > 1 && (fds[1].revents & POLLIN)) {
+	        print_messages(mq);
+	     }
+	     if (fds[0].revents & POLLIN) {
+    	    read(STDIN_FILENO, &input_char, 1);
+	     }
 
        // Wait for newline input to process command
        if (input_char == '\n') {
@@ -266,6 +304,9 @@ endline:
     // Stop and delete mq
     printf("\n");
     mq_stop(mq);
+    if (nfds == 1) {
+        thread_join(background, NULL);
+    }
     mq_delete(mq);
 
     return 0;
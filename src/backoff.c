@@ -0,0 +1,122 @@
+/* backoff.c: Reconnect policy (jittered exponential backoff and circuit breaker) */
+
+#include "mq/backoff.h"
+#include "mq/logging.h"
+
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Initialize Backoff structure with a policy (and no failures yet).
+ * @param   b           Backoff structure.
+ * @param   min_ms      First wait after a failed connect (0 retries at once).
+ * @param   max_ms      Longest wait while the circuit is closed.
+ * @param   threshold   Failed connects in a row that open the circuit (0
+ *                      never opens it).
+ * @param   cooldown_ms Wait while the circuit is open.
+ */
+void backoff_init(Backoff *b, int min_ms, int max_ms, size_t threshold, int cooldown_ms) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    *b = (Backoff) {
+        .min_ms      = min_ms > 0 ? min_ms : 0,
+        .max_ms      = max_ms > min_ms ? max_ms : min_ms,
+        .threshold   = threshold,
+        .cooldown_ms = cooldown_ms > 0 ? cooldown_ms : 0,
+        .state       = BACKOFF_CLOSED,
+        .seed        = (unsigned)(uintptr_t)b ^ (unsigned)getpid() ^ (unsigned)now.tv_nsec,
+    };
+}
+
+/**
+ * Return random wait between half of ceiling and all of it, so that clients
+ * which failed together do not all come back at the same moment.
+ * @param   b           Backoff structure.
+ * @param   ceiling     Longest wait in milliseconds.
+ * @return  Wait in milliseconds.
+ */
+static int backoff_jitter(Backoff *b, int ceiling) {
+    int half = ceiling / 2;
+    return ceiling - half + (half ? rand_r(&b->seed) % (half + 1) : 0);
+}
+
+/**
+ * Return milliseconds until the next connect may start.  An open circuit
+ * becomes half-open once its cooldown is over, so the connect that follows
+ * is its trial.
+ * @param   b           Backoff structure.
+ * @param   now         Monotonic time in milliseconds.
+ * @return  Milliseconds to wait (0 if a connect may start now).
+ */
+int backoff_remaining(Backoff *b, uint64_t now) {
+    if (b->retry_at > now) {
+        return (int)(b->retry_at - now);
+    }
+
+    if (b->state == BACKOFF_OPEN) {
+        b->state = BACKOFF_HALF_OPEN;
+    }
+    return 0;
+}
+
+/**
+ * Record a failed connect (or a request that failed on a connection) and
+ * schedule the next connect: each failure doubles the wait up to max_ms,
+ * until threshold failures open the circuit and connects are only tried once
+ * per cooldown (a failed trial reopens it).
+ * @param   b           Backoff structure.
+ * @param   now         Monotonic time in milliseconds.
+ * @param   host        Host of server (for logging).
+ * @param   port        Port of server (for logging).
+ * @return  Milliseconds until the next connect may start.
+ */
+int backoff_failure(Backoff *b, uint64_t now, const char *host, const char *port) {
+    b->failures++;
+
+    int delay;
+    if (b->state == BACKOFF_HALF_OPEN || (b->threshold && b->failures >= b->threshold)) {
+        if (b->state == BACKOFF_CLOSED) {
+            error("Circuit to %s%s%s open after %zu failures (retrying every %d ms)",
+                  host, port[0] ? ":" : "", port, b->failures, b->cooldown_ms);
+        }
+        b->state = BACKOFF_OPEN;
+        delay    = backoff_jitter(b, b->cooldown_ms);
+    } else {
+        int ceiling = b->min_ms;
+        for (size_t f = 1; f < b->failures && ceiling < b->max_ms; f++) {
+            ceiling *= 2;
+        }
+        delay = backoff_jitter(b, ceiling < b->max_ms ? ceiling : b->max_ms);
+    }
+
+    b->retry_at = now + delay;
+    return delay;
+}
+
+/**
+ * Record a successful request, which closes the circuit and resets the wait.
+ * @param   b           Backoff structure.
+ * @param   host        Host of server (for logging).
+ * @param   port        Port of server (for logging).
+ */
+void backoff_success(Backoff *b, const char *host, const char *port) {
+    if (b->state != BACKOFF_CLOSED) {
+        info("Reconnected to %s%s%s after %zu failures", host, port[0] ? ":" : "", port, b->failures);
+    }
+
+    b->state    = BACKOFF_CLOSED;
+    b->failures = 0;
+    b->retry_at = 0;
+}
+
+/**
+ * Return monotonic time in milliseconds.
+ */
+uint64_t backoff_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
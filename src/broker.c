@@ -0,0 +1,360 @@
+/* broker.c: Message Queue Broker (topics, queues, and subscriptions) */
+
+#include "mq/broker.h"
+#include "mq/string.h"
+
+/* Internal Prototypes */
+
+void	broker_queue_delete(void *value);
+void	broker_topic_delete(void *value);
+
+/* External Functions */
+
+/**
+ * Create Payload structure holding copy of message body (with one reference).
+ * @param   topic       Name of topic.
+ * @param   body        Message body.
+ * @param   length      Length of message body.
+ * @return  Newly allocated Payload structure.
+ */
+Payload * payload_create(const char *topic, const char *body, size_t length) {
+    size_t   topic_length = strlen(topic);
+    Payload *p = malloc(sizeof(Payload) + length + topic_length + 1);
+
+    if (p) {
+        p->refs         = 1;
+        p->length       = length;
+        p->topic_length = topic_length;
+        p->topic        = p->body + length;
+        memcpy(p->body, body, length);
+        memcpy(p->body + length, topic, topic_length + 1);
+    }
+
+    return p;
+}
+
+/**
+ * Add reference to Payload (safe to call from any thread).
+ * @param   p           Payload structure.
+ * @return  Payload structure.
+ */
+Payload * payload_retain(Payload *p) {
+    __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+/**
+ * Drop reference to Payload, freeing it with the last one (safe to call from
+ * any thread).
+ * @param   p           Payload structure.
+ */
+void payload_release(Payload *p) {
+    if (p && __atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(p);
+    }
+}
+
+/**
+ * Delete Message structure (and its reference to the payload).
+ * @param   m           Message structure.
+ */
+void message_delete(Message *m) {
+    if (m) {
+        payload_release(m->payload);
+        free(m);
+    }
+}
+
+/**
+ * Create Broker structure.
+ * @return  Newly allocated Broker structure.
+ */
+Broker * broker_create() {
+    Broker *b = calloc(1, sizeof(Broker));
+
+    if (b) {
+        b->topics = table_create(0);
+        b->queues = table_create(0);
+        if (!b->topics || !b->queues) {
+            broker_delete(b);
+            return NULL;
+        }
+    }
+
+    return b;
+}
+
+/**
+ * Delete Broker structure (and all of its topics, queues, and messages).
+ * @param   b           Broker structure.
+ */
+void broker_delete(Broker *b) {
+    if (b) {
+        if (b->topics)
+            table_delete(b->topics, broker_topic_delete);
+        if (b->queues)
+            table_delete(b->queues, broker_queue_delete);
+        free(b);
+    }
+}
+
+/**
+ * Lookup queue by name.
+ * @param   b           Broker structure.
+ * @param   name        Name of queue.
+ * @return  BrokerQueue structure (NULL if queue has never been subscribed).
+ */
+BrokerQueue * broker_queue(Broker *b, const char *name) {
+    return table_search(b->queues, name);
+}
+
+/**
+ * Check whether queue is subscribed to topic.
+ * @param   b           Broker structure.
+ * @param   queue       Name of queue.
+ * @param   topic       Name of topic.
+ * @return  Whether or not queue is subscribed to topic.
+ */
+bool broker_subscribed(Broker *b, const char *queue, const char *topic) {
+    BrokerQueue *q = table_search(b->queues, queue);
+    Topic       *t = table_search(b->topics, topic);
+
+    if (q && t) {
+        for (size_t s = 0; s < t->nsubscribers; s++) {
+            if (t->subscribers[s] == q) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Subscribe queue to topic (creating either if necessary).
+ * @param   b           Broker structure.
+ * @param   queue       Name of queue.
+ * @param   topic       Name of topic.
+ * @return  Whether or not subscription was successful.
+ */
+bool broker_subscribe(Broker *b, const char *queue, const char *topic) {
+    BrokerQueue *q = table_search(b->queues, queue);
+    if (!q) {
+        if (!(q = calloc(1, sizeof(BrokerQueue))) || !(q->name = strdup(queue))) {
+            free(q);
+            return false;
+        }
+        table_insert(b->queues, queue, q);
+    }
+
+    Topic *t = table_search(b->topics, topic);
+    if (!t) {
+        if (!(t = calloc(1, sizeof(Topic))) || !(t->name = strdup(topic))) {
+            free(t);
+            return false;
+        }
+        table_insert(b->topics, topic, t);
+    }
+
+    for (size_t s = 0; s < t->nsubscribers; s++) {
+        if (t->subscribers[s] == q) {
+            return true;
+        }
+    }
+
+    if (t->nsubscribers == t->capacity) {
+        size_t capacity      = t->capacity ? 2*t->capacity : 4;
+        BrokerQueue **bigger = realloc(t->subscribers, capacity * sizeof(BrokerQueue *));
+        if (!bigger) {
+            return false;
+        }
+        t->subscribers = bigger;
+        t->capacity    = capacity;
+    }
+
+    t->subscribers[t->nsubscribers++] = q;
+    return true;
+}
+
+/**
+ * Unsubscribe queue from topic.
+ * @param   b           Broker structure.
+ * @param   queue       Name of queue.
+ * @param   topic       Name of topic.
+ * @return  Whether or not queue was subscribed to topic.
+ */
+bool broker_unsubscribe(Broker *b, const char *queue, const char *topic) {
+    BrokerQueue *q = table_search(b->queues, queue);
+    Topic       *t = table_search(b->topics, topic);
+
+    if (!q || !t) {
+        return false;
+    }
+
+    for (size_t s = 0; s < t->nsubscribers; s++) {
+        if (t->subscribers[s] == q) {
+            memmove(&t->subscribers[s], &t->subscribers[s + 1],
+                    (t->nsubscribers - s - 1) * sizeof(BrokerQueue *));
+            t->nsubscribers--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Publish message to each queue subscribed to topic.
+ * @param   b           Broker structure.
+ * @param   topic       Name of topic.
+ * @param   body        Message body.
+ * @param   length      Length of message body.
+ * @return  Number of subscribers message was delivered to.
+ */
+size_t broker_publish(Broker *b, const char *topic, const char *body, size_t length) {
+    if (!table_search(b->topics, topic)) {
+        return 0;
+    }
+
+    Payload *p = payload_create(topic, body, length);
+    if (!p) {
+        return 0;
+    }
+
+    size_t subscribers = broker_publish_payload(b, p);
+    payload_release(p);
+    return subscribers;
+}
+
+/**
+ * Append message referring to payload (not a copy of it) to each queue
+ * subscribed to its topic.
+ * @param   b           Broker structure.
+ * @param   p           Payload structure (caller keeps its reference).
+ * @return  Number of subscribers message was delivered to.
+ */
+size_t broker_publish_payload(Broker *b, Payload *p) {
+    Topic *t = table_search(b->topics, p->topic);
+    if (!t) {
+        return 0;
+    }
+
+    size_t subscribers = 0;
+    for (size_t s = 0; s < t->nsubscribers; s++) {
+        BrokerQueue *q = t->subscribers[s];
+        Message     *m = malloc(sizeof(Message));
+        if (!m) {
+            continue;
+        }
+
+        m->payload = p;
+        m->next    = NULL;
+
+        if (q->tail) {
+            q->tail->next = m;
+        } else {
+            q->head = m;
+        }
+        q->tail = m;
+        q->size++;
+        subscribers++;
+
+        if (q->waiters && b->notify) {
+            b->notify(q, b->arg);
+        }
+    }
+
+    // Caller still holds a reference, so adding them all at once is safe
+    __atomic_add_fetch(&p->refs, subscribers, __ATOMIC_RELAXED);
+    return subscribers;
+}
+
+/**
+ * Remove oldest message from queue.
+ * @param   q           BrokerQueue structure.
+ * @return  Message (caller must delete) or NULL if queue is empty.
+ */
+Message * broker_queue_pop(BrokerQueue *q) {
+    Message *m = q->head;
+
+    if (m) {
+        q->head = m->next;
+        if (!q->head) {
+            q->tail = NULL;
+        }
+        q->size--;
+        m->next = NULL;
+    }
+
+    return m;
+}
+
+/**
+ * Add waiter to end of queue's list of waiting retrieves.
+ * @param   q           BrokerQueue structure.
+ * @param   w           Waiter structure (must not already be waiting).
+ */
+void broker_queue_wait(BrokerQueue *q, Waiter *w) {
+    w->queue = q;
+    w->next  = NULL;
+    w->prev  = NULL;
+
+    if (!q->waiters) {
+        q->waiters = w;
+        return;
+    }
+
+    Waiter *last = q->waiters;
+    while (last->next) {
+        last = last->next;
+    }
+    last->next = w;
+    w->prev    = last;
+}
+
+/**
+ * Remove waiter from its queue's list of waiting retrieves (if any).
+ * @param   w           Waiter structure.
+ */
+void broker_queue_unwait(Waiter *w) {
+    if (!w->queue) {
+        return;
+    }
+
+    if (w->prev) {
+        w->prev->next = w->next;
+    } else {
+        w->queue->waiters = w->next;
+    }
+    if (w->next) {
+        w->next->prev = w->prev;
+    }
+
+    w->queue = NULL;
+    w->next  = NULL;
+    w->prev  = NULL;
+}
+
+/* Internal Functions */
+
+void broker_queue_delete(void *value) {
+    BrokerQueue *q = value;
+    Message     *m;
+
+    while ((m = broker_queue_pop(q))) {
+        message_delete(m);
+    }
+
+    free(q->name);
+    free(q);
+}
+
+void broker_topic_delete(void *value) {
+    Topic *t = value;
+
+    free(t->subscribers);
+    free(t->name);
+    free(t);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
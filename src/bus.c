@@ -0,0 +1,745 @@
+/* bus.c: Shared-memory message bus (multi-producer rings with futex wakeups) */
+
+#include "mq/bus.h"
+#include "mq/logging.h"
+#include "mq/string.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define BUS_MAGIC	0x4d514232	/* "MQB2" (slots record their owner) */
+#define BUS_HEADER_SIZE	((sizeof(BusHeader) + 4095) & ~(size_t)4095)
+#define BUS_SIZE	(BUS_HEADER_SIZE + (size_t)BUS_QUEUES * BUS_RING_SIZE)
+#define BUS_ATTACH_MS	1000		/* How long to wait for another process to initialize bus */
+
+/* Internal Structures */
+
+typedef struct BusRecord BusRecord;
+struct BusRecord {
+    uint32_t size;			// Bytes in record (0 until committed)
+    uint16_t flags;
+    uint16_t topic_length;
+    uint64_t length;			// Bytes in body (after topic)
+};
+
+enum {
+    BUS_PAD = 1,			// Fills end of ring (record did not fit)
+};
+
+/* Internal Functions */
+
+/**
+ * Wait on or wake futex word shared between processes.
+ * @param   word        Futex word (in shared memory).
+ * @param   op          FUTEX_WAIT or FUTEX_WAKE.
+ * @param   value       Expected value (FUTEX_WAIT) or number to wake.
+ * @param   timeout     Relative timeout (NULL waits forever).
+ * @return  Result of system call (-1 with errno set on failure).
+ */
+static long bus_futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+/**
+ * Compute deadline timeout milliseconds from now.
+ * @param   deadline    Time to store deadline in (CLOCK_MONOTONIC).
+ * @param   timeout     Milliseconds from now.
+ */
+static void bus_deadline(struct timespec *deadline, int timeout) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec  += timeout / 1000;
+    deadline->tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * Compute time left until deadline.
+ * @param   deadline    Deadline (CLOCK_MONOTONIC).
+ * @param   remaining   Time to store what is left in.
+ * @return  Whether or not deadline is still ahead.
+ */
+static bool bus_remaining(const struct timespec *deadline, struct timespec *remaining) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remaining->tv_sec  = deadline->tv_sec - now.tv_sec;
+    remaining->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (remaining->tv_nsec < 0) {
+        remaining->tv_sec--;
+        remaining->tv_nsec += 1000000000L;
+    }
+    return remaining->tv_sec >= 0;
+}
+
+/**
+ * Lock futex mutex (0 unlocked, 1 locked, 2 locked with waiters).
+ * @param   lock        Futex word.
+ */
+static void bus_lock(uint32_t *lock) {
+    uint32_t state = 0;
+
+    if (__atomic_compare_exchange_n(lock, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (state != 2) {
+        state = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+    }
+    while (state != 0) {
+        bus_futex(lock, FUTEX_WAIT, 2, NULL);
+        state = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+/**
+ * Unlock futex mutex (waking one waiter if there are any).
+ * @param   lock        Futex word.
+ */
+static void bus_unlock(uint32_t *lock) {
+    if (__atomic_fetch_sub(lock, 1, __ATOMIC_RELEASE) != 1) {
+        __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+        bus_futex(lock, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+/**
+ * Lock slots and mark them as changing, so publishers scanning them retry.
+ * @param   b           Bus structure.
+ */
+static void bus_begin(Bus *b) {
+    bus_lock(&b->header->lock);
+    __atomic_fetch_add(&b->header->version, 1, __ATOMIC_ACQ_REL);
+}
+
+/**
+ * Mark slots as settled and unlock them.
+ * @param   b           Bus structure.
+ */
+static void bus_end(Bus *b) {
+    __atomic_fetch_add(&b->header->version, 1, __ATOMIC_RELEASE);
+    bus_unlock(&b->header->lock);
+}
+
+/**
+ * Wait until shared value becomes ready (set by the process that created the
+ * bus), polling for at most BUS_ATTACH_MS.
+ * @param   ready       Function checking whether value is ready.
+ * @param   arg         Argument to ready.
+ * @return  Whether or not value became ready.
+ */
+static bool bus_await(bool (*ready)(void *), void *arg) {
+    for (int ms = 0; ms < BUS_ATTACH_MS; ms++) {
+        if (ready(arg)) {
+            return true;
+        }
+        usleep(1000);
+    }
+    return ready(arg);
+}
+
+static bool bus_sized(void *arg) {
+    struct stat st;
+    return fstat(*(int *)arg, &st) == 0 && (size_t)st.st_size == BUS_SIZE;
+}
+
+static bool bus_initialized(void *arg) {
+    return __atomic_load_n(&((BusHeader *)arg)->magic, __ATOMIC_ACQUIRE) == BUS_MAGIC;
+}
+
+/**
+ * Check whether process owning a queue is still running (a crashed owner
+ * never detached, so its pid stays behind).
+ * @param   owner       Process id of owner (0 if none).
+ * @return  Whether or not owner is alive.
+ */
+static bool bus_alive(int32_t owner) {
+    return owner > 0 && (kill(owner, 0) == 0 || errno != ESRCH);
+}
+
+/**
+ * Find slot of queue (or claim a free one for it) and become its owner.  A
+ * queue has one consumer at a time, since only the owner advances its head.
+ * @param   b           Bus structure.
+ * @param   queue       Name of queue.
+ * @return  Index of slot (-1 with errno set to EBUSY if queue already has a
+ *          live owner, or ENOSPC if every slot is taken).
+ */
+static int bus_claim(Bus *b, const char *queue) {
+    int slot  = -1;
+    int found = -1;
+
+    bus_begin(b);
+    for (int index = 0; index < BUS_QUEUES; index++) {
+        BusSlot *s = &b->header->slots[index];
+        if (streq(s->name, queue)) {
+            found = index;
+            break;
+        }
+        if (slot < 0 && !s->name[0]) {
+            slot = index;
+        }
+    }
+    if (found >= 0) {
+        slot = bus_alive(b->header->slots[found].owner) ? -1 : found;
+        errno = EBUSY;
+    } else if (slot >= 0) {
+        snprintf(b->header->slots[slot].name, BUS_NAME, "%s", queue);
+    } else {
+        errno = ENOSPC;
+    }
+    if (slot >= 0) {
+        b->header->slots[slot].owner = getpid();
+    }
+    bus_end(b);
+
+    return slot;
+}
+
+/**
+ * Check whether a committed record waits at the head of our queue's ring.
+ * @param   b           Bus structure.
+ * @return  Whether or not there is a record to retrieve.
+ */
+static bool bus_pending(Bus *b) {
+    BusRing *  ring = &b->header->slots[b->slot].ring;
+    uint64_t   head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    BusRecord *r    = (BusRecord *)(b->rings + (size_t)b->slot * BUS_RING_SIZE + head % BUS_RING_SIZE);
+    return __atomic_load_n(&r->size, __ATOMIC_SEQ_CST) != 0;
+}
+
+/**
+ * Clear our eventfd once our ring looks empty, then look again, so a record
+ * committed in between is not left without a wakeup.
+ * @param   b           Bus structure.
+ * @return  Whether or not a record arrived after all.
+ */
+static bool bus_drain(Bus *b) {
+    int      fd = __atomic_load_n(&b->fd, __ATOMIC_ACQUIRE);
+    uint64_t value;
+
+    if (fd < 0 || read(fd, &value, sizeof(value)) < 0) {
+        return false;
+    }
+    return bus_pending(b);
+}
+
+/**
+ * Make our eventfd readable whenever a record is committed to our ring, until
+ * bus is stopped (publishers wake us like they wake a waiting retrieve).
+ * @param   arg         Bus structure.
+ * @return  NULL.
+ */
+static void * bus_watch(void *arg) {
+    Bus *    b    = arg;
+    BusRing *ring = &b->header->slots[b->slot].ring;
+    uint64_t one  = 1;
+
+    while (!__atomic_load_n(&b->stopped, __ATOMIC_ACQUIRE)) {
+        uint32_t published = __atomic_load_n(&ring->published, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+        if (bus_pending(b) && write(b->fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            error("Unable to signal eventfd: %s", strerror(errno));
+        }
+        if (!__atomic_load_n(&b->stopped, __ATOMIC_ACQUIRE)) {
+            bus_futex(&ring->published, FUTEX_WAIT, published, NULL);
+        }
+        __atomic_fetch_sub(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    }
+
+    // Leave it readable, so pollers retrieve the NULL that says we stopped
+    if (write(b->fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        error("Unable to signal eventfd: %s", strerror(errno));
+    }
+    return NULL;
+}
+
+/**
+ * Collect slots of queues subscribed to topic (retrying if they change while
+ * we look).
+ * @param   b           Bus structure.
+ * @param   topic       Topic published to.
+ * @param   slots       Array to store slot indices in.
+ * @return  Number of slots stored.
+ */
+static size_t bus_subscribers(Bus *b, const char *topic, int slots[BUS_QUEUES]) {
+    BusHeader *h = b->header;
+    uint32_t   version;
+    size_t     n;
+
+    do {
+        while ((version = __atomic_load_n(&h->version, __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+
+        n = 0;
+        for (int index = 0; index < BUS_QUEUES; index++) {
+            BusSlot *s       = &h->slots[index];
+            uint32_t ntopics = s->ntopics < BUS_TOPICS ? s->ntopics : BUS_TOPICS;
+            if (!s->name[0]) {
+                continue;
+            }
+            for (uint32_t t = 0; t < ntopics; t++) {
+                if (strncmp(s->topics[t], topic, BUS_NAME) == 0) {
+                    slots[n++] = index;
+                    break;
+                }
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&h->version, __ATOMIC_RELAXED) != version);
+
+    return n;
+}
+
+/**
+ * Write one record into ring of slot: reserve room by advancing tail, copy
+ * topic and body in, then commit by storing the record's size.
+ * @param   b           Bus structure.
+ * @param   slot        Slot to write to.
+ * @param   topic       Topic published to.
+ * @param   data        Message body.
+ * @param   length      Length of message body.
+ * @param   need        Size of record.
+ * @param   wait        Whether to wait for room (at most BUS_FULL_MS, and
+ *                      only while the queue's owner is alive).
+ * @return  Whether or not record was written.
+ */
+static bool bus_write(Bus *b, int slot, const char *topic, const void *data, size_t length, size_t need, bool wait) {
+    BusSlot *s     = &b->header->slots[slot];
+    BusRing *ring  = &s->ring;
+    char *   base  = b->rings + (size_t)slot * BUS_RING_SIZE;
+    uint64_t tail  = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    bool     timed = false;
+    size_t   pad;
+    struct timespec deadline, remaining;
+
+    while (true) {
+        // Read consumed before head, so a wake between them is not missed
+        uint32_t consumed = __atomic_load_n(&ring->consumed, __ATOMIC_ACQUIRE);
+        uint64_t head     = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        size_t   offset   = tail % BUS_RING_SIZE;
+
+        // Records never wrap: skip to the start if this one does not fit
+        pad = offset + need > BUS_RING_SIZE ? BUS_RING_SIZE - offset : 0;
+        if (tail + pad + need - head > BUS_RING_SIZE) {
+            // Nobody will drain the ring of a departed (or crashed) owner,
+            // and a stuck one must not hold up publishers for good
+            if (!wait || !bus_alive(__atomic_load_n(&s->owner, __ATOMIC_RELAXED))) {
+                return false;
+            }
+            if (!timed) {
+                bus_deadline(&deadline, BUS_FULL_MS);
+                timed = true;
+            }
+            if (!bus_remaining(&deadline, &remaining)) {
+                return false;
+            }
+            __atomic_fetch_add(&ring->blocked, 1, __ATOMIC_SEQ_CST);
+            bus_futex(&ring->consumed, FUTEX_WAIT, consumed, &remaining);
+            __atomic_fetch_sub(&ring->blocked, 1, __ATOMIC_SEQ_CST);
+            tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + pad + need, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (pad) {
+        BusRecord *r = (BusRecord *)(base + tail % BUS_RING_SIZE);
+        r->flags = BUS_PAD;
+        __atomic_store_n(&r->size, pad, __ATOMIC_RELEASE);
+    }
+
+    BusRecord *r    = (BusRecord *)(base + (tail + pad) % BUS_RING_SIZE);
+    r->flags        = 0;
+    r->topic_length = strlen(topic);
+    r->length       = length;
+    memcpy(r + 1, topic, r->topic_length);
+    memcpy((char *)(r + 1) + r->topic_length, data, length);
+    __atomic_store_n(&r->size, need, __ATOMIC_RELEASE);
+
+    // Wake owner (and its watcher) only if waiting: they check for records
+    // after saying so
+    __atomic_fetch_add(&ring->published, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST)) {
+        bus_futex(&ring->published, FUTEX_WAKE, INT_MAX, NULL);
+    }
+    return true;
+}
+
+/* External Functions */
+
+/**
+ * Attach to shared-memory bus at path (creating it if it does not exist yet)
+ * as owner of the named queue.  The queue keeps its ring and subscriptions
+ * when we detach, like a queue on the server, unless it is left empty, and
+ * the next process to attach to it takes over.  Only one Bus may own a queue
+ * at a time.
+ * @param   path        Name of shared-memory object (/name).
+ * @param   queue       Name of queue to own (NULL to only publish).
+ * @return  Newly allocated Bus structure (NULL on failure).
+ */
+Bus * bus_create(const char *path, const char *queue) {
+    if (queue && strlen(queue) >= BUS_NAME) {
+        error("Unable to attach %s to %s: queue name is too long", queue, path);
+        return NULL;
+    }
+
+    Bus *b = calloc(1, sizeof(Bus));
+    if (!b) {
+        return NULL;
+    }
+
+    bool created = true;
+    int  fd      = shm_open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = false;
+        fd      = shm_open(path, O_RDWR | O_CLOEXEC, 0);
+    }
+    if (fd < 0) {
+        error("Unable to open %s: %s", path, strerror(errno));
+        free(b);
+        return NULL;
+    }
+
+    // The creator sizes the segment (its pages are zero until touched)
+    if ((created && ftruncate(fd, BUS_SIZE) < 0) || (!created && !bus_await(bus_sized, &fd))) {
+        error("Unable to size %s: %s", path, created ? strerror(errno) : "not a bus");
+        close(fd);
+        free(b);
+        return NULL;
+    }
+
+    b->size   = BUS_SIZE;
+    b->header = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (b->header == MAP_FAILED) {
+        error("Unable to map %s: %s", path, strerror(errno));
+        free(b);
+        return NULL;
+    }
+
+    if (created) {
+        __atomic_store_n(&b->header->magic, BUS_MAGIC, __ATOMIC_RELEASE);
+    } else if (!bus_await(bus_initialized, b->header)) {
+        error("Unable to attach to %s: not initialized", path);
+        munmap(b->header, b->size);
+        free(b);
+        return NULL;
+    }
+
+    b->rings = (char *)b->header + BUS_HEADER_SIZE;
+    b->slot  = -1;
+    b->fd    = -1;
+    if (queue && (b->slot = bus_claim(b, queue)) < 0) {
+        error("Unable to attach %s to %s: %s", queue, path, errno == EBUSY ? "queue already has a consumer" : "no free queues");
+        munmap(b->header, b->size);
+        free(b);
+        return NULL;
+    }
+
+    return b;
+}
+
+/**
+ * Detach from bus, freeing our queue's slot if it has no subscriptions and no
+ * messages left.
+ * @param   b           Bus structure.
+ */
+void bus_delete(Bus *b) {
+    if (!b) {
+        return;
+    }
+
+    if (b->fd >= 0) {
+        bus_stop(b);
+        thread_join(b->watcher, NULL);
+        close(b->fd);
+    }
+
+    if (b->slot >= 0) {
+        BusSlot *s = &b->header->slots[b->slot];
+
+        bus_begin(b);
+        s->owner = 0;
+        if (!s->ntopics && __atomic_load_n(&s->ring.tail, __ATOMIC_ACQUIRE) == s->ring.head) {
+            s->name[0] = 0;
+        }
+        bus_end(b);
+    }
+
+    munmap(b->header, b->size);
+    free(b);
+}
+
+/**
+ * Remove shared-memory bus at path (processes attached to it keep using it
+ * until they detach).
+ * @param   path        Name of shared-memory object (/name).
+ * @return  Whether or not it was removed.
+ */
+bool bus_remove(const char *path) {
+    return shm_unlink(path) == 0;
+}
+
+/**
+ * Stop retrieving: wake a retrieve waiting on our queue and make it (and any
+ * later one) return NULL.
+ * @param   b           Bus structure.
+ */
+void bus_stop(Bus *b) {
+    __atomic_store_n(&b->stopped, true, __ATOMIC_RELEASE);
+
+    if (b->slot >= 0) {
+        BusRing *ring = &b->header->slots[b->slot].ring;
+        __atomic_fetch_add(&ring->published, 1, __ATOMIC_SEQ_CST);
+        bus_futex(&ring->published, FUTEX_WAKE, INT_MAX, NULL);
+    }
+}
+
+/**
+ * Subscribe our queue to topic.
+ * @param   b           Bus structure.
+ * @param   topic       Topic to subscribe to.
+ * @return  Whether or not queue is subscribed (false if there is no room).
+ */
+bool bus_subscribe(Bus *b, const char *topic) {
+    if (b->slot < 0 || strlen(topic) >= BUS_NAME) {
+        return false;
+    }
+
+    BusSlot *s          = &b->header->slots[b->slot];
+    bool     subscribed = false;
+
+    bus_begin(b);
+    for (uint32_t t = 0; t < s->ntopics && !subscribed; t++) {
+        subscribed = streq(s->topics[t], topic);
+    }
+    if (!subscribed && s->ntopics < BUS_TOPICS) {
+        snprintf(s->topics[s->ntopics++], BUS_NAME, "%s", topic);
+        subscribed = true;
+    }
+    bus_end(b);
+
+    if (!subscribed) {
+        error("Unable to subscribe %s to %s: too many topics", s->name, topic);
+    }
+    return subscribed;
+}
+
+/**
+ * Unsubscribe our queue from topic.
+ * @param   b           Bus structure.
+ * @param   topic       Topic to unsubscribe from.
+ * @return  Whether or not queue was subscribed.
+ */
+bool bus_unsubscribe(Bus *b, const char *topic) {
+    if (b->slot < 0) {
+        return false;
+    }
+
+    BusSlot *s     = &b->header->slots[b->slot];
+    bool     found = false;
+
+    bus_begin(b);
+    for (uint32_t t = 0; t < s->ntopics; t++) {
+        if (streq(s->topics[t], topic)) {
+            memcpy(s->topics[t], s->topics[--s->ntopics], BUS_NAME);
+            found = true;
+            break;
+        }
+    }
+    bus_end(b);
+
+    return found;
+}
+
+/**
+ * Publish message to topic by copying it into the ring of each queue
+ * subscribed to it.
+ * @param   b           Bus structure.
+ * @param   topic       Topic to publish to.
+ * @param   data        Message body.
+ * @param   length      Length of message body.
+ * @param   wait        Whether to wait for room in full rings (otherwise the
+ *                      message is dropped from them).  Publishers give up
+ *                      on a ring after BUS_FULL_MS, or at once if its owner
+ *                      is gone, and count the message as dropped.
+ * @return  Number of queues message was written to.
+ */
+size_t bus_publish(Bus *b, const char *topic, const void *data, size_t length, bool wait) {
+    size_t need = (sizeof(BusRecord) + strlen(topic) + length + 7) & ~(size_t)7;
+    int    slots[BUS_QUEUES];
+    size_t nslots = bus_subscribers(b, topic, slots);
+    size_t written = 0;
+
+    // Half a ring at most, so a record always fits once the ring drains
+    if (need > BUS_RING_SIZE / 2) {
+        error("Unable to publish %zu bytes to %s: message is too large", length, topic);
+        b->dropped += nslots;
+        return 0;
+    }
+
+    for (size_t i = 0; i < nslots; i++) {
+        if (bus_write(b, slots[i], topic, data, length, need, wait)) {
+            written++;
+        } else {
+            b->dropped++;
+        }
+    }
+
+    return written;
+}
+
+/**
+ * Wait at most timeout milliseconds for a record to be committed to our
+ * queue's ring, without taking it, so threads sharing the bus can wait
+ * without holding whatever serializes their retrieves.
+ * @param   b           Bus structure.
+ * @param   timeout     Milliseconds to wait (negative waits forever).
+ * @return  Whether or not a record is waiting (false if the wait expired or
+ *          bus was stopped).
+ */
+bool bus_wait(Bus *b, int timeout) {
+    if (b->slot < 0) {
+        return false;
+    }
+
+    BusRing *ring = &b->header->slots[b->slot].ring;
+
+    struct timespec deadline;
+    bus_deadline(&deadline, timeout);
+
+    while (!__atomic_load_n(&b->stopped, __ATOMIC_ACQUIRE)) {
+        if (bus_pending(b)) {
+            return true;
+        }
+
+        // Say we are waiting, then check again before sleeping
+        uint32_t published = __atomic_load_n(&ring->published, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+
+        bool expired = false;
+        if (!bus_pending(b) && !__atomic_load_n(&b->stopped, __ATOMIC_ACQUIRE)) {
+            struct timespec remaining;
+            expired = timeout >= 0 && !bus_remaining(&deadline, &remaining);
+            if (!expired) {
+                bus_futex(&ring->published, FUTEX_WAIT, published, timeout >= 0 ? &remaining : NULL);
+            }
+        }
+
+        __atomic_fetch_sub(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+        if (expired) {
+            return bus_drain(b);
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Retrieve next message from our queue's ring, waiting at most timeout
+ * milliseconds for one to be committed.
+ * @param   b           Bus structure.
+ * @param   timeout     Milliseconds to wait (negative waits forever).
+ * @return  Newly allocated Request holding message (NULL if nothing arrived
+ *          before timeout or bus was stopped).
+ */
+Request * bus_retrieve(Bus *b, int timeout) {
+    if (b->slot < 0) {
+        return NULL;
+    }
+
+    BusRing *ring = &b->header->slots[b->slot].ring;
+    char *   base = b->rings + (size_t)b->slot * BUS_RING_SIZE;
+
+    while (!__atomic_load_n(&b->stopped, __ATOMIC_ACQUIRE)) {
+        uint64_t   head = ring->head;
+        BusRecord *r    = (BusRecord *)(base + head % BUS_RING_SIZE);
+        uint32_t   size = __atomic_load_n(&r->size, __ATOMIC_ACQUIRE);
+
+        if (!size) {
+            if (!bus_wait(b, timeout)) {
+                return NULL;
+            }
+            continue;
+        }
+
+        Request *m = NULL;
+        if (!(r->flags & BUS_PAD)) {
+            char uri[BUS_NAME + sizeof("/topic/")];
+            snprintf(uri, sizeof(uri), "/topic/%.*s", (int)r->topic_length, (char *)(r + 1));
+
+            if ((m = request_reserve("PUT", uri, r->length))) {
+                struct timespec now;
+                clock_gettime(CLOCK_REALTIME, &now);
+                memcpy(m->body, (char *)(r + 1) + r->topic_length, r->length);
+                m->timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+            }
+        }
+
+        // Clear record so its bytes never look committed, then release it
+        memset(r, 0, size);
+        __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&ring->consumed, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->blocked, __ATOMIC_SEQ_CST)) {
+            bus_futex(&ring->consumed, FUTEX_WAKE, INT_MAX, NULL);
+        }
+
+        if (m) {
+            return m;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Return eventfd that is readable whenever our queue's ring holds records
+ * (created on first use, along with a thread that watches the ring for
+ * commits, so publishers wake it even from other processes).  Once it is
+ * readable, retrieve with a timeout of 0 until that returns NULL.
+ * @param   b           Bus structure.
+ * @return  File descriptor (-1 if we only publish or it could not be created).
+ */
+int bus_fd(Bus *b) {
+    if (b->slot < 0) {
+        return -1;
+    }
+
+    int fd = __atomic_load_n(&b->fd, __ATOMIC_ACQUIRE);
+    if (fd >= 0) {
+        return fd;
+    }
+
+    int created = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (created < 0) {
+        error("Unable to create eventfd: %s", strerror(errno));
+        return -1;
+    }
+    if (!__atomic_compare_exchange_n(&b->fd, &fd, created, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        close(created);
+        return fd;
+    }
+
+    thread_create(&b->watcher, NULL, bus_watch, b);
+    return created;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
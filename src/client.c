@@ -5,49 +5,153 @@
 #include "mq/socket.h"
 #include "mq/string.h"
 
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
 /* Internal Constants */
 
 #define SENTINEL "SHUTDOWN"
+#define STOP_ATTEMPTS 3		/* Sends of a window tried once stopping */
 
 /* Internal Prototypes */
 
+MessageQueue * mq_allocate(const char *name, const char *host, const char *port,
+                           Queue *outgoing, Queue *incoming);
+MessageQueue * mq_broker(MessageQueue *mq, const char *topic);
 void * mq_pusher(void *);
 void * mq_puller(void *);
+Request * mq_push_window(MessageQueue *mq, Request *head);
+Request * mq_abandon(MessageQueue *mq, Request *head, size_t n);
+Request * mq_window(MessageQueue *mq, int timeout, int linger_ms, bool *sentinel);
+Request * mq_take(MessageQueue *mq, int timeout);
+Request * mq_linger(MessageQueue *mq, Request *first, int linger_ms, bool *sentinel);
+bool   mq_is_publish(Request *r);
+bool   mq_is_sentinel(Request *r);
+Request * mq_inbox_take(MessageQueue *mq, int timeout, bool sentinel);
+Request * mq_sentinel();
+size_t mq_batch_record_size(Request *r);
+void   mq_report_batch(char *body);
+bool   mq_pull(MessageQueue *mq, bool *failed);
+bool   mq_stream(MessageQueue *mq, bool *failed);
+void   mq_backoff(MessageQueue *mq, Connection *c);
+void   mq_outcome(Connection *c, bool failed);
+size_t mq_unpack_records(MessageQueue *mq, char *body, size_t length, bool *sentinel, bool *invalid);
+Request * mq_parse_records(char *body, size_t length, size_t *consumed, bool *invalid);
+bool   mq_deliver(MessageQueue *mq, Request *head);
+void   mq_stamp(Request *head);
+void   mq_delete_requests(Request *head);
+void   mq_ignore_sigpipe();
 
 /* External Functions */
 
 /**
  * Create Message Queue withs specified name, host, and port.
  * @param   name        Name of client's queue.
+ * @param   host        Address of server (or unix:/path of its socket, or
+ *                      shm:/name of a shared-memory bus to use instead).
+ * @param   port        Port of server (ignored for unix:/path and shm:/name).
+ * @return  Newly allocated Message Queue structure.
+ */
+MessageQueue * mq_create(const char *name, const char *host, const char *port) {
+    return mq_create_with_queues(name, host, port, QUEUE_LIST, QUEUE_LIST, 0);
+}
+
+/**
+ * Create Message Queue with specified name, host, and port, and with the
+ * specified implementation of its outgoing and incoming queues.  QUEUE_MPSC
+ * suits outgoing (any thread may publish); QUEUE_SPSC only suits incoming if
+ * a single thread retrieves.  Rings are bounded, so publishing blocks while
+ * outgoing is full and the puller blocks while incoming is full.
+ * @param   name        Name of client's queue.
  * @param   host        Address of server.
  * @param   port        Port of server.
+ * @param   outgoing    Type of outgoing queue.
+ * @param   incoming    Type of incoming queue.
+ * @param   capacity    Capacity of ring queues.
  * @return  Newly allocated Message Queue structure.
  */
-MessageQueue * mq_create(const char *name, const char *host, const char *port) {
-    MessageQueue *mq = calloc(1, sizeof(MessageQueue));
+MessageQueue * mq_create_with_queues(const char *name, const char *host, const char *port,
+                                     QueueType outgoing, QueueType incoming, size_t capacity) {
+    return mq_allocate(name, host, port,
+                       queue_create_ring(outgoing, capacity),
+                       queue_create_ring(incoming, capacity));
+}
 
-    if (mq) {
+/**
+ * Create Message Queue with specified name, host, and port, whose outgoing
+ * and incoming queues are each bounded to capacity requests and max_bytes of
+ * message bodies.  With QUEUE_BLOCK, publishing waits while outgoing is full
+ * and the puller stops retrieving while incoming is full; the other policies
+ * refuse or drop messages instead (see mq_dropped).  Subscriptions and the
+ * shutdown SENTINEL are pushed even while a queue is full.
+ * @param   name        Name of client's queue.
+ * @param   host        Address of server.
+ * @param   port        Port of server.
+ * @param   capacity    Maximum number of messages in each queue (0 is unbounded).
+ * @param   max_bytes   Maximum bytes of message bodies in each queue (0 is unbounded).
+ * @param   policy      What publishing or receiving does while a queue is full.
+ * @return  Newly allocated Message Queue structure.
+ */
+MessageQueue * mq_create_bounded(const char *name, const char *host, const char *port,
+                                 size_t capacity, size_t max_bytes, QueuePolicy policy) {
+    return mq_allocate(name, host, port,
+                       queue_create_bounded(capacity, max_bytes, policy),
+                       queue_create_bounded(capacity, max_bytes, policy));
+}
 
-      // Check that each attributes exist and set values
-      if (name)
-        snprintf(mq->name, sizeof(mq->name), "%s", name);
-      if (host)
-        snprintf(mq->host, sizeof(mq->host), "%s", host);
-      if (port)
-        snprintf(mq->port, sizeof(mq->port), "%s", port);
+/**
+ * Create Message Queue that spreads topics over a cluster of brokers: the
+ * publishes and subscriptions of each topic go to the broker chosen for it by
+ * consistent hashing, and the messages retrieved from every broker are merged
+ * into one incoming queue.  Clients that list the same endpoints (in any
+ * order) agree on the broker of every topic.
+ * @param   name        Name of client's queue (on every broker).
+ * @param   endpoints   Brokers as host:port or unix:/path (NULL-terminated).
+ * @return  Newly allocated Message Queue structure.
+ */
+MessageQueue * mq_create_cluster(const char *name, const char *endpoints[]) {
+    size_t nbrokers = 0;
+    while (endpoints && endpoints[nbrokers]) {
+        nbrokers++;
+    }
 
-      // Create queues and initialize shutdown to false
-      mq->outgoing = queue_create();
-      mq->incoming = queue_create();
-      mq->shutdown = false;
+    MessageQueue *mq = nbrokers ? mq_create(name, NULL, NULL) : NULL;
+    if (!mq) {
+        return NULL;
+    }
 
-      // Initialize lock
-      mutex_init(&mq->lock_stop_mq, NULL);
+    mq->brokers = calloc(nbrokers, sizeof(MessageQueue *));
+    mq->cluster = cluster_create(endpoints, nbrokers);
+    if (!mq->brokers || !mq->cluster) {
+        mq_delete(mq);
+        return NULL;
+    }
+
+    for (size_t b = 0; b < nbrokers; b++) {
+        char host[NI_MAXHOST];
+        char port[NI_MAXSERV];
 
-      return mq;
+        if (!socket_endpoint(endpoints[b], host, sizeof(host), port, sizeof(port)) ||
+            strncmp(host, BUS_PREFIX, strlen(BUS_PREFIX)) == 0) {
+            error("Invalid cluster endpoint: %s", endpoints[b]);
+            mq_delete(mq);
+            return NULL;
+        }
+
+        // Each broker has its own outgoing queue, but delivers to ours
+        MessageQueue *broker = mq_create(name, host, port);
+        if (!broker) {
+            mq_delete(mq);
+            return NULL;
+        }
+        queue_delete(broker->incoming);
+        broker->incoming = mq->incoming;
+
+        mq->brokers[mq->nbrokers++] = broker;
     }
 
-    return NULL;
+    return mq;
 }
 
 /**
@@ -55,7 +159,22 @@ MessageQueue * mq_create(const char *name, const char *host, const char *port) {
  * @param   mq      Message Queue structure.
  */
 void mq_delete(MessageQueue *mq) {
-    queue_delete(mq->incoming);
+    for (size_t b = 0; b < mq->nbrokers; b++) {
+      mq->brokers[b]->incoming = NULL;
+      mq_delete(mq->brokers[b]);
+    }
+    free(mq->brokers);
+    cluster_delete(mq->cluster);
+
+    mq_delete_requests(mq->inbox);
+    while (mq->outbox_next < mq->outbox_size) {
+      request_delete(mq->outbox[mq->outbox_next++]);
+    }
+    connection_delete(mq->push_connection);
+    connection_delete(mq->pull_connection);
+    bus_delete(mq->bus);
+    if (mq->incoming)   // Brokers of a cluster share its incoming
+      queue_delete(mq->incoming);
     queue_delete(mq->outgoing);
     free(mq);
 }
@@ -67,42 +186,357 @@ void mq_delete(MessageQueue *mq) {
  * @param   body    Message body to publish.
  */
 void mq_publish(MessageQueue *mq, const char *topic, const char *body) {
+    mq_publish_bytes(mq, topic, body, strlen(body));
+}
+
+/**
+ * Publish one binary message (which may contain NULs) to topic.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   data    Message body to publish.
+ * @param   length  Length of message body.
+ */
+void mq_publish_bytes(MessageQueue *mq, const char *topic, const void *data, size_t length) {
+    if (mq->cluster) {
+      mq_publish_bytes(mq_broker(mq, topic), topic, data, length);
+      return;
+    }
+
+    // Copy straight into the rings of subscribers on a shared-memory bus
+    if (mq->bus) {
+      bus_publish(mq->bus, topic, data, length, true);
+      return;
+    }
+
     char publish_uri[BUFSIZ];
-    int status = sprintf(publish_uri, "/topic/%s", topic);
+    int status = snprintf(publish_uri, sizeof(publish_uri), "/topic/%s", topic);
 
     if (status < 0)
       return;
 
     // Create request and push onto outgoing
-    Request *r = request_create("PUT", publish_uri, body);
+    Request *r = request_create_bytes("PUT", publish_uri, data, length);
     queue_push(mq->outgoing, r);
 }
 
 /**
- * Retrieve one message (by taking Request from incoming queue).
+ * Publish one message to topic without waiting for room in outgoing queue.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   body    Message body to publish.
+ * @return  Whether or not the message was queued (false if outgoing is full
+ *          and its policy does not drop older messages to make room).
+ */
+bool mq_try_publish(MessageQueue *mq, const char *topic, const char *body) {
+    if (mq->cluster) {
+      return mq_try_publish(mq_broker(mq, topic), topic, body);
+    }
+
+    if (mq->bus) {
+      size_t dropped = mq->bus->dropped;
+      bus_publish(mq->bus, topic, body, strlen(body), false);
+      return mq->bus->dropped == dropped;
+    }
+
+    char publish_uri[BUFSIZ];
+    if (snprintf(publish_uri, sizeof(publish_uri), "/topic/%s", topic) < 0)
+      return false;
+
+    return queue_try_push(mq->outgoing, request_create("PUT", publish_uri, body));
+}
+
+/**
+ * Return number of messages dropped or refused by the outgoing and incoming
+ * queues of a bounded Message Queue.
+ * @param   mq          Message Queue structure.
+ * @param   outgoing    Where to store count for outgoing (may be NULL).
+ * @param   incoming    Where to store count for incoming (may be NULL).
+ * @return  Total number of messages lost.
+ */
+size_t mq_dropped(MessageQueue *mq, size_t *outgoing, size_t *incoming) {
+    size_t out = queue_dropped(mq->outgoing) + queue_rejected(mq->outgoing) + (mq->bus ? mq->bus->dropped : 0);
+    size_t in  = queue_dropped(mq->incoming) + queue_rejected(mq->incoming);
+
+    for (size_t b = 0; b < mq->nbrokers; b++) {
+      out += queue_dropped(mq->brokers[b]->outgoing) + queue_rejected(mq->brokers[b]->outgoing);
+    }
+
+    if (outgoing)
+      *outgoing = out;
+    if (incoming)
+      *incoming = in;
+    return out + in;
+}
+
+/**
+ * Retrieve one message (by taking Request from incoming queue).  This is a
+ * compatibility wrapper around mq_retrieve_msg that copies the body out.
  * @param   mq      Message Queue structure.
  * @return  Newly allocated message body (must be freed).
  */
 char * mq_retrieve(MessageQueue *mq) {
-    Request *r = queue_pop(mq->incoming);
+    return mq_retrieve_timed(mq, -1);
+}
+
+/**
+ * Retrieve one message without waiting (for callers that poll mq_fd).
+ * @param   mq      Message Queue structure.
+ * @return  Newly allocated message body (NULL if there is none).
+ */
+char * mq_try_retrieve(MessageQueue *mq) {
+    return mq_retrieve_timed(mq, 0);
+}
+
+/**
+ * Retrieve one message, waiting at most timeout milliseconds for one to
+ * arrive.
+ * @param   mq      Message Queue structure.
+ * @param   timeout Milliseconds to wait (negative waits forever).
+ * @return  Newly allocated message body (NULL if nothing arrived before
+ *          timeout or the SENTINEL was received).
+ */
+char * mq_retrieve_timed(MessageQueue *mq, int timeout) {
+    MQMessage *m = mq_retrieve_msg_timed(mq, timeout);
+    if (!m)
+      return NULL;
+
+    // Take body (without copying if it was read into its own buffer)
+    char *body = request_take_body(m);
+    mq_message_release(m);
+    return body;
+}
+
+/**
+ * Retrieve one message as a handle to the buffer it was received into, so
+ * the body is never copied on its way to the caller.
+ * @param   mq      Message Queue structure.
+ * @return  Message handle (release with mq_message_release, NULL if the
+ *          SENTINEL was received).
+ */
+MQMessage * mq_retrieve_msg(MessageQueue *mq) {
+    return mq_retrieve_msg_timed(mq, -1);
+}
+
+/**
+ * Retrieve one message as a handle, waiting at most timeout milliseconds for
+ * one to arrive.  Messages are popped from incoming in batches and handed out
+ * from the inbox, so a burst costs one acquisition of the incoming lock per
+ * batch.
+ * @param   mq      Message Queue structure.
+ * @param   timeout Milliseconds to wait (negative waits forever).
+ * @return  Message handle (NULL if nothing arrived before timeout or the
+ *          SENTINEL was received).
+ */
+MQMessage * mq_retrieve_msg_timed(MessageQueue *mq, int timeout) {
+    Request *r = mq_inbox_take(mq, timeout, true);
 
     // Check that request attributes exist and
     // the body is not SENTINEL
     if (!r)
       return NULL;
-    if (!r->body) {
+    if (!r->body || mq_is_sentinel(r)) {
       request_delete(r);
       return NULL;
     }
-    if (streq(r->body, SENTINEL)) {
+
+    return r;
+}
+
+/**
+ * Retrieve one message as a handle without waiting, telling nothing to
+ * retrieve apart from the SENTINEL (which another client stopping may have
+ * published), so a caller polling mq_fd can keep going until it is empty.
+ * @param   mq          Message Queue structure.
+ * @param   sentinel    Where to store whether the SENTINEL was taken.
+ * @return  Message handle (NULL if there is none or the SENTINEL was taken).
+ */
+MQMessage * mq_try_retrieve_msg(MessageQueue *mq, bool *sentinel) {
+    Request *r;
+
+    // Skip requests without bodies
+    while ((r = mq_inbox_take(mq, 0, true)) && !r->body) {
+      request_delete(r);
+    }
+
+    *sentinel = r && mq_is_sentinel(r);
+    if (*sentinel) {
       request_delete(r);
       return NULL;
     }
 
-    // Set body, delete the request and return
-    char *body = strdup(r->body);
-    request_delete(r);
-    return body;
+    return r;
+}
+
+/**
+ * Take next request from the inbox, refilling it from incoming (or taking it
+ * from the bus) when it is empty.  inbox_lock is only held to move requests,
+ * never while waiting for one to arrive, so a blocked retrieve does not hold
+ * up the timed and non-blocking ones of other threads.  While some thread
+ * waits, a refill takes a single request, so none sit in the inbox unseen by
+ * the waiter.
+ * @param   mq          Message Queue structure.
+ * @param   timeout     Milliseconds to wait (negative waits forever).
+ * @param   sentinel    Whether to take a SENTINEL (otherwise it is left at the
+ *                      head of the inbox for the next retrieve).
+ * @return  Request (NULL if nothing arrived before timeout or a SENTINEL was
+ *          left in the inbox).
+ */
+Request * mq_inbox_take(MessageQueue *mq, int timeout, bool sentinel) {
+    Request *r = NULL;
+
+    mutex_lock(&mq->inbox_lock);
+    if (mq->bus) {
+      r = bus_retrieve(mq->bus, 0);
+    } else {
+      if (!mq->inbox) {
+        Request *batch[MQ_BATCH];
+        size_t   n = queue_pop_batch(mq->incoming, batch, mq->inbox_waiters ? 1 : MQ_BATCH, 0);
+        for (size_t i = 0; i < n; i++) {
+          batch[i]->next = NULL;
+          if (mq->inbox_tail) {
+            mq->inbox_tail->next = batch[i];
+          } else {
+            mq->inbox = batch[i];
+          }
+          mq->inbox_tail = batch[i];
+        }
+      }
+
+      if (mq->inbox) {
+        if (!sentinel && mq->inbox->body && mq_is_sentinel(mq->inbox)) {
+          mutex_unlock(&mq->inbox_lock);
+          return NULL;
+        }
+
+        r = mq->inbox;
+        if (!(mq->inbox = r->next)) {
+          mq->inbox_tail = NULL;
+        }
+        r->next = NULL;
+      }
+    }
+
+    if (r || !timeout) {
+      mutex_unlock(&mq->inbox_lock);
+      return r;
+    }
+
+    // Wait without inbox_lock, taking only the request that arrives
+    mq->inbox_waiters++;
+    mutex_unlock(&mq->inbox_lock);
+
+    if (mq->bus) {
+      while (!r && bus_wait(mq->bus, timeout)) {
+        mutex_lock(&mq->inbox_lock);
+        r = bus_retrieve(mq->bus, 0);
+        mutex_unlock(&mq->inbox_lock);
+        if (timeout > 0) {
+          break;
+        }
+      }
+    } else if (!queue_pop_batch(mq->incoming, &r, 1, timeout)) {
+      r = NULL;
+    }
+
+    mutex_lock(&mq->inbox_lock);
+    mq->inbox_waiters--;
+    mutex_unlock(&mq->inbox_lock);
+    return r;
+}
+
+/**
+ * Return body of message (NUL-terminated, but it may also contain NULs).
+ * @param   m       Message handle.
+ * @return  Message body (valid until the message is released).
+ */
+const char * mq_message_body(const MQMessage *m) {
+    return m->body;
+}
+
+/**
+ * Return length of body of message.
+ * @param   m       Message handle.
+ * @return  Length of message body.
+ */
+size_t mq_message_length(const MQMessage *m) {
+    return m->length;
+}
+
+/**
+ * Return topic message was published to.  Messages retrieved one per request
+ * (retrieve_max of 1 without streaming) do not carry their topic.
+ * @param   m       Message handle.
+ * @return  Topic (NULL if unknown, valid until the message is released).
+ */
+const char * mq_message_topic(const MQMessage *m) {
+    if (!m->uri || strncmp(m->uri, "/topic/", strlen("/topic/")) != 0)
+      return NULL;
+    return m->uri + strlen("/topic/");
+}
+
+/**
+ * Return time message was received from server.
+ * @param   m       Message handle.
+ * @return  Nanoseconds since the epoch (CLOCK_REALTIME).
+ */
+uint64_t mq_message_timestamp(const MQMessage *m) {
+    return m->timestamp;
+}
+
+/**
+ * Release message handle (and the buffer holding its body).
+ * @param   m       Message handle.
+ */
+void mq_message_release(MQMessage *m) {
+    request_delete(m);
+}
+
+/**
+ * Return file descriptor that is readable whenever incoming queue holds
+ * messages, so one thread can poll many Message Queues.  Once it is readable,
+ * call mq_try_retrieve_msg until it returns NULL without taking the SENTINEL
+ * (messages already moved to the inbox do not keep it readable).  On a shared-memory bus it is readable
+ * while our queue's ring holds messages.
+ * @param   mq      Message Queue structure.
+ * @return  File descriptor (-1 on error).
+ */
+int mq_fd(MessageQueue *mq) {
+    return mq->bus ? bus_fd(mq->bus) : queue_fd(mq->incoming);
+}
+
+/**
+ * Retrieve up to max messages (by taking Requests from the inbox, refilled
+ * from incoming queue under a single acquisition of its lock).  A SENTINEL
+ * behind some messages is left in the inbox, so the next call reports it.
+ * @param   mq      Message Queue structure.
+ * @param   out     Array to store newly allocated message bodies (must be freed).
+ * @param   max     Maximum number of messages to retrieve.
+ * @return  Number of messages stored in out (0 if the SENTINEL was received
+ *          or max is 0).
+ */
+size_t mq_retrieve_batch(MessageQueue *mq, char *out[], size_t max) {
+    size_t n = 0;
+
+    // Only wait if nothing has been retrieved yet, and leave a SENTINEL
+    // behind messages for the next call
+    while (n < max) {
+      Request *r = mq_inbox_take(mq, n ? 0 : -1, !n);
+      if (!r) {
+        break;
+      }
+
+      // Skip requests without bodies, and stop at the SENTINEL
+      bool sentinel = r->body && mq_is_sentinel(r);
+      if (r->body && !sentinel) {
+        out[n++] = request_take_body(r);
+      }
+      request_delete(r);
+      if (sentinel) {
+        break;
+      }
+    }
+
+    return n;
 }
 
 /**
@@ -111,6 +545,16 @@ char * mq_retrieve(MessageQueue *mq) {
  * @param   topic   Topic string to subscribe to.
  **/
 void mq_subscribe(MessageQueue *mq, const char *topic) {
+    if (mq->cluster) {
+      mq_subscribe(mq_broker(mq, topic), topic);
+      return;
+    }
+
+    if (mq->bus) {
+      bus_subscribe(mq->bus, topic);
+      return;
+    }
+
     char subscribe_uri[BUFSIZ];
     int status = sprintf(subscribe_uri, "/subscription/%s/%s", mq->name, topic);
 
@@ -119,7 +563,7 @@ void mq_subscribe(MessageQueue *mq, const char *topic) {
 
     // Create request and push onto outgoing
     Request *r = request_create("PUT", subscribe_uri, NULL);
-    queue_push(mq->outgoing, r);
+    queue_push_force(mq->outgoing, r);
 }
 
 /**
@@ -128,6 +572,16 @@ void mq_subscribe(MessageQueue *mq, const char *topic) {
  * @param   topic   Topic string to unsubscribe from.
  **/
 void mq_unsubscribe(MessageQueue *mq, const char *topic) {
+    if (mq->cluster) {
+      mq_unsubscribe(mq_broker(mq, topic), topic);
+      return;
+    }
+
+    if (mq->bus) {
+      bus_unsubscribe(mq->bus, topic);
+      return;
+    }
+
     char unsubscribe_uri[BUFSIZ];
     int status = sprintf(unsubscribe_uri, "/subscription/%s/%s", mq->name, topic);
 
@@ -136,7 +590,7 @@ void mq_unsubscribe(MessageQueue *mq, const char *topic) {
 
     // Create request and push onto outgoing
     Request *r = request_create("DELETE", unsubscribe_uri, NULL);
-    queue_push(mq->outgoing, r);
+    queue_push_force(mq->outgoing, r);
 }
 
 /**
@@ -146,6 +600,48 @@ void mq_unsubscribe(MessageQueue *mq, const char *topic) {
  * @param   mq      Message Queue structure.
  */
 void mq_start(MessageQueue *mq) {
+    // Publishes and retrieves go straight to a shared-memory bus
+    if (mq->bus) {
+        return;
+    }
+
+    // Each broker of a cluster runs on its own (with our settings), and
+    // subscribes to the SENTINEL there so its puller can be stopped
+    if (mq->cluster) {
+        for (size_t b = 0; b < mq->nbrokers; b++) {
+            MessageQueue *broker = mq->brokers[b];
+
+            broker->keepalive           = mq->keepalive;
+            broker->window              = mq->window;
+            broker->linger_ms           = mq->linger_ms;
+            broker->max_batch_bytes     = mq->max_batch_bytes;
+            broker->retrieve_max        = mq->retrieve_max;
+            broker->streaming           = mq->streaming;
+            broker->reconnect_min_ms    = mq->reconnect_min_ms;
+            broker->reconnect_max_ms    = mq->reconnect_max_ms;
+            broker->breaker_threshold   = mq->breaker_threshold;
+            broker->breaker_cooldown_ms = mq->breaker_cooldown_ms;
+            broker->engine              = mq->engine;
+            mq_start(broker);
+        }
+        return;
+    }
+
+    // A shared engine drives the connections instead of threads of our own
+    if (mq->engine) {
+        mq_subscribe(mq, SENTINEL);
+        engine_attach(mq->engine, mq);
+        return;
+    }
+
+    // Each thread keeps its own connection since the puller blocks on it
+    mq->push_connection = connection_create(mq->host, mq->port, mq->keepalive);
+    mq->pull_connection = connection_create(mq->host, mq->port, mq->keepalive);
+    backoff_init(&mq->push_connection->backoff, mq->reconnect_min_ms, mq->reconnect_max_ms,
+                 mq->breaker_threshold, mq->breaker_cooldown_ms);
+    backoff_init(&mq->pull_connection->backoff, mq->reconnect_min_ms, mq->reconnect_max_ms,
+                 mq->breaker_threshold, mq->breaker_cooldown_ms);
+
     // Subscribe to topic = SENTINEL and run threads
     mq_subscribe(mq, SENTINEL);
     thread_create(&mq->pusher, NULL, mq_pusher, (void *)mq);
@@ -158,14 +654,34 @@ void mq_start(MessageQueue *mq) {
  * @param   mq      Message Queue structure.
  */
 void mq_stop(MessageQueue *mq) {
-    // Publish SENTINEL message
-    mq_publish(mq, SENTINEL, SENTINEL);
-
-    // Set shutdown and join threads
+    // Set shutdown before publishing the SENTINEL so threads waiting out a
+    // backoff give up on it (the puller keeps going until the SENTINEL is
+    // delivered)
     mutex_lock(&mq->lock_stop_mq);
     mq->shutdown = true;
+    cond_broadcast(&mq->stopped);
     mutex_unlock(&mq->lock_stop_mq);
 
+    if (mq->bus) {
+        bus_stop(mq->bus);
+        return;
+    }
+
+    if (mq->cluster) {
+        for (size_t b = 0; b < mq->nbrokers; b++) {
+            mq_stop(mq->brokers[b]);
+        }
+        return;
+    }
+
+    // Publish SENTINEL message (even if outgoing is full) and join threads
+    queue_push_force(mq->outgoing, mq_sentinel());
+
+    if (mq->engine) {
+        engine_detach(mq->engine, mq);
+        return;
+    }
+
     thread_join(mq->pusher, NULL);
     thread_join(mq->puller, NULL);
 }
@@ -182,37 +698,393 @@ bool mq_shutdown(MessageQueue *mq) {
     return shutdown;
 }
 
+/**
+ * Allocate Message Queue structure around its outgoing and incoming queues.
+ * @param   name        Name of client's queue.
+ * @param   host        Address of server.
+ * @param   port        Port of server.
+ * @param   outgoing    Outgoing queue (owned by Message Queue).
+ * @param   incoming    Incoming queue (owned by Message Queue).
+ * @return  Newly allocated Message Queue structure.
+ */
+MessageQueue * mq_allocate(const char *name, const char *host, const char *port,
+                           Queue *outgoing, Queue *incoming) {
+    MessageQueue *mq = calloc(1, sizeof(MessageQueue));
+
+    if (mq && outgoing && incoming) {
+
+      // Check that each attributes exist and set values
+      if (name)
+        snprintf(mq->name, sizeof(mq->name), "%s", name);
+      if (host)
+        snprintf(mq->host, sizeof(mq->host), "%s", host);
+      if (port)
+        snprintf(mq->port, sizeof(mq->port), "%s", port);
+
+      // Adopt queues and initialize shutdown to false
+      mq->outgoing = outgoing;
+      mq->incoming = incoming;
+      mq->shutdown = false;
+
+      // Reuse server connections across requests by default
+      mq->keepalive = true;
+      mq->window    = 1;
+
+      // Retrieve one message per request
+      mq->retrieve_max = 1;
+      mq->streaming    = false;
+
+      // Publishes are not batched unless max_batch_bytes is set
+      mq->linger_ms       = 0;
+      mq->max_batch_bytes = 0;
+
+      // Back off between failed connects, and only try every cooldown once
+      // the circuit opens
+      mq->reconnect_min_ms    = BACKOFF_MIN_MS;
+      mq->reconnect_max_ms    = BACKOFF_MAX_MS;
+      mq->breaker_threshold   = BACKOFF_THRESHOLD;
+      mq->breaker_cooldown_ms = BACKOFF_COOLDOWN_MS;
+
+      // Initialize locks
+      mutex_init(&mq->lock_stop_mq, NULL);
+      cond_init(&mq->stopped, NULL);
+      mutex_init(&mq->inbox_lock, NULL);
+
+      // Attach to a shared-memory bus instead of talking to a server
+      if (strncmp(mq->host, BUS_PREFIX, strlen(BUS_PREFIX)) != 0 ||
+          (mq->bus = bus_create(mq->host + strlen(BUS_PREFIX), mq->name))) {
+        return mq;
+      }
+    }
+
+    free(mq);
+    if (outgoing)
+      queue_delete(outgoing);
+    if (incoming)
+      queue_delete(incoming);
+    return NULL;
+}
+
 /* Internal Functions */
 
+/**
+ * Return Message Queue of the broker chosen for topic.
+ * @param   mq      Message Queue structure (of a cluster).
+ * @param   topic   Topic string.
+ * @return  Message Queue of broker.
+ */
+MessageQueue * mq_broker(MessageQueue *mq, const char *topic) {
+    return mq->brokers[cluster_lookup(mq->cluster, topic)];
+}
+
 /**
  * Pusher thread takes messages from outgoing queue and sends them to server.
  **/
 void * mq_pusher(void *arg) {
     MessageQueue *mq = (MessageQueue *)arg;
+    mq_ignore_sigpipe();
+
+    // Run until the SENTINEL (published by mq_stop) has been sent
+    bool sentinel = false;
+    while (!sentinel) {
+        Request *head = mq_window(mq, -1, mq->linger_ms, &sentinel);
+
+        // Write window to server (reconnecting until all of it is sent, or
+        // only a few more times once stopping)
+        size_t stopping = 0;
+        while (head) {
+            if (mq_shutdown(mq) && stopping++ == STOP_ATTEMPTS) {
+                mq_abandon(mq, head, SIZE_MAX);
+                break;
+            }
+            mq_backoff(mq, mq->push_connection);
+            head = mq_push_window(mq, head);
+        }
+    }
+
+    // Discard anything published after the SENTINEL
+    while (mq->outbox_next < mq->outbox_size) {
+        request_delete(mq->outbox[mq->outbox_next++]);
+    }
+
+    return 0;
+}
+
+/**
+ * Take the next window of requests to send: wait for one request and then
+ * take up to window - 1 more without waiting, so that everything already
+ * queued is pipelined together.  Consecutive publishes are grouped into batch
+ * requests when max_batch_bytes is set.
+ * @param   mq          Message Queue structure.
+ * @param   timeout     Milliseconds to wait for the first request (negative
+ *                      waits forever).
+ * @param   linger_ms   Milliseconds to wait for a batch to fill.
+ * @param   sentinel    Set if the SENTINEL is in the window (nothing after it
+ *                      is taken).
+ * @return  List of requests (NULL if nothing arrived before timeout).
+ **/
+Request * mq_window(MessageQueue *mq, int timeout, int linger_ms, bool *sentinel) {
+    Request *head = NULL;
+    Request *tail = NULL;
+    size_t   size = 0;
 
-    // Run until mq->shutdown is set
-    while (!mq_shutdown(mq)) {
-        FILE *fs = socket_connect(mq->host, mq->port);
-        if (!fs) {
-          continue;
+    while ((size < mq->window || size == 0) && !*sentinel) {
+        Request *r = mq_take(mq, size ? 0 : timeout);
+        if (!r) {
+            break;
         }
+        r->next = NULL;
 
-        // Write request to server
-        Request *r = queue_pop(mq->outgoing);
-        request_write(r, fs);
-        request_delete(r);
+        // Nothing is published after the SENTINEL
+        *sentinel |= streq(r->uri, "/topic/" SENTINEL);
 
-        char buffer[BUFSIZ];
+        // Group consecutive publishes into one batch request
+        if (mq->max_batch_bytes && mq_is_publish(r)) {
+            r = mq_linger(mq, r, linger_ms, sentinel);
+        }
 
-        // Read response from server
-        if (!fgets(buffer, BUFSIZ, fs)) {
-          fclose(fs);
-          continue;
+        if (tail) {
+            tail->next = r;
+        } else {
+            head = r;
+        }
+        for (tail = r; tail->next; tail = tail->next) {
+            size++;
         }
-        fclose(fs);
+        size++;
     }
 
-    return 0;
+    return head;
+}
+
+/**
+ * Take next request to send, popping a batch from outgoing queue into the
+ * outbox once the requests previously popped have all been taken.
+ * @param   mq      Message Queue structure.
+ * @param   timeout Milliseconds to wait (negative waits forever).
+ * @return  Request structure (NULL if nothing arrived before timeout).
+ **/
+Request * mq_take(MessageQueue *mq, int timeout) {
+    if (mq->outbox_next == mq->outbox_size) {
+        mq->outbox_size = queue_pop_batch(mq->outgoing, mq->outbox, MQ_BATCH, timeout);
+        mq->outbox_next = 0;
+    }
+
+    return mq->outbox_next < mq->outbox_size ? mq->outbox[mq->outbox_next++] : NULL;
+}
+
+/**
+ * Collect publish requests that follow the first one into a single batch
+ * request, waiting up to linger_ms for more to arrive until the batch holds
+ * max_batch_bytes.  Each publish is encoded as:
+ *
+ *  $TOPIC $LENGTH\n
+ *  $BODY
+ *
+ * @param   mq      Message Queue structure.
+ * @param   first   First publish request of batch.
+ * @param   linger_ms Milliseconds to wait for more publishes (a request that
+ *                  does not belong in the batch is put back in the outbox to
+ *                  be sent after it).
+ * @param   sentinel Set if the SENTINEL is published in the batch.
+ * @return  Batch request (or list of requests if they could not be batched).
+ **/
+Request * mq_linger(MessageQueue *mq, Request *first, int linger_ms, bool *sentinel) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec  += linger_ms / 1000;
+    deadline.tv_nsec += (linger_ms % 1000) * 1000000L;
+
+    Request *head  = first;
+    Request *tail  = first;
+    size_t   bytes = mq_batch_record_size(first);
+    size_t   count = 1;
+    tail->next     = NULL;
+
+    while (bytes < mq->max_batch_bytes) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+
+        Request *r = mq_take(mq, remaining > 0 ? remaining : 0);
+        if (!r) {
+            break;
+        }
+
+        // Anything other than a publish ends the batch (to keep its order)
+        if (!mq_is_publish(r) || bytes + mq_batch_record_size(r) > mq->max_batch_bytes) {
+            mq->outbox_next--;
+            break;
+        }
+
+        *sentinel |= streq(r->uri, "/topic/" SENTINEL);
+
+        tail->next = r;
+        tail       = r;
+        tail->next = NULL;
+        bytes     += mq_batch_record_size(r);
+        count++;
+    }
+
+    if (count == 1) {
+        return first;
+    }
+
+    // Encode each publish as a record in the batch body
+    Request *batch = request_reserve("PUT", "/batch", bytes);
+    size_t  offset = 0;
+    if (!batch) {
+        // Send requests unbatched instead
+        return head;
+    }
+
+    for (Request *r = head; r; r = r->next) {
+        const char *topic = r->uri + strlen("/topic/");
+        size_t      size  = r->body ? r->length : 0;
+
+        offset += sprintf(batch->body + offset, "%s %zu\n", topic, size);
+        memcpy(batch->body + offset, r->body ? r->body : "", size);
+        offset += size;
+    }
+    batch->body[offset] = 0;
+    batch->length       = offset;
+
+    mq_delete_requests(head);
+    return batch;
+}
+
+/**
+ * Returns whether or not request publishes a message to a topic.
+ * @param   r       Request structure.
+ **/
+bool mq_is_publish(Request *r) {
+    return streq(r->method, "PUT") && strncmp(r->uri, "/topic/", strlen("/topic/")) == 0;
+}
+
+/**
+ * Returns whether or not message received from server is the SENTINEL
+ * (comparing its whole body, which may contain NULs).
+ * @param   r       Request structure.
+ **/
+bool mq_is_sentinel(Request *r) {
+    return r->length == strlen(SENTINEL) && memcmp(r->body, SENTINEL, r->length) == 0;
+}
+
+/**
+ * Returns new SENTINEL message (published by mq_stop, or delivered in place of
+ * one a server that cannot be reached will never send).
+ **/
+Request * mq_sentinel() {
+    return request_create("PUT", "/topic/" SENTINEL, SENTINEL);
+}
+
+/**
+ * Returns number of bytes needed to encode publish request in a batch.
+ * @param   r       Request structure.
+ **/
+size_t mq_batch_record_size(Request *r) {
+    size_t size = r->body ? r->length : 0;
+    return strlen(r->uri) - strlen("/topic/") + 1 + snprintf(NULL, 0, "%zu", size) + 1 + size;
+}
+
+/**
+ * Write window of requests to server back-to-back and then read their
+ * responses in order, reporting any error response for each request.
+ * Requests that were written are never resent, since the server may have
+ * handled them before the connection failed.
+ * @param   mq      Message Queue structure.
+ * @param   head    List of requests to send.
+ * @return  List of requests that were not written (must be resent).
+ **/
+Request * mq_push_window(MessageQueue *mq, Request *head) {
+    Connection *c = mq->push_connection;
+
+    if (connection_open(c) < 0) {
+        mq_outcome(c, true);
+        return head;
+    }
+    if (connection_send(c, head) < 0) {
+        mq_outcome(c, true);
+        return mq_abandon(mq, head, c->sent);
+    }
+
+    // Match responses to requests (server responds in request order)
+    while (head) {
+        char *body = NULL;
+        int status = connection_read_response(c, &body, NULL);
+        if (status < 0) {
+            mq_outcome(c, true);
+            return mq_abandon(mq, head, SIZE_MAX);
+        }
+
+        if (status != 200) {
+            error("%s %s: %d %s", head->method, head->uri, status, body ? strtok(body, "\r\n") : "");
+        } else if (body && streq(head->uri, "/batch")) {
+            mq_report_batch(body);
+        }
+        free(body);
+
+        Request *next = head->next;
+        request_delete(head);
+        head = next;
+    }
+
+    mq_outcome(c, false);
+    connection_release(c);
+    return NULL;
+}
+
+/**
+ * Give up on the first n requests of list (reporting how many), such as those
+ * written to a connection that failed before they were answered.
+ * @param   mq      Message Queue structure.
+ * @param   head    List of requests.
+ * @param   n       Number of requests to give up on (SIZE_MAX for all).
+ * @return  Rest of list.
+ **/
+Request * mq_abandon(MessageQueue *mq, Request *head, size_t n) {
+    size_t abandoned = 0;
+    while (head && abandoned < n) {
+        Request *next = head->next;
+        request_delete(head);
+        head = next;
+        abandoned++;
+    }
+
+    if (abandoned) {
+        error_limited("Gave up on %zu requests to %s%s%s without a response",
+                      abandoned, mq->host, mq->port[0] ? ":" : "", mq->port);
+    }
+    return head;
+}
+
+/**
+ * Report each failed publish in a batch response, which has one line per
+ * published message:
+ *
+ *  $STATUS $MESSAGE\n
+ *
+ * @param   body    Batch response body.
+ **/
+void mq_report_batch(char *body) {
+    char *saveptr = NULL;
+    for (char *line = strtok_r(body, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        if (strtol(line, NULL, 10) != 200) {
+            error("PUT /batch: %s", line);
+        }
+    }
+}
+
+/**
+ * Delete list of requests.
+ * @param   head    List of requests.
+ **/
+void mq_delete_requests(Request *head) {
+    while (head) {
+        Request *next = head->next;
+        request_delete(head);
+        head = next;
+    }
 }
 
 /**
@@ -221,56 +1093,347 @@ void * mq_pusher(void *arg) {
  **/
 void * mq_puller(void *arg) {
     MessageQueue *mq = (MessageQueue *)arg;
+    mq_ignore_sigpipe();
 
-    // Run until mq->shutdown is set
-    while (!mq_shutdown(mq)) {
-      char get_uri[BUFSIZ];
-      int status = sprintf(get_uri, "/queue/%s", mq->name);
+    // Run until the SENTINEL (published by mq_stop) has been delivered
+    bool sentinel = false;
+    while (!sentinel) {
+      mq_backoff(mq, mq->pull_connection);
 
-      if (status < 0)
-        continue;
+      bool failed = false;
+      if (mq->streaming) {
+        sentinel = mq_stream(mq, &failed);
+      } else {
+        sentinel = mq_pull(mq, &failed);
+      }
+      mq_outcome(mq->pull_connection, failed);
 
-      FILE *fs = socket_connect(mq->host, mq->port);
-      if (!fs) {
-        continue;
+      // Once stopping, a server that cannot be reached will not send the
+      // SENTINEL, so deliver one ourselves to wake up mq_retrieve
+      if (!sentinel && failed && mq_shutdown(mq)) {
+        sentinel = mq_deliver(mq, mq_sentinel());
       }
+    }
 
-      // Write request to server
-      Request *r = request_create("GET", get_uri, NULL);
-      request_write(r, fs);
+    return 0;
+}
 
-      char buffer[BUFSIZ];
-      int length;
+/**
+ * Request messages from server once and deliver them to incoming queue.
+ * @param   mq      Message Queue structure.
+ * @param   failed  Set if the request failed.
+ * @return  Whether or not the SENTINEL was delivered.
+ **/
+bool mq_pull(MessageQueue *mq, bool *failed) {
+    bool sentinel = false;
+    char get_uri[BUFSIZ];
+    int status = sprintf(get_uri, "/queue/%s", mq->name);
+
+    if (status < 0)
+      return false;
+
+    // Ask for up to retrieve_max messages at once
+    if (mq->retrieve_max > 1) {
+      sprintf(get_uri + status, "?max=%zu", mq->retrieve_max);
+    }
 
-      // Check for response from server
-      if (!fgets(buffer, BUFSIZ, fs)) {
-        request_delete(r);
-        fclose(fs);
-        continue;
+    // Write request to server and read response into r->body
+    Request *r    = request_create("GET", get_uri, NULL);
+    char *body    = NULL;
+    size_t length = 0;
+
+    // Check for correct status code and push onto incoming
+    if (connection_request(mq->pull_connection, r, &body, &length) != 200) {
+      *failed = true;
+      free(body);
+      request_delete(r);
+    }
+    else if (mq->retrieve_max > 1) {
+      bool invalid;
+      if (mq_unpack_records(mq, body, length, &sentinel, &invalid) != length) {
+        error("Invalid record in response: %s", body);
       }
+      free(body);
+      request_delete(r);
+    }
+    else {
+      r->body   = body;
+      r->length = length;
+      sentinel  = mq_deliver(mq, r);
+    }
 
-      // Check for correct status code and scan for content length
-      if (strstr(buffer, "200 OK")) {
-        while (fgets(buffer, BUFSIZ, fs) && !streq(buffer, "\r\n")) {
-          sscanf(buffer, "Content-Length: %d", &length);
-        }
+    return sentinel;
+}
+
+/**
+ * Wait until connection may try connecting again after failed connects (see
+ * backoff_failure), or until the message queue is shutdown.
+ * @param   mq      Message Queue structure.
+ * @param   c       Connection structure.
+ **/
+void mq_backoff(MessageQueue *mq, Connection *c) {
+    int delay = backoff_remaining(&c->backoff, backoff_now());
+    if (delay <= 0) {
+      return;
+    }
+
+    // Condition variables wait until a deadline on the realtime clock
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += delay / 1000;
+    deadline.tv_nsec += (delay % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
 
-        // Read response from server into r->body and push onto incoming
-        char *response = calloc(1, length+1);
-        fread(response, 1, length, fs);
+    mutex_lock(&mq->lock_stop_mq);
+    while (!mq->shutdown && pthread_cond_timedwait(&mq->stopped, &mq->lock_stop_mq, &deadline) != ETIMEDOUT);
+    mutex_unlock(&mq->lock_stop_mq);
+
+    // An open circuit turns half-open once its cooldown has passed
+    backoff_remaining(&c->backoff, backoff_now());
+}
+
+/**
+ * Record outcome of a request on connection in its backoff.  A server that
+ * accepts connections and then fails requests (with an error status, or by
+ * closing at once) is backed off like one that refuses them, so only a
+ * request that succeeded resets the wait.
+ * @param   c       Connection structure.
+ * @param   failed  Whether or not the request (or its connect) failed.
+ **/
+void mq_outcome(Connection *c, bool failed) {
+    if (failed) {
+      backoff_failure(&c->backoff, backoff_now(), c->host, c->port);
+    } else {
+      backoff_success(&c->backoff, c->host, c->port);
+    }
+}
+
+/**
+ * Stream messages from server over a single connection until it is closed or
+ * the SENTINEL arrives.  The server sends each message as soon as it is
+ * published, as a record in a chunked response body.
+ * @param   mq      Message Queue structure.
+ * @param   failed  Set if the stream could not be opened or broke off.
+ * @return  Whether or not the SENTINEL was delivered.
+ **/
+bool mq_stream(MessageQueue *mq, bool *failed) {
+    char stream_uri[BUFSIZ];
+    if (snprintf(stream_uri, sizeof(stream_uri), "/stream/%s", mq->name) < 0)
+      return false;
+
+    *failed       = true;
+    Connection *c = mq->pull_connection;
+    if (connection_open(c) < 0) {
+      return false;
+    }
+
+    // Write request to server
+    Request *r = request_create("GET", stream_uri, NULL);
+    int sent   = connection_send(c, r);
+    request_delete(r);
 
-        r->body = response;
-        queue_push(mq->incoming, r);
+    if (sent < 0) {
+      return false;
+    }
+
+    // Anything but a chunked stream (such as 404 for a missing queue) is an
+    // ordinary response
+    int status = connection_read_head(c);
+    if (status < 0) {
+      return false;
+    }
+    if (status != 200 || !c->parser.chunked) {
+      connection_close(c);
+      return false;
+    }
+
+    // Stream is open: breaking off later starts backing off afresh
+    mq_outcome(c, false);
+
+    // Push each complete record onto incoming as its chunks arrive
+    char  *pending  = NULL;
+    size_t length   = 0;
+    bool   sentinel = false;
+    while (!sentinel) {
+      const char *piece;
+      ssize_t     size = connection_read_body(c, &piece);
+      if (size <= 0) {
+        break;
       }
-      else {
-        request_delete(r);
-        continue;
+
+      char *bigger = realloc(pending, length + size + 1);
+      if (!bigger) {
+        break;
       }
+      pending = bigger;
+      memcpy(pending + length, piece, size);
+      length += size;
+      pending[length] = 0;
 
-      fclose(fs);
+      bool   invalid;
+      size_t consumed = mq_unpack_records(mq, pending, length, &sentinel, &invalid);
+      if (invalid) {
+        break;
+      }
+      memmove(pending, pending + consumed, length - consumed);
+      length -= consumed;
     }
 
-    return 0;
+    free(pending);
+    connection_close(c);
+    *failed = !sentinel;
+    return sentinel;
+}
+
+/**
+ * Push each complete message in a multi-message response onto incoming
+ * queue.  Each message is encoded as a record:
+ *
+ *  $TOPIC $LENGTH\n
+ *  $BODY
+ *
+ * @param   mq      Message Queue structure.
+ * @param   body    Response body.
+ * @param   length  Length of response body.
+ * @param   sentinel Set if the SENTINEL was among the records.
+ * @param   invalid Set if a bad record stopped unpacking (see mq_parse_records).
+ * @return  Number of bytes consumed (a trailing partial record is left).
+ **/
+size_t mq_unpack_records(MessageQueue *mq, char *body, size_t length, bool *sentinel, bool *invalid) {
+    size_t consumed;
+
+    // Push every record in one batch
+    *sentinel |= mq_deliver(mq, mq_parse_records(body, length, &consumed, invalid));
+    return consumed;
+}
+
+/**
+ * Make a message of each complete record in body (see mq_unpack_records).
+ * Parsing stops at a record whose length is not a plain decimal number, or
+ * whose message cannot be allocated, since nothing after it can be framed.
+ * @param   body        Response body.
+ * @param   length      Length of response body.
+ * @param   consumed    Where to store number of bytes consumed.
+ * @param   invalid     Where to store whether a bad record stopped parsing.
+ * @return  List of messages (linked by next).
+ **/
+Request * mq_parse_records(char *body, size_t length, size_t *consumed, bool *invalid) {
+    char    *start = body;
+    char    *end   = body + length;
+    Request *head  = NULL;
+    Request *tail  = NULL;
+
+    *invalid = false;
+    while (body < end) {
+      char *newline = memchr(body, '\n', end - body);
+      if (!newline) {
+        break;
+      }
+
+      char  *space  = memchr(body, ' ', newline - body);
+      char  *digits = NULL;
+      size_t size   = 0;
+      if (space && space[1] >= '0' && space[1] <= '9') {
+        errno = 0;
+        size  = strtoul(space + 1, &digits, 10);
+      }
+      if (!space || digits != newline || errno == ERANGE) {
+        error("Invalid record: %.*s", (int)(newline - body), body);
+        *invalid = true;
+        break;
+      }
+      if (size > (size_t)(end - newline - 1)) {
+        break;
+      }
+
+      char uri[BUFSIZ];
+      snprintf(uri, sizeof(uri), "/topic/%.*s", (int)(space - body), body);
+
+      Request *r = request_reserve("PUT", uri, size);
+      if (!r) {
+        error("Unable to allocate record of %zu bytes: %s", size, strerror(errno));
+        *invalid = true;
+        break;
+      }
+      memcpy(r->body, newline + 1, size);
+      if (tail) {
+        tail->next = r;
+      } else {
+        head = r;
+      }
+      tail = r;
+
+      body = newline + 1 + size;
+    }
+
+    *consumed = body - start;
+    return head;
+}
+
+/**
+ * Push list of messages received from server (linked by next) onto incoming
+ * queue in one batch.  The SENTINEL is pushed even if incoming is full so
+ * mq_retrieve always sees it.
+ * @param   mq      Message Queue structure.
+ * @param   head    First request of list.
+ * @return  Whether or not the SENTINEL was in the list once stopping (every
+ *          client subscribes to it, so one arriving earlier was published
+ *          by another client stopping).
+ **/
+bool mq_deliver(MessageQueue *mq, Request *head) {
+    Request *run      = NULL;
+    Request *tail     = NULL;
+    bool     sentinel = false;
+
+    mq_stamp(head);
+    while (head) {
+      Request *next   = head->next;
+      head->next      = NULL;
+
+      if (head->body && mq_is_sentinel(head)) {
+        queue_push_batch(mq->incoming, run);
+        queue_push_force(mq->incoming, head);
+        run = tail = NULL;
+        sentinel   = true;
+      } else if (tail) {
+        tail->next = head;
+        tail       = head;
+      } else {
+        run = tail = head;
+      }
+
+      head = next;
+    }
+
+    queue_push_batch(mq->incoming, run);
+    return sentinel && mq_shutdown(mq);
+}
+
+/**
+ * Record when each message in list (linked by next) was received.
+ * @param   head    First request of list.
+ **/
+void mq_stamp(Request *head) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    for (Request *r = head; r; r = r->next) {
+      r->timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    }
+}
+
+/**
+ * Block SIGPIPE in the calling thread so a write to a connection the server has
+ * closed fails with EPIPE (and is retried) instead of killing the process.
+ **/
+void mq_ignore_sigpipe() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
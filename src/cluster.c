@@ -0,0 +1,115 @@
+/* cluster.c: Consistent hash ring choosing a broker for each topic */
+
+#include "mq/cluster.h"
+#include "mq/logging.h"
+#include "mq/table.h"
+
+#include <errno.h>
+
+/**
+ * Compare points by hash (for qsort), breaking ties by node so every client
+ * builds the same ring.
+ */
+static int cluster_compare(const void *a, const void *b) {
+    const ClusterPoint *p = a;
+    const ClusterPoint *q = b;
+
+    if (p->hash != q->hash) {
+        return p->hash < q->hash ? -1 : 1;
+    }
+    return p->node < q->node ? -1 : (p->node > q->node);
+}
+
+/**
+ * Create Cluster structure placing CLUSTER_REPLICAS points of each node on
+ * the ring.  Points are hashed from node names, so clients that list the same
+ * nodes (in any order) map every key to the same name.
+ * @param   nodes       Names of nodes (such as host:port of each broker).
+ * @param   nnodes      Number of nodes.
+ * @return  Newly allocated Cluster structure (NULL without nodes).
+ */
+Cluster * cluster_create(const char *nodes[], size_t nnodes) {
+    if (!nnodes) {
+        return NULL;
+    }
+
+    Cluster *c = calloc(1, sizeof(Cluster));
+    if (!c) {
+        return NULL;
+    }
+
+    c->nnodes  = nnodes;
+    c->npoints = nnodes * CLUSTER_REPLICAS;
+    c->points  = calloc(c->npoints, sizeof(ClusterPoint));
+    if (!c->points) {
+        error("Unable to allocate cluster: %s", strerror(errno));
+        free(c);
+        return NULL;
+    }
+
+    for (size_t n = 0; n < nnodes; n++) {
+        for (size_t r = 0; r < CLUSTER_REPLICAS; r++) {
+            char name[BUFSIZ];
+            snprintf(name, sizeof(name), "%s#%zu", nodes[n], r);
+            c->points[n * CLUSTER_REPLICAS + r] = (ClusterPoint) { cluster_hash(name), n };
+        }
+    }
+
+    qsort(c->points, c->npoints, sizeof(ClusterPoint), cluster_compare);
+    return c;
+}
+
+/**
+ * Delete Cluster structure.
+ * @param   c           Cluster structure.
+ */
+void cluster_delete(Cluster *c) {
+    if (c) {
+        free(c->points);
+        free(c);
+    }
+}
+
+/**
+ * Return node owning key: the node of the first point at or after the hash
+ * of key (wrapping around the ring).  Adding a node only moves the keys on
+ * the arcs its points take over.
+ * @param   c           Cluster structure.
+ * @param   key         Key string (such as a topic).
+ * @return  Index of node.
+ */
+size_t cluster_lookup(Cluster *c, const char *key) {
+    uint64_t hash = cluster_hash(key);
+    size_t   low  = 0;
+    size_t   high = c->npoints;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (c->points[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return c->points[low < c->npoints ? low : 0].node;
+}
+
+/**
+ * Compute hash of key: FNV-1a (see table_hash) followed by the finalizer of
+ * SplitMix64, so that names differing in a few characters land far apart.
+ * @param   key         Key string.
+ * @return  Hash of key.
+ */
+uint64_t cluster_hash(const char *key) {
+    uint64_t hash = table_hash(key);
+
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,467 @@
+/* connection.c: Persistent connection to Message Queue server */
+
+#include "mq/connection.h"
+#include "mq/logging.h"
+#include "mq/socket.h"
+#include "mq/string.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define CONNECTION_IOVECS   64	    /* Most buffers passed to one writev */
+#define CONNECTION_INLINE   256	    /* Bodies up to this size are copied after their head */
+
+/**
+ * Create Connection structure for specified host and port.
+ * @param   host        Address of server.
+ * @param   port        Port of server.
+ * @param   keepalive   Whether or not to reuse stream across requests.
+ * @return  Newly allocated Connection structure (not yet connected).
+ */
+Connection * connection_create(const char *host, const char *port, bool keepalive) {
+    Connection *c = calloc(1, sizeof(Connection));
+
+    if (c) {
+        if (host)
+            snprintf(c->host, sizeof(c->host), "%s", host);
+        if (port)
+            snprintf(c->port, sizeof(c->port), "%s", port);
+
+        socket_authority(c->host, c->port, c->authority, sizeof(c->authority));
+        c->keepalive = keepalive;
+        c->fd        = -1;
+        parser_init(&c->parser);
+        backoff_init(&c->backoff, BACKOFF_MIN_MS, BACKOFF_MAX_MS, BACKOFF_THRESHOLD, BACKOFF_COOLDOWN_MS);
+    }
+
+    return c;
+}
+
+/**
+ * Delete Connection structure (and close socket if open).
+ * @param   c           Connection structure.
+ */
+void connection_delete(Connection *c) {
+    if (c) {
+        connection_close(c);
+        free(c);
+    }
+}
+
+/**
+ * Returns whether or not idle socket has been closed (or written to) by the
+ * server, which never sends anything between responses.
+ * @param   c           Connection structure.
+ */
+static bool connection_stale(Connection *c) {
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    return c->input_start == c->input_end && poll(&pfd, 1, 0) != 0;
+}
+
+/**
+ * Return socket to server, connecting only if there is no open socket (or the
+ * idle one was closed by the server).  Callers record whether the request
+ * made on it succeeded in backoff (and wait out backoff_remaining before
+ * trying again), so failed connects and failed requests count alike.
+ * @param   c           Connection structure.
+ * @return  Socket file descriptor if successful, otherwise -1.
+ */
+int connection_open(Connection *c) {
+    if (c->fd >= 0 && connection_stale(c)) {
+        connection_close(c);
+    }
+
+    if (c->fd < 0) {
+        c->fd = socket_connect(c->host, c->port);
+        if (c->fd >= 0) {
+            c->connects++;
+        }
+    }
+
+    return c->fd;
+}
+
+/**
+ * Close socket to server and discard anything left unread (next open will
+ * reconnect).
+ * @param   c           Connection structure.
+ */
+void connection_close(Connection *c) {
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    c->input_start = 0;
+    c->input_end   = 0;
+    parser_init(&c->parser);
+}
+
+/**
+ * Finish with the current request: keep socket open for the next request if
+ * keepalive is enabled, otherwise close it.
+ * @param   c           Connection structure.
+ */
+void connection_release(Connection *c) {
+    if (!c->keepalive) {
+        connection_close(c);
+    }
+}
+
+/**
+ * Read more data from socket into the (empty) input buffer.
+ * @param   c           Connection structure.
+ * @return  Number of bytes read (0 at end of stream), otherwise -1.
+ */
+static ssize_t connection_fill(Connection *c) {
+    ssize_t nread;
+
+    c->input_start = 0;
+    c->input_end   = 0;
+    do {
+        nread = read(c->fd, c->input, sizeof(c->input));
+    } while (nread < 0 && errno == EINTR);
+
+    if (nread > 0) {
+        c->input_end = nread;
+    }
+    return nread;
+}
+
+/**
+ * Run response parser over input until its next event, reading more from
+ * socket whenever all of the buffered input has been consumed.
+ * @param   c           Connection structure.
+ * @param   data        Where to store start of body piece (PARSER_BODY).
+ * @param   length      Where to store length of body piece (PARSER_BODY).
+ * @return  Next event (PARSER_ERROR if stream fails or ends early).
+ */
+static ParserEvent connection_parse(Connection *c, const char **data, size_t *length) {
+    while (true) {
+        size_t      consumed;
+        ParserEvent event = parser_execute(&c->parser, c->input + c->input_start,
+                                           c->input_end - c->input_start, &consumed, data, length);
+        c->input_start += consumed;
+        if (event != PARSER_MORE) {
+            return event;
+        }
+
+        ssize_t nread = connection_fill(c);
+        if (nread == 0) {
+            return parser_finish(&c->parser) == PARSER_DONE ? PARSER_DONE : PARSER_ERROR;
+        }
+        if (nread < 0) {
+            return PARSER_ERROR;
+        }
+    }
+}
+
+/**
+ * Write all of the buffers in iov to socket, continuing after partial writes.
+ * @param   c           Connection structure.
+ * @param   iov         Buffers to write (modified as they are written).
+ * @param   iovcnt      Number of buffers.
+ * @param   written     Where to store number of bytes written (even if a
+ *                      later write failed).
+ * @return  Whether or not everything was written.
+ */
+static bool connection_writev(Connection *c, struct iovec *iov, int iovcnt, size_t *written) {
+    *written = 0;
+    while (iovcnt > 0) {
+        ssize_t nwritten = writev(c->fd, iov, iovcnt);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        *written += nwritten;
+
+        // Skip buffers written completely and advance into a partial one
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base  = (char *)iov->iov_base + nwritten;
+            iov->iov_len  -= nwritten;
+        }
+    }
+    return true;
+}
+
+/**
+ * Append buffer to iov, extending the last buffer if the new one follows it
+ * in memory.
+ * @param   iov         Buffers to write.
+ * @param   iovcnt      Number of buffers (updated).
+ * @param   data        Start of new buffer.
+ * @param   size        Size of new buffer.
+ */
+static void connection_append(struct iovec *iov, int *iovcnt, const void *data, size_t size) {
+    if (*iovcnt > 0 && (char *)iov[*iovcnt - 1].iov_base + iov[*iovcnt - 1].iov_len == data) {
+        iov[*iovcnt - 1].iov_len += size;
+    } else {
+        iov[*iovcnt].iov_base = (void *)data;
+        iov[*iovcnt].iov_len  = size;
+        (*iovcnt)++;
+    }
+}
+
+/**
+ * Count how many of the requests gathered for a failed write went out in
+ * full, that is whose head and body fall entirely inside the bytes written.
+ * @param   c           Connection structure.
+ * @param   first       First request gathered for the write.
+ * @param   gathered    Number of requests gathered for the write.
+ * @param   written     Number of bytes written before the write failed.
+ * @return  Number of requests written in full.
+ */
+static size_t connection_written(Connection *c, Request *first, size_t gathered, size_t written) {
+    size_t count = 0;
+    size_t end   = 0;
+
+    for (Request *r = first; r && count < gathered; r = r->next) {
+        size_t length = request_head(r, c->authority, NULL, 0);
+        if (length && r->body) {
+            length += r->length;
+        }
+        if ((end += length) > written) {
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Send list of requests to server.  The head of each request is formatted
+ * into the output buffer (along with small bodies) and larger bodies are
+ * written from where they are, so the whole list goes out in as few writev
+ * calls as the buffer allows without copying or stdio buffering.  How many
+ * requests were written in full (even if a later one failed) is stored in
+ * c->sent.
+ * @param   c           Connection structure.
+ * @param   head        List of requests to send.
+ * @return  0 if successful, otherwise -1 (socket is closed).
+ */
+int connection_send(Connection *c, Request *head) {
+    struct iovec iov[CONNECTION_IOVECS];
+    int          iovcnt   = 0;
+    size_t       used     = 0;
+    size_t       gathered = 0;
+    size_t       written  = 0;
+    Request *    first    = head;
+
+    c->sent = 0;
+    if (c->fd < 0) {
+        return -1;
+    }
+
+    for (Request *r = head; r; r = r->next) {
+        bool   copy   = r->body && r->length <= CONNECTION_INLINE;
+        size_t room   = sizeof(c->output) - used;
+        size_t length = request_head(r, c->authority, c->output + used, room);
+
+        // Flush what has been gathered so far if this request does not fit
+        if (length + (copy ? r->length : 0) > room || iovcnt + 2 > CONNECTION_IOVECS) {
+            if (!connection_writev(c, iov, iovcnt, &written)) {
+                goto failure;
+            }
+            c->sent += gathered;
+            first    = r;
+            gathered = 0;
+            iovcnt   = 0;
+            used     = 0;
+            room   = sizeof(c->output);
+            length = request_head(r, c->authority, c->output, room);
+            if (length > room) {
+                error("Request head too long: %zu bytes", length);
+                goto failure;
+            }
+        }
+        gathered++;
+        if (!length) {
+            continue;
+        }
+
+        char *start = c->output + used;
+        if (copy) {
+            memcpy(start + length, r->body, r->length);
+            length += r->length;
+        }
+        used += length;
+        connection_append(iov, &iovcnt, start, length);
+
+        if (r->body && !copy) {
+            connection_append(iov, &iovcnt, r->body, r->length);
+        }
+    }
+
+    if (connection_writev(c, iov, iovcnt, &written)) {
+        c->sent += gathered;
+        return 0;
+    }
+
+failure:
+    // Requests written in full before the failure are not sent again
+    c->sent += connection_written(c, first, gathered, written);
+    connection_close(c);
+    return -1;
+}
+
+/**
+ * Read status line and headers of one HTTP response from server:
+ *
+ *  HTTP/1.1 $STATUS $REASON\r\n
+ *  Content-Length: Length($BODY)\r\n
+ *  \r\n
+ *
+ * How the body is framed is recorded in the Connection's parser.
+ *
+ * @param   c           Connection structure.
+ * @return  HTTP status code if successful, otherwise -1 (socket is closed).
+ */
+int connection_read_head(Connection *c) {
+    const char *data;
+    size_t      length;
+
+    if (c->fd < 0) {
+        return -1;
+    }
+
+    if (connection_parse(c, &data, &length) != PARSER_HEAD) {
+        connection_close(c);
+        return -1;
+    }
+    return c->parser.status;
+}
+
+/**
+ * Read next piece of response body, whether it is delimited by Content-Length,
+ * chunked transfer encoding or the end of the stream.
+ * @param   c           Connection structure.
+ * @param   data        Where to store start of piece (valid until the next
+ *                      read from the Connection).
+ * @return  Length of piece, 0 at the end of the body, otherwise -1 (socket is
+ *          closed).
+ */
+ssize_t connection_read_body(Connection *c, const char **data) {
+    size_t length;
+
+    switch (c->fd < 0 ? PARSER_ERROR : connection_parse(c, data, &length)) {
+        case PARSER_BODY:
+            return length;
+        case PARSER_DONE:
+            return 0;
+        default:
+            connection_close(c);
+            return -1;
+    }
+}
+
+/**
+ * Read one HTTP response from server (head and body).  The body is delimited
+ * by Content-Length, chunked transfer encoding or the end of the stream.  The
+ * stream is closed if the server does not keep the connection alive.
+ *
+ * @param   c           Connection structure.
+ * @param   body        Where to store newly allocated body (NULL to discard).
+ * @param   length      Where to store length of body (may be NULL).
+ * @return  HTTP status code if successful, otherwise -1 (stream is closed).
+ */
+int connection_read_response(Connection *c, char **body, size_t *length) {
+    int status = connection_read_head(c);
+    if (status < 0) {
+        return -1;
+    }
+
+    // Size buffer for the whole body when its length is known up front
+    size_t capacity = c->parser.content_length >= 0 ? c->parser.content_length : BUFSIZ;
+    size_t size     = 0;
+    char  *data     = malloc(capacity + 1);
+    if (!data) {
+        goto failure;
+    }
+
+    const char *piece;
+    ssize_t     nread;
+    while ((nread = connection_read_body(c, &piece)) > 0) {
+        if (size + nread > capacity) {
+            capacity     = 2*(size + nread);
+            char *bigger = realloc(data, capacity + 1);
+            if (!bigger) {
+                goto failure;
+            }
+            data = bigger;
+        }
+        memcpy(data + size, piece, nread);
+        size += nread;
+    }
+    if (nread < 0) {
+        goto failure;
+    }
+    data[size] = 0;
+
+    if (body) {
+        *body = data;
+    } else {
+        free(data);
+    }
+    if (length) {
+        *length = size;
+    }
+
+    if (!c->parser.persistent) {
+        connection_close(c);
+    }
+    return status;
+
+failure:
+    free(data);
+    connection_close(c);
+    return -1;
+}
+
+/**
+ * Send Request to server and read its response, reconnecting once if it could
+ * not be sent over a reused socket the server has closed.  Once a request has
+ * been sent it is never sent again, since the server may have handled it
+ * (publishing it twice) before the response was lost.
+ * @param   c           Connection structure.
+ * @param   r           Request structure.
+ * @param   body        Where to store newly allocated body (NULL to discard).
+ * @param   length      Where to store length of body (may be NULL).
+ * @return  HTTP status code if successful, otherwise -1.
+ */
+int connection_request(Connection *c, Request *r, char **body, size_t *length) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused = (c->fd >= 0);
+        if (connection_open(c) < 0) {
+            return -1;
+        }
+
+        if (connection_send(c, r) == 0) {
+            int status = connection_read_response(c, body, length);
+            if (status >= 0) {
+                connection_release(c);
+            } else {
+                connection_close(c);
+            }
+            return status;
+        }
+
+        connection_close(c);
+        if (!reused) {
+            break;
+        }
+    }
+
+    return -1;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
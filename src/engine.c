@@ -0,0 +1,1540 @@
+/* engine.c: Shared epoll (or io_uring) I/O engine for Message Queue clients */
+
+#include "mq/client.h"
+#include "mq/logging.h"
+#include "mq/mailbox.h"
+#include "mq/parser.h"
+#include "mq/socket.h"
+#include "mq/string.h"
+#include "mq/uring.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define ENGINE_EVENTS	    256
+#define ENGINE_READ	    (1<<16)
+#define ENGINE_ENTRIES	    1024	/* io_uring submission queue entries */
+#define ENGINE_BUFFERS	    256		/* io_uring provided receive buffers */
+#define ENGINE_BUFFER_SIZE  (1<<14)
+#define ENGINE_GROUP	    0		/* io_uring buffer group of receives */
+#define REDELIVER_MS	    1		/* Wait before retrying a full incoming queue */
+#define SHUTDOWN_POLL_MS    100		/* Longest a backoff keeps mq_stop waiting */
+
+/* Internal Structures */
+
+typedef enum {
+    WATCH_OUTGOING,			// Outgoing queue has requests
+    WATCH_PUSH,				// Push connection is ready
+    WATCH_PULL,				// Pull connection is ready
+    WATCH_MAILBOX,			// Sessions were attached (no session)
+} WatchRole;
+
+typedef enum {
+    ENGINE_OP_POLL = 1,			// Readiness of Watch (io_uring user_data tag)
+    ENGINE_OP_SEND,			// Send of Channel output
+    ENGINE_OP_RECV,			// Receive into provided buffers of Channel
+} EngineOp;
+
+typedef struct Watch Watch;
+struct Watch {
+    EngineSession *session;
+    WatchRole      role;
+};
+
+typedef struct Channel Channel;
+struct Channel {
+    Watch    watch;			// Epoll registration (must be first)
+    int	     fd;			// Socket (-1 if disconnected)
+    int	     events;			// Events registered with epoll (or polled by io_uring)
+    bool     connecting;		// Waiting for non-blocking connect to finish
+    bool     sending;			// io_uring send in flight
+    bool     receiving;			// io_uring receive in flight
+    bool     cancelling;		// io_uring receive is being cancelled
+    uint64_t retry_at;			// When to reconnect after a failure (0 if now)
+    Backoff  backoff;			// Wait after failed connects
+
+    Request *requests;			// Requests sent (or to send) awaiting responses
+    Parser   parser;			// Response being read
+
+    char *   output;			// Serialized requests not yet written
+    size_t   output_size;
+    size_t   output_sent;
+    size_t   output_capacity;
+
+    char *   body;			// Body of response being read
+    size_t   body_size;
+    size_t   body_capacity;
+};
+
+struct EngineSession {
+    Mail          mail;			// Attachment sent to loop (must be first)
+    MessageQueue *mq;
+    EngineLoop *  loop;
+    char          authority[SOCKET_AUTHORITY];	// Value of Host header
+
+    Watch         outgoing;		// Outgoing queue event file descriptor
+    int           outgoing_fd;
+    int           outgoing_events;
+    Channel       push;
+    Channel       pull;
+
+    bool          sentinel;		// SENTINEL has been taken from outgoing
+    bool          pushed;		// SENTINEL has been sent
+    bool          received;		// SENTINEL has been received (or made up) once stopping
+    bool          pulled;		// Pull connection stopped after the SENTINEL
+    bool          streaming;		// Pull response is a stream of records
+    char *        records;		// Partial record at end of stream
+    size_t        records_size;
+    Request *     undelivered;		// Messages waiting for room in incoming
+    uint64_t      deliver_at;		// When to retry delivering (0 if not waiting)
+    uint64_t      linger_at;		// When to stop waiting for a batch to fill (0 if not waiting)
+    bool          lingering;		// Waiting (or done waiting) for a batch to fill
+
+    size_t        inflight;		// io_uring operations not yet completed
+    bool          done;			// Finished in loop (no more events handled)
+    bool          finished;		// Detached from loop (mq_stop may return)
+    EngineSession *next;		// Next session attached to loop
+    EngineSession *prev;
+    EngineSession *next_done;		// Next session finished in this loop pass
+};
+
+struct EngineLoop {
+    MQEngine *     engine;
+    Thread         thread;
+    int	           epoll_fd;
+    Uring *        uring;		// io_uring (NULL waits with epoll_fd instead)
+    bool           multishot;		// Receives keep going until cancelled
+    size_t         syscalls;		// System calls made for I/O
+    Mailbox *      mailbox;		// Sessions to attach (and wakeups)
+    Watch          mailbox_watch;
+    int            mailbox_events;
+    Mail           wakeup;		// Sent to stop the loop
+    bool           stopping;
+
+    EngineSession *sessions;		// Sessions attached to loop
+    size_t         waiting;		// Sessions with a retry scheduled
+    EngineSession *done;		// Sessions finished but not yet reported
+    char           input[ENGINE_READ];	// Data read from any socket
+};
+
+/* Client Prototypes (client.c) */
+
+Request * mq_window(MessageQueue *mq, int timeout, int linger_ms, bool *sentinel);
+Request * mq_take(MessageQueue *mq, int timeout);
+bool      mq_is_publish(Request *r);
+size_t    mq_batch_record_size(Request *r);
+Request * mq_parse_records(char *body, size_t length, size_t *consumed, bool *invalid);
+bool      mq_is_sentinel(Request *r);
+Request * mq_sentinel();
+void      mq_report_batch(char *body);
+void      mq_stamp(Request *head);
+void      mq_delete_requests(Request *head);
+void      mq_ignore_sigpipe();
+
+/* Internal Prototypes */
+
+void *	engine_run(void *arg);
+void	session_process(EngineSession *s);
+void	session_push(EngineSession *s);
+bool	session_linger(EngineSession *s);
+void	session_pull(EngineSession *s);
+void	session_deliver(EngineSession *s, Request *head);
+void	session_finish(EngineSession *s);
+void	session_release(EngineSession *s);
+void	session_schedule(EngineSession *s, uint64_t *at, uint64_t when);
+void	channel_close(EngineSession *s, Channel *c);
+void	channel_fail(EngineSession *s, Channel *c);
+void	channel_abandon(EngineSession *s, Channel *c, bool all);
+bool	channel_open(EngineSession *s, Channel *c);
+bool	channel_serialize(EngineSession *s, Channel *c);
+void	channel_flush(EngineSession *s, Channel *c);
+void	channel_read(EngineSession *s, Channel *c);
+void	channel_input(EngineSession *s, Channel *c, const char *input, size_t nread);
+bool	channel_event(EngineSession *s, Channel *c, ParserEvent event, const char *data, size_t length);
+void	channel_update(EngineSession *s, Channel *c);
+void	channel_submit(EngineSession *s, Channel *c);
+void	engine_watch(EngineLoop *l, int fd, int *registered, int events, Watch *watch);
+struct io_uring_sqe * engine_sqe(EngineLoop *l, int opcode, int fd, Watch *watch, EngineOp op);
+void	engine_count(EngineLoop *l, size_t n);
+void	engine_cancel(EngineLoop *l, Watch *watch, EngineOp op);
+void	engine_receive(EngineLoop *l);
+Uring *	engine_uring(EngineLoop *l);
+uint64_t engine_now();
+
+/* External Functions */
+
+/**
+ * Create I/O engine with nthreads event loops.  Each Message Queue whose
+ * engine is set before mq_start has its connections driven by one of the
+ * loops (with non-blocking sockets) instead of a pusher and puller thread of
+ * its own.  Publishing and retrieving work the same either way.
+ * @param   nthreads    Number of event loop threads (at least 1).
+ * @return  Newly allocated MQEngine structure (NULL on failure).
+ */
+MQEngine * mq_engine_create(size_t nthreads) {
+    return mq_engine_create_backend(nthreads, ENGINE_EPOLL);
+}
+
+/**
+ * Create I/O engine with nthreads event loops that use backend.  With
+ * ENGINE_URING each loop submits its sends, receives and polls in batches,
+ * one io_uring_enter per pass, and receives into buffers registered with
+ * the kernel (multishot where supported).  Loops whose kernel lacks what
+ * that needs fall back to ENGINE_EPOLL.
+ * @param   nthreads    Number of event loop threads (at least 1).
+ * @param   backend     I/O backend to try.
+ * @return  Newly allocated MQEngine structure (NULL on failure).
+ */
+MQEngine * mq_engine_create_backend(size_t nthreads, EngineBackend backend) {
+    MQEngine *e = calloc(1, sizeof(MQEngine));
+    if (!e) {
+        return NULL;
+    }
+
+    e->nloops  = nthreads ? nthreads : 1;
+    e->loops   = calloc(e->nloops, sizeof(EngineLoop));
+    e->backend = backend;
+    if (!e->loops) {
+        free(e);
+        return NULL;
+    }
+    mutex_init(&e->lock, NULL);
+    cond_init(&e->detached, NULL);
+
+    for (size_t index = 0; index < e->nloops; index++) {
+        EngineLoop *l = &e->loops[index];
+        l->engine         = e;
+        l->epoll_fd       = -1;
+        l->mailbox_events = -1;
+
+        if (backend == ENGINE_URING && !(l->uring = engine_uring(l))) {
+            e->backend = ENGINE_EPOLL;
+        }
+
+        if ((!l->uring && (l->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) || !(l->mailbox = mailbox_create())) {
+            error("Unable to create engine loop: %s", strerror(errno));
+            e->nloops = index + 1;
+            mq_engine_delete(e);
+            return NULL;
+        }
+
+        l->mailbox_watch = (Watch) { NULL, WATCH_MAILBOX };
+        engine_watch(l, l->mailbox->fd, &l->mailbox_events, EPOLLIN, &l->mailbox_watch);
+        thread_create(&l->thread, NULL, engine_run, l);
+    }
+
+    return e;
+}
+
+/**
+ * Stop event loops and delete MQEngine structure (only once every Message
+ * Queue attached to it has been stopped).
+ * @param   e           MQEngine structure.
+ */
+void mq_engine_delete(MQEngine *e) {
+    if (!e) {
+        return;
+    }
+
+    for (size_t index = 0; index < e->nloops; index++) {
+        EngineLoop *l = &e->loops[index];
+
+        if (l->mailbox) {
+            __atomic_store_n(&l->stopping, true, __ATOMIC_RELEASE);
+            mailbox_send(l->mailbox, &l->wakeup);
+            thread_join(l->thread, NULL);
+            mailbox_delete(l->mailbox);
+        }
+        if (l->epoll_fd >= 0) {
+            close(l->epoll_fd);
+        }
+        if (l->uring) {
+            uring_exit(l->uring);
+            free(l->uring);
+        }
+    }
+
+    free(e->loops);
+    free(e);
+}
+
+/**
+ * Return number of system calls the event loops have made for I/O (waiting,
+ * registering, reading and writing; not connecting or closing).
+ * @param   e           MQEngine structure.
+ * @return  Number of system calls.
+ */
+size_t mq_engine_syscalls(MQEngine *e) {
+    size_t syscalls = 0;
+
+    for (size_t index = 0; index < e->nloops; index++) {
+        EngineLoop *l = &e->loops[index];
+        syscalls += __atomic_load_n(&l->syscalls, __ATOMIC_RELAXED);
+        if (l->uring) {
+            syscalls += __atomic_load_n(&l->uring->enters, __ATOMIC_RELAXED);
+        }
+    }
+    return syscalls;
+}
+
+/**
+ * Hand Message Queue over to the next event loop (called by mq_start).
+ * @param   e           MQEngine structure.
+ * @param   mq          Message Queue structure.
+ */
+void engine_attach(MQEngine *e, MessageQueue *mq) {
+    EngineSession *s = calloc(1, sizeof(EngineSession));
+    if (!s) {
+        error("Unable to attach %s to engine", mq->name);
+        return;
+    }
+
+    s->mq          = mq;
+    s->outgoing    = (Watch) { s, WATCH_OUTGOING };
+    s->outgoing_fd = queue_fd(mq->outgoing);
+    s->push        = (Channel) { .watch = { s, WATCH_PUSH }, .fd = -1 };
+    s->pull        = (Channel) { .watch = { s, WATCH_PULL }, .fd = -1 };
+    parser_init(&s->push.parser);
+    parser_init(&s->pull.parser);
+    socket_authority(mq->host, mq->port, s->authority, sizeof(s->authority));
+    backoff_init(&s->push.backoff, mq->reconnect_min_ms, mq->reconnect_max_ms,
+                 mq->breaker_threshold, mq->breaker_cooldown_ms);
+    backoff_init(&s->pull.backoff, mq->reconnect_min_ms, mq->reconnect_max_ms,
+                 mq->breaker_threshold, mq->breaker_cooldown_ms);
+    mq->session    = s;
+
+    mutex_lock(&e->lock);
+    s->loop = &e->loops[e->next++ % e->nloops];
+    mutex_unlock(&e->lock);
+
+    mailbox_send(s->loop->mailbox, &s->mail);
+}
+
+/**
+ * Wait for event loop to finish with Message Queue (called by mq_stop once
+ * the SENTINEL has been published).
+ * @param   e           MQEngine structure.
+ * @param   mq          Message Queue structure.
+ */
+void engine_detach(MQEngine *e, MessageQueue *mq) {
+    EngineSession *s = mq->session;
+    if (!s) {
+        return;
+    }
+
+    mutex_lock(&e->lock);
+    while (!s->finished) {
+        cond_wait(&e->detached, &e->lock);
+    }
+    mutex_unlock(&e->lock);
+
+    mq->session = NULL;
+    free(s);
+}
+
+/* Event Loop Functions */
+
+/**
+ * Return monotonic time in milliseconds.
+ */
+uint64_t engine_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+/**
+ * Count system calls made by loop.
+ * @param   l           EngineLoop structure.
+ * @param   n           Number of system calls.
+ */
+void engine_count(EngineLoop *l, size_t n) {
+    __atomic_store_n(&l->syscalls, l->syscalls + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Set up io_uring for loop, with its ring of receive buffers.
+ * @param   l           EngineLoop structure.
+ * @return  Newly allocated Uring structure (NULL if io_uring is unavailable).
+ */
+Uring * engine_uring(EngineLoop *l) {
+    Uring *u = calloc(1, sizeof(Uring));
+    if (!u) {
+        return NULL;
+    }
+
+    int status = uring_init(u, ENGINE_ENTRIES);
+    if (status < 0) {
+        info("io_uring is unavailable (%s), using epoll", strerror(-status));
+        free(u);
+        return NULL;
+    }
+
+    status = uring_buffers(u, ENGINE_BUFFERS, ENGINE_BUFFER_SIZE, ENGINE_GROUP);
+    if (status < 0) {
+        info("io_uring buffer rings are unavailable (%s), using epoll", strerror(-status));
+        uring_exit(u);
+        free(u);
+        return NULL;
+    }
+
+    l->multishot = true;
+    return u;
+}
+
+/**
+ * Queue io_uring operation on behalf of watch (submitted with the rest at the
+ * end of the loop pass).  Its completion is tagged with watch and op.
+ * @param   l           EngineLoop structure.
+ * @param   opcode      IORING_OP_* operation.
+ * @param   fd          File descriptor.
+ * @param   watch       Watch to report completion to (NULL for none).
+ * @param   op          What completion means for watch.
+ * @return  Submission queue entry to fill in (NULL if none is free).
+ */
+struct io_uring_sqe * engine_sqe(EngineLoop *l, int opcode, int fd, Watch *watch, EngineOp op) {
+    struct io_uring_sqe *sqe = uring_sqe(l->uring);
+    if (!sqe) {
+        error("Unable to queue io_uring operation");
+        return NULL;
+    }
+
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->user_data = watch ? (uintptr_t)watch | op : 0;
+    if (watch && watch->session) {
+        watch->session->inflight++;
+    }
+    return sqe;
+}
+
+/**
+ * Cancel io_uring operation of watch (its completion still arrives).
+ * @param   l           EngineLoop structure.
+ * @param   watch       Watch operation was queued for.
+ * @param   op          Operation to cancel.
+ */
+void engine_cancel(EngineLoop *l, Watch *watch, EngineOp op) {
+    struct io_uring_sqe *sqe = engine_sqe(l, op == ENGINE_OP_POLL ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL, -1, NULL, 0);
+    if (sqe) {
+        sqe->addr = (uintptr_t)watch | op;
+    }
+}
+
+/**
+ * Register file descriptor with epoll for events (adding, modifying or
+ * removing it as needed).  With io_uring, a one-shot poll is queued instead,
+ * which reports readiness once (registered returns to -1 then, and 0 means a
+ * removal is under way).
+ * @param   l           EngineLoop structure.
+ * @param   fd          File descriptor.
+ * @param   registered  Events currently registered (-1 if not added; updated).
+ * @param   events      Events to wait for (-1 to remove).
+ * @param   watch       Watch to report events with.
+ */
+void engine_watch(EngineLoop *l, int fd, int *registered, int events, Watch *watch) {
+    if (fd < 0 || *registered == events) {
+        return;
+    }
+
+    if (l->uring) {
+        if (events > 0 && *registered < 0) {
+            struct io_uring_sqe *sqe = engine_sqe(l, IORING_OP_POLL_ADD, fd, watch, ENGINE_OP_POLL);
+            if (sqe) {
+                sqe->poll32_events = events;
+                *registered = events;
+            }
+        } else if (events <= 0 && *registered > 0) {
+            engine_cancel(l, watch, ENGINE_OP_POLL);
+            *registered = 0;
+        }
+        return;
+    }
+
+    struct epoll_event event = { .events = events, .data.ptr = watch };
+    engine_count(l, 1);
+    if (events < 0) {
+        epoll_ctl(l->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    } else if (*registered < 0) {
+        if (epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            error("Unable to add descriptor to epoll: %s", strerror(errno));
+            return;
+        }
+    } else {
+        epoll_ctl(l->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    }
+    *registered = events;
+}
+
+/**
+ * Take in sessions attached by mq_start.
+ * @param   l           EngineLoop structure.
+ */
+void engine_receive(EngineLoop *l) {
+    engine_count(l, 1);
+    Mail *mail = mailbox_receive(l->mailbox);
+
+    while (mail) {
+        EngineSession *s = (EngineSession *)mail;
+        mail = mail->next;
+        if (&s->mail == &l->wakeup) {
+            continue;
+        }
+
+        s->next = l->sessions;
+        if (l->sessions) {
+            l->sessions->prev = s;
+        }
+        l->sessions = s;
+
+        s->outgoing_events = -1;
+        s->push.events     = -1;
+        s->pull.events     = -1;
+        session_process(s);
+    }
+}
+
+/**
+ * Process sessions whose retry time has come (or which are shutting down,
+ * since mq_stop does not wait out a backoff).
+ * @param   l           EngineLoop structure.
+ * @return  Milliseconds until the next retry (-1 if none is scheduled).
+ */
+int engine_timers(EngineLoop *l) {
+    if (!l->waiting) {
+        return -1;
+    }
+
+    // Process sessions that are due (which may schedule new retries)
+    uint64_t now = engine_now();
+    for (EngineSession *s = l->sessions; s; s = s->next) {
+        uint64_t *timers[] = { &s->push.retry_at, &s->pull.retry_at, &s->deliver_at, &s->linger_at };
+        bool      due      = false;
+        bool      stopping = mq_shutdown(s->mq);
+        for (size_t t = 0; t < sizeof(timers) / sizeof(timers[0]); t++) {
+            if (*timers[t] && (*timers[t] <= now || stopping)) {
+                *timers[t] = 0;
+                l->waiting--;
+                due = true;
+            }
+        }
+
+        if (due) {
+            session_process(s);
+        }
+    }
+
+    // Then find the earliest retry still scheduled
+    uint64_t next = 0;
+    for (EngineSession *s = l->sessions; s && l->waiting; s = s->next) {
+        uint64_t timers[] = { s->push.retry_at, s->pull.retry_at, s->deliver_at, s->linger_at };
+
+        for (size_t t = 0; t < sizeof(timers) / sizeof(timers[0]); t++) {
+            if (timers[t] && (!next || timers[t] < next)) {
+                next = timers[t];
+            }
+        }
+    }
+
+    if (!next) {
+        return -1;
+    }
+    return next > now ? (int)(next - now < SHUTDOWN_POLL_MS ? next - now : SHUTDOWN_POLL_MS) : 0;
+}
+
+/**
+ * Finish connecting channel once its socket is writable.
+ * @param   s           EngineSession structure.
+ * @param   c           Channel structure.
+ * @return  Whether or not the connection succeeded.
+ */
+bool engine_connected(EngineSession *s, Channel *c) {
+    int       status = 0;
+    socklen_t size   = sizeof(status);
+
+    engine_count(s->loop, 1);
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &status, &size);
+    if (status) {
+        error_limited("Unable to connect to %s:%s: %s", s->mq->host, s->mq->port, strerror(status));
+        socket_failed(s->mq->host, s->mq->port);
+        channel_fail(s, c);
+        return false;
+    }
+
+    c->connecting = false;
+    return true;
+}
+
+/**
+ * Wait for epoll events (until timeout) and handle them.
+ * @param   l           EngineLoop structure.
+ * @param   timeout     Milliseconds to wait (negative waits forever).
+ * @return  Whether or not the loop can go on.
+ */
+bool engine_epoll(EngineLoop *l, int timeout) {
+    struct epoll_event events[ENGINE_EVENTS];
+
+    engine_count(l, 1);
+    int nevents = epoll_wait(l->epoll_fd, events, ENGINE_EVENTS, timeout);
+    if (nevents < 0) {
+        if (errno == EINTR) {
+            return true;
+        }
+        error("Unable to wait for events: %s", strerror(errno));
+        return false;
+    }
+
+    for (int e = 0; e < nevents; e++) {
+        Watch         *w = events[e].data.ptr;
+        EngineSession *s = w->session;
+
+        if (w->role == WATCH_MAILBOX) {
+            engine_receive(l);
+            continue;
+        }
+        if (s->done) {
+            continue;
+        }
+
+        if (w->role != WATCH_OUTGOING) {
+            Channel *c = (Channel *)w;
+
+            if (c->connecting && !engine_connected(s, c)) {
+                session_process(s);
+                continue;
+            }
+            if (events[e].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                channel_read(s, c);
+            }
+        }
+
+        session_process(s);
+    }
+
+    return true;
+}
+
+/**
+ * Handle completion of io_uring operation.
+ * @param   l           EngineLoop structure.
+ * @param   cqe         Completion queue entry.
+ */
+void engine_complete(EngineLoop *l, struct io_uring_cqe *cqe) {
+    Watch         *w    = (Watch *)(uintptr_t)(cqe->user_data & ~(uint64_t)7);
+    EngineOp       op   = cqe->user_data & 7;
+    EngineSession *s    = w->session;
+    Channel       *c    = (Channel *)w;
+    bool           more = cqe->flags & IORING_CQE_F_MORE;
+    int            res  = cqe->res;
+
+    if (w->role == WATCH_MAILBOX) {
+        l->mailbox_events = -1;
+        engine_receive(l);
+        engine_watch(l, l->mailbox->fd, &l->mailbox_events, EPOLLIN, &l->mailbox_watch);
+        return;
+    }
+
+    if (!more) {
+        s->inflight--;
+    }
+
+    switch (op) {
+        case ENGINE_OP_POLL:
+            if (w->role == WATCH_OUTGOING) {
+                s->outgoing_events = -1;
+                break;
+            }
+            c->events = -1;
+            if (!s->done && c->fd >= 0 && c->connecting && res >= 0) {
+                engine_connected(s, c);
+            }
+            break;
+
+        case ENGINE_OP_SEND:
+            c->sending = false;
+            if (!s->done && c->fd >= 0) {
+                if (res < 0) {
+                    channel_fail(s, c);
+                } else {
+                    c->output_sent += res;
+                }
+            }
+            break;
+
+        case ENGINE_OP_RECV: {
+            char *data = NULL;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                data = uring_buffer(l->uring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            if (!more) {
+                c->receiving  = false;
+                c->cancelling = false;
+            }
+
+            if (!s->done && c->fd >= 0) {
+                if (res >= 0) {
+                    channel_input(s, c, data, res);
+                } else if (res == -EINVAL && l->multishot) {
+                    // Multishot receives only exist from 6.0: take one at a time
+                    l->multishot = false;
+                } else if (res != -ENOBUFS && res != -ECANCELED) {
+                    channel_fail(s, c);
+                }
+            }
+
+            if (data) {
+                uring_recycle(l->uring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            break;
+        }
+    }
+
+    session_process(s);
+}
+
+/**
+ * Submit queued io_uring operations, wait for completions (until timeout)
+ * and handle them.
+ * @param   l           EngineLoop structure.
+ * @param   timeout     Milliseconds to wait (negative waits forever).
+ * @return  Whether or not the loop can go on.
+ */
+bool engine_uring_wait(EngineLoop *l, int timeout) {
+    int status = uring_enter(l->uring, true, timeout);
+    if (status < 0 && status != -ETIME && status != -EINTR && status != -EAGAIN && status != -EBUSY) {
+        error("Unable to wait for completions: %s", strerror(-status));
+        return false;
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_cqe(l->uring))) {
+        struct io_uring_cqe copy = *cqe;
+        uring_seen(l->uring);
+        if (copy.user_data) {
+            engine_complete(l, &copy);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Run event loop until the engine is deleted.
+ * @param   arg         EngineLoop structure.
+ * @return  NULL.
+ */
+void * engine_run(void *arg) {
+    EngineLoop *l = arg;
+
+    mq_ignore_sigpipe();
+
+    while (!__atomic_load_n(&l->stopping, __ATOMIC_ACQUIRE)) {
+        int timeout = engine_timers(l);
+        if (!(l->uring ? engine_uring_wait(l, timeout) : engine_epoll(l, timeout))) {
+            break;
+        }
+
+        // Let mq_stop return for sessions finished once nothing is in flight
+        EngineSession **link     = &l->done;
+        EngineSession  *released = NULL;
+        while (*link) {
+            EngineSession *s = *link;
+            if (s->inflight) {
+                link = &s->next_done;
+                continue;
+            }
+            *link        = s->next_done;
+            session_release(s);
+            s->next_done = released;
+            released     = s;
+        }
+
+        if (released) {
+            mutex_lock(&l->engine->lock);
+            while (released) {
+                EngineSession *s = released;
+                released    = s->next_done;
+                s->finished = true;
+            }
+            cond_broadcast(&l->engine->detached);
+            mutex_unlock(&l->engine->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/* Session Functions */
+
+/**
+ * Advance both connections of session as far as they can go without
+ * blocking, and finish the session once both have stopped.
+ * @param   s           EngineSession structure.
+ */
+void session_process(EngineSession *s) {
+    if (s->done) {
+        return;
+    }
+
+    session_push(s);
+    session_pull(s);
+
+    if (s->pushed && s->pulled) {
+        session_finish(s);
+        return;
+    }
+
+    // Only wait for outgoing while there is no window in flight (or batch
+    // filling up)
+    int events = !s->pushed && !s->push.requests && !s->lingering ? EPOLLIN : 0;
+    engine_watch(s->loop, s->outgoing_fd, &s->outgoing_events, events, &s->outgoing);
+    channel_update(s, &s->push);
+    channel_update(s, &s->pull);
+}
+
+/**
+ * Send the next window of requests from outgoing (like the pusher thread).
+ * @param   s           EngineSession structure.
+ */
+void session_push(EngineSession *s) {
+    MessageQueue *mq = s->mq;
+    Channel      *c  = &s->push;
+
+    if (s->pushed) {
+        return;
+    }
+
+    if (!c->requests) {
+        if (c->sending) {
+            return;
+        }
+        if (s->sentinel) {
+            s->pushed = true;
+            channel_close(s, c);
+            return;
+        }
+
+        if (session_linger(s) || !(c->requests = mq_window(mq, 0, 0, &s->sentinel))) {
+            return;
+        }
+        c->output_size = 0;
+    }
+
+    // Shutting down does not wait out a backoff (one last connect decides)
+    if (c->fd < 0 && ((c->retry_at && !mq_shutdown(mq)) || !channel_open(s, c))) {
+        return;
+    }
+
+    if (!c->connecting) {
+        channel_flush(s, c);
+    }
+}
+
+/**
+ * Decide whether to wait for the batch at the front of outgoing to fill: like
+ * mq_linger in the pusher thread, a publish waits up to linger_ms for more
+ * to arrive, unless those already queued fill max_batch_bytes (the loop sets
+ * a timer instead of blocking).
+ * @param   s           EngineSession structure.
+ * @return  Whether or not to wait before taking the next window.
+ */
+bool session_linger(EngineSession *s) {
+    MessageQueue *mq = s->mq;
+
+    if (!mq->max_batch_bytes || mq->linger_ms <= 0 || mq_shutdown(mq)) {
+        s->lingering = false;
+        return false;
+    }
+    if (s->lingering) {
+        // Keep waiting until the timer has gone off
+        s->lingering = s->linger_at != 0;
+        return s->lingering;
+    }
+
+    Request *r = mq_take(mq, 0);
+    if (!r) {
+        return false;
+    }
+    mq->outbox_next--;
+
+    size_t bytes = 0;
+    for (size_t i = mq->outbox_next; i < mq->outbox_size && mq_is_publish(mq->outbox[i]); i++) {
+        bytes += mq_batch_record_size(mq->outbox[i]);
+    }
+    if (!mq_is_publish(r) || bytes >= mq->max_batch_bytes) {
+        return false;
+    }
+
+    s->lingering = true;
+    session_schedule(s, &s->linger_at, engine_now() + mq->linger_ms);
+    return true;
+}
+
+/**
+ * Ask server for messages and deliver them to incoming (like the puller
+ * thread), until the SENTINEL has been delivered.
+ * @param   s           EngineSession structure.
+ */
+void session_pull(EngineSession *s) {
+    MessageQueue *mq = s->mq;
+    Channel      *c  = &s->pull;
+
+    if (s->pulled) {
+        return;
+    }
+
+    // Stop reading while incoming has no room for what was received
+    if (s->undelivered) {
+        session_deliver(s, NULL);
+        if (s->undelivered) {
+            if (!s->deliver_at) {
+                session_schedule(s, &s->deliver_at, engine_now() + REDELIVER_MS);
+            }
+            return;
+        }
+    }
+
+    if (s->received) {
+        mq_delete_requests(c->requests);
+        c->requests = NULL;
+        s->pulled   = true;
+        channel_close(s, c);
+        return;
+    }
+
+    if (!c->requests) {
+        if (c->sending) {
+            return;
+        }
+
+        char uri[BUFSIZ];
+        int  status;
+        if (mq->streaming) {
+            status = snprintf(uri, sizeof(uri), "/stream/%s", mq->name);
+        } else if (mq->retrieve_max > 1) {
+            status = snprintf(uri, sizeof(uri), "/queue/%s?max=%zu", mq->name, mq->retrieve_max);
+        } else {
+            status = snprintf(uri, sizeof(uri), "/queue/%s", mq->name);
+        }
+        if (status < 0 || !(c->requests = request_create("GET", uri, NULL))) {
+            return;
+        }
+        c->output_size = 0;
+    }
+
+    // Shutting down does not wait out a backoff (one last connect decides)
+    if (c->fd < 0 && ((c->retry_at && !mq_shutdown(mq)) || !channel_open(s, c))) {
+        return;
+    }
+
+    if (!c->connecting) {
+        channel_flush(s, c);
+    }
+}
+
+/**
+ * Push messages received from server (linked by next) onto incoming without
+ * blocking.  Whatever does not fit yet is kept (in order) and retried later.
+ * The SENTINEL is pushed even if incoming is full, as mq_deliver does.
+ * @param   s           EngineSession structure.
+ * @param   head        List of new messages (NULL to retry undelivered ones).
+ */
+void session_deliver(EngineSession *s, Request *head) {
+    Queue *incoming = s->mq->incoming;
+
+    // Every client subscribes to the SENTINEL, so only one arriving once
+    // stopping ends the pull (as in mq_deliver)
+    mq_stamp(head);
+    for (Request *r = head; r; r = r->next) {
+        s->received |= r->body && mq_is_sentinel(r) && mq_shutdown(s->mq);
+    }
+    if (s->undelivered) {
+        Request *tail = s->undelivered;
+        while (tail->next) {
+            tail = tail->next;
+        }
+        tail->next = head;
+    } else {
+        s->undelivered = head;
+    }
+
+    while (s->undelivered) {
+        // Split off the run of messages before the next SENTINEL
+        Request *run  = s->undelivered;
+        Request *prev = NULL;
+        Request *rest = run;
+        while (rest && !(rest->body && mq_is_sentinel(rest))) {
+            prev = rest;
+            rest = rest->next;
+        }
+
+        if (prev) {
+            prev->next = NULL;
+            Request *left = queue_try_push_batch(incoming, run);
+            if (left) {
+                for (prev = left; prev->next; prev = prev->next);
+                prev->next     = rest;
+                s->undelivered = left;
+                return;
+            }
+            s->undelivered = rest;
+            continue;
+        }
+
+        // Rings have no room to force, so the SENTINEL waits like the rest
+        Request *next = rest->next;
+        rest->next    = NULL;
+        if (incoming->type == QUEUE_LIST) {
+            queue_push_force(incoming, rest);
+        } else if (queue_try_push_batch(incoming, rest)) {
+            rest->next = next;
+            return;
+        }
+        s->undelivered = next;
+    }
+}
+
+/**
+ * Schedule session to be processed again at a later time.
+ * @param   s           EngineSession structure.
+ * @param   at          Timer to set.
+ * @param   when        Monotonic time in milliseconds.
+ */
+void session_schedule(EngineSession *s, uint64_t *at, uint64_t when) {
+    if (!*at) {
+        s->loop->waiting++;
+    }
+    *at = when;
+}
+
+/**
+ * Stop everything session does in the loop and queue it to be reported
+ * finished to mq_stop at the end of the loop pass (or once its io_uring
+ * operations have all completed).
+ * @param   s           EngineSession structure.
+ */
+void session_finish(EngineSession *s) {
+    EngineLoop *l = s->loop;
+
+    channel_close(s, &s->push);
+    channel_close(s, &s->pull);
+    engine_watch(l, s->outgoing_fd, &s->outgoing_events, -1, &s->outgoing);
+
+    uint64_t *timers[] = { &s->push.retry_at, &s->pull.retry_at, &s->deliver_at, &s->linger_at };
+    for (size_t t = 0; t < sizeof(timers) / sizeof(timers[0]); t++) {
+        if (*timers[t]) {
+            *timers[t] = 0;
+            l->waiting--;
+        }
+    }
+
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        l->sessions = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+
+    s->done      = true;
+    s->next_done = l->done;
+    l->done      = s;
+}
+
+/**
+ * Free what finished session holds (once nothing in flight refers to it).
+ * @param   s           EngineSession structure.
+ */
+void session_release(EngineSession *s) {
+    mq_delete_requests(s->push.requests);
+    mq_delete_requests(s->pull.requests);
+    mq_delete_requests(s->undelivered);
+    free(s->push.output);
+    free(s->pull.output);
+    free(s->push.body);
+    free(s->pull.body);
+    free(s->records);
+}
+
+/* Channel Functions */
+
+/**
+ * Start non-blocking connection for channel and serialize its requests.
+ * @param   s           EngineSession structure.
+ * @param   c           Channel structure.
+ * @return  Whether or not the connection was started.
+ */
+bool channel_open(EngineSession *s, Channel *c) {
+    // io_uring operations on the previous socket have to complete first
+    if (c->sending || c->receiving || c->events >= 0) {
+        return false;
+    }
+
+    c->fd = socket_connect_nonblocking(s->mq->host, s->mq->port);
+    if (c->fd < 0) {
+        channel_fail(s, c);
+        return false;
+    }
+
+    c->connecting  = true;
+    c->events      = -1;
+    c->output_size = 0;
+    c->output_sent = 0;
+    parser_init(&c->parser);
+    return true;
+}
+
+/**
+ * Close channel socket (unanswered requests are kept to be sent again).
+ * @param   s           EngineSession structure.
+ * @param   c           Channel structure.
+ */
+void channel_close(EngineSession *s, Channel *c) {
+    if (c->fd >= 0) {
+        engine_watch(s->loop, c->fd, &c->events, -1, &c->watch);
+        if (c->sending) {
+            engine_cancel(s->loop, &c->watch, ENGINE_OP_SEND);
+        }
+        if (c->receiving && !c->cancelling) {
+            engine_cancel(s->loop, &c->watch, ENGINE_OP_RECV);
+            c->cancelling = true;
+        }
+        close(c->fd);
+        c->fd = -1;
+    }
+
+    c->connecting  = false;
+    c->output_size = 0;
+    c->output_sent = 0;
+    c->body_size   = 0;
+    parser_init(&c->parser);
+
+    if (c == &s->pull) {
+        s->streaming    = false;
+        s->records_size = 0;
+    }
+}
+
+/**
+ * Close channel after a failure (of its connect or of a request) and record
+ * it in its backoff, then reconnect once the backoff allows, unless the
+ * Message Queue is shutting down (then its requests are given up, as the
+ * threads do).
+ * Publishes that were already written are never sent again.
+ * @param   s           EngineSession structure.
+ * @param   c           Channel structure.
+ */
+void channel_fail(EngineSession *s, Channel *c) {
+    backoff_failure(&c->backoff, engine_now(), s->mq->host, s->mq->port);
+    if (c == &s->push) {
+        channel_abandon(s, c, mq_shutdown(s->mq));
+    }
+    channel_close(s, c);
+
+    // Once stopping, a server that cannot be reached will not send the
+    // SENTINEL, so deliver one ourselves (as mq_puller does)
+    if (mq_shutdown(s->mq)) {
+        mq_delete_requests(c->requests);
+        c->requests = NULL;
+        if (c == &s->pull && !s->received) {
+            session_deliver(s, mq_sentinel());
+        }
+        return;
+    }
+
+    uint64_t now = engine_now();
+    session_schedule(s, &c->retry_at, now + backoff_remaining(&c->backoff, now));
+}
+
+/**
+ * Give up on requests of channel that were written in full (the server may
+ * have handled them), reporting how many, so only the rest are sent again.
+ * The requests left are the tail of what was serialized into output.
+ * @param   s           EngineSession structure.
+ * @param   c           Channel structure.
+ * @param   all         Whether to give up on unwritten requests too.
+ */
+void channel_abandon(EngineSession *s, Channel *c, bool all) {
+    size_t offset = c->output_size;
+    for (Request *r = c->requests; r && c->output_sent; r = r->next) {
+        offset -= request_head(r, s->authority, NULL, 0) + (r->body ? r->length : 0);
+    }
+
+    size_t abandoned = 0;
+    while (c->requests) {
+        Request *r      = c->requests;
+        size_t   length = request_head(r, s->authority, NULL, 0) + (r->body ? r->length : 0);
+        if (!all && (!c->output_sent || offset + length > c->output_sent)) {
+            break;
+        }
+        offset     += length;
+        c->requests = r->next;
+        request_delete(r);
+        abandoned++;
+    }
+
+    if (abandoned) {
+        error_limited("Gave up on %zu requests to %s%s%s without a response",
+                      abandoned, s->mq->host, s->mq->port[0] ? ":" : "", s->mq->port);
+    }
+}
+
+/**
+ * Serialize every request of channel into its output buffer.
+ * @param   s           EngineSession structure.
+ * @param   c           Channel structure.
+ * @return  Whether or not there was memory for the output.
+ */
+bool channel_serialize(EngineSession *s, Channel *c) {
+    c->output_size = 0;
+    c->output_sent = 0;
+
+    for (Request *r = c->requests; r; r = r->next) {
+        size_t room   = c->output_capacity - c->output_size;
+        size_t head   = request_head(r, s->authority, c->output + c->output_size, room);
+        size_t length = head + (r->body ? r->length : 0);
+
+        if (length > room) {
+            size_t capacity = c->output_capacity ? c->output_capacity : BUFSIZ;
+            while (capacity < c->output_size + length) {
+                capacity *= 2;
+            }
+            char *bigger = realloc(c->output, capacity);
+            if (!bigger) {
+                return false;
+            }
+            c->output          = bigger;
+            c->output_capacity = capacity;
+            request_head(r, s->authority, c->output + c->output_size, length);
+        }
+
+        if (r->body) {
+            memcpy(c->output + c->output_size + head, r->body, r->length);
+        }
+        c->output_size += length;
+    }
+
+    return true;
+}
+
+/**
+ * Write as much of channel output as the socket takes (or serialize it to be
+ * sent by io_uring).
+ * @param   s           EngineSession structure.
+ * @param   c           Channel structure.
+ */
+void channel_flush(EngineSession *s, Channel *c) {
+    if (!c->output_size && !channel_serialize(s, c)) {
+        channel_fail(s, c);
+        return;
+    }
+
+    // io_uring sends are queued by channel_update
+    if (s->loop->uring) {
+        return;
+    }
+
+    while (c->output_sent < c->output_size) {
+        engine_count(s->loop, 1);
+        ssize_t nwritten = write(c->fd, c->output + c->output_sent, c->output_size - c->output_sent);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                channel_fail(s, c);
+            }
+            return;
+        }
+        c->output_sent += nwritten;
+    }
+}
+
+/**
+ * Register channel socket for the events it is waiting on: writable while
+ * connecting or output is unsent, and readable unless delivery is stalled.
+ * @param   s           EngineSession structure.
+ * @param   c           Channel structure.
+ */
+void channel_update(EngineSession *s, Channel *c) {
+    EngineLoop *l = s->loop;
+
+    if (c->fd < 0) {
+        return;
+    }
+
+    if (l->uring) {
+        channel_submit(s, c);
+        return;
+    }
+
+    int events = 0;
+    if (c->connecting || c->output_sent < c->output_size) {
+        events |= EPOLLOUT;
+    }
+    if (!c->connecting && !(c == &s->pull && s->undelivered)) {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    engine_watch(l, c->fd, &c->events, events, &c->watch);
+}
+
+/**
+ * Queue the io_uring operations channel is waiting on: a poll while
+ * connecting, a send of unsent output, and a receive unless delivery is
+ * stalled (then a receive in flight is cancelled).
+ * @param   s           EngineSession structure.
+ * @param   c           Channel structure.
+ */
+void channel_submit(EngineSession *s, Channel *c) {
+    EngineLoop          *l = s->loop;
+    struct io_uring_sqe *sqe;
+
+    if (c->connecting) {
+        engine_watch(l, c->fd, &c->events, EPOLLOUT, &c->watch);
+        return;
+    }
+
+    if (!c->sending && c->output_sent < c->output_size &&
+        (sqe = engine_sqe(l, IORING_OP_SEND, c->fd, &c->watch, ENGINE_OP_SEND))) {
+        sqe->addr      = (uintptr_t)(c->output + c->output_sent);
+        sqe->len       = c->output_size - c->output_sent;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        c->sending     = true;
+    }
+
+    bool reading = !(c == &s->pull && s->undelivered);
+    if (reading && !c->receiving &&
+        (sqe = engine_sqe(l, IORING_OP_RECV, c->fd, &c->watch, ENGINE_OP_RECV))) {
+        sqe->flags     = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = ENGINE_GROUP;
+        sqe->ioprio    = l->multishot ? IORING_RECV_MULTISHOT : 0;
+        c->receiving   = true;
+    } else if (!reading && c->receiving && !c->cancelling) {
+        engine_cancel(l, &c->watch, ENGINE_OP_RECV);
+        c->cancelling = true;
+    }
+}
+
+/**
+ * Read everything available from channel socket and parse the responses.
+ * @param   s           EngineSession structure.
+ * @param   c           Channel structure.
+ */
+void channel_read(EngineSession *s, Channel *c) {
+    char *input = s->loop->input;
+
+    while (c->fd >= 0) {
+        engine_count(s->loop, 1);
+        ssize_t nread = read(c->fd, input, ENGINE_READ);
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                channel_fail(s, c);
+            }
+            return;
+        }
+
+        channel_input(s, c, input, nread);
+        if (nread == 0) {
+            return;
+        }
+    }
+}
+
+/**
+ * Parse responses in data received on channel.
+ * @param   s           EngineSession structure.
+ * @param   c           Channel structure.
+ * @param   input       Data received.
+ * @param   nread       Number of bytes received (0 at end of stream).
+ */
+void channel_input(EngineSession *s, Channel *c, const char *input, size_t nread) {
+    if (nread == 0) {
+        // End of stream completes a body delimited by it; anything else
+        // pending is resent on a new connection
+        if (parser_finish(&c->parser) == PARSER_DONE) {
+            channel_event(s, c, PARSER_DONE, NULL, 0);
+        }
+        if (c->fd >= 0) {
+            if (c->requests) {
+                channel_fail(s, c);
+            } else {
+                channel_close(s, c);
+            }
+        }
+        return;
+    }
+
+    size_t offset = 0;
+    while (c->fd >= 0) {
+        const char *data;
+        size_t      length;
+        size_t      consumed;
+        ParserEvent event = parser_execute(&c->parser, input + offset, nread - offset, &consumed, &data, &length);
+        offset += consumed;
+
+        if (event == PARSER_MORE) {
+            break;
+        }
+        if (event == PARSER_ERROR || !channel_event(s, c, event, data, length)) {
+            if (c->fd >= 0) {
+                channel_fail(s, c);
+            }
+            return;
+        }
+    }
+}
+
+/**
+ * Handle one parser event of a response on channel.
+ * @param   s           EngineSession structure.
+ * @param   c           Channel structure.
+ * @param   event       Parser event.
+ * @param   data        Piece of body (PARSER_BODY).
+ * @param   length      Length of piece of body (PARSER_BODY).
+ * @return  Whether or not the response was expected.
+ */
+bool channel_event(EngineSession *s, Channel *c, ParserEvent event, const char *data, size_t length) {
+    MessageQueue *mq = s->mq;
+    Request      *r  = c->requests;
+
+    if (!r) {
+        return false;
+    }
+
+    switch (event) {
+        case PARSER_HEAD:
+            c->body_size = 0;
+            if (c == &s->pull && mq->streaming && c->parser.status == 200 && c->parser.chunked) {
+                // Stream is open: breaking off later starts backing off afresh
+                s->streaming = true;
+                backoff_success(&c->backoff, mq->host, mq->port);
+            }
+            return true;
+
+        case PARSER_BODY:
+            if (c == &s->pull && s->streaming) {
+                // Deliver each complete record as it arrives
+                char *bigger = realloc(s->records, s->records_size + length + 1);
+                if (!bigger) {
+                    return false;
+                }
+                s->records = bigger;
+                memcpy(s->records + s->records_size, data, length);
+                s->records_size += length;
+                s->records[s->records_size] = 0;
+
+                size_t consumed;
+                bool   invalid;
+                session_deliver(s, mq_parse_records(s->records, s->records_size, &consumed, &invalid));
+                if (invalid) {
+                    return false;
+                }
+                memmove(s->records, s->records + consumed, s->records_size - consumed);
+                s->records_size -= consumed;
+
+                if (s->received) {
+                    mq_delete_requests(c->requests);
+                    c->requests = NULL;
+                    channel_close(s, c);
+                }
+                return true;
+            }
+
+            if (c->body_size + length + 1 > c->body_capacity) {
+                size_t capacity = c->parser.content_length >= 0 ? (size_t)c->parser.content_length + 1 : 2*(c->body_size + length) + 1;
+                if (capacity < c->body_size + length + 1) {
+                    capacity = c->body_size + length + 1;
+                }
+                char *bigger = realloc(c->body, capacity);
+                if (!bigger) {
+                    return false;
+                }
+                c->body          = bigger;
+                c->body_capacity = capacity;
+            }
+            memcpy(c->body + c->body_size, data, length);
+            c->body_size += length;
+            return true;
+
+        case PARSER_DONE:
+            break;
+
+        default:
+            return false;
+    }
+
+    // Response is complete: match it to the first request awaiting one
+    int   status = c->parser.status;
+    char *body   = c->body ? c->body : "";
+    if (c->body) {
+        c->body[c->body_size] = 0;
+    }
+    c->requests = r->next;
+    r->next     = NULL;
+
+    // A pull that failed (or a stream that ended without the SENTINEL) backs
+    // off like a failed connect, so a failing server is not asked in a loop
+    if (c == &s->pull && (status != 200 || s->streaming) && !s->received) {
+        request_delete(r);
+        channel_fail(s, c);
+        return true;
+    }
+    if (status == 200) {
+        backoff_success(&c->backoff, mq->host, mq->port);
+    }
+
+    if (c == &s->push) {
+        if (status != 200) {
+            error("%s %s: %d %s", r->method, r->uri, status, strtok(body, "\r\n") ? body : "");
+        } else if (c->body_size && streq(r->uri, "/batch")) {
+            mq_report_batch(body);
+        }
+        request_delete(r);
+    } else if (s->streaming) {
+        // Stream ended: ask for a new one
+        s->streaming = false;
+        request_delete(r);
+    } else if (status != 200) {
+        request_delete(r);
+    } else if (mq->retrieve_max > 1) {
+        size_t consumed;
+        bool   invalid;
+        session_deliver(s, mq_parse_records(body, c->body_size, &consumed, &invalid));
+        if (consumed != c->body_size) {
+            error("Invalid record in response: %s", body);
+        }
+        request_delete(r);
+    } else {
+        // Message body becomes the body of the request (like the puller)
+        r->body       = c->body;
+        r->length     = c->body_size;
+        c->body       = NULL;
+        c->body_capacity = 0;
+        if (!r->body && !(r->body = calloc(1, 1))) {
+            request_delete(r);
+            r = NULL;
+        }
+        if (r) {
+            session_deliver(s, r);
+        }
+    }
+    c->body_size = 0;
+
+    // Finish with the connection like connection_release
+    if (!c->parser.persistent || (!mq->keepalive && !c->requests)) {
+        channel_close(s, c);
+    }
+    return true;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,83 @@
+/* mailbox.c: Lock-free multi-producer, single-consumer mailbox */
+
+#include "mq/logging.h"
+#include "mq/mailbox.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/**
+ * Create Mailbox structure.
+ * @return  Newly allocated Mailbox structure.
+ */
+Mailbox * mailbox_create() {
+    Mailbox *m = calloc(1, sizeof(Mailbox));
+
+    if (m) {
+        m->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m->fd < 0) {
+            error("Unable to create eventfd: %s", strerror(errno));
+            free(m);
+            return NULL;
+        }
+    }
+
+    return m;
+}
+
+/**
+ * Delete Mailbox structure (any mail still in it is not freed).
+ * @param   m           Mailbox structure.
+ */
+void mailbox_delete(Mailbox *m) {
+    if (m) {
+        close(m->fd);
+        free(m);
+    }
+}
+
+/**
+ * Send mail to mailbox (safe to call from any thread).  The event file
+ * descriptor is only signaled when the mailbox was empty, since the receiver
+ * takes everything at once.
+ * @param   m           Mailbox structure.
+ * @param   mail        Mail to send (owned by receiver afterwards).
+ */
+void mailbox_send(Mailbox *m, Mail *mail) {
+    Mail *head = __atomic_load_n(&m->head, __ATOMIC_RELAXED);
+
+    do {
+        mail->next = head;
+    } while (!__atomic_compare_exchange_n(&m->head, &head, mail, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (!head) {
+        uint64_t one = 1;
+        while (write(m->fd, &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+}
+
+/**
+ * Receive all mail sent so far (only call from the receiving thread).
+ * @param   m           Mailbox structure.
+ * @return  List of mail in the order it was sent (NULL if empty).
+ */
+Mail * mailbox_receive(Mailbox *m) {
+    uint64_t count;
+    while (read(m->fd, &count, sizeof(count)) < 0 && errno == EINTR);
+
+    Mail *head     = __atomic_exchange_n(&m->head, NULL, __ATOMIC_ACQUIRE);
+    Mail *reversed = NULL;
+
+    while (head) {
+        Mail *next = head->next;
+        head->next = reversed;
+        reversed   = head;
+        head       = next;
+    }
+
+    return reversed;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,362 @@
+/* parser.c: Incremental HTTP/1.1 response parser */
+
+#include "mq/parser.h"
+
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+
+/* Internal Functions */
+
+/**
+ * Return whether header name (of given length) matches target.
+ */
+static bool parser_header_is(const char *name, size_t length, const char *target) {
+    return length == strlen(target) && strncasecmp(name, target, length) == 0;
+}
+
+/**
+ * Put parser into error state.
+ * @param   p           Parser structure.
+ * @return  PARSER_ERROR.
+ */
+static ParserEvent parser_fail(Parser *p) {
+    p->state = PARSER_INVALID;
+    return PARSER_ERROR;
+}
+
+/**
+ * Take next line from input, joining it with any partial line saved from
+ * previous input.  Complete lines are returned in place when possible and
+ * without their line ending.
+ * @param   p           Parser structure.
+ * @param   input       Input buffer.
+ * @param   size        Size of input buffer.
+ * @param   offset      Offset into input (advanced past what is taken).
+ * @param   line        Where to store start of line.
+ * @param   length      Where to store length of line.
+ * @return  1 if a line is complete, 0 if more input is needed, otherwise -1
+ *          (line is too long).
+ */
+static int parser_line(Parser *p, const char *input, size_t size, size_t *offset, const char **line, size_t *length) {
+    const char *start   = input + *offset;
+    size_t      buffered = size - *offset;
+    const char *newline = memchr(start, '\n', buffered);
+    size_t      n       = newline ? (size_t)(newline - start) + 1 : buffered;
+
+    if (p->line_length + n > PARSER_LINE) {
+        return -1;
+    }
+    *offset += n;
+
+    if (!newline || p->line_length) {
+        memcpy(p->line + p->line_length, start, n);
+        p->line_length += n;
+        if (!newline) {
+            return 0;
+        }
+        start = p->line;
+        n     = p->line_length;
+        p->line_length = 0;
+    }
+
+    *line   = start;
+    *length = n - 1;
+    if (*length && start[*length - 1] == '\r') {
+        (*length)--;
+    }
+    return 1;
+}
+
+/**
+ * Parse status line:
+ *
+ *  HTTP/1.$MINOR $STATUS $REASON
+ *
+ * @param   p           Parser structure.
+ * @param   line        Start of line.
+ * @param   length      Length of line.
+ * @return  PARSER_MORE if successful, otherwise PARSER_ERROR.
+ */
+static ParserEvent parser_status(Parser *p, const char *line, size_t length) {
+    if (length < 12 || memcmp(line, "HTTP/1.", 7) != 0 || line[7] < '0' || line[7] > '9' || line[8] != ' ') {
+        return parser_fail(p);
+    }
+
+    int status = 0;
+    for (size_t i = 9; i < 12; i++) {
+        if (line[i] < '0' || line[i] > '9') {
+            return parser_fail(p);
+        }
+        status = 10*status + (line[i] - '0');
+    }
+    if (length > 12 && line[12] != ' ') {
+        return parser_fail(p);
+    }
+
+    p->status         = status;
+    p->persistent     = (line[7] >= '1');
+    p->chunked        = false;
+    p->content_length = -1;
+    p->state          = PARSER_HEADER;
+    return PARSER_MORE;
+}
+
+/**
+ * Parse header line (or the blank line that ends the headers).  Only the
+ * headers that frame the body or the connection are recorded.
+ * @param   p           Parser structure.
+ * @param   line        Start of line.
+ * @param   length      Length of line.
+ * @return  PARSER_HEAD at the end of the headers, PARSER_MORE after any other
+ *          header, otherwise PARSER_ERROR.
+ */
+static ParserEvent parser_header(Parser *p, const char *line, size_t length) {
+    if (length == 0) {
+        if (p->chunked) {
+            p->content_length = -1;
+            p->state          = PARSER_CHUNK_SIZE;
+        } else if (p->status / 100 == 1 || p->status == 204 || p->status == 304) {
+            p->content_length = 0;
+            p->remaining      = 0;
+            p->state          = PARSER_LENGTH;
+        } else if (p->content_length >= 0) {
+            p->remaining      = p->content_length;
+            p->state          = PARSER_LENGTH;
+        } else {
+            // Without a length, the body only ends when the server closes the stream
+            p->persistent     = false;
+            p->state          = PARSER_CLOSE;
+        }
+        return PARSER_HEAD;
+    }
+
+    const char *colon = memchr(line, ':', length);
+    if (!colon) {
+        return PARSER_MORE;
+    }
+
+    size_t      name_length  = colon - line;
+    const char *value        = colon + 1;
+    size_t      value_length = length - name_length - 1;
+    while (value_length && (*value == ' ' || *value == '\t')) {
+        value++;
+        value_length--;
+    }
+    while (value_length && (value[value_length - 1] == ' ' || value[value_length - 1] == '\t')) {
+        value_length--;
+    }
+
+    if (parser_header_is(line, name_length, "Content-Length")) {
+        if (value_length == 0) {
+            return parser_fail(p);
+        }
+
+        long content_length = 0;
+        for (size_t i = 0; i < value_length; i++) {
+            if (value[i] < '0' || value[i] > '9' || content_length > (LONG_MAX - 9) / 10) {
+                return parser_fail(p);
+            }
+            content_length = 10*content_length + (value[i] - '0');
+        }
+        p->content_length = content_length;
+    } else if (parser_header_is(line, name_length, "Transfer-Encoding")) {
+        p->chunked = value_length >= 7 && strncasecmp(value + value_length - 7, "chunked", 7) == 0;
+    } else if (parser_header_is(line, name_length, "Connection")) {
+        if (value_length == 5 && strncasecmp(value, "close", 5) == 0) {
+            p->persistent = false;
+        } else if (value_length == 10 && strncasecmp(value, "keep-alive", 10) == 0) {
+            p->persistent = true;
+        }
+    }
+
+    return PARSER_MORE;
+}
+
+/**
+ * Parse chunk size line (hexadecimal, optionally followed by extensions).
+ * @param   p           Parser structure.
+ * @param   line        Start of line.
+ * @param   length      Length of line.
+ * @return  PARSER_MORE if successful, otherwise PARSER_ERROR.
+ */
+static ParserEvent parser_chunk_size(Parser *p, const char *line, size_t length) {
+    size_t size   = 0;
+    size_t digits = 0;
+
+    for (; digits < length; digits++) {
+        char c = line[digits];
+        int  value;
+
+        if (c >= '0' && c <= '9') {
+            value = c - '0';
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            value = (c | 0x20) - 'a' + 10;
+        } else {
+            break;
+        }
+
+        if (size > (LONG_MAX >> 4)) {
+            return parser_fail(p);
+        }
+        size = (size << 4) | value;
+    }
+
+    if (digits == 0 || (digits < length && line[digits] != ';' && line[digits] != ' ' && line[digits] != '\t')) {
+        return parser_fail(p);
+    }
+
+    p->remaining = size;
+    p->state     = size ? PARSER_CHUNK_DATA : PARSER_TRAILER;
+    return PARSER_MORE;
+}
+
+/**
+ * Handle complete line according to current state.
+ * @param   p           Parser structure.
+ * @param   line        Start of line.
+ * @param   length      Length of line.
+ * @return  Event produced by line (PARSER_MORE if none).
+ */
+static ParserEvent parser_process_line(Parser *p, const char *line, size_t length) {
+    switch (p->state) {
+        case PARSER_STATUS:
+            return parser_status(p, line, length);
+        case PARSER_HEADER:
+            return parser_header(p, line, length);
+        case PARSER_CHUNK_SIZE:
+            return parser_chunk_size(p, line, length);
+        case PARSER_CHUNK_END:
+            if (length != 0) {
+                return parser_fail(p);
+            }
+            p->state = PARSER_CHUNK_SIZE;
+            return PARSER_MORE;
+        case PARSER_TRAILER:
+            if (length != 0) {
+                return PARSER_MORE;
+            }
+            p->state = PARSER_STATUS;
+            return PARSER_DONE;
+        default:
+            return parser_fail(p);
+    }
+}
+
+/* External Functions */
+
+/**
+ * Initialize Parser to expect the start of a response.
+ * @param   p           Parser structure.
+ */
+void parser_init(Parser *p) {
+    p->state          = PARSER_STATUS;
+    p->remaining      = 0;
+    p->status         = 0;
+    p->persistent     = false;
+    p->chunked        = false;
+    p->content_length = -1;
+    p->line_length    = 0;
+}
+
+/**
+ * Parse input up to the next event.  Call again with the rest of the input
+ * (input + consumed) until PARSER_MORE is returned, which means all of the
+ * input has been consumed.  Responses may follow each other back-to-back:
+ * after PARSER_DONE the parser continues with the next response.
+ *
+ * Nothing is allocated: lines are parsed in place unless split across inputs
+ * (then they are gathered in the Parser) and body data is returned as pieces
+ * of the input.
+ *
+ * @param   p           Parser structure.
+ * @param   input       Input buffer.
+ * @param   size        Size of input buffer.
+ * @param   consumed    Where to store number of input bytes consumed.
+ * @param   data        Where to store start of body piece (PARSER_BODY).
+ * @param   length      Where to store length of body piece (PARSER_BODY).
+ * @return  Next event.
+ */
+ParserEvent parser_execute(Parser *p, const char *input, size_t size, size_t *consumed,
+                           const char **data, size_t *length) {
+    ParserEvent event  = PARSER_MORE;
+    size_t      offset = 0;
+
+    while (event == PARSER_MORE) {
+        size_t buffered = size - offset;
+
+        switch (p->state) {
+            case PARSER_LENGTH:
+                if (p->remaining == 0) {
+                    p->state = PARSER_STATUS;
+                    event    = PARSER_DONE;
+                    break;
+                }
+                /* Fallthrough */
+            case PARSER_CHUNK_DATA:
+                if (buffered == 0) {
+                    goto done;
+                }
+                *data   = input + offset;
+                *length = p->remaining < buffered ? p->remaining : buffered;
+                offset += *length;
+                p->remaining -= *length;
+                if (p->state == PARSER_CHUNK_DATA && p->remaining == 0) {
+                    p->state = PARSER_CHUNK_END;
+                }
+                event = PARSER_BODY;
+                break;
+            case PARSER_CLOSE:
+                if (buffered == 0) {
+                    goto done;
+                }
+                *data   = input + offset;
+                *length = buffered;
+                offset  = size;
+                event   = PARSER_BODY;
+                break;
+            case PARSER_INVALID:
+                event = PARSER_ERROR;
+                break;
+            default: {
+                const char *line;
+                size_t      line_length;
+
+                if (buffered == 0) {
+                    goto done;
+                }
+
+                int found = parser_line(p, input, size, &offset, &line, &line_length);
+                if (found < 0) {
+                    event = parser_fail(p);
+                } else if (found > 0) {
+                    event = parser_process_line(p, line, line_length);
+                }
+                break;
+            }
+        }
+    }
+
+done:
+    *consumed = offset;
+    return event;
+}
+
+/**
+ * Tell Parser the stream has ended.
+ * @param   p           Parser structure.
+ * @return  PARSER_DONE if the end of the stream completes a body delimited by
+ *          it, PARSER_MORE if no response was started, otherwise PARSER_ERROR.
+ */
+ParserEvent parser_finish(Parser *p) {
+    if (p->state == PARSER_CLOSE) {
+        p->state = PARSER_STATUS;
+        return PARSER_DONE;
+    }
+    if (p->state == PARSER_STATUS && p->line_length == 0) {
+        return PARSER_MORE;
+    }
+    return parser_fail(p);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
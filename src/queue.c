@@ -2,17 +2,99 @@
 
 #include "mq/queue.h"
 
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+/* Internal Constants */
+
+#define SPIN_LIMIT  128	    /* Times to check a ring before parking */
+
+/* Internal Prototypes */
+
+Queue *	    queue_allocate(QueueType type);
+size_t	    queue_request_bytes(Request *r);
+bool	    queue_list_fits(Queue *q, size_t bytes);
+bool	    queue_list_push(Queue *q, Request *r, bool wait, bool force);
+bool	    queue_list_admit(Queue *q, Request *r, bool wait, bool force);
+bool	    queue_list_wait(Queue *q, const struct timespec *deadline, bool poll);
+Request *   queue_list_take(Queue *q);
+Request *   queue_list_evict(Queue *q);
+void	    queue_deadline(int timeout, struct timespec *deadline);
+bool	    queue_ring_put(Queue *q, Request *r);
+Request *   queue_ring_take(Queue *q);
+void	    queue_ring_push(Queue *q, Request *r);
+Request *   queue_ring_pop(Queue *q, const struct timespec *deadline);
+void	    queue_ring_wake(Queue *q, size_t *waiters, Cond *cond);
+bool	    queue_ring_empty(Queue *q);
+void	    queue_ring_ready(Queue *q);
+void	    queue_ring_idle(Queue *q);
+void	    queue_fd_set(Queue *q, bool readable);
+
+/* External Functions */
+
 /**
  * Create queue structure.
  * @return  Newly allocated queue structure.
  */
 Queue * queue_create() {
-    Queue *q = (Queue *) calloc(1, sizeof(Queue));
+    return queue_allocate(QUEUE_LIST);
+}
 
-    // Set initial size to 0 and initialize primitives
-    q->size = 0;
-    mutex_init(&q->lock, NULL);
-    cond_init(&q->produced, NULL);
+/**
+ * Create lock-free ring queue structure.  Pushing to a full ring and popping
+ * from an empty one spin briefly and then park.
+ * @param   type        QUEUE_MPSC or QUEUE_SPSC (QUEUE_LIST ignores capacity).
+ * @param   capacity    Maximum number of requests (rounded up to a power of 2).
+ * @return  Newly allocated queue structure.
+ */
+Queue * queue_create_ring(QueueType type, size_t capacity) {
+    Queue *q = queue_allocate(type);
+
+    if (!q || type == QUEUE_LIST) {
+        return q;
+    }
+
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    q->slots = calloc(size, sizeof(Slot));
+    if (!q->slots) {
+        free(q);
+        return NULL;
+    }
+
+    q->mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        q->slots[i].sequence = i;
+    }
+
+    return q;
+}
+
+/**
+ * Create bounded queue structure.  While it holds capacity requests, or the
+ * next body would take it past max_bytes, a push follows policy.  A request
+ * is always accepted by an empty queue, however large its body.
+ * @param   capacity    Maximum number of requests (0 is unbounded).
+ * @param   max_bytes   Maximum total length of bodies (0 is unbounded).
+ * @param   policy      What a push does while the queue is full.
+ * @return  Newly allocated queue structure.
+ */
+Queue * queue_create_bounded(size_t capacity, size_t max_bytes, QueuePolicy policy) {
+    Queue *q = queue_allocate(QUEUE_LIST);
+
+    if (q) {
+        q->capacity  = capacity;
+        q->max_bytes = max_bytes;
+        q->policy    = policy;
+    }
 
     return q;
 }
@@ -22,23 +104,524 @@ Queue * queue_create() {
  * @param   q       Queue structure.
  */
 void queue_delete(Queue *q) {
-    while (q->size > 0) {
-      Request *r = queue_pop(q);
-      request_delete(r);
+    if (q->type != QUEUE_LIST) {
+        Request *r;
+        while ((r = queue_ring_take(q))) {
+            request_delete(r);
+        }
+        free(q->slots);
+    } else {
+        while (q->size > 0) {
+          Request *r = queue_pop(q);
+          request_delete(r);
+        }
     }
 
+    if (q->fd >= 0) {
+        close(q->fd);
+    }
     free(q);
 }
 
 /**
- * Push request to the back of queue.
+ * Push request to the back of queue, following the policy of a bounded queue
+ * while it is full (rings always wait for room).  A request that is not
+ * pushed is deleted.
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ * @return  Whether or not the request was pushed.
+ */
+bool queue_push(Queue *q, Request *r) {
+    if (q->type != QUEUE_LIST) {
+        queue_ring_push(q, r);
+        return true;
+    }
+
+    return queue_list_push(q, r, q->policy == QUEUE_BLOCK, false);
+}
+
+/**
+ * Push request to the back of queue without waiting for room.  A request
+ * that is not pushed is deleted.
  * @param   q       Queue structure.
  * @param   r       Request structure.
+ * @return  Whether or not the request was pushed.
+ */
+bool queue_try_push(Queue *q, Request *r) {
+    if (q->type != QUEUE_LIST) {
+        r->next = NULL;
+        if (!queue_ring_put(q, r)) {
+            __atomic_add_fetch(&q->rejected, 1, __ATOMIC_RELAXED);
+            request_delete(r);
+            return false;
+        }
+        queue_ring_wake(q, &q->sleepers, &q->produced);
+        queue_ring_ready(q);
+        return true;
+    }
+
+    return queue_list_push(q, r, false, false);
+}
+
+/**
+ * Push request to the back of queue regardless of its bounds (for control
+ * requests that must not be lost).
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ */
+void queue_push_force(Queue *q, Request *r) {
+    if (q->type != QUEUE_LIST) {
+        queue_ring_push(q, r);
+        return;
+    }
+
+    queue_list_push(q, r, false, true);
+}
+
+/**
+ * Pop request to the front of queue (block until there is something to return).
+ * @param   q       Queue structure.
+ * @return  Request structure.
+ */
+Request * queue_pop(Queue *q) {
+    if (q->type != QUEUE_LIST) {
+        return queue_ring_pop(q, NULL);
+    }
+
+    // Acquire the lock
+    mutex_lock(&q->lock);
+
+    // Wait until there is something in the queue
+    while (q->size == 0) {
+        cond_wait(&q->produced, &q->lock);
+    }
+
+    // Update the head pointer and decrement size
+    Request *r = queue_list_take(q);
+
+    // Release the lock
+    mutex_unlock(&q->lock);
+    return r;
+}
+
+/**
+ * Pop up to max requests from the front of queue under a single acquisition
+ * of the lock, waiting at most timeout milliseconds for the first to arrive.
+ * @param   q       Queue structure.
+ * @param   out     Array to store popped requests in.
+ * @param   max     Maximum number of requests to pop.
+ * @param   timeout Milliseconds to wait (negative waits forever).
+ * @return  Number of requests stored in out (0 if nothing arrived before
+ *          timeout).
+ */
+size_t queue_pop_batch(Queue *q, Request **out, size_t max, int timeout) {
+    size_t n = 0;
+
+    if (max == 0) {
+        return 0;
+    }
+
+    if (q->type != QUEUE_LIST) {
+        if (!(out[n] = queue_pop_timed(q, timeout))) {
+            return 0;
+        }
+        for (n++; n < max && (out[n] = queue_ring_take(q)); n++);
+        queue_ring_wake(q, &q->blocked, &q->consumed);
+        return n;
+    }
+
+    struct timespec deadline;
+    if (timeout > 0) {
+        queue_deadline(timeout, &deadline);
+    }
+
+    // Acquire the lock
+    mutex_lock(&q->lock);
+
+    // Wait until there is something in the queue or the deadline passes
+    queue_list_wait(q, timeout < 0 ? NULL : &deadline, timeout == 0);
+
+    // Update the head pointer and decrement size for each request
+    while (n < max && q->size > 0) {
+        out[n++] = queue_list_take(q);
+    }
+
+    // Release the lock
+    mutex_unlock(&q->lock);
+    return n;
+}
+
+/**
+ * Push list of requests (linked by next) to the back of queue under a single
+ * acquisition of the lock.  An unbounded queue splices the whole list on; a
+ * bounded one applies its policy to each request in turn.  Requests that are
+ * not pushed are deleted.
+ * @param   q       Queue structure.
+ * @param   head    First request of list.
+ * @return  Number of requests pushed.
  */
-void queue_push(Queue *q, Request *r) {
+size_t queue_push_batch(Queue *q, Request *head) {
+    size_t n = 0;
+
+    if (!head) {
+        return 0;
+    }
+
+    if (q->type != QUEUE_LIST) {
+        while (head) {
+            Request *next = head->next;
+            queue_ring_push(q, head);
+            head = next;
+            n++;
+        }
+        return n;
+    }
+
+    if (!q->capacity && !q->max_bytes) {
+        Request *tail = head;
+        for (n = 1; tail->next; tail = tail->next) {
+            n++;
+        }
+
+        // Acquire the lock and splice list onto the back
+        mutex_lock(&q->lock);
+        if (q->head == NULL) {
+            q->head = head;
+        } else {
+            q->tail->next = head;
+        }
+        if (q->size == 0 && q->fd >= 0) {
+            queue_fd_set(q, true);
+        }
+        q->tail  = tail;
+        q->size += n;
+
+        // Wake every consumer there may now be work for and release the lock
+        if (n > 1) {
+            cond_broadcast(&q->produced);
+        } else {
+            cond_signal(&q->produced);
+        }
+        mutex_unlock(&q->lock);
+        return n;
+    }
+
+    Request *refused = NULL;
+
+    // Acquire the lock and admit each request according to policy
+    mutex_lock(&q->lock);
+    while (head) {
+        Request *next = head->next;
+
+        // Consumers only hear about the batch at the end, so wake them for
+        // what it admitted before waiting on them to make room
+        if (n && q->policy == QUEUE_BLOCK && !queue_list_fits(q, q->max_bytes ? queue_request_bytes(head) : 0)) {
+            cond_broadcast(&q->produced);
+        }
+        if (queue_list_admit(q, head, q->policy == QUEUE_BLOCK, false)) {
+            n++;
+        } else {
+            head->next = refused;
+            refused    = head;
+        }
+        head = next;
+    }
+    if (n) {
+        cond_broadcast(&q->produced);
+    }
+    mutex_unlock(&q->lock);
+
+    // Delete refused requests outside of the lock
+    while (refused) {
+        Request *next = refused->next;
+        request_delete(refused);
+        refused = next;
+    }
+
+    return n;
+}
+
+/**
+ * Push as much of list of requests (linked by next) to the back of queue as
+ * fits without waiting.  Requests a queue would wait for room for (rings and
+ * QUEUE_BLOCK) are left for the caller to push later; other policies refuse
+ * or drop requests as usual (deleting them).
+ * @param   q       Queue structure.
+ * @param   head    First request of list.
+ * @return  Requests that were not pushed for want of room (NULL if none).
+ */
+Request * queue_try_push_batch(Queue *q, Request *head) {
+    if (!head) {
+        return NULL;
+    }
+
+    if (q->type != QUEUE_LIST) {
+        size_t n = 0;
+        while (head) {
+            Request *next = head->next;
+            head->next    = NULL;
+            if (!queue_ring_put(q, head)) {
+                head->next = next;
+                break;
+            }
+            head = next;
+            n++;
+        }
+        if (n) {
+            queue_ring_wake(q, &q->sleepers, &q->produced);
+            queue_ring_ready(q);
+        }
+        return head;
+    }
+
+    if (q->policy != QUEUE_BLOCK || (!q->capacity && !q->max_bytes)) {
+        queue_push_batch(q, head);
+        return NULL;
+    }
+
+    size_t n = 0;
+
+    // Acquire the lock and admit each request until the queue is full
+    mutex_lock(&q->lock);
+    while (head && queue_list_fits(q, q->max_bytes ? queue_request_bytes(head) : 0)) {
+        Request *next = head->next;
+        queue_list_admit(q, head, false, false);
+        head = next;
+        n++;
+    }
+    if (n) {
+        cond_broadcast(&q->produced);
+    }
+    mutex_unlock(&q->lock);
+
+    return head;
+}
+
+/**
+ * Pop request from the front of queue without blocking.
+ * @param   q       Queue structure.
+ * @return  Request structure (NULL if queue is empty).
+ */
+Request * queue_try_pop(Queue *q) {
+    Request *r = NULL;
+
+    if (q->type != QUEUE_LIST) {
+        if ((r = queue_ring_take(q))) {
+            queue_ring_wake(q, &q->blocked, &q->consumed);
+        }
+        return r;
+    }
+
+    // Acquire the lock
+    mutex_lock(&q->lock);
+
+    // Update the head pointer and decrement size if there is something
+    if (q->size > 0) {
+        r = queue_list_take(q);
+    }
+
+    // Release the lock
+    mutex_unlock(&q->lock);
+    return r;
+}
+
+/**
+ * Pop request from the front of queue, waiting at most timeout milliseconds
+ * for something to arrive.
+ * @param   q       Queue structure.
+ * @param   timeout Milliseconds to wait (negative waits forever).
+ * @return  Request structure (NULL if nothing arrived before timeout).
+ */
+Request * queue_pop_timed(Queue *q, int timeout) {
+    if (timeout < 0) {
+        return queue_pop(q);
+    }
+    if (timeout == 0 && q->type != QUEUE_LIST) {
+        return queue_try_pop(q);
+    }
+
+    // Compute absolute deadline
+    struct timespec deadline;
+    queue_deadline(timeout, &deadline);
+
+    if (q->type != QUEUE_LIST) {
+        return queue_ring_pop(q, &deadline);
+    }
+
+    Request *r = NULL;
+
     // Acquire the lock
     mutex_lock(&q->lock);
 
+    // Wait until there is something in the queue or the deadline passes
+    queue_list_wait(q, &deadline, false);
+
+    // Update the head pointer and decrement size if there is something
+    if (q->size > 0) {
+        r = queue_list_take(q);
+    }
+
+    // Release the lock
+    mutex_unlock(&q->lock);
+    return r;
+}
+
+/**
+ * Return eventfd that is readable whenever queue is non-empty (it is created
+ * on first use, so queues nobody polls never touch it).  Only the consumer
+ * should pop from a ring while polling its descriptor.
+ * @param   q       Queue structure.
+ * @return  File descriptor (-1 if it could not be created).
+ */
+int queue_fd(Queue *q) {
+    mutex_lock(&q->lock);
+    if (q->fd < 0) {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0) {
+            error("Unable to create eventfd: %s", strerror(errno));
+        } else if (q->type == QUEUE_LIST) {
+            q->fd = fd;
+            if (q->size > 0) {
+                queue_fd_set(q, true);
+            }
+        } else {
+            // Either a producer sees the descriptor or we see its request
+            __atomic_store_n(&q->fd, fd, __ATOMIC_SEQ_CST);
+            if (!queue_ring_empty(q)) {
+                queue_ring_ready(q);
+            }
+        }
+    }
+    mutex_unlock(&q->lock);
+    return q->fd;
+}
+
+/**
+ * Return number of requests discarded by a QUEUE_DROP_* policy.
+ * @param   q       Queue structure.
+ * @return  Number of dropped requests.
+ */
+size_t queue_dropped(Queue *q) {
+    mutex_lock(&q->lock);
+    size_t dropped = q->dropped;
+    mutex_unlock(&q->lock);
+    return dropped;
+}
+
+/**
+ * Return number of requests refused by QUEUE_FAIL or a try push while full.
+ * @param   q       Queue structure.
+ * @return  Number of rejected requests.
+ */
+size_t queue_rejected(Queue *q) {
+    return __atomic_load_n(&q->rejected, __ATOMIC_RELAXED);
+}
+
+/* Internal Functions */
+
+Queue * queue_allocate(QueueType type) {
+    Queue *q = NULL;
+
+    // Keep enqueue and dequeue positions on their own cache lines
+    if (posix_memalign((void **)&q, CACHE_LINE, sizeof(Queue)) != 0) {
+        return NULL;
+    }
+    memset(q, 0, sizeof(Queue));
+
+    // Set initial size to 0 and initialize primitives
+    q->type = type;
+    q->size = 0;
+    q->fd   = -1;
+    mutex_init(&q->lock, NULL);
+    cond_init(&q->produced, NULL);
+    cond_init(&q->consumed, NULL);
+
+    return q;
+}
+
+/**
+ * Return the number of bytes a request counts against max_bytes.
+ * @param   r       Request structure.
+ * @return  Length of body.
+ */
+size_t queue_request_bytes(Request *r) {
+    return r->body ? r->length : 0;
+}
+
+/**
+ * Return whether list has room for one more request (call with lock held).
+ * @param   q       Queue structure.
+ * @param   bytes   Length of body of request.
+ * @return  Whether or not request fits.
+ */
+bool queue_list_fits(Queue *q, size_t bytes) {
+    if (q->capacity && q->size >= q->capacity) {
+        return false;
+    }
+    return !q->max_bytes || q->size == 0 || q->bytes + bytes <= q->max_bytes;
+}
+
+/**
+ * Push request to the back of list, applying policy while it is full.
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ * @param   wait    Whether or not to wait for room.
+ * @param   force   Whether or not to ignore bounds.
+ * @return  Whether or not the request was pushed (it is deleted if not).
+ */
+bool queue_list_push(Queue *q, Request *r, bool wait, bool force) {
+    // Acquire the lock
+    mutex_lock(&q->lock);
+
+    bool pushed = queue_list_admit(q, r, wait, force);
+
+    // Signal that a value has been pushed and release the lock
+    if (pushed) {
+        cond_signal(&q->produced);
+    }
+    mutex_unlock(&q->lock);
+
+    if (!pushed) {
+        request_delete(r);
+    }
+    return pushed;
+}
+
+/**
+ * Append request to list once policy allows (call with lock held).
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ * @param   wait    Whether or not to wait for room.
+ * @param   force   Whether or not to ignore bounds.
+ * @return  Whether or not the request was appended (counted if not).
+ */
+bool queue_list_admit(Queue *q, Request *r, bool wait, bool force) {
+    size_t bytes = q->max_bytes ? queue_request_bytes(r) : 0;
+
+    // Make room or give up according to policy
+    while (!force && !queue_list_fits(q, bytes)) {
+        if (q->policy == QUEUE_DROP_OLDEST) {
+            // Control requests stay, so with nothing else left drop r
+            Request *victim = queue_list_evict(q);
+            q->dropped++;
+            if (!victim) {
+                return false;
+            }
+            request_delete(victim);
+        } else if (wait) {
+            q->blocked++;
+            cond_wait(&q->consumed, &q->lock);
+            q->blocked--;
+        } else {
+            if (q->policy == QUEUE_DROP_NEWEST) {
+                q->dropped++;
+            } else {
+                __atomic_add_fetch(&q->rejected, 1, __ATOMIC_RELAXED);
+            }
+            return false;
+        }
+    }
+
     // Empty queue
     if (q->head == NULL) {
         q->head = r;
@@ -50,35 +633,331 @@ void queue_push(Queue *q, Request *r) {
         q->tail = r;
     }
 
-    r->next = NULL;
-    ++q->size;
+    r->next   = NULL;
+    r->forced = force;
+    if (q->size++ == 0 && q->fd >= 0) {
+        queue_fd_set(q, true);
+    }
+    q->bytes += bytes;
+    return true;
+}
 
-    // Signal that a value has been pushed and release the lock
-    cond_signal(&q->produced);
-    mutex_unlock(&q->lock);
+/**
+ * Wait until list is non-empty (call with lock held).
+ * @param   q           Queue structure.
+ * @param   deadline    When to give up (NULL waits forever).
+ * @param   poll        Whether or not to return without waiting.
+ * @return  Whether or not there is something in the list.
+ */
+bool queue_list_wait(Queue *q, const struct timespec *deadline, bool poll) {
+    while (q->size == 0 && !poll) {
+        if (!deadline) {
+            cond_wait(&q->produced, &q->lock);
+            continue;
+        }
+
+        int rc = pthread_cond_timedwait(&q->produced, &q->lock, deadline);
+        if (rc == ETIMEDOUT) {
+            break;
+        }
+        if (rc != 0) {
+            error("%s", strerror(rc));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return q->size > 0;
 }
 
 /**
- * Pop request to the front of queue (block until there is something to return).
+ * Take request from the front of non-empty list (call with lock held) and
+ * wake any producers waiting for room.
  * @param   q       Queue structure.
  * @return  Request structure.
  */
-Request * queue_pop(Queue *q) {
-    // Acquire the lock
-    mutex_lock(&q->lock);
+Request * queue_list_take(Queue *q) {
+    Request *r = q->head;
+    q->head = q->head->next;
+    if (--q->size == 0 && q->fd >= 0) {
+        queue_fd_set(q, false);
+    }
+    if (q->max_bytes) {
+        q->bytes -= queue_request_bytes(r);
+    }
 
-    // Wait until there is something in the queue
-    while (q->size == 0) {
-        cond_wait(&q->produced, &q->lock);
+    if (q->blocked) {
+        cond_broadcast(&q->consumed);
     }
+    return r;
+}
 
-    // Update the head pointer and decrement size
-    Request *r = q->head;
-    q->head = q->head->next;
-    --q->size;
+/**
+ * Take oldest request that was not forced in from list (call with lock held),
+ * so QUEUE_DROP_OLDEST never discards subscriptions or the SENTINEL.
+ * @param   q       Queue structure.
+ * @return  Request structure (NULL if every request was forced in).
+ */
+Request * queue_list_evict(Queue *q) {
+    Request *previous = NULL;
+    Request *r        = q->head;
 
-    // Release the lock
+    while (r && r->forced) {
+        previous = r;
+        r        = r->next;
+    }
+    if (!r || !previous) {
+        return r ? queue_list_take(q) : NULL;
+    }
+
+    // Unlink from the middle (the list stays non-empty)
+    previous->next = r->next;
+    if (q->tail == r) {
+        q->tail = previous;
+    }
+    q->size--;
+    if (q->max_bytes) {
+        q->bytes -= queue_request_bytes(r);
+    }
+    return r;
+}
+
+/**
+ * Compute absolute CLOCK_REALTIME deadline timeout milliseconds from now.
+ * @param   timeout     Milliseconds from now.
+ * @param   deadline    Where to store deadline.
+ */
+void queue_deadline(int timeout, struct timespec *deadline) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec  += timeout / 1000;
+    deadline->tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * Put request in ring without blocking.
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ * @return  Whether or not there was room in the ring.
+ */
+bool queue_ring_put(Queue *q, Request *r) {
+    if (q->type == QUEUE_SPSC) {
+        size_t position = __atomic_load_n(&q->enqueue, __ATOMIC_RELAXED);
+        if (position - __atomic_load_n(&q->dequeue, __ATOMIC_ACQUIRE) > q->mask) {
+            return false;
+        }
+
+        q->slots[position & q->mask].request = r;
+        __atomic_store_n(&q->enqueue, position + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Claim a position whose slot the consumer has released
+    size_t position = __atomic_load_n(&q->enqueue, __ATOMIC_RELAXED);
+    Slot  *slot;
+    while (true) {
+        slot = &q->slots[position & q->mask];
+
+        size_t   sequence   = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue, &position, position + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = __atomic_load_n(&q->enqueue, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->request = r;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Take request from ring without blocking (only call from the consumer).
+ * @param   q       Queue structure.
+ * @return  Request structure (NULL if ring is empty).
+ */
+Request * queue_ring_take(Queue *q) {
+    size_t   position = __atomic_load_n(&q->dequeue, __ATOMIC_RELAXED);
+    Slot    *slot     = &q->slots[position & q->mask];
+    Request *r;
+
+    if (q->type == QUEUE_SPSC) {
+        if (position == __atomic_load_n(&q->enqueue, __ATOMIC_ACQUIRE)) {
+            queue_ring_idle(q);
+            return NULL;
+        }
+
+        r = slot->request;
+        __atomic_store_n(&q->dequeue, position + 1, __ATOMIC_RELEASE);
+        return r;
+    }
+
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1) {
+        queue_ring_idle(q);
+        return NULL;
+    }
+
+    // Release slot for the producer one lap ahead
+    r = slot->request;
+    __atomic_store_n(&slot->sequence, position + q->mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&q->dequeue, position + 1, __ATOMIC_RELAXED);
+    return r;
+}
+
+/**
+ * Wake threads parked on cond if there are any.  The fence pairs with the
+ * one in the parking thread: either it sees our change to the ring or we see
+ * it waiting.
+ * @param   q       Queue structure.
+ * @param   waiters Number of threads parked on cond.
+ * @param   cond    Condition variable to broadcast.
+ */
+void queue_ring_wake(Queue *q, size_t *waiters, Cond *cond) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED)) {
+        mutex_lock(&q->lock);
+        cond_broadcast(cond);
+        mutex_unlock(&q->lock);
+    }
+}
+
+/**
+ * Return whether ring is empty without taking anything from it.
+ * @param   q       Queue structure.
+ * @return  Whether or not the next position is unfilled.
+ */
+bool queue_ring_empty(Queue *q) {
+    size_t position = __atomic_load_n(&q->dequeue, __ATOMIC_ACQUIRE);
+
+    if (q->type == QUEUE_SPSC) {
+        return position == __atomic_load_n(&q->enqueue, __ATOMIC_ACQUIRE);
+    }
+    return __atomic_load_n(&q->slots[position & q->mask].sequence, __ATOMIC_ACQUIRE) != position + 1;
+}
+
+/**
+ * Make the eventfd of ring readable after a push, unless it already is.
+ * @param   q       Queue structure.
+ */
+void queue_ring_ready(Queue *q) {
+    if (__atomic_load_n(&q->fd, __ATOMIC_SEQ_CST) >= 0 &&
+        !__atomic_exchange_n(&q->signalled, true, __ATOMIC_SEQ_CST)) {
+        queue_fd_set(q, true);
+    }
+}
+
+/**
+ * Clear the eventfd of ring once the consumer finds it empty.  A push that
+ * raced with the clear is seen by the check that follows it.
+ * @param   q       Queue structure.
+ */
+void queue_ring_idle(Queue *q) {
+    if (__atomic_load_n(&q->fd, __ATOMIC_RELAXED) >= 0 &&
+        __atomic_exchange_n(&q->signalled, false, __ATOMIC_SEQ_CST)) {
+        queue_fd_set(q, false);
+        if (!queue_ring_empty(q)) {
+            queue_ring_ready(q);
+        }
+    }
+}
+
+/**
+ * Make eventfd of queue readable or drain it.
+ * @param   q           Queue structure.
+ * @param   readable    Whether or not it should be readable.
+ */
+void queue_fd_set(Queue *q, bool readable) {
+    uint64_t value = 1;
+    ssize_t  result;
+
+    if (readable) {
+        result = write(q->fd, &value, sizeof(value));
+    } else {
+        result = read(q->fd, &value, sizeof(value));
+    }
+    (void)result;
+}
+
+/**
+ * Push request to ring, spinning and then parking while it is full.
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ */
+void queue_ring_push(Queue *q, Request *r) {
+    r->next = NULL;
+
+    for (size_t spin = 0; !queue_ring_put(q, r); spin++) {
+        if (spin < SPIN_LIMIT) {
+            sched_yield();
+            continue;
+        }
+
+        mutex_lock(&q->lock);
+        __atomic_add_fetch(&q->blocked, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (!queue_ring_put(q, r)) {
+            cond_wait(&q->consumed, &q->lock);
+        }
+        __atomic_sub_fetch(&q->blocked, 1, __ATOMIC_SEQ_CST);
+        mutex_unlock(&q->lock);
+        break;
+    }
+
+    queue_ring_wake(q, &q->sleepers, &q->produced);
+    queue_ring_ready(q);
+}
+
+/**
+ * Pop request from ring, spinning and then parking while it is empty.
+ * @param   q           Queue structure.
+ * @param   deadline    When to give up (NULL waits forever).
+ * @return  Request structure (NULL if nothing arrived before deadline).
+ */
+Request * queue_ring_pop(Queue *q, const struct timespec *deadline) {
+    Request *r;
+
+    for (size_t spin = 0; spin < SPIN_LIMIT; spin++) {
+        if ((r = queue_ring_take(q))) {
+            queue_ring_wake(q, &q->blocked, &q->consumed);
+            return r;
+        }
+        sched_yield();
+    }
+
+    mutex_lock(&q->lock);
+    __atomic_add_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (!(r = queue_ring_take(q))) {
+        if (!deadline) {
+            cond_wait(&q->produced, &q->lock);
+            continue;
+        }
+
+        int rc = pthread_cond_timedwait(&q->produced, &q->lock, deadline);
+        if (rc == ETIMEDOUT) {
+            r = queue_ring_take(q);
+            break;
+        }
+        if (rc != 0) {
+            error("%s", strerror(rc));
+            exit(EXIT_FAILURE);
+        }
+    }
+    __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
     mutex_unlock(&q->lock);
+
+    if (r) {
+        queue_ring_wake(q, &q->blocked, &q->consumed);
+    }
     return r;
 }
 
@@ -1,79 +1,458 @@
 /* request.c: Request structure */
 
 #include "mq/request.h"
+#include "mq/thread.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* Internal Constants */
+
+#define CLASS_MINIMUM	128		/* Size of smallest pooled allocation */
+#define CACHE_COUNT	64		/* Most allocations of a size a thread keeps */
+#define CACHE_BYTES	(1<<20)		/* Most bytes of a size a thread keeps */
+#define POOL_FACTOR	16		/* Shared pool holds this many thread caches */
+#define POOL_BYTES	(16<<20)	/* Most bytes the shared pool keeps in all */
+
+/* Internal Structures */
+
+typedef struct Cache Cache;
+struct Cache {
+    Request *free[REQUEST_CLASSES];	// Free allocations of each size
+    size_t   count[REQUEST_CLASSES];
+    bool     registered;		// Whether thread exit flushes cache
+};
+
+/* Internal Globals */
+
+static __thread Cache ThreadCache;
+
+static Mutex          PoolLock = PTHREAD_MUTEX_INITIALIZER;
+static Request *      PoolFree[REQUEST_CLASSES];
+static size_t         PoolCount[REQUEST_CLASSES];
+static size_t         PoolBytes = 0;
+static pthread_key_t  PoolKey;
+static pthread_once_t PoolOnce = PTHREAD_ONCE_INIT;
+
+static size_t         Allocations = 0;
+
+/* Internal Prototypes */
+
+Request *   request_allocate(const char *method, const char *uri, const void *body, size_t length, bool reserve);
+size_t      request_class(size_t size);
+size_t      request_class_limit(size_t c);
+Cache *     request_cache();
+Request *   request_pool_get(size_t c);
+void        request_pool_put(Request *r);
+size_t      request_pool_transfer(Request **from, size_t *from_count, Request **to, size_t *to_count, size_t n);
+void        request_pool_trim(size_t c);
+void        request_pool_init();
+void        request_pool_flush(void *arg);
+
+/* External Functions */
+
 /**
- * Create Request structure.
+ * Create Request structure.  The structure, method, uri and body share one
+ * allocation, which is recycled through a pool when the Request is deleted.
  * @param   method      Request method string.
  * @param   uri         Request uri string.
  * @param   body        Request body string.
  * @return  Newly allocated Request structure.
  */
 Request * request_create(const char *method, const char *uri, const char *body) {
-    Request *r = (Request*) calloc(1, sizeof(Request));
+    return request_allocate(method, uri, body, body ? strlen(body) : 0, false);
+}
+
+/**
+ * Create Request structure with a binary body (which may contain NULs).
+ * @param   method      Request method string.
+ * @param   uri         Request uri string.
+ * @param   body        Request body (NULL for none).
+ * @param   length      Length of body.
+ * @return  Newly allocated Request structure.
+ */
+Request * request_create_bytes(const char *method, const char *uri, const void *body, size_t length) {
+    return request_allocate(method, uri, body, length, false);
+}
+
+/**
+ * Create Request structure with room for a body of length bytes (plus a
+ * terminating NUL), for callers that fill in body themselves.
+ * @param   method      Request method string.
+ * @param   uri         Request uri string.
+ * @param   length      Length of body.
+ * @return  Newly allocated Request structure.
+ */
+Request * request_reserve(const char *method, const char *uri, size_t length) {
+    return request_allocate(method, uri, NULL, length, true);
+}
+
+/**
+ * Delete Request structure.  A body that was assigned from a separate
+ * allocation is freed along with it.
+ * @param   r           Request structure.
+ */
+void request_delete(Request *r) {
+    if (r) {
+        char *data = (char *)(r + 1);
+
+        if (r->body && (r->body < data || r->body >= (char *)r + r->capacity))
+          free(r->body);
+
+        request_pool_put(r);
+    }
+}
+
+/**
+ * Take body out of Request structure as a separate allocation.
+ * @param   r           Request structure.
+ * @return  Newly allocated body (must be freed, NULL if there is none).
+ */
+char * request_take_body(Request *r) {
+    char *data = (char *)(r + 1);
+    char *body = r->body;
+
+    if (body && body >= data && body < (char *)r + r->capacity) {
+        body = malloc(r->length + 1);
+        if (body) {
+            memcpy(body, r->body, r->length);
+            body[r->length] = 0;
+        }
+    }
 
+    r->body   = NULL;
+    r->length = 0;
+    return body;
+}
+
+/**
+ * Return number of times the Request pool has had to call malloc.
+ * @return  Number of allocations.
+ */
+size_t request_allocations() {
+    return __atomic_load_n(&Allocations, __ATOMIC_RELAXED);
+}
+
+/* Internal Functions */
+
+Request * request_allocate(const char *method, const char *uri, const void *body, size_t length, bool reserve) {
+    size_t method_length = method ? strlen(method) + 1 : 0;
+    size_t uri_length    = uri    ? strlen(uri) + 1    : 0;
+    size_t body_length   = (body || reserve) ? length + 1 : 0;
+    size_t size          = sizeof(Request) + method_length + uri_length + body_length;
+
+    Request *r = request_pool_get(request_class(size));
     if (!r) {
-        free(r);
-        return NULL;
+        r = malloc(size);
+        if (!r) {
+            return NULL;
+        }
+        r->capacity = size;
+        __atomic_add_fetch(&Allocations, 1, __ATOMIC_RELAXED);
     }
 
-    // Set values
+    size_t capacity = r->capacity;
+    memset(r, 0, sizeof(Request));
+    r->capacity = capacity;
+
+    // Lay out strings after the structure
+    char *data = (char *)(r + 1);
     if (method) {
-        r->method = strdup(method);
+        r->method = memcpy(data, method, method_length);
+        data     += method_length;
     }
     if (uri) {
-        r->uri = strdup(uri);
+        r->uri = memcpy(data, uri, uri_length);
+        data  += uri_length;
     }
-    if (body) {
-        r->body = strdup(body);
+    if (body || reserve) {
+        r->body   = data;
+        r->length = length;
+        if (body) {
+            memcpy(r->body, body, length);
+        }
+        r->body[length] = 0;
     }
 
     return r;
 }
 
 /**
- * Delete Request structure.
- * @param   r           Request structure.
+ * Return size class of an allocation (REQUEST_CLASSES if it is too large to
+ * pool).
+ * @param   size        Number of bytes needed.
+ * @return  Size class.
  */
-void request_delete(Request *r) {
+size_t request_class(size_t size) {
+    size_t c = 0;
+    while (c < REQUEST_CLASSES && ((size_t)CLASS_MINIMUM << c) < size) {
+        c++;
+    }
+    return c;
+}
+
+/**
+ * Return most allocations of a size class a thread keeps.
+ * @param   c           Size class.
+ * @return  Number of allocations.
+ */
+size_t request_class_limit(size_t c) {
+    size_t limit = CACHE_BYTES / ((size_t)CLASS_MINIMUM << c);
+    return limit < 1 ? 1 : (limit > CACHE_COUNT ? CACHE_COUNT : limit);
+}
+
+/**
+ * Return cache of calling thread, arranging for it to be flushed to the
+ * shared pool when the thread exits.
+ * @return  Cache structure.
+ */
+Cache * request_cache() {
+    Cache *cache = &ThreadCache;
+
+    if (!cache->registered) {
+        PTHREAD_CHECK(pthread_once(&PoolOnce, request_pool_init));
+        PTHREAD_CHECK(pthread_setspecific(PoolKey, cache));
+        cache->registered = true;
+    }
+
+    return cache;
+}
+
+/**
+ * Get allocation of size class from the thread cache, refilling the cache
+ * from the shared pool when it is empty.
+ * @param   c           Size class.
+ * @return  Allocation with capacity set (NULL if there is none to reuse).
+ */
+Request * request_pool_get(size_t c) {
+    if (c >= REQUEST_CLASSES) {
+        return NULL;
+    }
+
+    Cache *cache = request_cache();
+
+    if (!cache->count[c] && __atomic_load_n(&PoolCount[c], __ATOMIC_RELAXED)) {
+        mutex_lock(&PoolLock);
+        PoolBytes -= request_pool_transfer(&PoolFree[c], &PoolCount[c], &cache->free[c], &cache->count[c],
+                                           request_class_limit(c) / 2 + 1) * ((size_t)CLASS_MINIMUM << c);
+        mutex_unlock(&PoolLock);
+    }
+
+    Request *r = cache->free[c];
     if (r) {
+        cache->free[c] = r->next;
+        cache->count[c]--;
+        return r;
+    }
 
-        if (r->method)
-          free(r->method);
-        if (r->uri)
-          free(r->uri);
-        if (r->body)
-          free(r->body);
+    // Only allocate at the size of the class so the allocation can be pooled
+    r = malloc((size_t)CLASS_MINIMUM << c);
+    if (r) {
+        r->capacity = (size_t)CLASS_MINIMUM << c;
+        __atomic_add_fetch(&Allocations, 1, __ATOMIC_RELAXED);
+    }
+    return r;
+}
 
+/**
+ * Put allocation back in the thread cache, moving half of the cache to the
+ * shared pool (and freeing what the pool has no room for) when it is full.
+ * @param   r           Request structure.
+ */
+void request_pool_put(Request *r) {
+    size_t c = request_class(r->capacity);
+
+    if (c >= REQUEST_CLASSES || ((size_t)CLASS_MINIMUM << c) != r->capacity) {
         free(r);
+        return;
+    }
+
+    Cache *cache = request_cache();
+    r->next        = cache->free[c];
+    cache->free[c] = r;
+    cache->count[c]++;
+
+    size_t limit = request_class_limit(c);
+    if (cache->count[c] > limit) {
+        mutex_lock(&PoolLock);
+        PoolBytes += request_pool_transfer(&cache->free[c], &cache->count[c], &PoolFree[c], &PoolCount[c],
+                                           limit / 2 + 1) * ((size_t)CLASS_MINIMUM << c);
+        request_pool_trim(c);
+        mutex_unlock(&PoolLock);
     }
 }
 
 /**
- * Write HTTP Request to stream:
+ * Move up to n allocations from one free list to another.
+ * @param   from        Free list to move from.
+ * @param   from_count  Length of free list to move from.
+ * @param   to          Free list to move to.
+ * @param   to_count    Length of free list to move to.
+ * @param   n           Number of allocations to move.
+ * @return  Number of allocations moved.
+ */
+size_t request_pool_transfer(Request **from, size_t *from_count, Request **to, size_t *to_count, size_t n) {
+    size_t moved = 0;
+
+    while (moved < n && *from) {
+        Request *r = *from;
+        *from      = r->next;
+        r->next    = *to;
+        *to        = r;
+        (*from_count)--;
+        (*to_count)++;
+        moved++;
+    }
+    return moved;
+}
+
+/**
+ * Free allocations of size class the shared pool has no room for: beyond
+ * POOL_FACTOR thread caches of it, or past POOL_BYTES in all (call with
+ * PoolLock held).
+ * @param   c           Size class.
+ */
+void request_pool_trim(size_t c) {
+    size_t size = (size_t)CLASS_MINIMUM << c;
+
+    while (PoolFree[c] && (PoolCount[c] > POOL_FACTOR * request_class_limit(c) || PoolBytes > POOL_BYTES)) {
+        Request *extra = PoolFree[c];
+        PoolFree[c]    = extra->next;
+        PoolCount[c]--;
+        PoolBytes     -= size;
+        free(extra);
+    }
+}
+
+/**
+ * Create key whose destructor flushes a thread cache when its thread exits.
+ */
+void request_pool_init() {
+    PTHREAD_CHECK(pthread_key_create(&PoolKey, request_pool_flush));
+}
+
+/**
+ * Move every allocation in an exiting thread's cache to the shared pool.
+ * @param   arg         Cache structure.
+ */
+void request_pool_flush(void *arg) {
+    Cache *cache = arg;
+
+    mutex_lock(&PoolLock);
+    for (size_t c = 0; c < REQUEST_CLASSES; c++) {
+        PoolBytes += request_pool_transfer(&cache->free[c], &cache->count[c], &PoolFree[c], &PoolCount[c],
+                                           cache->count[c]) * ((size_t)CLASS_MINIMUM << c);
+        request_pool_trim(c);
+    }
+    mutex_unlock(&PoolLock);
+    cache->registered = false;
+}
+
+/**
+ * Format head of HTTP Request (everything before the body) into buffer:
  *
- *  $METHOD $URI HTTP/1.0\r\n
+ *  $METHOD $URI HTTP/1.1\r\n
+ *  Host: $HOST\r\n
  *  Content-Length: Length($BODY)\r\n
  *  \r\n
- *  $BODY
+ *
+ * Nothing is written unless the whole head fits, so the caller can flush its
+ * buffer and try again with the length returned.
+ *
+ * HTTP/1.1 servers reject requests without a Host header, so it is only left
+ * out when host is NULL.
  *
  * @param   r           Request structure.
- * @param   fs          Socket file stream.
+ * @param   host        Value of Host header (see socket_authority).
+ * @param   buffer      Where to store head (not NUL terminated).
+ * @param   size        Size of buffer.
+ * @return  Length of head (0 if Request has no method or uri).
  */
-void request_write(Request *r, FILE *fs) {
-    if (r->method != NULL && r->uri != NULL) {
-        fprintf(fs, "%s %s HTTP/1.0\r\n", r->method, r->uri);
+size_t request_head(Request *r, const char *host, char *buffer, size_t size) {
+    if (r->method == NULL || r->uri == NULL) {
+        return 0;
+    }
 
-        if (r->body != NULL) {
-            fprintf(fs, "Content-Length: %zu\r\n", strlen(r->body));
-            fprintf(fs, "\r\n");
-            fprintf(fs, "%s", r->body);
-        }
-        else {
-            fprintf(fs, "\r\n");
+    size_t method_length = strlen(r->method);
+    size_t uri_length    = strlen(r->uri);
+    size_t host_length   = host ? strlen(host) : 0;
+
+    // Format Content-Length digits backwards into the end of a small buffer
+    char   digits[24];
+    size_t ndigits = 0;
+    if (r->body != NULL) {
+        size_t value = r->length;
+        do {
+            digits[sizeof(digits) - ++ndigits] = '0' + value % 10;
+            value /= 10;
+        } while (value);
+    }
+
+    size_t length = method_length + uri_length + strlen("  HTTP/1.1\r\n\r\n");
+    if (host != NULL) {
+        length += strlen("Host: \r\n") + host_length;
+    }
+    if (r->body != NULL) {
+        length += strlen("Content-Length: \r\n") + ndigits;
+    }
+    if (length > size) {
+        return length;
+    }
+
+    char *p = buffer;
+    memcpy(p, r->method, method_length);
+    p += method_length;
+    *p++ = ' ';
+    memcpy(p, r->uri, uri_length);
+    p += uri_length;
+    memcpy(p, " HTTP/1.1\r\n", 11);
+    p += 11;
+    if (host != NULL) {
+        memcpy(p, "Host: ", 6);
+        p += 6;
+        memcpy(p, host, host_length);
+        p += host_length;
+        memcpy(p, "\r\n", 2);
+        p += 2;
+    }
+    if (r->body != NULL) {
+        memcpy(p, "Content-Length: ", 16);
+        p += 16;
+        memcpy(p, digits + sizeof(digits) - ndigits, ndigits);
+        p += ndigits;
+        memcpy(p, "\r\n", 2);
+        p += 2;
+    }
+    memcpy(p, "\r\n", 2);
+    return length;
+}
+
+/**
+ * Write HTTP Request to stream (the head formatted by request_head followed
+ * by the body, if any).
+ * @param   r           Request structure.
+ * @param   host        Value of Host header (NULL to leave it out).
+ * @param   fs          File stream.
+ */
+void request_write(Request *r, const char *host, FILE *fs) {
+    char   buffer[BUFSIZ];
+    size_t length = request_head(r, host, buffer, sizeof(buffer));
+    char * head   = buffer;
+
+    if (length > sizeof(buffer)) {
+        if (!(head = malloc(length))) {
+            return;
         }
+        request_head(r, host, head, length);
+    }
+
+    fwrite(head, 1, length, fs);
+    if (length && r->body != NULL) {
+        fwrite(r->body, 1, r->length, fs);
+    }
+
+    if (head != buffer) {
+        free(head);
     }
 }
@@ -0,0 +1,1514 @@
+/* server.c: Message Queue Server (native epoll broker) */
+
+#define _GNU_SOURCE	/* pthread_setaffinity_np */
+
+#include "mq/broker.h"
+#include "mq/logging.h"
+#include "mq/mailbox.h"
+#include "mq/socket.h"
+#include "mq/string.h"
+#include "mq/thread.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define DEFAULT_ADDRESS	    "0.0.0.0"
+#define DEFAULT_PORT	    "9620"
+
+#define MAX_EVENTS	    256
+#define MAX_HEAD	    (1<<16)	/* Largest request line and headers */
+#define MAX_BODY	    (1L<<28)	/* Largest request body */
+#define MAX_PENDING_OUTPUT  (1<<22)	/* Stop reading requests past this much output */
+#define MAX_INPUT	    (MAX_HEAD + MAX_BODY)	/* Stop reading past this much unhandled input */
+#define READ_SIZE	    (1<<16)
+#define COPY_THRESHOLD	    256		/* Copy smaller bodies instead of referencing them */
+#define MAX_IOVECS	    256
+
+/* Structures */
+
+typedef struct Buffer Buffer;
+struct Buffer {
+    char *  data;
+    size_t  size;			// Bytes stored
+    size_t  offset;			// Bytes already consumed
+    size_t  capacity;
+};
+
+typedef struct Segment Segment;
+struct Segment {
+    Payload *payload;			// Body to send (NULL for bytes in output buffer)
+    size_t   offset;			// Offset of unsent bytes in buffer or body
+    size_t   length;			// Number of unsent bytes
+};
+
+typedef struct Output Output;
+struct Output {
+    Buffer   buffer;			// Response heads and small bodies
+    Segment *segments;			// Pieces of output in the order they are sent
+    size_t   first;			// First segment not completely sent
+    size_t   nsegments;
+    size_t   capacity;
+    size_t   pending;			// Bytes not yet sent
+};
+
+typedef struct Shard Shard;
+
+typedef struct Session Session;
+struct Session {
+    Waiter  waiter;			// Parked retrieve (must be first)
+    int	    fd;
+    int	    events;			// Events registered with epoll
+
+    Buffer  in;				// Requests read but not yet handled
+    Output  out;			// Responses not yet written
+
+    bool    keepalive;			// Whether to keep stream open after response
+    bool    closing;			// Close once output is written
+    bool    closed;			// Socket is closed (freed after event loop pass)
+    bool    throttled;			// Stopped handling requests until output drains
+    bool    streaming;			// Parked retrieve is a stream
+    long    max;			// Parked retrieve maximum (0 for single message)
+
+    bool    pending;			// Whether session is on pending list
+    Session *next;			// Next session on pending or closed list
+
+    Shard * migrate;			// Shard that owns the queue of the next request
+};
+
+typedef struct Server Server;
+
+struct Shard {
+    Server * server;
+    size_t   index;
+    Thread   thread;
+
+    int	     epoll_fd;
+    int	     listen_fd;
+    Broker * broker;			// Queues whose names hash to this shard
+    Mailbox *mailbox;			// Sessions and publishes from other shards
+    Buffer   scratch;			// Response body being built
+
+    Session *pending;			// Sessions with work to do after event
+    Session *pending_tail;
+    Session *closed;			// Sessions to free after event loop pass
+};
+
+struct Server {
+    Shard *  shards;
+    size_t   nshards;
+    bool     unix_path;			// Listening on a Unix domain socket
+
+    Table *  registry;			// Topic name -> subscribers on each shard
+    RWLock   registry_lock;
+};
+
+typedef enum {
+    ENVELOPE_SESSION,			// Session migrating to shard
+    ENVELOPE_PUBLISH,			// Payload published to topic on another shard
+} EnvelopeType;
+
+typedef struct Envelope Envelope;
+struct Envelope {
+    Mail	 mail;			// Must be first
+    EnvelopeType type;
+    Session *	 session;
+    Payload *	 payload;
+};
+
+/* Buffer Functions */
+
+/**
+ * Ensure buffer has room for at least needed more bytes (plus a NUL).
+ * @param   b           Buffer structure.
+ * @param   needed      Number of bytes to make room for.
+ * @return  Whether or not buffer has enough room (never for sizes whose
+ *          doubling would overflow).
+ */
+bool buffer_reserve(Buffer *b, size_t needed) {
+    if (needed >= SIZE_MAX / 2 - b->size) {
+        return false;
+    }
+    if (b->size + needed < b->capacity) {
+        return true;
+    }
+
+    // Reclaim consumed space before growing
+    if (b->offset) {
+        memmove(b->data, b->data + b->offset, b->size - b->offset);
+        b->size  -= b->offset;
+        b->offset = 0;
+        if (b->size + needed < b->capacity) {
+            return true;
+        }
+    }
+
+    size_t capacity = b->capacity ? b->capacity : BUFSIZ;
+    while (b->size + needed >= capacity) {
+        capacity *= 2;
+    }
+
+    char *data = realloc(b->data, capacity);
+    if (!data) {
+        return false;
+    }
+
+    b->data     = data;
+    b->capacity = capacity;
+    return true;
+}
+
+bool buffer_write(Buffer *b, const void *data, size_t length) {
+    if (!buffer_reserve(b, length)) {
+        return false;
+    }
+
+    memcpy(b->data + b->size, data, length);
+    b->size += length;
+    b->data[b->size] = 0;
+    return true;
+}
+
+bool buffer_printf(Buffer *b, const char *format, ...) {
+    va_list args;
+    int     length;
+
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (length < 0 || !buffer_reserve(b, length)) {
+        return false;
+    }
+
+    va_start(args, format);
+    vsnprintf(b->data + b->size, length + 1, format, args);
+    va_end(args);
+
+    b->size += length;
+    return true;
+}
+
+void buffer_clear(Buffer *b) {
+    b->size   = 0;
+    b->offset = 0;
+}
+
+/* Output Functions */
+
+Segment * output_segment(Output *o) {
+    if (o->nsegments == o->capacity) {
+        size_t   capacity = o->capacity ? 2*o->capacity : 16;
+        Segment *bigger   = realloc(o->segments, capacity * sizeof(Segment));
+        if (!bigger) {
+            return NULL;
+        }
+        o->segments = bigger;
+        o->capacity = capacity;
+    }
+
+    return &o->segments[o->nsegments++];
+}
+
+/**
+ * Record that length bytes were appended to the output buffer at offset.
+ * @param   o           Output structure.
+ * @param   offset      Offset of bytes in buffer.
+ * @param   length      Number of bytes appended.
+ */
+void output_append(Output *o, size_t offset, size_t length) {
+    Segment *last = o->nsegments > o->first ? &o->segments[o->nsegments - 1] : NULL;
+
+    if (last && !last->payload && last->offset + last->length == offset) {
+        last->length += length;
+    } else if ((last = output_segment(o))) {
+        last->payload = NULL;
+        last->offset  = offset;
+        last->length  = length;
+    } else {
+        o->buffer.size = offset;
+        return;
+    }
+
+    o->pending += length;
+}
+
+void output_write(Output *o, const void *data, size_t length) {
+    size_t offset = o->buffer.size;
+
+    if (buffer_write(&o->buffer, data, length)) {
+        output_append(o, offset, length);
+    }
+}
+
+void output_printf(Output *o, const char *format, ...) {
+    va_list args;
+    int     length;
+
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (length < 0 || !buffer_reserve(&o->buffer, length)) {
+        return;
+    }
+
+    va_start(args, format);
+    vsnprintf(o->buffer.data + o->buffer.size, length + 1, format, args);
+    va_end(args);
+
+    o->buffer.size += length;
+    output_append(o, o->buffer.size - length, length);
+}
+
+/**
+ * Append body of payload to output: small bodies are copied, larger ones are
+ * sent straight from the payload (which is retained until then).
+ * @param   o           Output structure.
+ * @param   p           Payload structure.
+ */
+void output_payload(Output *o, Payload *p) {
+    if (p->length < COPY_THRESHOLD) {
+        output_write(o, p->body, p->length);
+        return;
+    }
+
+    Segment *segment = output_segment(o);
+    if (segment) {
+        segment->payload = payload_retain(p);
+        segment->offset  = 0;
+        segment->length  = p->length;
+        o->pending      += p->length;
+    }
+}
+
+/**
+ * Mark nbytes of output as sent, releasing payloads that are done.
+ * @param   o           Output structure.
+ * @param   nbytes      Number of bytes sent.
+ */
+void output_advance(Output *o, size_t nbytes) {
+    o->pending -= nbytes;
+
+    while (nbytes && o->first < o->nsegments) {
+        Segment *segment = &o->segments[o->first];
+        size_t   sent    = nbytes < segment->length ? nbytes : segment->length;
+
+        segment->offset += sent;
+        segment->length -= sent;
+        nbytes          -= sent;
+
+        if (!segment->length) {
+            payload_release(segment->payload);
+            o->first++;
+        }
+    }
+
+    if (o->first == o->nsegments) {
+        o->first     = 0;
+        o->nsegments = 0;
+        buffer_clear(&o->buffer);
+    }
+}
+
+/**
+ * Send as much output as possible with one writev.
+ * @param   o           Output structure.
+ * @param   fd          Socket file descriptor.
+ * @return  Number of bytes sent, otherwise -1.
+ */
+ssize_t output_send(Output *o, int fd) {
+    struct iovec iov[MAX_IOVECS];
+    int          iovcnt = 0;
+
+    for (size_t index = o->first; index < o->nsegments && iovcnt < MAX_IOVECS; index++) {
+        Segment *segment = &o->segments[index];
+        char    *base    = segment->payload ? segment->payload->body : o->buffer.data;
+
+        iov[iovcnt].iov_base = base + segment->offset;
+        iov[iovcnt].iov_len  = segment->length;
+        iovcnt++;
+    }
+
+    ssize_t nwritten = writev(fd, iov, iovcnt);
+    if (nwritten > 0) {
+        output_advance(o, nwritten);
+    }
+    return nwritten;
+}
+
+void output_delete(Output *o) {
+    for (size_t index = o->first; index < o->nsegments; index++) {
+        payload_release(o->segments[index].payload);
+    }
+
+    free(o->segments);
+    free(o->buffer.data);
+}
+
+/* Utility Functions */
+
+const char * http_reason(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Payload Too Large";
+        case 431: return "Request Header Fields Too Large";
+        default:  return "Internal Server Error";
+    }
+}
+
+/**
+ * Decode %XX escapes of URL path component in place.
+ * @param   s           String to decode.
+ */
+void url_decode(char *s) {
+    char *w = s;
+
+    for (char *r = s; *r; r++) {
+        if (r[0] == '%' && isxdigit((unsigned char)r[1]) && isxdigit((unsigned char)r[2])) {
+            char hex[3] = { r[1], r[2], 0 };
+            *w++ = strtol(hex, NULL, 16);
+            r   += 2;
+        } else {
+            *w++ = *r;
+        }
+    }
+
+    *w = 0;
+}
+
+/* Shard Functions */
+
+/**
+ * Add subscribers to count of topic on shard in the registry.
+ * @param   s           Shard structure.
+ * @param   topic       Name of topic.
+ * @param   delta       Number of subscribers added (negative if removed).
+ */
+void shard_register(Shard *s, const char *topic, long delta) {
+    Server *server = s->server;
+
+    rwlock_wrlock(&server->registry_lock);
+    size_t *counts = table_search(server->registry, topic);
+    if (!counts && (counts = calloc(server->nshards, sizeof(size_t)))) {
+        table_insert(server->registry, topic, counts);
+    }
+    if (counts) {
+        counts[s->index] += delta;
+    }
+    rwlock_unlock(&server->registry_lock);
+}
+
+bool shard_subscribe(Shard *s, const char *queue, const char *topic) {
+    if (broker_subscribed(s->broker, queue, topic)) {
+        return true;
+    }
+
+    if (!broker_subscribe(s->broker, queue, topic)) {
+        return false;
+    }
+
+    shard_register(s, topic, 1);
+    return true;
+}
+
+bool shard_unsubscribe(Shard *s, const char *queue, const char *topic) {
+    if (!broker_unsubscribe(s->broker, queue, topic)) {
+        return false;
+    }
+
+    shard_register(s, topic, -1);
+    return true;
+}
+
+/**
+ * Publish message to every queue subscribed to topic: queues on this shard
+ * get it directly, and each other shard with subscribers gets a reference to
+ * the same payload through its mailbox.
+ * @param   s           Shard structure.
+ * @param   topic       Name of topic.
+ * @param   body        Message body.
+ * @param   length      Length of message body.
+ * @return  Number of subscribers to topic (across all shards).
+ */
+size_t shard_publish(Shard *s, const char *topic, const char *body, size_t length) {
+    Server *server = s->server;
+
+    if (server->nshards == 1) {
+        return broker_publish(s->broker, topic, body, length);
+    }
+
+    size_t counts[server->nshards];
+    rwlock_rdlock(&server->registry_lock);
+    size_t *registered = table_search(server->registry, topic);
+    if (registered) {
+        memcpy(counts, registered, sizeof(counts));
+    }
+    rwlock_unlock(&server->registry_lock);
+
+    if (!registered) {
+        return 0;
+    }
+
+    Payload *p = payload_create(topic, body, length);
+    if (!p) {
+        return 0;
+    }
+
+    size_t subscribers = 0;
+    for (size_t shard = 0; shard < server->nshards; shard++) {
+        if (!counts[shard]) {
+            continue;
+        }
+        subscribers += counts[shard];
+
+        if (shard == s->index) {
+            broker_publish_payload(s->broker, p);
+            continue;
+        }
+
+        Envelope *e = malloc(sizeof(Envelope));
+        if (!e) {
+            continue;
+        }
+        e->type    = ENVELOPE_PUBLISH;
+        e->payload = payload_retain(p);
+        mailbox_send(server->shards[shard].mailbox, &e->mail);
+    }
+
+    payload_release(p);
+    return subscribers;
+}
+
+/**
+ * Find shard that owns the queue named in request URI (queues and their
+ * subscriptions are sharded by queue name).
+ * @param   s           Shard structure.
+ * @param   uri         Request URI (not NUL-terminated).
+ * @param   length      Length of request URI.
+ * @return  Shard that should handle request.
+ */
+Shard * shard_owner(Shard *s, const char *uri, size_t length) {
+    Server *server = s->server;
+    char    path[BUFSIZ];
+    char   *name;
+
+    if (server->nshards == 1) {
+        return s;
+    }
+
+    length = length < sizeof(path) ? length : sizeof(path) - 1;
+    memcpy(path, uri, length);
+    path[length] = 0;
+    path[strcspn(path, "?")] = 0;
+
+    if (strstr(path, "/topic/")) {
+        return s;
+    } else if ((name = strstr(path, "/queue/"))) {
+        name += strlen("/queue/");
+    } else if ((name = strstr(path, "/stream/"))) {
+        name += strlen("/stream/");
+    } else if ((name = strstr(path, "/subscription/"))) {
+        name += strlen("/subscription/");
+        char *topic = strrchr(name, '/');
+        if (!topic) {
+            return s;
+        }
+        *topic = 0;
+    } else {
+        return s;
+    }
+
+    url_decode(name);
+    return &server->shards[table_hash(name) % server->nshards];
+}
+
+/* Session Functions */
+
+/**
+ * Return whether session may read more input: not while it is throttled, and
+ * not once it holds more unhandled input than any one request needs, so a
+ * client cannot make the broker buffer without bound.
+ * @param   c           Session structure.
+ * @return  Whether or not to read from session socket.
+ */
+bool session_reading(Session *c) {
+    return !c->throttled && c->in.size - c->in.offset < MAX_INPUT;
+}
+
+void session_update_events(Shard *s, Session *c) {
+    int events = session_reading(c) ? EPOLLIN | EPOLLRDHUP : 0;
+
+    if (c->out.pending) {
+        events |= EPOLLOUT;
+    }
+
+    if (events != c->events) {
+        struct epoll_event event = { .events = events, .data.ptr = c };
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+        c->events = events;
+    }
+}
+
+/**
+ * Close session socket and queue it to be freed once the current event loop
+ * pass is done (other events may still refer to it).
+ * @param   s           Shard structure.
+ * @param   c           Session structure.
+ */
+void session_close(Shard *s, Session *c) {
+    if (c->closed) {
+        return;
+    }
+
+    broker_queue_unwait(&c->waiter);
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+
+    c->closed = true;
+    if (!c->pending) {
+        c->next   = s->closed;
+        s->closed = c;
+    }
+}
+
+void session_mark_pending(Shard *s, Session *c) {
+    if (c->pending || c->closed) {
+        return;
+    }
+
+    c->pending = true;
+    c->next    = NULL;
+    if (s->pending_tail) {
+        s->pending_tail->next = c;
+    } else {
+        s->pending = c;
+    }
+    s->pending_tail = c;
+}
+
+/**
+ * Write as much pending output as the socket will take.
+ * @param   s           Shard structure.
+ * @param   c           Session structure.
+ */
+void session_flush(Shard *s, Session *c) {
+    while (c->out.pending) {
+        ssize_t nwritten = output_send(&c->out, c->fd);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            session_close(s, c);
+            return;
+        }
+    }
+
+    if (!c->out.pending) {
+        if (c->closing) {
+            session_close(s, c);
+            return;
+        }
+    }
+
+    // Resume requests that were held back while too much output was pending
+    if (c->throttled && c->out.pending < MAX_PENDING_OUTPUT) {
+        session_mark_pending(s, c);
+    }
+
+    session_update_events(s, c);
+}
+
+/**
+ * Write HTTP response head to session output:
+ *
+ *  HTTP/1.1 $STATUS $REASON\r\n
+ *  Content-Type: text/html; charset=UTF-8\r\n
+ *  Content-Length: $LENGTH\r\n
+ *  \r\n
+ *
+ * @param   c           Session structure.
+ * @param   status      HTTP status code.
+ * @param   length      Length of body (negative for chunked body).
+ */
+void session_respond_head(Session *c, int status, long length) {
+    output_printf(&c->out, "HTTP/1.1 %d %s\r\nContent-Type: text/html; charset=UTF-8\r\n",
+        status, http_reason(status));
+
+    if (length < 0) {
+        output_printf(&c->out, "Transfer-Encoding: chunked\r\n");
+    } else {
+        output_printf(&c->out, "Content-Length: %ld\r\n", length);
+    }
+
+    if (!c->keepalive) {
+        output_printf(&c->out, "Connection: close\r\n");
+        c->closing = true;
+    }
+
+    output_write(&c->out, "\r\n", 2);
+}
+
+void session_respond(Session *c, int status, const char *body, size_t length) {
+    session_respond_head(c, status, length);
+    output_write(&c->out, body, length);
+}
+
+void session_respond_scratch(Shard *s, Session *c, int status) {
+    session_respond(c, status, s->scratch.data, s->scratch.size);
+}
+
+void session_respond_default(Shard *s, Session *c, int status) {
+    buffer_clear(&s->scratch);
+    buffer_printf(&s->scratch, "<html><title>%d: %s</title><body>%d: %s</body></html>",
+        status, http_reason(status), status, http_reason(status));
+    session_respond_scratch(s, c, status);
+}
+
+/**
+ * Compute size of record for message:
+ *
+ *  $TOPIC $LENGTH\n
+ *  $BODY
+ *
+ * @param   p           Payload structure.
+ * @return  Number of bytes in record.
+ */
+size_t record_size(Payload *p) {
+    size_t digits = 1;
+
+    for (size_t length = p->length; length >= 10; length /= 10) {
+        digits++;
+    }
+
+    return p->topic_length + 1 + digits + 1 + p->length;
+}
+
+void session_write_record(Session *c, Message *m) {
+    output_printf(&c->out, "%s %zu\n", m->payload->topic, m->payload->length);
+    output_payload(&c->out, m->payload);
+}
+
+/**
+ * Respond to parked (or new) retrieve with messages from its queue.
+ * @param   c           Session structure.
+ * @param   q           BrokerQueue to retrieve from.
+ * @return  Whether or not retrieve was answered.
+ */
+bool session_retrieve(Session *c, BrokerQueue *q) {
+    Message *m;
+
+    if (!q->head) {
+        return false;
+    }
+
+    if (!c->streaming && !c->max) {
+        m = broker_queue_pop(q);
+        session_respond_head(c, 200, m->payload->length);
+        output_payload(&c->out, m->payload);
+        message_delete(m);
+        return true;
+    }
+
+    // Size the records up front, since bodies are sent from the payloads
+    long   count = 0;
+    size_t size  = 0;
+    for (m = q->head; m && (c->streaming || count < c->max); m = m->next, count++) {
+        size += record_size(m->payload);
+    }
+
+    if (c->streaming) {
+        output_printf(&c->out, "%zx\r\n", size);
+    } else {
+        session_respond_head(c, 200, size);
+    }
+
+    while (count-- > 0 && (m = broker_queue_pop(q))) {
+        session_write_record(c, m);
+        message_delete(m);
+    }
+
+    if (c->streaming) {
+        output_write(&c->out, "\r\n", 2);
+    }
+    return true;
+}
+
+/**
+ * Parse record of batch at offset:
+ *
+ *  $TOPIC $LENGTH\n
+ *  $BODY
+ *
+ * @param   body        Batch of records.
+ * @param   length      Length of batch.
+ * @param   offset      Offset of record.
+ * @param   space       Where to store end of topic.
+ * @param   message     Where to store start of body.
+ * @param   nbytes      Where to store length of body.
+ * @return  Offset of next record (0 if record is invalid or truncated).
+ */
+size_t batch_record(char *body, size_t length, size_t offset, char **space, char **message, size_t *nbytes) {
+    char *record  = body + offset;
+    char *newline = memchr(record, '\n', length - offset);
+    char *end     = NULL;
+
+    *space    = newline ? memchr(record, ' ', newline - record) : NULL;
+    long size = *space ? strtol(*space + 1, &end, 10) : -1;
+    if (!*space || size < 0 || end != newline || (size_t)size > length - (newline + 1 - body)) {
+        return 0;
+    }
+
+    *message = newline + 1;
+    *nbytes  = (size_t)size;
+    return (*message - body) + *nbytes;
+}
+
+/**
+ * Publish each record of batch, writing one status line per record.  Nothing
+ * is published unless every record is whole.
+ * @param   s           Shard structure.
+ * @param   c           Session structure.
+ * @param   body        Batch of records.
+ * @param   length      Length of batch.
+ */
+void session_publish_batch(Shard *s, Session *c, char *body, size_t length) {
+    char  *space;
+    char  *message;
+    size_t nbytes;
+
+    buffer_clear(&s->scratch);
+    for (size_t offset = 0; offset < length; ) {
+        size_t next = batch_record(body, length, offset, &space, &message, &nbytes);
+        if (!next) {
+            buffer_printf(&s->scratch, "Invalid batch record at offset: %zu\n", offset);
+            session_respond_scratch(s, c, 400);
+            return;
+        }
+        offset = next;
+    }
+
+    for (size_t offset = 0; offset < length; ) {
+        char *record = body + offset;
+        offset = batch_record(body, length, offset, &space, &message, &nbytes);
+        *space = 0;
+
+        size_t subscribers = shard_publish(s, record, message, nbytes);
+        if (subscribers) {
+            buffer_printf(&s->scratch, "200 Published message (%zu bytes) to %zu subscribers of %s\n",
+                nbytes, subscribers, record);
+        } else {
+            buffer_printf(&s->scratch, "404 There are no subscribers for topic: %s\n", record);
+        }
+    }
+
+    session_respond_scratch(s, c, 200);
+}
+
+/**
+ * Dispatch one HTTP request to its route:
+ *
+ *  PUT     /topic/$topic
+ *  PUT     /batch
+ *  GET     /queue/$queue[?max=$n]
+ *  GET     /stream/$queue
+ *  PUT     /subscription/$queue/$topic
+ *  DELETE  /subscription/$queue/$topic
+ *
+ * @param   s           Shard structure.
+ * @param   c           Session structure.
+ * @param   method      Request method.
+ * @param   path        Request path (modified in place).
+ * @param   query       Request query string (may be NULL).
+ * @param   body        Request body.
+ * @param   length      Length of request body.
+ */
+void session_dispatch(Shard *s, Session *c, const char *method, char *path, char *query, char *body, size_t length) {
+    char *argument;
+
+    if ((argument = strstr(path, "/topic/"))) {
+        if (!streq(method, "PUT")) {
+            session_respond_default(s, c, 405);
+            return;
+        }
+
+        argument += strlen("/topic/");
+        url_decode(argument);
+
+        size_t subscribers = shard_publish(s, argument, body, length);
+        buffer_clear(&s->scratch);
+        if (subscribers) {
+            buffer_printf(&s->scratch, "Published message (%zu bytes) to %zu subscribers of %s\n",
+                length, subscribers, argument);
+            session_respond_scratch(s, c, 200);
+        } else {
+            buffer_printf(&s->scratch, "There are no subscribers for topic: %s\n", argument);
+            session_respond_scratch(s, c, 404);
+        }
+    } else if (streq(path, "/batch")) {
+        if (!streq(method, "PUT")) {
+            session_respond_default(s, c, 405);
+            return;
+        }
+
+        session_publish_batch(s, c, body, length);
+    } else if ((argument = strstr(path, "/queue/")) || (argument = strstr(path, "/stream/"))) {
+        if (!streq(method, "GET")) {
+            session_respond_default(s, c, 405);
+            return;
+        }
+
+        c->streaming = (argument[1] == 's');
+        c->max       = 0;
+        argument    += c->streaming ? strlen("/stream/") : strlen("/queue/");
+        url_decode(argument);
+
+        BrokerQueue *q = broker_queue(s->broker, argument);
+        buffer_clear(&s->scratch);
+        if (!q) {
+            buffer_printf(&s->scratch, "There is no queue named: %s\n", argument);
+            session_respond_scratch(s, c, 404);
+            return;
+        }
+
+        for (char *parameter = query; parameter; parameter = strchr(parameter, '&')) {
+            if (*parameter == '&') {
+                parameter++;
+            }
+            if (strncmp(parameter, "max=", 4) == 0) {
+                char *value = parameter + 4;
+                char *end   = NULL;
+                c->max      = strtol(value, &end, 10);
+                if (end == value || (*end && *end != '&') || c->max < 0) {
+                    value[strcspn(value, "&")] = 0;
+                    buffer_printf(&s->scratch, "Invalid max: %s\n", value);
+                    session_respond_scratch(s, c, 400);
+                    return;
+                }
+            }
+        }
+
+        if (c->streaming) {
+            session_respond_head(c, 200, -1);
+            session_retrieve(c, q);
+        } else if (session_retrieve(c, q)) {
+            return;
+        }
+
+        // Park until a publish to the queue wakes us up
+        broker_queue_wait(q, &c->waiter);
+    } else if ((argument = strstr(path, "/subscription/"))) {
+        argument   += strlen("/subscription/");
+        char *topic = strrchr(argument, '/');
+        if (!topic) {
+            session_respond_default(s, c, 404);
+            return;
+        }
+        *topic++ = 0;
+        url_decode(argument);
+        url_decode(topic);
+
+        buffer_clear(&s->scratch);
+        if (streq(method, "PUT")) {
+            if (shard_subscribe(s, argument, topic)) {
+                buffer_printf(&s->scratch, "Subscribed queue (%s) to topic (%s)\n", argument, topic);
+                session_respond_scratch(s, c, 200);
+            } else {
+                buffer_printf(&s->scratch, "There is no queue named: %s\n", argument);
+                session_respond_scratch(s, c, 404);
+            }
+        } else if (streq(method, "DELETE")) {
+            if (shard_unsubscribe(s, argument, topic)) {
+                buffer_printf(&s->scratch, "Unsubscribed queue (%s) from topic (%s)\n", argument, topic);
+                session_respond_scratch(s, c, 200);
+            } else {
+                buffer_printf(&s->scratch, "There is no queue named: %s\n", argument);
+                session_respond_scratch(s, c, 404);
+            }
+        } else {
+            session_respond_default(s, c, 405);
+        }
+    } else {
+        session_respond_default(s, c, 404);
+    }
+}
+
+/**
+ * Handle each complete request in session input (in order) until input runs
+ * out, a retrieve has to wait, or too much output is pending.
+ * @param   s           Shard structure.
+ * @param   c           Session structure.
+ */
+void session_process(Shard *s, Session *c) {
+    // Answer parked retrieve first if its queue has messages now
+    if (c->waiter.queue) {
+        BrokerQueue *q = c->waiter.queue;
+        if (!session_retrieve(c, q) || c->streaming) {
+            return;
+        }
+        broker_queue_unwait(&c->waiter);
+    }
+
+    while (!c->closing && !c->waiter.queue && !c->migrate) {
+        if ((c->throttled = (c->out.pending >= MAX_PENDING_OUTPUT))) {
+            break;
+        }
+
+        char  *head   = c->in.data + c->in.offset;
+        size_t nbytes = c->in.size - c->in.offset;
+        char  *end    = nbytes ? strstr(head, "\r\n\r\n") : NULL;
+
+        if (!end) {
+            if (nbytes > MAX_HEAD) {
+                c->keepalive = false;
+                session_respond_default(s, c, 431);
+            }
+            break;
+        }
+        // Parse request line: $METHOD $URI HTTP/1.$MINOR
+        char *line    = strstr(head, "\r\n");
+        char *uri     = memchr(head, ' ', line - head);
+        char *version = uri ? memchr(uri + 1, ' ', line - uri - 1) : NULL;
+        if (!version) {
+            c->keepalive = false;
+            session_respond_default(s, c, 400);
+            break;
+        }
+        bool keepalive = (strncmp(version + 1, "HTTP/1.0", 8) != 0);
+
+        // Parse headers (in place, since the body may not have arrived yet)
+        long length = 0;
+        for (char *header = line + 2; header < end; header = strstr(header, "\r\n") + 2) {
+            char *value = header + strcspn(header, ":\r");
+            if (*value != ':') {
+                continue;
+            }
+            value += 1 + strspn(value + 1, " \t");
+
+            if (strncasecmp(header, "Content-Length:", 15) == 0) {
+                // Only plain digits (overflow is caught as too large below)
+                char *digits = value;
+                length = (*value >= '0' && *value <= '9') ? strtol(value, &digits, 10) : -1;
+                if (digits[strspn(digits, " \t")] != '\r') {
+                    length = -1;
+                }
+            } else if (strncasecmp(header, "Connection:", 11) == 0) {
+                if (strncasecmp(value, "close", 5) == 0) {
+                    keepalive = false;
+                } else if (strncasecmp(value, "keep-alive", 10) == 0) {
+                    keepalive = true;
+                }
+            }
+        }
+
+        if (length < 0) {
+            c->keepalive = false;
+            session_respond_default(s, c, 400);
+            break;
+        }
+        if (length > MAX_BODY) {
+            c->keepalive = false;
+            session_respond_default(s, c, 413);
+            break;
+        }
+
+        // Wait for the rest of the body
+        size_t head_length = (end + 4) - head;
+        if (nbytes < head_length + length) {
+            if (!buffer_reserve(&c->in, head_length + length - nbytes)) {
+                session_close(s, c);
+            }
+            break;
+        }
+
+        // Hand session to the shard that owns the queue (request and all)
+        Shard *owner = shard_owner(s, uri + 1, version - uri - 1);
+        if (owner != s) {
+            c->migrate = owner;
+            break;
+        }
+
+        c->keepalive = keepalive;
+        *uri++       = 0;
+        *version     = 0;
+
+        char *body  = head + head_length;
+        char *query = strchr(uri, '?');
+        if (query) {
+            *query++ = 0;
+        }
+
+        c->in.offset += head_length + length;
+
+        // Body is followed by the next request, so copy out what we need
+        char saved = body[length];
+        body[length] = 0;
+        session_dispatch(s, c, head, uri, query, body, length);
+        body[length] = saved;
+    }
+
+    if (c->in.offset == c->in.size) {
+        buffer_clear(&c->in);
+    }
+}
+
+/**
+ * Read everything available from session socket (while it may read, see
+ * session_reading).
+ * @param   s           Shard structure.
+ * @param   c           Session structure.
+ * @return  Whether or not the session is still open.
+ */
+bool session_read(Shard *s, Session *c) {
+    while (session_reading(c)) {
+        if (!buffer_reserve(&c->in, READ_SIZE)) {
+            session_close(s, c);
+            return false;
+        }
+
+        ssize_t nread = read(c->fd, c->in.data + c->in.size, c->in.capacity - c->in.size - 1);
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            session_close(s, c);
+            return false;
+        }
+        if (nread == 0) {
+            session_close(s, c);
+            return false;
+        }
+
+        c->in.size += nread;
+        c->in.data[c->in.size] = 0;
+    }
+
+    return true;
+}
+
+/* Event Loop Functions */
+
+/**
+ * Wake every retrieve waiting on queue (called by broker on publish).
+ * @param   q           BrokerQueue that has a new message.
+ * @param   arg         Shard structure.
+ */
+void shard_notify(BrokerQueue *q, void *arg) {
+    for (Waiter *w = q->waiters; w; w = w->next) {
+        session_mark_pending(arg, (Session *)w);
+    }
+}
+
+/**
+ * Hand session over to the shard that owns the queue of its next request.
+ * @param   s           Shard structure.
+ * @param   c           Session structure.
+ */
+void shard_migrate(Shard *s, Session *c) {
+    Envelope *e = calloc(1, sizeof(Envelope));
+    if (!e) {
+        session_close(s, c);
+        return;
+    }
+
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    e->type    = ENVELOPE_SESSION;
+    e->session = c;
+    mailbox_send(c->migrate->mailbox, &e->mail);
+}
+
+/**
+ * Take in sessions and publishes sent by other shards.
+ * @param   s           Shard structure.
+ */
+void shard_receive(Shard *s) {
+    Mail *mail = mailbox_receive(s->mailbox);
+
+    while (mail) {
+        Envelope *e = (Envelope *)mail;
+        mail = mail->next;
+
+        if (e->type == ENVELOPE_PUBLISH) {
+            broker_publish_payload(s->broker, e->payload);
+            payload_release(e->payload);
+        } else {
+            Session *c = e->session;
+            c->migrate = NULL;
+            c->events  = EPOLLIN | EPOLLRDHUP;
+
+            struct epoll_event event = { .events = c->events, .data.ptr = c };
+            if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+                error("Unable to add socket to epoll: %s", strerror(errno));
+                close(c->fd);
+                c->closed = true;
+                c->next   = s->closed;
+                s->closed = c;
+            } else {
+                session_mark_pending(s, c);
+            }
+        }
+
+        free(e);
+    }
+}
+
+/**
+ * Process and flush each session that has work to do, including sessions
+ * woken up while doing so.
+ * @param   s           Shard structure.
+ */
+void shard_drain(Shard *s) {
+    while (s->pending) {
+        Session *c = s->pending;
+        s->pending = c->next;
+        if (!s->pending) {
+            s->pending_tail = NULL;
+        }
+
+        c->pending = false;
+        if (c->closed) {
+            c->next   = s->closed;
+            s->closed = c;
+            continue;
+        }
+
+        session_process(s, c);
+        if (c->migrate && !c->closed) {
+            shard_migrate(s, c);
+            continue;
+        }
+        session_flush(s, c);
+    }
+
+    while (s->closed) {
+        Session *c = s->closed;
+        s->closed  = c->next;
+        free(c->in.data);
+        output_delete(&c->out);
+        free(c);
+    }
+}
+
+void shard_accept(Shard *s) {
+    while (true) {
+        int fd = accept(s->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                error("Unable to accept: %s", strerror(errno));
+            }
+            return;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        if (!s->server->unix_path) {
+            int nodelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        }
+
+        Session *c = calloc(1, sizeof(Session));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd     = fd;
+        c->events = EPOLLIN | EPOLLRDHUP;
+
+        struct epoll_event event = { .events = c->events, .data.ptr = c };
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            error("Unable to add socket to epoll: %s", strerror(errno));
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+/**
+ * Run event loop of shard forever.
+ * @param   arg         Shard structure.
+ * @return  NULL (only if epoll fails).
+ */
+void * shard_run(void *arg) {
+    Shard *s = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    // Keep each event loop on its own core
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(s->index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    while (true) {
+        int nevents = epoll_wait(s->epoll_fd, events, MAX_EVENTS, -1);
+        if (nevents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error("Unable to wait for events: %s", strerror(errno));
+            return NULL;
+        }
+
+        for (int e = 0; e < nevents; e++) {
+            Session *c = events[e].data.ptr;
+            if (!c) {
+                shard_accept(s);
+                continue;
+            }
+            if (events[e].data.ptr == s->mailbox) {
+                shard_receive(s);
+                continue;
+            }
+            if (c->closed) {
+                continue;
+            }
+
+            if (events[e].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                // A hangup is reported even while we do not read, and reading
+                // is what would notice it
+                if (!session_reading(c) && (events[e].events & (EPOLLHUP | EPOLLERR))) {
+                    session_close(s, c);
+                    continue;
+                }
+                if (!session_read(s, c)) {
+                    continue;
+                }
+            }
+
+            session_mark_pending(s, c);
+        }
+
+        shard_drain(s);
+    }
+
+    return NULL;
+}
+
+/* Server Functions */
+
+/**
+ * Allocate non-blocking socket listening on Unix domain socket path.  A
+ * socket already at path is only replaced when connecting to it is refused
+ * (a stale socket a previous server left there); one that still accepts
+ * connections belongs to a running server, so fail with EADDRINUSE instead.
+ * @param   path        Path of socket to listen on.
+ * @return  Socket file descriptor if successful, otherwise -1.
+ */
+int server_listen_unix(const char *path) {
+    struct sockaddr_un address;
+    int socket_fd = -1;
+
+    if (!socket_unix_address(&address, path) ||
+        (socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        error("Unable to listen on %s%s: %s", SOCKET_UNIX_PREFIX, path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int status   = (probe_fd >= 0 && connect(probe_fd, (struct sockaddr *)&address, sizeof(address)) == 0) ? 0 : errno;
+        if (probe_fd >= 0) {
+            close(probe_fd);
+        }
+
+        if (status != ECONNREFUSED) {
+            error("Unable to listen on %s%s: %s", SOCKET_UNIX_PREFIX, path, strerror(EADDRINUSE));
+            close(socket_fd);
+            errno = EADDRINUSE;
+            return -1;
+        }
+        unlink(path);
+    }
+
+    if (bind(socket_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(socket_fd, SOMAXCONN) < 0) {
+        error("Unable to listen on %s%s: %s", SOCKET_UNIX_PREFIX, path, strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+/**
+ * Allocate non-blocking socket listening on address (or unix:/path) and port.
+ * @param   address     Address to listen on.
+ * @param   port        Port to listen on.
+ * @param   reuseport   Whether other sockets may listen on the same port.
+ * @return  Socket file descriptor if successful, otherwise -1.
+ */
+int server_listen(const char *address, const char *port, bool reuseport) {
+    const char *path = socket_unix_path(address);
+    if (path) {
+        return server_listen_unix(path);
+    }
+
+    struct addrinfo *results;
+    struct addrinfo  hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags    = AI_PASSIVE,
+    };
+    int status;
+    if ((status = getaddrinfo(address, port, &hints, &results)) != 0) {
+        error("Unable to resolve %s:%s: %s", address, port, gai_strerror(status));
+        return -1;
+    }
+
+    int socket_fd = -1;
+    for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
+        if ((socket_fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol)) < 0) {
+            continue;
+        }
+
+        int reuse = 1;
+        setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (reuseport) {
+            setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+        }
+
+        if (bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0 || listen(socket_fd, SOMAXCONN) < 0) {
+            close(socket_fd);
+            socket_fd = -1;
+        }
+    }
+
+    freeaddrinfo(results);
+
+    if (socket_fd < 0) {
+        error("Unable to listen on %s:%s: %s", address, port, strerror(errno));
+    }
+    return socket_fd;
+}
+
+/**
+ * Create each shard: its own listening socket (the kernel spreads incoming
+ * connections across them), event loop, mailbox, and broker.  Unix domain
+ * sockets cannot share a path, so shards share one listening socket instead
+ * and each connection wakes only one of them.
+ * @param   server      Server structure.
+ * @param   address     Address to listen on.
+ * @param   port        Port to listen on.
+ * @return  Whether or not every shard was created.
+ */
+bool server_create_shards(Server *server, const char *address, const char *port) {
+    server->shards   = calloc(server->nshards, sizeof(Shard));
+    server->registry = table_create(0);
+    if (!server->shards || !server->registry) {
+        return false;
+    }
+    rwlock_init(&server->registry_lock, NULL);
+
+    server->unix_path = socket_unix_path(address) != NULL;
+
+    for (size_t index = 0; index < server->nshards; index++) {
+        Shard *s  = &server->shards[index];
+        s->server = server;
+        s->index  = index;
+
+        if (server->unix_path && index > 0) {
+            s->listen_fd = server->shards[0].listen_fd;
+        } else if ((s->listen_fd = server_listen(address, port, server->nshards > 1)) < 0) {
+            return false;
+        }
+
+        if ((s->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            error("Unable to create epoll: %s", strerror(errno));
+            return false;
+        }
+
+        if (!(s->mailbox = mailbox_create()) || !(s->broker = broker_create())) {
+            return false;
+        }
+        s->broker->notify = shard_notify;
+        s->broker->arg    = s;
+
+        struct epoll_event listener = { .events = EPOLLIN | (server->unix_path ? EPOLLEXCLUSIVE : 0), .data.ptr = NULL };
+        struct epoll_event mailbox  = { .events = EPOLLIN, .data.ptr = s->mailbox };
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &listener);
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->mailbox->fd, &mailbox);
+    }
+
+    return true;
+}
+
+/* Main execution */
+
+void usage(const char *program, int status) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "    --address=ADDRESS   Address (or unix:/path) to listen on (default: %s)\n", DEFAULT_ADDRESS);
+    fprintf(stderr, "    --port=PORT         Port to listen on (default: %s)\n", DEFAULT_PORT);
+    fprintf(stderr, "    --threads=N         Number of event loops (default: number of cores)\n");
+    exit(status);
+}
+
+int main(int argc, char *argv[]) {
+    const char *address = DEFAULT_ADDRESS;
+    const char *port    = DEFAULT_PORT;
+    Server      server  = {
+        .nshards = sysconf(_SC_NPROCESSORS_ONLN),
+    };
+
+    for (int argind = 1; argind < argc; argind++) {
+        char *arg = argv[argind];
+        if (strncmp(arg, "--address=", 10) == 0) {
+            address = arg + 10;
+        } else if (strncmp(arg, "--port=", 7) == 0) {
+            port = arg + 7;
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            server.nshards = strtoul(arg + 10, NULL, 10);
+        } else if (streq(arg, "-h") || streq(arg, "--help")) {
+            usage(argv[0], EXIT_SUCCESS);
+        } else {
+            usage(argv[0], EXIT_FAILURE);
+        }
+    }
+
+    if (server.nshards < 1) {
+        server.nshards = 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!server_create_shards(&server, address, port)) {
+        return EXIT_FAILURE;
+    }
+
+    if (server.unix_path) {
+        info("Listening on %s with %lu event loops", address, server.nshards);
+    } else {
+        info("Listening on %s:%s with %lu event loops", address, port, server.nshards);
+    }
+    for (size_t index = 1; index < server.nshards; index++) {
+        thread_create(&server.shards[index].thread, NULL, shard_run, &server.shards[index]);
+    }
+    shard_run(&server.shards[0]);
+
+    return EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -2,64 +2,520 @@
 
 #include "mq/logging.h"
 #include "mq/socket.h"
+#include "mq/string.h"
+#include "mq/thread.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+/* Internal Structures */
+
+typedef struct SocketCache SocketCache;
+struct SocketCache {
+    char          host[NI_MAXHOST];
+    char          port[NI_MAXSERV];
+    SocketAddress addresses[SOCKET_ADDRESSES];
+    size_t        naddresses;
+    size_t        preferred;		// Address to try first
+    int64_t       expires;		// When to look up again (monotonic ms)
+    SocketCache * next;
+};
+
+/* Globals */
+
+static SocketCache *Cache     = NULL;	// Resolved addresses of each host and port
+static Mutex        CacheLock = PTHREAD_MUTEX_INITIALIZER;
+static int          CacheTTL  = SOCKET_CACHE_TTL;
+static size_t       Lookups   = 0;
+
+/* Internal Functions */
+
 /**
- * Create socket connection to specified host and port.
- * @param   host    Host string to connect to.
- * @param   port    Port string to connect to.
- * @return  Socket file stream of connection if successful, otherwise NULL.
+ * Return path of Unix domain socket if host is a unix:/path endpoint.
+ * @param   host    Host string.
+ * @return  Path of socket (NULL if host is not a Unix endpoint).
+ */
+const char * socket_unix_path(const char *host) {
+    return strncmp(host, SOCKET_UNIX_PREFIX, strlen(SOCKET_UNIX_PREFIX)) == 0 ? host + strlen(SOCKET_UNIX_PREFIX) : NULL;
+}
+
+/**
+ * Fill in Unix domain socket address for path.
+ * @param   address Address structure.
+ * @param   path    Path of socket.
+ * @return  Whether or not path fits in the address.
+ */
+bool    socket_unix_address(struct sockaddr_un *address, const char *path) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+/**
+ * Format value of the HTTP Host header for host and port: host:port, with
+ * brackets around an IPv6 address, or localhost for a unix:/path endpoint.
+ * @param   host        Host string.
+ * @param   port        Port string (may be empty).
+ * @param   buffer      Where to store value.
+ * @param   size        Size of buffer (SOCKET_AUTHORITY fits any value).
+ */
+void    socket_authority(const char *host, const char *port, char *buffer, size_t size) {
+    if (socket_unix_path(host)) {
+        snprintf(buffer, size, "localhost");
+    } else if (strchr(host, ':')) {
+        snprintf(buffer, size, "[%s]%s%s", host, port[0] ? ":" : "", port);
+    } else {
+        snprintf(buffer, size, "%s%s%s", host, port[0] ? ":" : "", port);
+    }
+}
+
+/**
+ * Split endpoint into host and port: host:port, [address]:port for IPv6, or
+ * unix:/path (which is kept whole as host, with an empty port).
+ * @param   endpoint    Endpoint string.
+ * @param   host        Where to store host.
+ * @param   hostlen     Size of host.
+ * @param   port        Where to store port.
+ * @param   portlen     Size of port.
+ * @return  Whether or not endpoint has both a host and port that fit.
  */
-FILE *  socket_connect(const char *host, const char *port) {
-    /* Lookup server address information */
+bool    socket_endpoint(const char *endpoint, char *host, size_t hostlen, char *port, size_t portlen) {
+    if (socket_unix_path(endpoint)) {
+        return snprintf(host, hostlen, "%s", endpoint) < (int)hostlen &&
+               snprintf(port, portlen, "%s", "") < (int)portlen;
+    }
+
+    const char *colon = strrchr(endpoint, ':');
+    if (!colon || colon == endpoint || !colon[1]) {
+        return false;
+    }
+
+    /* Brackets only surround an IPv6 address */
+    const char *start = endpoint;
+    const char *end   = colon;
+    if (*start == '[' && end[-1] == ']') {
+        start++;
+        end--;
+    }
+
+    return end > start &&
+           snprintf(host, hostlen, "%.*s", (int)(end - start), start) < (int)hostlen &&
+           snprintf(port, portlen, "%s", colon + 1) < (int)portlen;
+}
+
+/**
+ * Create Unix domain socket connection to specified path (which completes
+ * or fails at once, even without blocking).
+ * @param   path    Path of socket to connect to.
+ * @param   flags   Socket type flags.
+ * @return  Socket file descriptor of connection if successful, otherwise -1.
+ */
+static int socket_open_unix(const char *path, int flags) {
+    struct sockaddr_un address;
+    int socket_fd = -1;
+
+    if (socket_unix_address(&address, path) &&
+        (socket_fd = socket(AF_UNIX, SOCK_STREAM | flags, 0)) >= 0 &&
+        connect(socket_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(socket_fd);
+        socket_fd = -1;
+    }
+
+    if (socket_fd < 0) {
+        error_limited("Unable to connect to %s%s: %s", SOCKET_UNIX_PREFIX, path, strerror(errno));
+    }
+    return socket_fd;
+}
+
+/**
+ * Return milliseconds on the monotonic clock.
+ */
+static int64_t socket_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/**
+ * Find cached entry for host and port (call with CacheLock held).
+ * @param   host    Host string.
+ * @param   port    Port string.
+ * @return  Cache entry (NULL if there is none).
+ */
+static SocketCache * socket_cache_find(const char *host, const char *port) {
+    for (SocketCache *e = Cache; e; e = e->next) {
+        if (streq(e->host, host) && streq(e->port, port)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Copy addresses of cache entry, starting with the preferred one (call with
+ * CacheLock held).
+ * @param   e           Cache entry.
+ * @param   addresses   Array to store addresses in.
+ * @param   max         Size of array.
+ * @return  Number of addresses stored.
+ */
+static size_t socket_cache_copy(SocketCache *e, SocketAddress *addresses, size_t max) {
+    size_t n = e->naddresses < max ? e->naddresses : max;
+    for (size_t i = 0; i < n; i++) {
+        addresses[i] = e->addresses[(e->preferred + i) % e->naddresses];
+    }
+    return n;
+}
+
+/**
+ * Look up addresses of host and port with getaddrinfo, ordered so that
+ * address families alternate (starting with the first one returned) as in
+ * Happy Eyeballs (RFC 8305).
+ * @param   host        Host string.
+ * @param   port        Port string.
+ * @param   addresses   Array to store addresses in.
+ * @param   max         Size of array.
+ * @return  Number of addresses stored (0 if host could not be resolved).
+ */
+static size_t socket_lookup(const char *host, const char *port, SocketAddress *addresses, size_t max) {
     struct addrinfo *results;
     struct addrinfo  hints = {
-	     .ai_family   = AF_UNSPEC,   /* Return IPv4 and IPv6 choices */
-  	   .ai_socktype = SOCK_STREAM, /* Use TCP */
+        .ai_family   = AF_UNSPEC,   /* Return IPv4 and IPv6 choices */
+        .ai_socktype = SOCK_STREAM, /* Use TCP */
     };
     int status;
+
+    __atomic_add_fetch(&Lookups, 1, __ATOMIC_RELAXED);
     if ((status = getaddrinfo(host, port, &hints, &results)) != 0) {
-        error("Unable to resolve %s:%s: %s", host, port, gai_strerror(status));
-        return NULL;
+        error_limited("Unable to resolve %s:%s: %s", host, port, gai_strerror(status));
+        return 0;
     }
 
-    /* For each server entry, allocate socket and try to connect */
-    int socket_fd = -1;
-    for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
-        /* Allocate socket */
-        if ((socket_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
-            error("Unable to make socket: %s", strerror(errno));
+    /* Take the first family and the others in turns */
+    struct addrinfo *first[SOCKET_ADDRESSES], *other[SOCKET_ADDRESSES];
+    size_t nfirst = 0, nother = 0;
+    for (struct addrinfo *p = results; p; p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage)) {
             continue;
         }
+        if (p->ai_family == results->ai_family && nfirst < SOCKET_ADDRESSES) {
+            first[nfirst++] = p;
+        } else if (p->ai_family != results->ai_family && nother < SOCKET_ADDRESSES) {
+            other[nother++] = p;
+        }
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; n < max && (i < nfirst || i < nother); i++) {
+        struct addrinfo *pair[] = { i < nfirst ? first[i] : NULL, i < nother ? other[i] : NULL };
+        for (size_t j = 0; j < 2 && n < max; j++) {
+            if (pair[j]) {
+                memcpy(&addresses[n].address, pair[j]->ai_addr, pair[j]->ai_addrlen);
+                addresses[n].length = pair[j]->ai_addrlen;
+                n++;
+            }
+        }
+    }
+
+    freeaddrinfo(results);
+    return n;
+}
+
+/**
+ * Create socket connection to specified host and port (or to the Unix
+ * domain socket named by a unix:/path host, ignoring port).
+ * @param   host    Host string to connect to.
+ * @param   port    Port string to connect to.
+ * @param   flags   Socket type flags (SOCK_NONBLOCK starts the connection
+ *                  to the preferred address without waiting for it, while
+ *                  otherwise every address is raced).
+ * @return  Socket file descriptor of connection if successful, otherwise -1.
+ */
+static int socket_open(const char *host, const char *port, int flags) {
+    const char *path = socket_unix_path(host);
+    if (path) {
+        return socket_open_unix(path, flags);
+    }
+
+    SocketAddress addresses[SOCKET_ADDRESSES];
+    size_t        naddresses = socket_resolve(host, port, addresses, SOCKET_ADDRESSES);
+    if (!naddresses) {
+        return -1;
+    }
 
-        /* Connect to host */
-        if (connect(socket_fd, p->ai_addr, p->ai_addrlen) < 0) {
+    int socket_fd = -1;
+    if (flags & SOCK_NONBLOCK) {
+        /* Start connecting (the caller reports a failure with socket_failed) */
+        SocketAddress *a = &addresses[0];
+        if ((socket_fd = socket(a->address.ss_family, SOCK_STREAM | flags, 0)) >= 0 &&
+            connect(socket_fd, (struct sockaddr *)&a->address, a->length) < 0 && errno != EINPROGRESS) {
             close(socket_fd);
             socket_fd = -1;
+        }
+    } else {
+        /* Race addresses and remember which one won */
+        size_t winner;
+        if ((socket_fd = socket_race(addresses, naddresses, SOCKET_CONNECT_TIMEOUT, &winner)) >= 0) {
+            fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) & ~O_NONBLOCK);
+            socket_prefer(host, port, &addresses[winner]);
+        }
+    }
+
+    if (socket_fd < 0) {
+        error_limited("Unable to connect to %s:%s: %s", host, port, strerror(errno));
+        if (flags & SOCK_NONBLOCK) {
+            socket_failed(host, port);
+        }
+        return -1;
+    }
+
+    /* Send small requests immediately on persistent connections */
+    int nodelay = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    return socket_fd;
+}
+
+/**
+ * Create socket connection to specified host and port.
+ * @param   host    Host string to connect to.
+ * @param   port    Port string to connect to.
+ * @return  Socket file descriptor of connection if successful, otherwise -1.
+ */
+int     socket_connect(const char *host, const char *port) {
+    return socket_open(host, port, 0);
+}
+
+/**
+ * Start non-blocking socket connection to specified host and port.  The
+ * socket becomes writable once connected; SO_ERROR then tells whether the
+ * connection succeeded.
+ * @param   host    Host string to connect to.
+ * @param   port    Port string to connect to.
+ * @return  Socket file descriptor of connection if successful, otherwise -1.
+ */
+int     socket_connect_nonblocking(const char *host, const char *port) {
+    return socket_open(host, port, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+/**
+ * Resolve host and port, reusing addresses looked up within the last
+ * CacheTTL milliseconds (so reconnecting needs no name service lookup).
+ * @param   host        Host string.
+ * @param   port        Port string.
+ * @param   addresses   Array to store addresses in (preferred one first).
+ * @param   max         Size of array.
+ * @return  Number of addresses stored (0 if host could not be resolved).
+ */
+size_t  socket_resolve(const char *host, const char *port, SocketAddress *addresses, size_t max) {
+    int64_t now = socket_now();
+    size_t  n   = 0;
+
+    mutex_lock(&CacheLock);
+    SocketCache *e = socket_cache_find(host, port);
+    if (e && now < e->expires) {
+        n = socket_cache_copy(e, addresses, max);
+    }
+    mutex_unlock(&CacheLock);
+    if (n) {
+        return n;
+    }
+
+    /* Look up outside the lock so other hosts are not held up */
+    SocketAddress found[SOCKET_ADDRESSES];
+    size_t        nfound = socket_lookup(host, port, found, SOCKET_ADDRESSES);
+    if (!nfound) {
+        return 0;
+    }
+
+    mutex_lock(&CacheLock);
+    if (!(e = socket_cache_find(host, port)) && (e = calloc(1, sizeof(SocketCache)))) {
+        snprintf(e->host, sizeof(e->host), "%s", host);
+        snprintf(e->port, sizeof(e->port), "%s", port);
+        e->next = Cache;
+        Cache   = e;
+    }
+    if (e) {
+        memcpy(e->addresses, found, nfound * sizeof(SocketAddress));
+        e->naddresses = nfound;
+        e->preferred  = 0;
+        e->expires    = socket_now() + CacheTTL;
+    }
+    mutex_unlock(&CacheLock);
+
+    n = nfound < max ? nfound : max;
+    memcpy(addresses, found, n * sizeof(SocketAddress));
+    return n;
+}
+
+/**
+ * Connect to the first of addresses that answers, Happy Eyeballs style:
+ * each attempt gets SOCKET_ATTEMPT_DELAY milliseconds before the next one is
+ * started alongside it (or at once if it fails), and the first to connect
+ * wins.
+ * @param   addresses   Addresses to try (in order).
+ * @param   naddresses  Number of addresses.
+ * @param   timeout     Milliseconds to wait for any to connect.
+ * @param   winner      Where to store index of address that connected.
+ * @return  Non-blocking socket file descriptor if successful, otherwise -1
+ *          (with errno of the last failure, or ETIMEDOUT).
+ */
+int     socket_race(const SocketAddress *addresses, size_t naddresses, int timeout, size_t *winner) {
+    struct pollfd attempts[SOCKET_ADDRESSES];
+    size_t        started  = 0;
+    int           failure  = ECONNREFUSED;
+    int           socket_fd = -1;
+    int64_t       deadline = socket_now() + timeout;
+    int64_t       next     = 0;
+
+    naddresses = naddresses < SOCKET_ADDRESSES ? naddresses : SOCKET_ADDRESSES;
+    while (socket_fd < 0) {
+        int64_t now     = socket_now();
+        size_t  pending = 0;
+        for (size_t i = 0; i < started; i++) {
+            pending += attempts[i].fd >= 0;
+        }
+
+        /* Start next attempt once the previous one has had its head start */
+        if (started < naddresses && (now >= next || !pending)) {
+            const SocketAddress *a  = &addresses[started];
+            int                  fd = socket(a->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+            attempts[started] = (struct pollfd) { .fd = -1, .events = POLLOUT };
+            if (fd >= 0 && connect(fd, (struct sockaddr *)&a->address, a->length) == 0) {
+                socket_fd = fd;
+                *winner   = started;
+            } else if (fd >= 0 && errno == EINPROGRESS) {
+                attempts[started].fd = fd;
+                next = now + SOCKET_ATTEMPT_DELAY;
+            } else {
+                failure = errno;
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+            started++;
             continue;
         }
+
+        if (!pending) {
+            errno = failure;
+            return -1;
+        }
+        if (now >= deadline) {
+            failure = ETIMEDOUT;
+            break;
+        }
+
+        int64_t until = started < naddresses && next < deadline ? next : deadline;
+        if (poll(attempts, started, until - now) < 0 && errno != EINTR) {
+            failure = errno;
+            break;
+        }
+
+        for (size_t i = 0; i < started && socket_fd < 0; i++) {
+            if (attempts[i].fd < 0 || !attempts[i].revents) {
+                continue;
+            }
+
+            int       status = 0;
+            socklen_t size   = sizeof(status);
+            getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &status, &size);
+            if (status) {
+                /* Failed attempts hand over to the next one at once */
+                failure = status;
+                close(attempts[i].fd);
+                attempts[i].fd = -1;
+                next = 0;
+            } else {
+                socket_fd      = attempts[i].fd;
+                attempts[i].fd = -1;
+                *winner        = i;
+            }
+        }
     }
 
-    /* Release allocate address information */
-    freeaddrinfo(results);
+    /* Abandon the attempts that lost */
+    for (size_t i = 0; i < started; i++) {
+        if (attempts[i].fd >= 0) {
+            close(attempts[i].fd);
+        }
+    }
 
     if (socket_fd < 0) {
-        error("Unable to connect to %s:%s: %s", host, port, strerror(errno));
-        return NULL;
+        errno = failure;
     }
+    return socket_fd;
+}
 
-    /* Make file stream */
-    FILE *fs = fdopen(socket_fd, "r+");
-    if (!fs) {
-        error("Unable to make file stream: %s", strerror(errno));
-        close(socket_fd);
+/**
+ * Make address the first one tried for host and port from now on.
+ * @param   host    Host string.
+ * @param   port    Port string.
+ * @param   address Address that connected.
+ */
+void    socket_prefer(const char *host, const char *port, const SocketAddress *address) {
+    mutex_lock(&CacheLock);
+    SocketCache *e = socket_cache_find(host, port);
+    for (size_t i = 0; e && i < e->naddresses; i++) {
+        if (e->addresses[i].length == address->length &&
+            memcmp(&e->addresses[i].address, &address->address, address->length) == 0) {
+            e->preferred = i;
+            break;
+        }
+    }
+    mutex_unlock(&CacheLock);
+}
+
+/**
+ * Report that connecting to the preferred address of host and port failed,
+ * so the next non-blocking connection tries the address after it.
+ * @param   host    Host string.
+ * @param   port    Port string.
+ */
+void    socket_failed(const char *host, const char *port) {
+    mutex_lock(&CacheLock);
+    SocketCache *e = socket_cache_find(host, port);
+    if (e && e->naddresses) {
+        e->preferred = (e->preferred + 1) % e->naddresses;
     }
-    return fs;
+    mutex_unlock(&CacheLock);
+}
+
+/**
+ * Set how long resolved addresses are reused.
+ * @param   ttl     Milliseconds (0 looks up every time).
+ * @return  Previous setting.
+ */
+int     socket_cache_ttl(int ttl) {
+    mutex_lock(&CacheLock);
+    int previous = CacheTTL;
+    CacheTTL     = ttl;
+    for (SocketCache *e = Cache; e; e = e->next) {
+        e->expires = 0;
+    }
+    mutex_unlock(&CacheLock);
+    return previous;
+}
+
+/**
+ * Return number of name service lookups made so far.
+ */
+size_t  socket_lookups() {
+    return __atomic_load_n(&Lookups, __ATOMIC_RELAXED);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,179 @@
+/* table.c: Hash Table of strings to values */
+
+#include "mq/table.h"
+#include "mq/string.h"
+
+/* Internal Constants */
+
+#define DEFAULT_CAPACITY    64
+#define MAX_LOAD_FACTOR     2
+
+/* Internal Prototypes */
+
+void    table_resize(Table *t, size_t capacity);
+
+/* External Functions */
+
+/**
+ * Create Table structure.
+ * @param   capacity    Initial number of buckets (0 for default).
+ * @return  Newly allocated Table structure.
+ */
+Table * table_create(size_t capacity) {
+    Table *t = calloc(1, sizeof(Table));
+
+    if (t) {
+        t->capacity = capacity ? capacity : DEFAULT_CAPACITY;
+        t->buckets  = calloc(t->capacity, sizeof(Entry *));
+        if (!t->buckets) {
+            free(t);
+            return NULL;
+        }
+    }
+
+    return t;
+}
+
+/**
+ * Delete Table structure (and all of its entries).
+ * @param   t               Table structure.
+ * @param   delete_value    Function to delete each value (may be NULL).
+ */
+void table_delete(Table *t, void (*delete_value)(void *)) {
+    if (!t) {
+        return;
+    }
+
+    for (size_t b = 0; b < t->capacity; b++) {
+        Entry *e = t->buckets[b];
+        while (e) {
+            Entry *next = e->next;
+            if (delete_value) {
+                delete_value(e->value);
+            }
+            free(e->key);
+            free(e);
+            e = next;
+        }
+    }
+
+    free(t->buckets);
+    free(t);
+}
+
+/**
+ * Insert value into Table with specified key (replacing any existing value).
+ * @param   t       Table structure.
+ * @param   key     Key string.
+ * @param   value   Value to store.
+ */
+void table_insert(Table *t, const char *key, void *value) {
+    size_t bucket = table_hash(key) % t->capacity;
+
+    for (Entry *e = t->buckets[bucket]; e; e = e->next) {
+        if (streq(e->key, key)) {
+            e->value = value;
+            return;
+        }
+    }
+
+    Entry *e = calloc(1, sizeof(Entry));
+    if (!e) {
+        return;
+    }
+
+    e->key   = strdup(key);
+    e->value = value;
+    e->next  = t->buckets[bucket];
+    t->buckets[bucket] = e;
+
+    if (++t->size > MAX_LOAD_FACTOR * t->capacity) {
+        table_resize(t, 2 * t->capacity);
+    }
+}
+
+/**
+ * Search Table for value with specified key.
+ * @param   t       Table structure.
+ * @param   key     Key string.
+ * @return  Value stored with key (NULL if there is none).
+ */
+void * table_search(Table *t, const char *key) {
+    for (Entry *e = t->buckets[table_hash(key) % t->capacity]; e; e = e->next) {
+        if (streq(e->key, key)) {
+            return e->value;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Remove entry with specified key from Table.
+ * @param   t       Table structure.
+ * @param   key     Key string.
+ * @return  Value that was stored with key (NULL if there was none).
+ */
+void * table_remove(Table *t, const char *key) {
+    Entry **link = &t->buckets[table_hash(key) % t->capacity];
+
+    for (Entry *e = *link; e; link = &e->next, e = e->next) {
+        if (streq(e->key, key)) {
+            void *value = e->value;
+            *link = e->next;
+            free(e->key);
+            free(e);
+            t->size--;
+            return value;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Compute FNV-1a hash of key.
+ * @param   key     Key string.
+ * @return  Hash of key.
+ */
+size_t table_hash(const char *key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (const unsigned char *c = (const unsigned char *)key; *c; c++) {
+        hash ^= *c;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/* Internal Functions */
+
+/**
+ * Move every entry of Table into a new array of buckets.
+ * @param   t           Table structure.
+ * @param   capacity    New number of buckets.
+ */
+void table_resize(Table *t, size_t capacity) {
+    Entry **buckets = calloc(capacity, sizeof(Entry *));
+    if (!buckets) {
+        return;
+    }
+
+    for (size_t b = 0; b < t->capacity; b++) {
+        Entry *e = t->buckets[b];
+        while (e) {
+            Entry *next  = e->next;
+            size_t index = table_hash(e->key) % capacity;
+            e->next = buckets[index];
+            buckets[index] = e;
+            e = next;
+        }
+    }
+
+    free(t->buckets);
+    t->buckets  = buckets;
+    t->capacity = capacity;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
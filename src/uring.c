@@ -0,0 +1,252 @@
+/* uring.c: Minimal io_uring interface (raw system calls, no liburing) */
+
+#include "mq/uring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define URING_REQUIRED	(IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)
+
+/* External Functions */
+
+/**
+ * Set up io_uring with room for entries submissions (and four times as many
+ * completions).  Kernels without the features we rely on (a single ring
+ * mapping, no dropped completions and timeouts on enter, all from 5.11) are
+ * refused so the caller can fall back to epoll.
+ * @param   u           Uring structure.
+ * @param   entries     Number of submission queue entries (power of 2).
+ * @return  0 if successful, otherwise negative errno.
+ */
+int uring_init(Uring *u, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof(Uring));
+    memset(&p, 0, sizeof(p));
+    p.flags      = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = 4 * entries;
+
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        // Cooperative task running only exists from 5.19
+        p.flags &= ~IORING_SETUP_COOP_TASKRUN;
+        u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (u->fd < 0) {
+        return -errno;
+    }
+
+    u->features = p.features;
+    if ((p.features & URING_REQUIRED) != URING_REQUIRED) {
+        close(u->fd);
+        return -ENOTSUP;
+    }
+
+    // Both rings share one mapping
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size   = sq_size > cq_size ? sq_size : cq_size;
+    u->ring        = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        int status = -errno;
+        close(u->fd);
+        return status;
+    }
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes      = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        int status = -errno;
+        munmap(u->ring, u->ring_size);
+        close(u->fd);
+        return status;
+    }
+
+    char *ring     = u->ring;
+    u->sq_head     = (unsigned *)(ring + p.sq_off.head);
+    u->sq_tail     = (unsigned *)(ring + p.sq_off.tail);
+    u->sq_array    = (unsigned *)(ring + p.sq_off.array);
+    u->sq_mask     = *(unsigned *)(ring + p.sq_off.ring_mask);
+    u->sq_entries  = p.sq_entries;
+    u->sq_local    = *u->sq_tail;
+    u->cq_head     = (unsigned *)(ring + p.cq_off.head);
+    u->cq_tail     = (unsigned *)(ring + p.cq_off.tail);
+    u->cq_mask     = *(unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqes        = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * Tear down io_uring (cancelling anything still in flight) and release its
+ * buffers.
+ * @param   u           Uring structure.
+ */
+void uring_exit(Uring *u) {
+    close(u->fd);
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->ring, u->ring_size);
+
+    if (u->buffers) {
+        munmap(u->buffers, u->buffers_size);
+        free(u->buffer_data);
+    }
+}
+
+/**
+ * Return next free submission queue entry (cleared).  When the submission
+ * queue is full, what is in it is submitted first.
+ * @param   u           Uring structure.
+ * @return  Submission queue entry (NULL if the kernel takes none).
+ */
+struct io_uring_sqe * uring_sqe(Uring *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    if (u->sq_local - head >= u->sq_entries) {
+        if (uring_enter(u, false, 0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sq_local - head >= u->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned index = u->sq_local++ & u->sq_mask;
+    u->sq_array[index] = index;
+    memset(&u->sqes[index], 0, sizeof(struct io_uring_sqe));
+    return &u->sqes[index];
+}
+
+/**
+ * Submit every queued entry and optionally wait for a completion, in a single
+ * system call.
+ * @param   u           Uring structure.
+ * @param   wait        Whether or not to wait for at least one completion.
+ * @param   timeout     Milliseconds to wait (negative waits forever).
+ * @return  Number of entries submitted (or negative errno; -ETIME if the
+ *          timeout passed and -EINTR if interrupted are not failures).
+ */
+int uring_enter(Uring *u, bool wait, int timeout) {
+    // Publish new entries to the kernel
+    unsigned tail = __atomic_load_n(u->sq_tail, __ATOMIC_RELAXED);
+    u->sq_pending += u->sq_local - tail;
+    __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec      ts  = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L };
+    struct io_uring_getevents_arg arg = { .ts = timeout >= 0 ? (uint64_t)(uintptr_t)&ts : 0 };
+    unsigned                      flags = IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+
+    __atomic_store_n(&u->enters, u->enters + 1, __ATOMIC_RELAXED);
+    int submitted = syscall(__NR_io_uring_enter, u->fd, u->sq_pending, wait ? 1 : 0, flags, &arg, sizeof(arg));
+    if (submitted < 0) {
+        return -errno;
+    }
+
+    u->sq_pending -= submitted;
+    return submitted;
+}
+
+/**
+ * Return next completion queue entry without consuming it.
+ * @param   u           Uring structure.
+ * @return  Completion queue entry (NULL if there is none).
+ */
+struct io_uring_cqe * uring_cqe(Uring *u) {
+    unsigned head = *u->cq_head;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &u->cqes[head & u->cq_mask];
+}
+
+/**
+ * Consume completion queue entry returned by uring_cqe.
+ * @param   u           Uring structure.
+ */
+void uring_seen(Uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Register a ring of provided buffers (from 5.19) that receives submitted
+ * with IOSQE_BUFFER_SELECT in group pick from as data arrives, so no buffer
+ * is tied up by a socket that is only waiting.
+ * @param   u           Uring structure.
+ * @param   nbuffers    Number of buffers (power of 2, at most 32768).
+ * @param   size        Size of each buffer.
+ * @param   group       Buffer group ID.
+ * @return  0 if successful, otherwise negative errno.
+ */
+int uring_buffers(Uring *u, unsigned nbuffers, size_t size, unsigned short group) {
+    u->buffers_size = nbuffers * sizeof(struct io_uring_buf);
+    u->buffers      = mmap(NULL, u->buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->buffers == MAP_FAILED) {
+        u->buffers = NULL;
+        return -errno;
+    }
+
+    u->buffer_data = malloc(nbuffers * size);
+    if (!u->buffer_data) {
+        munmap(u->buffers, u->buffers_size);
+        u->buffers = NULL;
+        return -ENOMEM;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr    = (uint64_t)(uintptr_t)u->buffers,
+        .ring_entries = nbuffers,
+        .bgid         = group,
+    };
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int status = -errno;
+        munmap(u->buffers, u->buffers_size);
+        free(u->buffer_data);
+        u->buffers     = NULL;
+        u->buffer_data = NULL;
+        return status;
+    }
+
+    u->nbuffers     = nbuffers;
+    u->buffer_size  = size;
+    u->buffer_group = group;
+    u->buffer_tail  = 0;
+    for (unsigned id = 0; id < nbuffers; id++) {
+        uring_recycle(u, id);
+    }
+    return 0;
+}
+
+/**
+ * Return data of provided buffer (as named by IORING_CQE_BUFFER_SHIFT).
+ * @param   u           Uring structure.
+ * @param   id          Buffer ID.
+ * @return  Start of buffer.
+ */
+char * uring_buffer(Uring *u, unsigned id) {
+    return u->buffer_data + id * u->buffer_size;
+}
+
+/**
+ * Hand provided buffer back to the kernel once its data has been used.
+ * @param   u           Uring structure.
+ * @param   id          Buffer ID.
+ */
+void uring_recycle(Uring *u, unsigned id) {
+    struct io_uring_buf *b = &u->buffers->bufs[u->buffer_tail & (u->nbuffers - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)uring_buffer(u, id);
+    b->len  = u->buffer_size;
+    b->bid  = id;
+    __atomic_store_n(&u->buffers->tail, ++u->buffer_tail, __ATOMIC_RELEASE);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,217 @@
+/* bench_client.c: Message Queue Client publish/retrieve benchmark */
+
+#include "mq/client.h"
+#include "mq/thread.h"
+
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char * TOPIC = "benchmark";
+
+/* Structures */
+
+typedef struct Run Run;
+struct Run {
+    struct Mode *mode;
+    const char * host;
+    const char * port;
+    size_t       nmessages;
+    size_t       size;
+    size_t       nsamples;
+    size_t       client;
+    Thread       thread;
+
+    double       elapsed;
+    double       latency;
+};
+
+/* Modes */
+
+typedef struct Mode Mode;
+struct Mode {
+    const char *name;
+    void      (*configure)(MessageQueue *mq);
+    bool        rings;		// Use lock-free ring queues
+};
+
+void configure_connect(MessageQueue *mq) {
+    mq->keepalive = false;
+}
+
+void configure_keepalive(MessageQueue *mq) {
+    mq->keepalive = true;
+}
+
+void configure_pipelined(MessageQueue *mq) {
+    mq->keepalive = true;
+    mq->window    = 64;
+}
+
+void configure_batched(MessageQueue *mq) {
+    mq->keepalive       = true;
+    mq->window          = 64;
+    mq->linger_ms       = 1;
+    mq->max_batch_bytes = 1<<16;
+}
+
+void configure_batched_retrieve(MessageQueue *mq) {
+    configure_batched(mq);
+    mq->retrieve_max = 64;
+}
+
+void configure_streaming(MessageQueue *mq) {
+    configure_pipelined(mq);
+    mq->streaming = true;
+}
+
+Mode MODES[] = {
+    { "connect per request", configure_connect },
+    { "keep-alive"         , configure_keepalive },
+    { "pipelined (window 64)", configure_pipelined },
+    { "batched (linger 1 ms)", configure_batched },
+    { "batched retrieve (max 64)", configure_batched_retrieve },
+    { "streaming"            , configure_streaming },
+    { "streaming (rings)"    , configure_streaming, true },
+    { NULL, NULL },
+};
+
+/* Functions */
+
+double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Publish nmessages to a topic of our own and retrieve them all again,
+ * measuring the time until the last one arrives.  Then publish nsamples
+ * messages one at a time, measuring the average delivery latency of each.
+ */
+void * benchmark_client(void *arg) {
+    Run *run = arg;
+    size_t nmessages = run->nmessages;
+    size_t nsamples  = run->nsamples;
+    size_t size      = run->size;
+
+    char name[BUFSIZ];
+    char topic[BUFSIZ];
+    snprintf(name, sizeof(name), "bench_client.%d.%lu.%s", getpid(), run->client, run->mode->name);
+    snprintf(topic, sizeof(topic), "%s.%lu", TOPIC, run->client);
+    for (char *c = name; *c; c++) {
+        if (*c == ' ') *c = '_';
+    }
+
+    MessageQueue *mq = run->mode->rings ?
+        mq_create_with_queues(name, run->host, run->port, QUEUE_MPSC, QUEUE_SPSC, 1<<12) :
+        mq_create(name, run->host, run->port);
+    assert(mq);
+    run->mode->configure(mq);
+
+    mq_subscribe(mq, topic);
+    mq_start(mq);
+
+    char *body = malloc(size + 1);
+    assert(body);
+    memset(body, 'x', size);
+    body[size] = 0;
+
+    double start = timestamp();
+    for (size_t m = 0; m < nmessages; m++) {
+        mq_publish(mq, topic, body);
+    }
+
+    size_t received = 0;
+    while (received < nmessages) {
+        MQMessage *message = mq_retrieve_msg(mq);
+        if (message) {
+            assert(mq_message_length(message) == size);
+            mq_message_release(message);
+            received++;
+        }
+    }
+    double elapsed = timestamp() - start;
+
+    double latency = 0;
+    for (size_t m = 0; m < nsamples; m++) {
+        double sent = timestamp();
+        mq_publish(mq, topic, body);
+
+        MQMessage *message;
+        while (!(message = mq_retrieve_msg(mq)));
+        latency += timestamp() - sent;
+        mq_message_release(message);
+    }
+
+    mq_unsubscribe(mq, topic);
+    mq_stop(mq);
+    mq_delete(mq);
+    free(body);
+
+    run->elapsed = elapsed;
+    run->latency = nsamples ? latency / nsamples : 0;
+    return NULL;
+}
+
+/**
+ * Run benchmark with nclients concurrent clients (each with its own queue
+ * and topic) and report their combined throughput.
+ */
+void benchmark(Mode *mode, const char *host, const char *port, size_t nmessages, size_t size, size_t nsamples, size_t nclients) {
+    Run runs[nclients];
+
+    for (size_t client = 0; client < nclients; client++) {
+        runs[client] = (Run) {
+            .mode      = mode,
+            .host      = host,
+            .port      = port,
+            .nmessages = nmessages,
+            .size      = size,
+            .nsamples  = nsamples,
+            .client    = client,
+        };
+        thread_create(&runs[client].thread, NULL, benchmark_client, &runs[client]);
+    }
+
+    double elapsed = 0;
+    double latency = 0;
+    for (size_t client = 0; client < nclients; client++) {
+        thread_join(runs[client].thread, NULL);
+        elapsed  = runs[client].elapsed > elapsed ? runs[client].elapsed : elapsed;
+        latency += runs[client].latency / nclients;
+    }
+
+    printf("%-28s %8.3lf s %12.1lf messages/s %10.1lf us latency\n",
+        mode->name, elapsed, nclients * nmessages / elapsed, latency * 1e6);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host       = "localhost";
+    char *port       = "9620";
+    size_t nmessages = 1<<12;
+    size_t size      = 64;
+    size_t nsamples  = 16;
+    size_t nclients  = 1;
+
+    if (argc > 1) { host      = argv[1]; }
+    if (argc > 2) { port      = argv[2]; }
+    if (argc > 3) { nmessages = strtoul(argv[3], NULL, 10); }
+    if (argc > 4) { size      = strtoul(argv[4], NULL, 10); }
+    if (argc > 5) { nsamples  = strtoul(argv[5], NULL, 10); }
+    if (argc > 6) { nclients  = strtoul(argv[6], NULL, 10); }
+
+    printf("%lu messages of %lu bytes via %s:%s (%lu clients)\n\n", nmessages, size, host, port, nclients);
+    for (Mode *mode = MODES; mode->name; mode++) {
+        benchmark(mode, host, port, nmessages, size, nsamples, nclients);
+        fflush(stdout);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,193 @@
+/* bench_engine.c: Message Queue I/O backend benchmark (threads vs epoll vs io_uring) */
+
+#include "mq/client.h"
+#include "mq/thread.h"
+
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char * TOPIC = "benchmark";
+
+/* Structures */
+
+typedef struct Mode Mode;
+struct Mode {
+    const char *  name;
+    bool          engine;	// Share one engine instead of threads per queue
+    EngineBackend backend;
+};
+
+typedef struct Run Run;
+struct Run {
+    Mode *       mode;
+    MQEngine *   engine;
+    const char * host;
+    const char * port;
+    size_t       nmessages;
+    size_t       size;
+    size_t       client;
+    Thread       thread;
+};
+
+Mode MODES[] = {
+    { "threads"          , false },
+    { "engine (epoll)"   , true, ENGINE_EPOLL },
+    { "engine (io_uring)", true, ENGINE_URING },
+    { NULL },
+};
+
+/* Functions */
+
+double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Return number of read and write system calls made by the process so far
+ * (recvs, sends and io_uring operations are not counted by the kernel).
+ */
+size_t rw_syscalls() {
+    FILE  *fs    = fopen("/proc/self/io", "r");
+    char   line[BUFSIZ];
+    size_t count = 0;
+
+    while (fs && fgets(line, sizeof(line), fs)) {
+        size_t value;
+        if (sscanf(line, "syscr: %zu", &value) == 1 || sscanf(line, "syscw: %zu", &value) == 1) {
+            count += value;
+        }
+    }
+
+    if (fs) {
+        fclose(fs);
+    }
+    return count;
+}
+
+/**
+ * Publish nmessages to a topic of our own (pipelined) and retrieve them all
+ * again (several per response).
+ */
+void * benchmark_client(void *arg) {
+    Run *run = arg;
+
+    char name[BUFSIZ];
+    char topic[BUFSIZ];
+    snprintf(name, sizeof(name), "bench_engine.%d.%lu.%d.%d", getpid(), run->client, run->mode->engine, run->mode->backend);
+    snprintf(topic, sizeof(topic), "%s.%lu", TOPIC, run->client);
+
+    MessageQueue *mq = mq_create(name, run->host, run->port);
+    assert(mq);
+    mq->window       = 64;
+    mq->retrieve_max = 64;
+    mq->engine       = run->engine;
+
+    mq_subscribe(mq, topic);
+    mq_start(mq);
+
+    char *body = malloc(run->size + 1);
+    assert(body);
+    memset(body, 'x', run->size);
+    body[run->size] = 0;
+
+    for (size_t m = 0; m < run->nmessages; m++) {
+        mq_publish(mq, topic, body);
+    }
+    size_t received = 0;
+    while (received < run->nmessages) {
+        MQMessage *message = mq_retrieve_msg(mq);
+        if (message) {
+            assert(mq_message_length(message) == run->size);
+            mq_message_release(message);
+            received++;
+        }
+    }
+
+    mq_unsubscribe(mq, topic);
+    mq_stop(mq);
+    mq_delete(mq);
+    free(body);
+    return NULL;
+}
+
+/**
+ * Run benchmark with nclients concurrent clients (each with its own queue and
+ * topic, sharing one engine loop when mode has one) and report combined
+ * throughput and system calls per message.
+ */
+void benchmark(Mode *mode, const char *host, const char *port, size_t nmessages, size_t size, size_t nclients) {
+    Run       runs[nclients];
+    MQEngine *engine = NULL;
+
+    if (mode->engine) {
+        engine = mq_engine_create_backend(1, mode->backend);
+        assert(engine);
+        if (engine->backend != mode->backend) {
+            printf("%-20s (unavailable, falls back to epoll)\n", mode->name);
+            mq_engine_delete(engine);
+            return;
+        }
+    }
+
+    size_t rw    = rw_syscalls();
+    double start = timestamp();
+    for (size_t client = 0; client < nclients; client++) {
+        runs[client] = (Run) {
+            .mode      = mode,
+            .engine    = engine,
+            .host      = host,
+            .port      = port,
+            .nmessages = nmessages,
+            .size      = size,
+            .client    = client,
+        };
+        thread_create(&runs[client].thread, NULL, benchmark_client, &runs[client]);
+    }
+
+    for (size_t client = 0; client < nclients; client++) {
+        thread_join(runs[client].thread, NULL);
+    }
+    double elapsed = timestamp() - start;
+    double total   = nclients * nmessages;
+
+    rw = rw_syscalls() - rw;
+    if (engine) {
+        printf("%-20s %8.3lf s %12.1lf messages/s %8.3lf read+write/msg %8.3lf loop syscalls/msg\n",
+            mode->name, elapsed, total / elapsed, rw / total, mq_engine_syscalls(engine) / total);
+        mq_engine_delete(engine);
+    } else {
+        printf("%-20s %8.3lf s %12.1lf messages/s %8.3lf read+write/msg\n",
+            mode->name, elapsed, total / elapsed, rw / total);
+    }
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host       = "localhost";
+    char *port       = "9620";
+    size_t nmessages = 1<<12;
+    size_t size      = 64;
+    size_t nclients  = 16;
+
+    if (argc > 1) { host      = argv[1]; }
+    if (argc > 2) { port      = argv[2]; }
+    if (argc > 3) { nmessages = strtoul(argv[3], NULL, 10); }
+    if (argc > 4) { size      = strtoul(argv[4], NULL, 10); }
+    if (argc > 5) { nclients  = strtoul(argv[5], NULL, 10); }
+
+    printf("%lu messages of %lu bytes via %s:%s (%lu clients)\n\n", nmessages, size, host, port, nclients);
+    for (Mode *mode = MODES; mode->name; mode++) {
+        benchmark(mode, host, port, nmessages, size, nclients);
+        fflush(stdout);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,156 @@
+/* bench_parser.c: HTTP response parsing benchmark (stdio vs incremental parser) */
+
+#include "mq/parser.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+
+/* Structures */
+
+typedef struct Mode Mode;
+struct Mode {
+    const char *name;
+    size_t      (*parse)(char *input, size_t size, size_t *body_bytes);
+};
+
+/* Functions */
+
+double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Parse responses the way the client used to: fgets and sscanf over a stdio
+ * stream, copying each body out with fread (Content-Length framing only).
+ */
+size_t parse_stdio(char *input, size_t size, size_t *body_bytes) {
+    FILE  *fs         = fmemopen(input, size, "r");
+    char   buffer[BUFSIZ];
+    char   body[BUFSIZ];
+    size_t nresponses = 0;
+    assert(fs);
+
+    while (fgets(buffer, BUFSIZ, fs)) {
+        int  minor, status;
+        long content_length = -1;
+        if (sscanf(buffer, "HTTP/1.%d %d", &minor, &status) != 2) {
+            break;
+        }
+
+        while (fgets(buffer, BUFSIZ, fs) && !streq(buffer, "\r\n")) {
+            if (strncasecmp(buffer, "Content-Length:", 15) == 0) {
+                content_length = strtol(buffer + 15, NULL, 10);
+            }
+        }
+
+        if (content_length < 0 || content_length > BUFSIZ ||
+            fread(body, 1, content_length, fs) != (size_t)content_length) {
+            break;
+        }
+        *body_bytes += content_length;
+        nresponses++;
+    }
+
+    fclose(fs);
+    return nresponses;
+}
+
+/**
+ * Parse responses with the incremental parser, handing it the input in 64 KiB
+ * reads as a Connection does.
+ */
+size_t parse_incremental(char *input, size_t size, size_t *body_bytes) {
+    Parser p;
+    size_t nresponses = 0;
+    parser_init(&p);
+
+    for (size_t offset = 0; offset < size; offset += 1<<16) {
+        const char *piece = input + offset;
+        size_t      left  = size - offset < (1<<16) ? size - offset : (1<<16);
+        ParserEvent event;
+
+        do {
+            const char *data;
+            size_t      length;
+            size_t      consumed;
+            event  = parser_execute(&p, piece, left, &consumed, &data, &length);
+            piece += consumed;
+            left  -= consumed;
+
+            if (event == PARSER_BODY) {
+                *body_bytes += length;
+            } else if (event == PARSER_DONE) {
+                nresponses++;
+            }
+            assert(event != PARSER_ERROR);
+        } while (event != PARSER_MORE);
+    }
+
+    return nresponses;
+}
+
+Mode MODES[] = {
+    { "fgets/sscanf/fread", parse_stdio },
+    { "parser"            , parse_incremental },
+    { NULL, NULL },
+};
+
+/**
+ * Build nresponses pipelined responses with size byte bodies.
+ */
+char * build_input(size_t nresponses, size_t size, size_t *length) {
+    char head[BUFSIZ];
+    int  head_length = snprintf(head, sizeof(head),
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n", size);
+
+    *length     = nresponses * (head_length + size);
+    char *input = malloc(*length);
+    assert(input);
+
+    for (char *p = input; p < input + *length; p += head_length + size) {
+        memcpy(p, head, head_length);
+        memset(p + head_length, 'x', size);
+    }
+    return input;
+}
+
+void benchmark(Mode *mode, char *input, size_t size, size_t nresponses) {
+    size_t body_bytes = 0;
+    double start      = timestamp();
+    size_t parsed     = mode->parse(input, size, &body_bytes);
+    double elapsed    = timestamp() - start;
+    assert(parsed == nresponses);
+
+    printf("%-24s %8.3lf s %12.1lf responses/s %8.1lf MB/s\n",
+        mode->name, elapsed, nresponses / elapsed, size / elapsed / (1<<20));
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    size_t nresponses = 1<<20;
+    size_t size       = 64;
+
+    if (argc > 1) { nresponses = strtoul(argv[1], NULL, 10); }
+    if (argc > 2) { size       = strtoul(argv[2], NULL, 10); }
+    assert(size <= BUFSIZ);
+
+    size_t length;
+    char  *input = build_input(nresponses, size, &length);
+
+    printf("%lu pipelined responses with %lu byte bodies\n\n", nresponses, size);
+    for (Mode *mode = MODES; mode->name; mode++) {
+        benchmark(mode, input, length, nresponses);
+        fflush(stdout);
+    }
+
+    free(input);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,150 @@
+/* bench_queue.c: Concurrent Queue of Requests contention benchmark */
+
+#include "mq/thread.h"
+#include "mq/queue.h"
+
+#include <assert.h>
+#include <time.h>
+
+/* Constants */
+
+#define BATCH       64
+
+/* Structures */
+
+typedef struct Mode Mode;
+struct Mode {
+    const char *name;
+    bool        batched;    // Use queue_push_batch and queue_pop_batch
+};
+
+Mode MODES[] = {
+    { "push/pop"            , false },
+    { "push_batch/pop_batch", true },
+    { NULL, false },
+};
+
+typedef struct Worker Worker;
+struct Worker {
+    Mode   *mode;
+    Queue  *queue;
+    size_t  nmessages;
+    Thread  thread;
+};
+
+/* Functions */
+
+double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Threads */
+
+void * consumer(void *arg) {
+    Worker  *w = arg;
+    Request *out[BATCH];
+    size_t   messages = 0;
+
+    while (messages < w->nmessages) {
+        size_t max    = w->nmessages - messages < BATCH ? w->nmessages - messages : BATCH;
+        size_t popped = 1;
+
+        if (w->mode->batched) {
+            popped = queue_pop_batch(w->queue, out, max, -1);
+        } else {
+            out[0] = queue_pop(w->queue);
+        }
+
+        for (size_t r = 0; r < popped; r++) {
+            request_delete(out[r]);
+        }
+        messages += popped;
+    }
+
+    return NULL;
+}
+
+void * producer(void *arg) {
+    Worker *w = arg;
+
+    for (size_t m = 0; m < w->nmessages; ) {
+        if (!w->mode->batched) {
+            queue_push(w->queue, request_create("1", "2", "3"));
+            m++;
+            continue;
+        }
+
+        Request *head = NULL;
+        for (size_t r = 0; r < BATCH && m < w->nmessages; r++, m++) {
+            Request *n = request_create("1", "2", "3");
+            n->next = head;
+            head    = n;
+        }
+        queue_push_batch(w->queue, head);
+    }
+
+    return NULL;
+}
+
+/**
+ * Move nmessages from each of nproducers producers to nconsumers consumers
+ * through one queue and report the rate messages cross it.
+ */
+void benchmark(Mode *mode, size_t nproducers, size_t nconsumers, size_t nmessages) {
+    Queue *q = queue_create();
+    Worker producers[nproducers];
+    Worker consumers[nconsumers];
+    assert(q);
+
+    // Split messages between consumers (the first takes any remainder)
+    size_t total = nproducers * nmessages;
+
+    double start = timestamp();
+    for (size_t c = 0; c < nconsumers; c++) {
+        consumers[c] = (Worker) {
+            .mode      = mode,
+            .queue     = q,
+            .nmessages = total / nconsumers + (c == 0 ? total % nconsumers : 0),
+        };
+        thread_create(&consumers[c].thread, NULL, consumer, &consumers[c]);
+    }
+    for (size_t p = 0; p < nproducers; p++) {
+        producers[p] = (Worker) { .mode = mode, .queue = q, .nmessages = nmessages };
+        thread_create(&producers[p].thread, NULL, producer, &producers[p]);
+    }
+
+    for (size_t p = 0; p < nproducers; p++) {
+        thread_join(producers[p].thread, NULL);
+    }
+    for (size_t c = 0; c < nconsumers; c++) {
+        thread_join(consumers[c].thread, NULL);
+    }
+    double elapsed = timestamp() - start;
+
+    printf("%-28s %8.3lf s %14.1lf messages/s\n", mode->name, elapsed, total / elapsed);
+    queue_delete(q);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    size_t nproducers = 4;
+    size_t nconsumers = 2;
+    size_t nmessages  = 1<<18;
+
+    if (argc > 1) { nproducers = strtoul(argv[1], NULL, 10); }
+    if (argc > 2) { nconsumers = strtoul(argv[2], NULL, 10); }
+    if (argc > 3) { nmessages  = strtoul(argv[3], NULL, 10); }
+
+    printf("%lu messages from each of %lu producers to %lu consumers\n\n", nmessages, nproducers, nconsumers);
+    for (Mode *mode = MODES; mode->name; mode++) {
+        benchmark(mode, nproducers, nconsumers, nmessages);
+        fflush(stdout);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
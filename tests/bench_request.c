@@ -0,0 +1,138 @@
+/* bench_request.c: Request allocation benchmark */
+
+#include "mq/thread.h"
+#include "mq/queue.h"
+
+#include <assert.h>
+#include <time.h>
+
+/* Constants */
+
+const char * METHOD = "PUT";
+const char * URI    = "/topic/benchmark";
+
+/* Structures */
+
+typedef struct Mode Mode;
+struct Mode {
+    const char *name;
+    Request *   (*create)(const char *method, const char *uri, const char *body);
+    void        (*delete)(Request *r);
+};
+
+typedef struct Run Run;
+struct Run {
+    Mode *      mode;
+    Queue *     queue;
+    const char *body;
+    size_t      nrequests;
+};
+
+/* Globals */
+
+size_t Mallocs = 0;
+
+/* Functions */
+
+double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Allocate Request the way it used to be: the structure plus a copy of each
+ * string.
+ */
+Request * separate_create(const char *method, const char *uri, const char *body) {
+    Request *r = calloc(1, sizeof(Request));
+    r->method  = strdup(method);
+    r->uri     = strdup(uri);
+    r->body    = strdup(body);
+    r->length  = strlen(body);
+    __atomic_add_fetch(&Mallocs, 4, __ATOMIC_RELAXED);
+    return r;
+}
+
+void separate_delete(Request *r) {
+    free(r->method);
+    free(r->uri);
+    free(r->body);
+    free(r);
+}
+
+Mode MODES[] = {
+    { "separate allocations", separate_create, separate_delete },
+    { "pooled allocation"   , request_create , request_delete },
+    { NULL, NULL, NULL },
+};
+
+/* Threads */
+
+void * producer(void *arg) {
+    Run *run = arg;
+
+    for (size_t r = 0; r < run->nrequests; r++) {
+        queue_push(run->queue, run->mode->create(METHOD, URI, run->body));
+    }
+
+    return NULL;
+}
+
+/**
+ * Create nrequests on one thread and delete them on another (as publish does
+ * with the pusher thread), reporting the rate and mallocs per request.
+ */
+void benchmark(Mode *mode, size_t nrequests, size_t size) {
+    Run run = {
+        .mode      = mode,
+        .queue     = queue_create_bounded(1<<10, 0, QUEUE_BLOCK),
+        .nrequests = nrequests,
+    };
+    assert(run.queue);
+
+    char *body = malloc(size + 1);
+    assert(body);
+    memset(body, 'x', size);
+    body[size] = 0;
+    run.body   = body;
+
+    size_t mallocs = Mallocs + request_allocations();
+    double start   = timestamp();
+
+    Thread thread;
+    thread_create(&thread, NULL, producer, &run);
+    for (size_t r = 0; r < nrequests; r++) {
+        mode->delete(queue_pop(run.queue));
+    }
+    thread_join(thread, NULL);
+
+    double elapsed = timestamp() - start;
+    mallocs = Mallocs + request_allocations() - mallocs;
+
+    printf("%-24s %8.3lf s %12.1lf requests/s %8.3lf mallocs/request\n",
+        mode->name, elapsed, nrequests / elapsed, (double)mallocs / nrequests);
+
+    queue_delete(run.queue);
+    free(body);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    size_t nrequests = 1<<20;
+    size_t size      = 64;
+
+    if (argc > 1) { nrequests = strtoul(argv[1], NULL, 10); }
+    if (argc > 2) { size      = strtoul(argv[2], NULL, 10); }
+
+    printf("%lu requests with %lu byte bodies\n\n", nrequests, size);
+    for (Mode *mode = MODES; mode->name; mode++) {
+        benchmark(mode, nrequests, size);
+        fflush(stdout);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,149 @@
+/* bench_serialize.c: Request serialization benchmark (stdio vs writev) */
+
+#include "mq/connection.h"
+#include "mq/thread.h"
+
+#include <assert.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define WINDOW      64
+
+const char * METHOD = "PUT";
+const char * URI    = "/topic/benchmark";
+
+/* Structures */
+
+typedef struct Mode Mode;
+struct Mode {
+    const char *name;
+    bool        (*send)(Connection *c, FILE *fs, Request *head);
+};
+
+/* Functions */
+
+double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Write Request the way request_write used to: formatted with fprintf into
+ * the stdio buffer.
+ */
+void fprintf_write(Request *r, FILE *fs) {
+    fprintf(fs, "%s %s HTTP/1.1\r\n", r->method, r->uri);
+    fprintf(fs, "Host: %s\r\n", "localhost");
+    fprintf(fs, "Content-Length: %zu\r\n", r->length);
+    fprintf(fs, "\r\n");
+    fwrite(r->body, 1, r->length, fs);
+}
+
+bool send_fprintf(Connection *c, FILE *fs, Request *head) {
+    for (Request *r = head; r; r = r->next) {
+        fprintf_write(r, fs);
+    }
+    return fflush(fs) == 0;
+}
+
+bool send_request_write(Connection *c, FILE *fs, Request *head) {
+    for (Request *r = head; r; r = r->next) {
+        request_write(r, "localhost", fs);
+    }
+    return fflush(fs) == 0;
+}
+
+bool send_writev(Connection *c, FILE *fs, Request *head) {
+    return connection_send(c, head) == 0;
+}
+
+Mode MODES[] = {
+    { "fprintf + fflush"      , send_fprintf },
+    { "request_write + fflush", send_request_write },
+    { "connection_send"       , send_writev },
+    { NULL, NULL },
+};
+
+/* Threads */
+
+void * drainer(void *arg) {
+    int  fd = *(int *)arg;
+    char buffer[1<<16];
+
+    while (read(fd, buffer, sizeof(buffer)) > 0);
+    return NULL;
+}
+
+/**
+ * Send nrequests in windows of WINDOW over a socket pair (drained by another
+ * thread) and report the rate they are serialized and written.
+ */
+void benchmark(Mode *mode, size_t nrequests, size_t size) {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    Thread thread;
+    thread_create(&thread, NULL, drainer, &sv[1]);
+
+    Connection *c = connection_create(NULL, NULL, true);
+    assert(c);
+    c->fd    = sv[0];
+    FILE *fs = fdopen(dup(sv[0]), "w");
+    assert(fs);
+
+    char *body = malloc(size + 1);
+    assert(body);
+    memset(body, 'x', size);
+    body[size] = 0;
+
+    Request *window = NULL;
+    for (size_t r = 0; r < WINDOW; r++) {
+        Request *n = request_create(METHOD, URI, body);
+        assert(n);
+        n->next = window;
+        window  = n;
+    }
+
+    double start = timestamp();
+    for (size_t r = 0; r < nrequests; r += WINDOW) {
+        assert(mode->send(c, fs, window));
+    }
+    double elapsed = timestamp() - start;
+
+    printf("%-24s %8.3lf s %12.1lf requests/s\n", mode->name, elapsed, nrequests / elapsed);
+
+    while (window) {
+        Request *next = window->next;
+        request_delete(window);
+        window = next;
+    }
+    fclose(fs);
+    connection_delete(c);
+    thread_join(thread, NULL);
+    close(sv[1]);
+    free(body);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    size_t nrequests = 1<<20;
+    size_t size      = 64;
+
+    if (argc > 1) { nrequests = strtoul(argv[1], NULL, 10); }
+    if (argc > 2) { size      = strtoul(argv[2], NULL, 10); }
+
+    printf("%lu requests with %lu byte bodies (window %d)\n\n", nrequests, size, WINDOW);
+    for (Mode *mode = MODES; mode->name; mode++) {
+        benchmark(mode, nrequests, size);
+        fflush(stdout);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
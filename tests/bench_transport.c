@@ -0,0 +1,205 @@
+/* bench_transport.c: Message Queue transport benchmark (TCP loopback vs Unix domain socket vs shared memory) */
+
+#include "mq/bus.h"
+#include "mq/client.h"
+#include "mq/thread.h"
+
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char * TOPIC = "benchmark";
+
+/* Structures */
+
+typedef struct Mode Mode;
+struct Mode {
+    const char *name;
+    size_t      window;		// Requests in flight per connection
+    size_t      retrieve_max;	// Messages per retrieve
+};
+
+typedef struct Run Run;
+struct Run {
+    Mode *       mode;
+    const char * host;
+    const char * port;
+    size_t       nmessages;
+    size_t       size;
+    size_t       nsamples;
+    size_t       client;
+    Thread       thread;
+
+    MessageQueue *mq;
+    const char * topic;
+    const char * body;
+
+    double       elapsed;
+    double       latency;
+};
+
+Mode MODES[] = {
+    { "keep-alive"              , 1 , 1 },
+    { "pipelined (window 64)"   , 64, 1 },
+    { "batched retrieve (max 64)", 64, 64 },
+    { NULL },
+};
+
+Mode SHARED = { "shared memory", 1, 1 };
+
+/* Functions */
+
+double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Publish nmessages to topic (from a thread of its own, so retrieving is not
+ * held up by a publisher waiting for room in a shared-memory ring).
+ */
+void * publisher_thread(void *arg) {
+    Run *run = arg;
+    for (size_t m = 0; m < run->nmessages; m++) {
+        mq_publish(run->mq, run->topic, run->body);
+    }
+    return NULL;
+}
+
+/**
+ * Publish nmessages to a topic of our own and retrieve them all again,
+ * measuring the time until the last one arrives.  Then publish nsamples
+ * messages one at a time, measuring the average delivery latency of each.
+ */
+void * benchmark_client(void *arg) {
+    Run *run = arg;
+
+    char name[BUFSIZ];
+    char topic[BUFSIZ];
+    snprintf(name, sizeof(name), "bench_transport.%d.%lu.%lu.%lu", getpid(), run->client, run->mode->window, run->mode->retrieve_max);
+    snprintf(topic, sizeof(topic), "%s.%lu", TOPIC, run->client);
+
+    MessageQueue *mq = mq_create(name, run->host, run->port);
+    assert(mq);
+    mq->window       = run->mode->window;
+    mq->retrieve_max = run->mode->retrieve_max;
+
+    mq_subscribe(mq, topic);
+    mq_start(mq);
+
+    char *body = malloc(run->size + 1);
+    assert(body);
+    memset(body, 'x', run->size);
+    body[run->size] = 0;
+
+    run->mq    = mq;
+    run->topic = topic;
+    run->body  = body;
+
+    Thread publisher;
+    double start = timestamp();
+    thread_create(&publisher, NULL, publisher_thread, run);
+
+    size_t received = 0;
+    while (received < run->nmessages) {
+        MQMessage *message = mq_retrieve_msg(mq);
+        if (message) {
+            assert(mq_message_length(message) == run->size);
+            mq_message_release(message);
+            received++;
+        }
+    }
+    run->elapsed = timestamp() - start;
+    thread_join(publisher, NULL);
+
+    double latency = 0;
+    for (size_t m = 0; m < run->nsamples; m++) {
+        double sent = timestamp();
+        mq_publish(mq, topic, body);
+
+        MQMessage *message;
+        while (!(message = mq_retrieve_msg(mq)));
+        latency += timestamp() - sent;
+        mq_message_release(message);
+    }
+    run->latency = run->nsamples ? latency / run->nsamples : 0;
+
+    mq_unsubscribe(mq, topic);
+    mq_stop(mq);
+    mq_delete(mq);
+    free(body);
+    return NULL;
+}
+
+/**
+ * Run benchmark with nclients concurrent clients (each with its own queue and
+ * topic) over one transport and report their combined throughput.
+ */
+void benchmark(Mode *mode, const char *transport, const char *host, const char *port,
+               size_t nmessages, size_t size, size_t nsamples, size_t nclients) {
+    Run runs[nclients];
+
+    for (size_t client = 0; client < nclients; client++) {
+        runs[client] = (Run) {
+            .mode      = mode,
+            .host      = host,
+            .port      = port,
+            .nmessages = nmessages,
+            .size      = size,
+            .nsamples  = nsamples,
+            .client    = client,
+        };
+        thread_create(&runs[client].thread, NULL, benchmark_client, &runs[client]);
+    }
+
+    double elapsed = 0;
+    double latency = 0;
+    for (size_t client = 0; client < nclients; client++) {
+        thread_join(runs[client].thread, NULL);
+        elapsed  = runs[client].elapsed > elapsed ? runs[client].elapsed : elapsed;
+        latency += runs[client].latency / nclients;
+    }
+
+    printf("%-26s %-4s %8.3lf s %12.1lf messages/s %10.1lf us latency\n",
+        mode->name, transport, elapsed, nclients * nmessages / elapsed, latency * 1e6);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host       = "localhost";
+    char *port       = "9620";
+    char *path       = "unix:/tmp/mq.sock";
+    char *shm        = "shm:/bench_transport";
+    size_t nmessages = 1<<12;
+    size_t size      = 64;
+    size_t nsamples  = 64;
+    size_t nclients  = 1;
+
+    if (argc > 1) { host      = argv[1]; }
+    if (argc > 2) { port      = argv[2]; }
+    if (argc > 3) { path      = argv[3]; }
+    if (argc > 4) { shm       = argv[4]; }
+    if (argc > 5) { nmessages = strtoul(argv[5], NULL, 10); }
+    if (argc > 6) { size      = strtoul(argv[6], NULL, 10); }
+    if (argc > 7) { nsamples  = strtoul(argv[7], NULL, 10); }
+    if (argc > 8) { nclients  = strtoul(argv[8], NULL, 10); }
+
+    printf("%lu messages of %lu bytes via %s:%s, %s and %s (%lu clients)\n\n", nmessages, size, host, port, path, shm, nclients);
+    for (Mode *mode = MODES; mode->name; mode++) {
+        benchmark(mode, "tcp" , host, port, nmessages, size, nsamples, nclients);
+        benchmark(mode, "unix", path, NULL, nmessages, size, nsamples, nclients);
+        fflush(stdout);
+    }
+
+    // Queues on a shared-memory bus outlive us, so remove it afterwards
+    benchmark(&SHARED, "shm", shm, NULL, nmessages, size, nsamples, nclients);
+    bus_remove(shm + strlen(BUS_PREFIX));
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,311 @@
+/* test_backoff_unit.c: Test Backoff functions (Unit) */
+
+#include "mq/backoff.h"
+#include "mq/client.h"
+#include "mq/engine.h"
+#include "mq/thread.h"
+
+#include <assert.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Structures */
+
+typedef struct Failing Failing;
+struct Failing {
+    int	    fd;				// Listening socket
+    bool    hangup;			// Close connections without responding
+    bool    stop;
+    size_t  accepts;			// Connections accepted
+};
+
+/* Functions */
+
+double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Return seconds of CPU time used by the process.
+ */
+double cpu_time() {
+    struct rusage usage;
+    assert(getrusage(RUSAGE_SELF, &usage) == 0);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * Store a loopback port nothing listens on (as a string).
+ * @param   port        Where to store port number.
+ */
+void refused_port(char port[NI_MAXSERV]) {
+    struct sockaddr_in in = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t length      = sizeof(in);
+    int fd                = socket(AF_INET, SOCK_STREAM, 0);
+
+    assert(fd >= 0);
+    assert(bind(fd, (struct sockaddr *)&in, sizeof(in)) == 0);
+    assert(getsockname(fd, (struct sockaddr *)&in, &length) == 0);
+    snprintf(port, NI_MAXSERV, "%d", ntohs(in.sin_port));
+    close(fd);
+}
+
+/**
+ * Publish to a Message Queue whose server is down for a while, checking that
+ * it does not spin, that stopping it does not wait out its backoff, and that
+ * a consumer still sees the end of the queue.
+ * @param   engine      Shared I/O engine (NULL runs threads).
+ * @param   threshold   Failed connects that open the circuit.
+ */
+void outage(MQEngine *engine, size_t threshold) {
+    char port[NI_MAXSERV];
+    refused_port(port);
+
+    MessageQueue *mq = mq_create("outage", "localhost", port);
+    assert(mq);
+    mq->engine              = engine;
+    mq->breaker_threshold   = threshold;
+    mq->breaker_cooldown_ms = 60000;
+    mq_subscribe(mq, "topic");
+    mq_start(mq);
+
+    double cpu = cpu_time();
+    for (size_t m = 0; m < 16; m++) {
+        mq_publish(mq, "topic", "message");
+    }
+    usleep(1000000);
+    assert(cpu_time() - cpu < 0.25);
+
+    // Waits have been doubling (or the circuit opened)
+    if (!engine) {
+        assert(mq->push_connection->backoff.failures >= 3);
+        assert(mq->push_connection->backoff.failures <= (threshold ? threshold : 8));
+        assert(mq->push_connection->backoff.state == (threshold ? BACKOFF_OPEN : BACKOFF_CLOSED));
+    }
+
+    double start = timestamp();
+    mq_stop(mq);
+    assert(timestamp() - start < 0.5);
+
+    // The server never sends the SENTINEL, so one is delivered in its place
+    assert(mq_retrieve(mq) == NULL);
+    mq_delete(mq);
+}
+
+/**
+ * Accept connections and fail every request on them: respond 503, or close
+ * the connection at once.
+ * @param   arg         Failing structure.
+ */
+void * failing_server(void *arg) {
+    Failing *f = arg;
+
+    while (!__atomic_load_n(&f->stop, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = { .fd = f->fd, .events = POLLIN };
+        int client;
+        if (poll(&pfd, 1, 10) <= 0 || (client = accept(f->fd, NULL, NULL)) < 0) {
+            continue;
+        }
+        __atomic_add_fetch(&f->accepts, 1, __ATOMIC_RELAXED);
+
+        char buffer[BUFSIZ];
+        if (!f->hangup && read(client, buffer, sizeof(buffer)) > 0) {
+            const char *response = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            assert(write(client, response, strlen(response)) > 0);
+        }
+        close(client);
+    }
+    return NULL;
+}
+
+/**
+ * Run a Message Queue against a server that accepts connections but fails
+ * every request, checking that it backs off instead of asking in a loop.
+ * @param   engine      Shared I/O engine (NULL runs threads).
+ * @param   hangup      Whether server closes connections without responding.
+ */
+void failing(MQEngine *engine, bool hangup) {
+    struct sockaddr_in in = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t length      = sizeof(in);
+    Failing   f           = { .fd = socket(AF_INET, SOCK_STREAM, 0), .hangup = hangup };
+    char      port[NI_MAXSERV];
+
+    assert(f.fd >= 0);
+    assert(bind(f.fd, (struct sockaddr *)&in, sizeof(in)) == 0 && listen(f.fd, 64) == 0);
+    assert(getsockname(f.fd, (struct sockaddr *)&in, &length) == 0);
+    snprintf(port, sizeof(port), "%d", ntohs(in.sin_port));
+
+    Thread server;
+    thread_create(&server, NULL, failing_server, &f);
+
+    MessageQueue *mq = mq_create("failing", "localhost", port);
+    assert(mq);
+    mq->engine = engine;
+    mq_subscribe(mq, "topic");
+    mq_start(mq);
+    mq_publish(mq, "topic", "message");
+
+    double cpu = cpu_time();
+    usleep(1000000);
+    assert(cpu_time() - cpu < 0.25);
+    assert(__atomic_load_n(&f.accepts, __ATOMIC_RELAXED) < 40);
+
+    mq_stop(mq);
+    assert(mq_retrieve(mq) == NULL);
+    mq_delete(mq);
+
+    __atomic_store_n(&f.stop, true, __ATOMIC_RELEASE);
+    thread_join(server, NULL);
+    close(f.fd);
+}
+
+/* Tests */
+
+int test_00_backoff_failure() {
+    Backoff b;
+    backoff_init(&b, 100, 1000, 0, 5000);
+    assert(b.state == BACKOFF_CLOSED && b.failures == 0);
+    assert(backoff_remaining(&b, 1) == 0);
+
+    // Each failure doubles the wait (with jitter down to half of it) up to max
+    uint64_t now = 1000;
+    int ceilings[] = { 100, 200, 400, 800, 1000, 1000, 1000 };
+    for (size_t f = 0; f < sizeof(ceilings) / sizeof(ceilings[0]); f++) {
+        int delay = backoff_failure(&b, now, "localhost", "9620");
+        assert(delay >= ceilings[f] / 2 && delay <= ceilings[f]);
+        assert(backoff_remaining(&b, now) == delay);
+        assert(backoff_remaining(&b, now + delay) == 0);
+        now += delay;
+    }
+    assert(b.failures == 7 && b.state == BACKOFF_CLOSED);
+
+    // Clients failing together spread their waits out
+    Backoff other;
+    backoff_init(&other, 100, 1000, 0, 5000);
+    bool differ = false;
+    for (size_t f = 0; f < 16; f++) {
+        backoff_failure(&b, now, "localhost", "9620");
+        backoff_failure(&other, now, "localhost", "9620");
+        differ |= b.retry_at != other.retry_at;
+    }
+    assert(differ);
+
+    // Success starts over
+    backoff_success(&b, "localhost", "9620");
+    assert(b.failures == 0 && backoff_remaining(&b, now) == 0);
+    int delay = backoff_failure(&b, now, "localhost", "9620");
+    assert(delay >= 50 && delay <= 100);
+
+    // Without a minimum there is no wait at all
+    backoff_init(&b, 0, 0, 0, 0);
+    assert(backoff_failure(&b, now, "localhost", "9620") == 0);
+    assert(backoff_remaining(&b, now) == 0);
+    return EXIT_SUCCESS;
+}
+
+int test_01_backoff_breaker() {
+    Backoff b;
+    backoff_init(&b, 100, 1000, 3, 5000);
+
+    // Threshold failures in a row open the circuit for the cooldown
+    uint64_t now = 1000;
+    for (size_t f = 0; f < 2; f++) {
+        now += backoff_failure(&b, now, "localhost", "9620");
+        assert(b.state == BACKOFF_CLOSED);
+    }
+    int delay = backoff_failure(&b, now, "localhost", "9620");
+    assert(b.state == BACKOFF_OPEN);
+    assert(delay >= 2500 && delay <= 5000);
+
+    // It turns half-open once the cooldown is over, and a failed trial
+    // reopens it
+    assert(backoff_remaining(&b, now + delay - 1) == 1);
+    assert(b.state == BACKOFF_OPEN);
+    now += delay;
+    assert(backoff_remaining(&b, now) == 0);
+    assert(b.state == BACKOFF_HALF_OPEN);
+
+    delay = backoff_failure(&b, now, "localhost", "9620");
+    assert(b.state == BACKOFF_OPEN);
+    assert(delay >= 2500 && delay <= 5000);
+
+    // A successful trial closes it again
+    now += delay;
+    assert(backoff_remaining(&b, now) == 0);
+    backoff_success(&b, "localhost", "9620");
+    assert(b.state == BACKOFF_CLOSED && b.failures == 0);
+    delay = backoff_failure(&b, now, "localhost", "9620");
+    assert(b.state == BACKOFF_CLOSED && delay <= 100);
+    return EXIT_SUCCESS;
+}
+
+int test_02_mq_outage() {
+    outage(NULL, 0);
+    outage(NULL, 3);
+    return EXIT_SUCCESS;
+}
+
+int test_03_mq_engine_outage() {
+    EngineBackend backends[] = { ENGINE_EPOLL, ENGINE_URING };
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        MQEngine *engine = mq_engine_create_backend(1, backends[b]);
+        assert(engine);
+        outage(engine, 0);
+        outage(engine, 3);
+        mq_engine_delete(engine);
+    }
+    return EXIT_SUCCESS;
+}
+
+int test_04_mq_failing_server() {
+    failing(NULL, false);
+    failing(NULL, true);
+
+    EngineBackend backends[] = { ENGINE_EPOLL, ENGINE_URING };
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        MQEngine *engine = mq_engine_create_backend(1, backends[b]);
+        assert(engine);
+        failing(engine, false);
+        failing(engine, true);
+        mq_engine_delete(engine);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test backoff_failure\n");
+        fprintf(stderr, "    1. Test backoff_breaker\n");
+        fprintf(stderr, "    2. Test mq_outage\n");
+        fprintf(stderr, "    3. Test mq_engine_outage\n");
+        fprintf(stderr, "    4. Test mq_failing_server\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_backoff_failure(); break;
+        case 1:  status = test_01_backoff_breaker(); break;
+        case 2:  status = test_02_mq_outage(); break;
+        case 3:  status = test_03_mq_engine_outage(); break;
+        case 4:  status = test_04_mq_failing_server(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
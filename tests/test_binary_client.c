@@ -0,0 +1,107 @@
+/* test_binary_client.c: Message Queue binary message test */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define MAX_SIZE    (64<<20)
+
+const char * TOPIC   = "binary";
+const size_t SIZES[] = { 1, 2, 255, 1<<16, 1<<20, MAX_SIZE, 0 };
+
+/* Functions */
+
+/**
+ * Fill message with a pattern that includes NUL, CR and LF bytes.
+ */
+void fill(char *data, size_t size, size_t seed) {
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (i + seed) % 7 == 0 ? 0 : (char)((i * 31 + seed) & 0xff);
+    }
+}
+
+/**
+ * Publish a message of each size and check that each arrives intact.
+ */
+void echo(const char *name, const char *host, const char *port, void (*configure)(MessageQueue *)) {
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    configure(mq);
+
+    mq_subscribe(mq, TOPIC);
+    mq_start(mq);
+
+    char *data     = malloc(MAX_SIZE);
+    char *expected = malloc(MAX_SIZE);
+    assert(data && expected);
+
+    for (size_t s = 0; SIZES[s]; s++) {
+        fill(data, SIZES[s], s);
+        mq_publish_bytes(mq, TOPIC, data, SIZES[s]);
+    }
+
+    for (size_t s = 0; SIZES[s]; s++) {
+        MQMessage *m = mq_retrieve_msg(mq);
+        assert(m);
+
+        fill(expected, SIZES[s], s);
+        assert(mq_message_length(m) == SIZES[s]);
+        assert(memcmp(mq_message_body(m), expected, SIZES[s]) == 0);
+        mq_message_release(m);
+    }
+
+    // Messages still queued when stopping come out in one batch, and the
+    // SENTINEL behind them ends the next one
+    for (size_t m = 0; m < 3; m++) {
+        mq_publish(mq, TOPIC, "tail");
+    }
+    mq_unsubscribe(mq, TOPIC);
+    mq_stop(mq);
+
+    char *tail[8];
+    assert(mq_retrieve_batch(mq, tail, 0) == 0);
+    assert(mq_retrieve_batch(mq, tail, 8) == 3);
+    for (size_t m = 0; m < 3; m++) {
+        assert(streq(tail[m], "tail"));
+        free(tail[m]);
+    }
+    assert(mq_retrieve_batch(mq, tail, 8) == 0);
+    mq_delete(mq);
+    free(data);
+    free(expected);
+}
+
+void configure_default(MessageQueue *mq) {
+}
+
+void configure_streaming(MessageQueue *mq) {
+    mq->streaming       = true;
+    mq->window          = 8;
+    mq->linger_ms       = 1;
+    mq->max_batch_bytes = 1<<16;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host = "localhost";
+    char *port = "9620";
+    char name[BUFSIZ];
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+
+    snprintf(name, sizeof(name), "binary_client_test.%d", getpid());
+    echo(name, host, port, configure_default);
+
+    snprintf(name, sizeof(name), "binary_client_test.%d.streaming", getpid());
+    echo(name, host, port, configure_streaming);
+
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,171 @@
+/* test_broker_unit.c: Test Message Queue Broker (Unit) */
+
+#include "mq/broker.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+/* Constants */
+
+const char * BODY = "You win some, you lose some";
+
+/* Functions */
+
+int test_00_broker_create() {
+    Broker *b = broker_create();
+    assert(b);
+    assert(b->topics);
+    assert(b->queues);
+    assert(broker_queue(b, "q0") == NULL);
+
+    broker_delete(b);
+    return EXIT_SUCCESS;
+}
+
+int test_01_broker_subscribe() {
+    Broker *b = broker_create();
+    assert(b);
+
+    assert(!broker_subscribed(b, "q0", "t0"));
+    assert(broker_subscribe(b, "q0", "t0"));
+    assert(broker_subscribe(b, "q0", "t0"));
+    assert(broker_subscribed(b, "q0", "t0"));
+    assert(broker_queue(b, "q0"));
+
+    assert(!broker_unsubscribe(b, "q0", "t1"));
+    assert(!broker_unsubscribe(b, "q1", "t0"));
+    assert(broker_unsubscribe(b, "q0", "t0"));
+    assert(!broker_unsubscribe(b, "q0", "t0"));
+    assert(!broker_subscribed(b, "q0", "t0"));
+
+    // Queues outlive their subscriptions
+    assert(broker_queue(b, "q0"));
+
+    broker_delete(b);
+    return EXIT_SUCCESS;
+}
+
+int test_02_broker_publish() {
+    Broker *b = broker_create();
+    char    name[BUFSIZ];
+    assert(b);
+
+    assert(broker_publish(b, "t0", BODY, strlen(BODY)) == 0);
+
+    for (size_t q = 0; q < 5; q++) {
+        snprintf(name, sizeof(name), "q%lu", q);
+        assert(broker_subscribe(b, name, "t0"));
+    }
+    assert(broker_publish(b, "t0", BODY, strlen(BODY)) == 5);
+    assert(broker_publish(b, "t1", BODY, strlen(BODY)) == 0);
+
+    // Every subscriber queue refers to the same payload
+    Payload *p = broker_queue(b, "q0")->head->payload;
+    assert(p->refs == 5);
+    assert(p->length == strlen(BODY));
+    assert(memcmp(p->body, BODY, p->length) == 0);
+    assert(streq(p->topic, "t0"));
+
+    for (size_t q = 0; q < 5; q++) {
+        snprintf(name, sizeof(name), "q%lu", q);
+        BrokerQueue *queue = broker_queue(b, name);
+        assert(queue->size == 1);
+        assert(queue->head->payload == p);
+    }
+
+    broker_delete(b);
+    return EXIT_SUCCESS;
+}
+
+int test_03_broker_queue_pop() {
+    Broker *b = broker_create();
+    assert(b);
+
+    assert(broker_subscribe(b, "q0", "t0"));
+    assert(broker_subscribe(b, "q1", "t0"));
+    assert(broker_publish(b, "t0", "m0", 2) == 2);
+    assert(broker_publish(b, "t0", "m1", 2) == 2);
+
+    BrokerQueue *q0 = broker_queue(b, "q0");
+    BrokerQueue *q1 = broker_queue(b, "q1");
+
+    Message *m = broker_queue_pop(q0);
+    assert(m && memcmp(m->payload->body, "m0", 2) == 0);
+    assert(m->payload->refs == 2);
+    message_delete(m);
+    assert(q1->head->payload->refs == 1);
+
+    m = broker_queue_pop(q1);
+    assert(m && memcmp(m->payload->body, "m0", 2) == 0);
+    message_delete(m);
+
+    m = broker_queue_pop(q0);
+    assert(m && memcmp(m->payload->body, "m1", 2) == 0);
+    message_delete(m);
+
+    assert(broker_queue_pop(q0) == NULL);
+    assert(q0->size == 0);
+    assert(q1->size == 1);
+
+    broker_delete(b);
+    return EXIT_SUCCESS;
+}
+
+int test_04_broker_queue_wait() {
+    Broker *b = broker_create();
+    Waiter  w[3] = {{0}};
+    assert(b);
+
+    assert(broker_subscribe(b, "q0", "t0"));
+    BrokerQueue *q = broker_queue(b, "q0");
+
+    for (size_t i = 0; i < 3; i++) {
+        broker_queue_wait(q, &w[i]);
+        assert(w[i].queue == q);
+    }
+    assert(q->waiters == &w[0]);
+
+    broker_queue_unwait(&w[1]);
+    assert(w[1].queue == NULL);
+    assert(w[0].next == &w[2] && w[2].prev == &w[0]);
+
+    broker_queue_unwait(&w[0]);
+    assert(q->waiters == &w[2]);
+    broker_queue_unwait(&w[2]);
+    assert(q->waiters == NULL);
+
+    broker_delete(b);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test broker_create\n");
+        fprintf(stderr, "    1. Test broker_subscribe\n");
+        fprintf(stderr, "    2. Test broker_publish\n");
+        fprintf(stderr, "    3. Test broker_queue_pop\n");
+        fprintf(stderr, "    4. Test broker_queue_wait\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_broker_create(); break;
+        case 1:  status = test_01_broker_subscribe(); break;
+        case 2:  status = test_02_broker_publish(); break;
+        case 3:  status = test_03_broker_queue_pop(); break;
+        case 4:  status = test_04_broker_queue_wait(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,519 @@
+/* test_bus_unit.c: Test Shared-memory Bus (Unit) */
+
+#include "mq/bus.h"
+#include "mq/client.h"
+#include "mq/string.h"
+#include "mq/thread.h"
+
+#include <assert.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define PRODUCERS   4
+#define MESSAGES    (1<<14)
+
+/* Structures */
+
+typedef struct Sample Sample;
+struct Sample {
+    size_t  producer;
+    size_t  sequence;
+};
+
+/* Functions */
+
+const char * bus_path() {
+    static char path[BUFSIZ];
+    if (!path[0]) {
+        // Named once, so processes forked later share it
+        snprintf(path, sizeof(path), "/test_bus_unit.%d", getpid());
+    }
+    return path;
+}
+
+double timestamp() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void * retrieve_thread(void *arg) {
+    return bus_retrieve((Bus *)arg, -1);
+}
+
+void * waiting_thread(void *arg) {
+    return mq_retrieve_msg((MessageQueue *)arg);
+}
+
+void * publish_thread(void *arg) {
+    char body[BUS_RING_SIZE / 8] = {0};
+    for (size_t m = 0; m < 16; m++) {
+        assert(bus_publish((Bus *)arg, "full", body, sizeof(body), true) == 1);
+    }
+    return NULL;
+}
+
+/* Tests */
+
+int test_00_bus_create() {
+    Bus *b = bus_create(bus_path(), "queue");
+    assert(b);
+    assert(b->slot >= 0);
+
+    // A queue has one consumer, and another queue gets its own slot
+    Bus *other = bus_create(bus_path(), "other");
+    Bus *none  = bus_create(bus_path(), NULL);
+    assert(bus_create(bus_path(), "queue") == NULL);
+    assert(other && none);
+    assert(other->slot != b->slot);
+    assert(none->slot < 0);
+    assert(bus_retrieve(none, 0) == NULL);
+
+    // Names that do not fit are refused
+    char name[BUS_NAME + 1];
+    memset(name, 'x', BUS_NAME);
+    name[BUS_NAME] = 0;
+    assert(bus_create(bus_path(), name) == NULL);
+
+    // Once detached, attaching again finds the same queue
+    assert(bus_subscribe(b, "topic"));
+    int slot = b->slot;
+    bus_delete(b);
+    b = bus_create(bus_path(), "queue");
+    assert(b && b->slot == slot);
+    assert(bus_unsubscribe(b, "topic"));
+
+    bus_delete(none);
+    bus_delete(other);
+    bus_delete(b);
+    assert(bus_remove(bus_path()));
+    assert(!bus_remove(bus_path()));
+    return EXIT_SUCCESS;
+}
+
+int test_01_bus_publish() {
+    Bus *subscriber = bus_create(bus_path(), "subscriber");
+    Bus *publisher  = bus_create(bus_path(), NULL);
+    assert(subscriber && publisher);
+
+    assert(bus_subscribe(subscriber, "sports"));
+    assert(bus_subscribe(subscriber, "sports"));
+    assert(bus_subscribe(subscriber, "news"));
+
+    assert(bus_publish(publisher, "sports", "goal", 4, true) == 1);
+    assert(bus_publish(publisher, "weather", "rain", 4, true) == 0);
+    assert(bus_publish(publisher, "news", "a\0b", 3, true) == 1);
+
+    Request *r = bus_retrieve(subscriber, 0);
+    assert(r && r->length == 4 && streq(r->body, "goal") && streq(r->uri, "/topic/sports"));
+    assert(r->timestamp);
+    request_delete(r);
+
+    r = bus_retrieve(subscriber, 0);
+    assert(r && r->length == 3 && memcmp(r->body, "a\0b", 3) == 0 && streq(r->uri, "/topic/news"));
+    request_delete(r);
+
+    // Nothing else arrived (waiting gives up once timeout passes)
+    assert(bus_retrieve(subscriber, 0) == NULL);
+    assert(bus_retrieve(subscriber, 10) == NULL);
+
+    assert(bus_unsubscribe(subscriber, "sports"));
+    assert(!bus_unsubscribe(subscriber, "sports"));
+    assert(bus_publish(publisher, "sports", "miss", 4, true) == 0);
+    assert(bus_publish(publisher, "news", "flash", 5, true) == 1);
+
+    r = bus_retrieve(subscriber, -1);
+    assert(r && streq(r->body, "flash"));
+    request_delete(r);
+
+    // Messages too large for a ring are dropped
+    char *large = calloc(1, BUS_RING_SIZE);
+    assert(large);
+    assert(bus_publish(publisher, "news", large, BUS_RING_SIZE, true) == 0);
+    assert(publisher->dropped == 1);
+    free(large);
+
+    assert(bus_unsubscribe(subscriber, "news"));
+    bus_delete(publisher);
+    bus_delete(subscriber);
+    assert(bus_remove(bus_path()));
+    return EXIT_SUCCESS;
+}
+
+int test_02_bus_wrap() {
+    Bus *b = bus_create(bus_path(), "queue");
+    assert(b && bus_subscribe(b, "topic"));
+
+    // Bodies of varying size go around the ring several times
+    char   body[1<<13];
+    size_t total = 0;
+    for (size_t m = 0; total < 8 * BUS_RING_SIZE; m++) {
+        size_t length = (m * 7919) % sizeof(body);
+        memset(body, 'a' + m % 26, length);
+        assert(bus_publish(b, "topic", body, length, true) == 1);
+        total += length;
+
+        Request *r = bus_retrieve(b, 0);
+        assert(r && r->length == length);
+        for (size_t i = 0; i < length; i++) {
+            assert(r->body[i] == 'a' + (char)(m % 26));
+        }
+        request_delete(r);
+    }
+    assert(bus_retrieve(b, 0) == NULL);
+
+    bus_delete(b);
+    assert(bus_remove(bus_path()));
+    return EXIT_SUCCESS;
+}
+
+int test_03_bus_full() {
+    Bus *b = bus_create(bus_path(), "queue");
+    assert(b && bus_subscribe(b, "full"));
+
+    // Without waiting, publishes that do not fit are dropped
+    char   body[BUS_RING_SIZE / 8] = {0};
+    size_t written = 0;
+    while (bus_publish(b, "full", body, sizeof(body), false)) {
+        written++;
+    }
+    assert(written > 0 && written < 8);
+    assert(b->dropped == 1);
+
+    // A waiting publisher resumes as the ring drains
+    Thread thread;
+    thread_create(&thread, NULL, publish_thread, b);
+    for (size_t m = 0; m < written + 16; m++) {
+        Request *r = bus_retrieve(b, -1);
+        assert(r && r->length == sizeof(body));
+        request_delete(r);
+    }
+    thread_join(thread, NULL);
+    assert(bus_retrieve(b, 0) == NULL);
+
+    bus_delete(b);
+    assert(bus_remove(bus_path()));
+    return EXIT_SUCCESS;
+}
+
+int test_04_bus_processes() {
+    Bus *b = bus_create(bus_path(), "queue");
+    assert(b && bus_subscribe(b, "samples"));
+
+    // Each producer process publishes its samples in order
+    pid_t pids[PRODUCERS];
+    for (size_t p = 0; p < PRODUCERS; p++) {
+        if ((pids[p] = fork()) == 0) {
+            Bus *publisher = bus_create(bus_path(), NULL);
+            if (!publisher) {
+                _exit(EXIT_FAILURE);
+            }
+            for (size_t m = 0; m < MESSAGES; m++) {
+                Sample sample = { p, m };
+                bus_publish(publisher, "samples", &sample, sizeof(sample), true);
+            }
+            bus_delete(publisher);
+            _exit(EXIT_SUCCESS);
+        }
+        assert(pids[p] > 0);
+    }
+
+    size_t next[PRODUCERS] = {0};
+    for (size_t m = 0; m < PRODUCERS * MESSAGES; m++) {
+        Request *r = bus_retrieve(b, 10000);
+        assert(r && r->length == sizeof(Sample));
+
+        Sample sample;
+        memcpy(&sample, r->body, sizeof(sample));
+        assert(sample.producer < PRODUCERS && sample.sequence == next[sample.producer]);
+        next[sample.producer]++;
+        request_delete(r);
+    }
+
+    for (size_t p = 0; p < PRODUCERS; p++) {
+        int status;
+        assert(waitpid(pids[p], &status, 0) == pids[p]);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+    assert(bus_retrieve(b, 0) == NULL);
+
+    bus_delete(b);
+    assert(bus_remove(bus_path()));
+    return EXIT_SUCCESS;
+}
+
+int test_05_bus_stop() {
+    Bus *b = bus_create(bus_path(), "queue");
+    assert(b);
+
+    Thread thread;
+    thread_create(&thread, NULL, retrieve_thread, b);
+    usleep(10000);
+    bus_stop(b);
+
+    void *result = b;
+    thread_join(thread, &result);
+    assert(result == NULL);
+    assert(bus_retrieve(b, -1) == NULL);
+
+    bus_delete(b);
+    assert(bus_remove(bus_path()));
+    return EXIT_SUCCESS;
+}
+
+int test_06_mq_bus() {
+    char host[BUFSIZ];
+    snprintf(host, sizeof(host), "%s%s", BUS_PREFIX, bus_path());
+
+    MessageQueue *subscriber = mq_create("subscriber", host, NULL);
+    assert(subscriber && subscriber->bus);
+    mq_subscribe(subscriber, "topic");
+    mq_start(subscriber);
+
+    // Another process publishes through a Message Queue of its own
+    pid_t pid = fork();
+    if (pid == 0) {
+        MessageQueue *publisher = mq_create("publisher", host, NULL);
+        if (!publisher) {
+            _exit(EXIT_FAILURE);
+        }
+        mq_start(publisher);
+        for (size_t m = 0; m < MESSAGES; m++) {
+            char body[BUFSIZ];
+            snprintf(body, sizeof(body), "%zu", m);
+            mq_publish(publisher, "topic", body);
+        }
+        mq_stop(publisher);
+        mq_delete(publisher);
+        _exit(EXIT_SUCCESS);
+    }
+    assert(pid > 0);
+
+    for (size_t m = 0; m < MESSAGES; m++) {
+        MQMessage *message = mq_retrieve_msg_timed(subscriber, 10000);
+        assert(message);
+        assert(strtoul(mq_message_body(message), NULL, 10) == m);
+        assert(streq(mq_message_topic(message), "topic"));
+        mq_message_release(message);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    assert(mq_try_retrieve(subscriber) == NULL);
+
+    mq_unsubscribe(subscriber, "topic");
+    mq_stop(subscriber);
+    assert(mq_retrieve(subscriber) == NULL);
+    mq_delete(subscriber);
+    assert(bus_remove(bus_path()));
+    return EXIT_SUCCESS;
+}
+
+int test_07_bus_owner() {
+    Bus *b         = bus_create(bus_path(), "queue");
+    Bus *publisher = bus_create(bus_path(), NULL);
+    assert(b && publisher && bus_subscribe(b, "full"));
+
+    // A live owner that stops reading holds publishers up for BUS_FULL_MS
+    char   body[BUS_RING_SIZE / 8] = {0};
+    size_t written = 0;
+    while (bus_publish(publisher, "full", body, sizeof(body), false)) {
+        written++;
+    }
+    double start = timestamp();
+    assert(bus_publish(publisher, "full", body, sizeof(body), true) == 0);
+    assert(timestamp() - start >= BUS_FULL_MS / 1000.0 * 0.9);
+    assert(publisher->dropped == 2);
+
+    // A crashed owner holds nobody up, and its queue can be taken over
+    pid_t pid = fork();
+    if (pid == 0) {
+        Bus *crashed = bus_create(bus_path(), "crashed");
+        _exit(crashed && bus_subscribe(crashed, "full") ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int status;
+    assert(pid > 0 && waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+    assert(bus_unsubscribe(b, "full"));
+    start = timestamp();
+    for (size_t m = 0; m < written + 4; m++) {
+        bus_publish(publisher, "full", body, sizeof(body), true);
+    }
+    assert(timestamp() - start < BUS_FULL_MS / 1000.0 / 2);
+
+    Bus *crashed = bus_create(bus_path(), "crashed");
+    assert(crashed);
+    Request *r = bus_retrieve(crashed, 0);
+    assert(r && r->length == sizeof(body));
+    request_delete(r);
+
+    assert(bus_unsubscribe(crashed, "full"));
+    bus_delete(crashed);
+    bus_delete(publisher);
+    bus_delete(b);
+    assert(bus_remove(bus_path()));
+    return EXIT_SUCCESS;
+}
+
+int test_08_bus_fd() {
+    Bus *b = bus_create(bus_path(), "queue");
+    assert(b && bus_subscribe(b, "topic"));
+    assert(bus_fd(b) >= 0 && bus_fd(b) == bus_fd(b));
+
+    struct pollfd pfd = { .fd = bus_fd(b), .events = POLLIN };
+    assert(poll(&pfd, 1, 0) == 0);
+
+    // Another process publishing makes it readable until we drain the ring
+    pid_t pid = fork();
+    if (pid == 0) {
+        Bus *publisher = bus_create(bus_path(), NULL);
+        _exit(publisher && bus_publish(publisher, "topic", "one", 3, true) == 1 &&
+              bus_publish(publisher, "topic", "two", 3, true) == 1 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int status;
+    assert(pid > 0 && waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+    assert(poll(&pfd, 1, 10000) == 1 && (pfd.revents & POLLIN));
+    size_t received = 0;
+    Request *r;
+    while ((r = bus_retrieve(b, 0))) {
+        request_delete(r);
+        received++;
+    }
+    assert(received == 2);
+    assert(poll(&pfd, 1, 0) == 0);
+
+    // Stopping leaves it readable, so pollers find out
+    bus_stop(b);
+    assert(poll(&pfd, 1, 10000) == 1);
+    assert(bus_retrieve(b, 0) == NULL);
+
+    assert(bus_unsubscribe(b, "topic"));
+    bus_delete(b);
+    assert(bus_remove(bus_path()));
+    return EXIT_SUCCESS;
+}
+
+int test_09_mq_waiters() {
+    char host[BUFSIZ];
+    snprintf(host, sizeof(host), "%s%s", BUS_PREFIX, bus_path());
+
+    MessageQueue *bus   = mq_create("waiters", host, NULL);
+    MessageQueue *plain = mq_create("waiters", "localhost", "9620");
+    Bus *         publisher = bus_create(bus_path(), NULL);
+    assert(bus && bus->bus && plain && publisher);
+    mq_subscribe(bus, "topic");
+    mq_start(bus);
+
+    MessageQueue *mqs[] = { bus, plain };
+    for (size_t m = 0; m < 2; m++) {
+        MessageQueue *mq = mqs[m];
+
+        // A retrieve blocked in one thread holds up no other thread's
+        Thread waiter;
+        thread_create(&waiter, NULL, waiting_thread, mq);
+        usleep(50000);
+
+        double start = timestamp();
+        assert(mq_retrieve_timed(mq, 100) == NULL);
+        assert(mq_try_retrieve(mq) == NULL);
+        assert(timestamp() - start < 1.0);
+
+        // And it still gets the next message
+        if (mq->bus) {
+            assert(bus_publish(publisher, "topic", "one", 3, true) == 1);
+        } else {
+            assert(queue_push(mq->incoming, request_create("PUT", "/topic/topic", "one")));
+        }
+
+        void *message;
+        thread_join(waiter, &message);
+        assert(message && streq(mq_message_body(message), "one"));
+        mq_message_release(message);
+    }
+
+    mq_unsubscribe(bus, "topic");
+    mq_stop(bus);
+    mq_delete(bus);
+    mq_delete(plain);
+    bus_delete(publisher);
+    assert(bus_remove(bus_path()));
+    return EXIT_SUCCESS;
+}
+
+int test_10_mq_try_retrieve_msg() {
+    MessageQueue *mq = mq_create("sentinel", "localhost", "9620");
+    assert(mq);
+
+    // A SENTINEL another client published does not hide what follows it
+    assert(queue_push(mq->incoming, request_create("PUT", "/topic/topic", "one")));
+    assert(queue_push(mq->incoming, request_create("PUT", "/topic/SHUTDOWN", "SHUTDOWN")));
+    assert(queue_push(mq->incoming, request_create("PUT", "/topic/topic", "two")));
+
+    const char *expected[] = { "one", NULL, "two" };
+    for (size_t m = 0; m < 3; m++) {
+        bool       sentinel;
+        MQMessage *message = mq_try_retrieve_msg(mq, &sentinel);
+        if (expected[m]) {
+            assert(message && !sentinel && streq(mq_message_body(message), expected[m]));
+            mq_message_release(message);
+        } else {
+            assert(!message && sentinel);
+        }
+    }
+
+    bool sentinel = true;
+    assert(mq_try_retrieve_msg(mq, &sentinel) == NULL && !sentinel);
+
+    mq_delete(mq);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test bus_create\n");
+        fprintf(stderr, "    1. Test bus_publish\n");
+        fprintf(stderr, "    2. Test bus_wrap\n");
+        fprintf(stderr, "    3. Test bus_full\n");
+        fprintf(stderr, "    4. Test bus_processes\n");
+        fprintf(stderr, "    5. Test bus_stop\n");
+        fprintf(stderr, "    6. Test mq_bus\n");
+        fprintf(stderr, "    7. Test bus_owner\n");
+        fprintf(stderr, "    8. Test bus_fd\n");
+        fprintf(stderr, "    9. Test mq_waiters\n");
+        fprintf(stderr, "    10. Test mq_try_retrieve_msg\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_bus_create(); break;
+        case 1:  status = test_01_bus_publish(); break;
+        case 2:  status = test_02_bus_wrap(); break;
+        case 3:  status = test_03_bus_full(); break;
+        case 4:  status = test_04_bus_processes(); break;
+        case 5:  status = test_05_bus_stop(); break;
+        case 6:  status = test_06_mq_bus(); break;
+        case 7:  status = test_07_bus_owner(); break;
+        case 8:  status = test_08_bus_fd(); break;
+        case 9:  status = test_09_mq_waiters(); break;
+        case 10: status = test_10_mq_try_retrieve_msg(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,128 @@
+/* test_cluster_client.c: Message Queue cluster (multiple brokers) test */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define NTOPICS	    32
+#define NMESSAGES   32
+
+/* Functions */
+
+/**
+ * Publish to many topics through a cluster Message Queue and retrieve them
+ * all again, checking that each topic keeps its order and that topics were
+ * spread over every broker.
+ */
+void echo(const char *endpoints[], const char *suffix, MQEngine *engine,
+          void (*configure)(MessageQueue *)) {
+    char name[BUFSIZ];
+    char topics[NTOPICS][BUFSIZ];
+    char body[BUFSIZ];
+
+    snprintf(name, sizeof(name), "cluster_client_test.%d.%s", getpid(), suffix);
+    MessageQueue *mq = mq_create_cluster(name, endpoints);
+    assert(mq && mq->nbrokers > 0);
+    configure(mq);
+    mq->engine = engine;
+
+    // Another client listing the brokers in reverse picks the same broker
+    // for every topic
+    size_t      nbrokers = mq->nbrokers;
+    const char *reversed[nbrokers + 1];
+    for (size_t b = 0; b < nbrokers; b++) {
+        reversed[b] = endpoints[nbrokers - 1 - b];
+    }
+    reversed[nbrokers] = NULL;
+    MessageQueue *other = mq_create_cluster(name, reversed);
+    assert(other && other->nbrokers == nbrokers);
+
+    size_t used[nbrokers];
+    memset(used, 0, sizeof(used));
+    for (size_t t = 0; t < NTOPICS; t++) {
+        snprintf(topics[t], sizeof(topics[t]), "cluster_client_test.%d.%s.%zu", getpid(), suffix, t);
+        MessageQueue *broker = mq->brokers[cluster_lookup(mq->cluster, topics[t])];
+        MessageQueue *same   = other->brokers[cluster_lookup(other->cluster, topics[t])];
+        assert(streq(broker->host, same->host) && streq(broker->port, same->port));
+        used[cluster_lookup(mq->cluster, topics[t])]++;
+
+        mq_subscribe(mq, topics[t]);
+    }
+    for (size_t b = 0; b < nbrokers; b++) {
+        assert(used[b] > 0);
+    }
+    mq_delete(other);
+
+    mq_start(mq);
+
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        for (size_t t = 0; t < NTOPICS; t++) {
+            snprintf(body, sizeof(body), "%zu:%zu", t, m);
+            mq_publish(mq, topics[t], body);
+        }
+    }
+
+    // Brokers interleave, but each topic arrives in order
+    size_t next[NTOPICS] = {0};
+    for (size_t n = 0; n < NTOPICS * NMESSAGES; n++) {
+        char *message = mq_retrieve(mq);
+        assert(message);
+
+        size_t t, m;
+        assert(sscanf(message, "%zu:%zu", &t, &m) == 2);
+        assert(t < NTOPICS && m == next[t]);
+        next[t]++;
+        free(message);
+    }
+
+    for (size_t t = 0; t < NTOPICS; t++) {
+        mq_unsubscribe(mq, topics[t]);
+    }
+    mq_stop(mq);
+    assert(mq_retrieve_timed(mq, 0) == NULL);
+    mq_delete(mq);
+}
+
+void configure_default(MessageQueue *mq) {
+}
+
+void configure_pipelined(MessageQueue *mq) {
+    mq->window       = 8;
+    mq->retrieve_max = 16;
+}
+
+void configure_streaming(MessageQueue *mq) {
+    mq->streaming       = true;
+    mq->window          = 8;
+    mq->linger_ms       = 1;
+    mq->max_batch_bytes = 1<<16;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s ENDPOINT...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char **endpoints = (const char **)argv + 1;
+    assert(mq_create_cluster("invalid", (const char *[]){ "localhost", NULL }) == NULL);
+    assert(mq_create_cluster("invalid", (const char *[]){ NULL }) == NULL);
+
+    echo(endpoints, "default", NULL, configure_default);
+    echo(endpoints, "pipelined", NULL, configure_pipelined);
+    echo(endpoints, "streaming", NULL, configure_streaming);
+
+    MQEngine *engine = mq_engine_create(2);
+    assert(engine);
+    echo(endpoints, "engine", engine, configure_pipelined);
+    mq_engine_delete(engine);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,135 @@
+/* test_cluster_unit.c: Test Cluster functions (Unit) */
+
+#include "mq/cluster.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Constants */
+
+#define NKEYS	    (1<<14)
+
+const char *NODES[] = { "localhost:9620", "localhost:9621", "localhost:9622", "localhost:9623", "localhost:9624" };
+
+/* Functions */
+
+/**
+ * Format key number as a topic name.
+ */
+const char * key(size_t k) {
+    static char name[BUFSIZ];
+    snprintf(name, sizeof(name), "topic.%zu", k);
+    return name;
+}
+
+/* Tests */
+
+int test_00_cluster_create() {
+    assert(cluster_create(NODES, 0) == NULL);
+
+    Cluster *c = cluster_create(NODES, 4);
+    assert(c);
+    assert(c->nnodes == 4 && c->npoints == 4 * CLUSTER_REPLICAS);
+    for (size_t p = 1; p < c->npoints; p++) {
+        assert(c->points[p - 1].hash <= c->points[p].hash);
+    }
+
+    // Every node owns CLUSTER_REPLICAS points
+    size_t points[4] = {0};
+    for (size_t p = 0; p < c->npoints; p++) {
+        assert(c->points[p].node < 4);
+        points[c->points[p].node]++;
+    }
+    for (size_t n = 0; n < 4; n++) {
+        assert(points[n] == CLUSTER_REPLICAS);
+    }
+
+    cluster_delete(c);
+    cluster_delete(NULL);
+    return EXIT_SUCCESS;
+}
+
+int test_01_cluster_lookup() {
+    Cluster *c = cluster_create(NODES, 4);
+    assert(c);
+
+    // Keys spread evenly, and each always goes to the same node
+    size_t counts[4] = {0};
+    for (size_t k = 0; k < NKEYS; k++) {
+        size_t node = cluster_lookup(c, key(k));
+        assert(node < 4);
+        assert(cluster_lookup(c, key(k)) == node);
+        counts[node]++;
+    }
+    for (size_t n = 0; n < 4; n++) {
+        assert(counts[n] > NKEYS / 4 * 2 / 3 && counts[n] < NKEYS / 4 * 4 / 3);
+    }
+
+    // Listing the same nodes in another order maps keys to the same names
+    const char *reversed[] = { NODES[3], NODES[2], NODES[1], NODES[0] };
+    Cluster    *r          = cluster_create(reversed, 4);
+    assert(r);
+    for (size_t k = 0; k < NKEYS; k++) {
+        assert(reversed[cluster_lookup(r, key(k))] == NODES[cluster_lookup(c, key(k))]);
+    }
+
+    // A single node owns everything
+    Cluster *one = cluster_create(NODES, 1);
+    assert(one);
+    assert(cluster_lookup(one, "") == 0 && cluster_lookup(one, key(0)) == 0);
+
+    cluster_delete(one);
+    cluster_delete(r);
+    cluster_delete(c);
+    return EXIT_SUCCESS;
+}
+
+int test_02_cluster_rebalance() {
+    Cluster *before = cluster_create(NODES, 4);
+    Cluster *after  = cluster_create(NODES, 5);
+    assert(before && after);
+
+    // Adding a node only moves keys to it (about a fifth of them)
+    size_t moved = 0;
+    for (size_t k = 0; k < NKEYS; k++) {
+        size_t from = cluster_lookup(before, key(k));
+        size_t to   = cluster_lookup(after, key(k));
+        if (from != to) {
+            assert(to == 4);
+            moved++;
+        }
+    }
+    assert(moved > NKEYS / 5 * 2 / 3 && moved < NKEYS / 5 * 4 / 3);
+
+    cluster_delete(after);
+    cluster_delete(before);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test cluster_create\n");
+        fprintf(stderr, "    1. Test cluster_lookup\n");
+        fprintf(stderr, "    2. Test cluster_rebalance\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_cluster_create(); break;
+        case 1:  status = test_01_cluster_lookup(); break;
+        case 2:  status = test_02_cluster_rebalance(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,147 @@
+/* test_engine_client.c: Message Queue shared I/O engine test */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define NQUEUES	    16
+#define NMESSAGES   64
+#define NTHREADS    2
+
+const EngineBackend BACKENDS[] = { ENGINE_EPOLL, ENGINE_URING };
+
+/* Functions */
+
+/**
+ * Have many Message Queues share one engine: each publishes to its own topic
+ * and checks that every message comes back in order.
+ */
+void echo(MQEngine *engine, const char *host, const char *port, const char *suffix,
+          MessageQueue *(*create)(const char *, const char *, const char *),
+          void (*configure)(MessageQueue *)) {
+    MessageQueue *mqs[NQUEUES];
+    char name[BUFSIZ];
+    char body[BUFSIZ];
+
+    for (size_t q = 0; q < NQUEUES; q++) {
+        snprintf(name, sizeof(name), "engine_client_test.%d.%d.%s.%zu", getpid(), engine->backend, suffix, q);
+        mqs[q] = create(name, host, port);
+        assert(mqs[q]);
+        configure(mqs[q]);
+
+        mqs[q]->engine = engine;
+        mq_subscribe(mqs[q], name);
+        mq_start(mqs[q]);
+    }
+
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        for (size_t q = 0; q < NQUEUES; q++) {
+            snprintf(body, sizeof(body), "%zu:%zu", q, m);
+            mq_publish(mqs[q], mqs[q]->name, body);
+        }
+    }
+
+    for (size_t q = 0; q < NQUEUES; q++) {
+        for (size_t m = 0; m < NMESSAGES; m++) {
+            char *message = mq_retrieve(mqs[q]);
+            assert(message);
+
+            snprintf(body, sizeof(body), "%zu:%zu", q, m);
+            assert(streq(message, body));
+            free(message);
+        }
+    }
+
+    for (size_t q = 0; q < NQUEUES; q++) {
+        mq_unsubscribe(mqs[q], mqs[q]->name);
+        mq_stop(mqs[q]);
+        mq_delete(mqs[q]);
+    }
+}
+
+/**
+ * Check that a lone publish on the engine waits linger_ms for its batch to
+ * fill, as it does in the pusher thread.
+ */
+void linger(MQEngine *engine, const char *host, const char *port) {
+    char name[BUFSIZ];
+    snprintf(name, sizeof(name), "engine_client_test.%d.%d.linger", getpid(), engine->backend);
+
+    MessageQueue *mq = mq_create(name, host, port);
+    assert(mq);
+    mq->linger_ms       = 200;
+    mq->max_batch_bytes = 1<<16;
+    mq->engine          = engine;
+    mq_subscribe(mq, name);
+    mq_start(mq);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mq_publish(mq, name, "lingered");
+    char *message = mq_retrieve(mq);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(message && streq(message, "lingered"));
+    assert((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000 >= 150);
+    free(message);
+
+    mq_unsubscribe(mq, name);
+    mq_stop(mq);
+    mq_delete(mq);
+}
+
+MessageQueue * create_small(const char *name, const char *host, const char *port) {
+    return mq_create_bounded(name, host, port, 4, 0, QUEUE_BLOCK);
+}
+
+void configure_default(MessageQueue *mq) {
+}
+
+void configure_pipelined(MessageQueue *mq) {
+    mq->window       = 8;
+    mq->retrieve_max = 16;
+}
+
+void configure_streaming(MessageQueue *mq) {
+    mq->streaming       = true;
+    mq->window          = 8;
+    mq->linger_ms       = 1;
+    mq->max_batch_bytes = 1<<16;
+}
+
+void configure_lingering(MessageQueue *mq) {
+    mq->window          = 8;
+    mq->linger_ms       = 20;
+    mq->max_batch_bytes = 1<<10;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char *host = "localhost";
+    char *port = "9620";
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+
+    for (size_t b = 0; b < sizeof(BACKENDS) / sizeof(BACKENDS[0]); b++) {
+        MQEngine *engine = mq_engine_create_backend(NTHREADS, BACKENDS[b]);
+        assert(engine);
+
+        echo(engine, host, port, "default", mq_create, configure_default);
+        echo(engine, host, port, "pipelined", mq_create, configure_pipelined);
+        echo(engine, host, port, "streaming", mq_create, configure_streaming);
+        echo(engine, host, port, "bounded", create_small, configure_pipelined);
+        echo(engine, host, port, "lingering", mq_create, configure_lingering);
+        linger(engine, host, port);
+
+        mq_engine_delete(engine);
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
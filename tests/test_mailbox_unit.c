@@ -0,0 +1,154 @@
+/* test_mailbox_unit.c: Test Lock-free Mailbox (Unit) */
+
+#include "mq/mailbox.h"
+#include "mq/thread.h"
+
+#include <assert.h>
+#include <poll.h>
+
+/* Constants */
+
+#define PRODUCERS   4
+#define LETTERS	    (1<<14)
+
+/* Structures */
+
+typedef struct Letter Letter;
+struct Letter {
+    Mail    mail;
+    size_t  producer;
+    size_t  sequence;
+};
+
+typedef struct Producer Producer;
+struct Producer {
+    Mailbox *mailbox;
+    size_t   index;
+    Thread   thread;
+};
+
+/* Functions */
+
+Letter * letter_create(size_t producer, size_t sequence) {
+    Letter *l = calloc(1, sizeof(Letter));
+    assert(l);
+    l->producer = producer;
+    l->sequence = sequence;
+    return l;
+}
+
+bool mailbox_readable(Mailbox *m) {
+    struct pollfd pfd = { .fd = m->fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) == 1;
+}
+
+void * producer_thread(void *arg) {
+    Producer *p = arg;
+
+    for (size_t sequence = 0; sequence < LETTERS; sequence++) {
+        mailbox_send(p->mailbox, &letter_create(p->index, sequence)->mail);
+    }
+
+    return NULL;
+}
+
+int test_00_mailbox_create() {
+    Mailbox *m = mailbox_create();
+    assert(m);
+    assert(m->head == NULL);
+    assert(m->fd >= 0);
+    assert(!mailbox_readable(m));
+
+    mailbox_delete(m);
+    return EXIT_SUCCESS;
+}
+
+int test_01_mailbox_send() {
+    Mailbox *m = mailbox_create();
+    assert(m);
+
+    for (size_t sequence = 0; sequence < 5; sequence++) {
+        mailbox_send(m, &letter_create(0, sequence)->mail);
+        assert(m->head);
+        assert(mailbox_readable(m));
+    }
+
+    size_t sequence = 0;
+    for (Mail *mail = mailbox_receive(m); mail; sequence++) {
+        Letter *l = (Letter *)mail;
+        mail = mail->next;
+        assert(l->sequence == sequence);
+        free(l);
+    }
+    assert(sequence == 5);
+    assert(m->head == NULL);
+    assert(!mailbox_readable(m));
+    assert(mailbox_receive(m) == NULL);
+
+    mailbox_delete(m);
+    return EXIT_SUCCESS;
+}
+
+int test_02_mailbox_producers() {
+    Mailbox *m = mailbox_create();
+    assert(m);
+
+    Producer producers[PRODUCERS];
+    for (size_t p = 0; p < PRODUCERS; p++) {
+        producers[p].mailbox = m;
+        producers[p].index   = p;
+        thread_create(&producers[p].thread, NULL, producer_thread, &producers[p]);
+    }
+
+    // Each producer's letters arrive exactly once and in the order sent
+    size_t next[PRODUCERS] = {0};
+    size_t received        = 0;
+    while (received < PRODUCERS * LETTERS) {
+        struct pollfd pfd = { .fd = m->fd, .events = POLLIN };
+        poll(&pfd, 1, 1000);
+
+        for (Mail *mail = mailbox_receive(m); mail; received++) {
+            Letter *l = (Letter *)mail;
+            mail = mail->next;
+            assert(l->sequence == next[l->producer]);
+            next[l->producer]++;
+            free(l);
+        }
+    }
+
+    for (size_t p = 0; p < PRODUCERS; p++) {
+        thread_join(producers[p].thread, NULL);
+        assert(next[p] == LETTERS);
+    }
+    assert(mailbox_receive(m) == NULL);
+
+    mailbox_delete(m);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test mailbox_create\n");
+        fprintf(stderr, "    1. Test mailbox_send\n");
+        fprintf(stderr, "    2. Test mailbox_producers\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_mailbox_create(); break;
+        case 1:  status = test_01_mailbox_send(); break;
+        case 2:  status = test_02_mailbox_producers(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
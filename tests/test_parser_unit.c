@@ -0,0 +1,351 @@
+/* test_parser_unit.c: Test Incremental HTTP Response Parser (Unit) */
+
+#include "mq/parser.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Constants */
+
+#define RESPONSES   8
+#define BODY        512
+#define MUTATIONS   (1<<14)
+
+#define BINARY      "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\n\0\r\n\0"
+
+/* Structures */
+
+typedef struct Case Case;
+struct Case {
+    const char *input;
+    size_t      size;		// Size of input (0 for strlen)
+    bool        eof;		// Whether stream ends after input
+    size_t      nresponses;	// Number of complete responses expected
+    int         status[RESPONSES];
+    const char *body[RESPONSES];
+    size_t      body_size;	// Size of first body (0 for strlen)
+};
+
+typedef struct Result Result;
+struct Result {
+    bool        error;
+    size_t      nheads;
+    size_t      nresponses;
+    int         status[RESPONSES];
+    bool        persistent[RESPONSES];
+    size_t      length[RESPONSES];
+    char        body[RESPONSES][BODY];
+};
+
+/* Corpus */
+
+Case VALID[] = {
+    { "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello", 0, false,
+      1, { 200 }, { "hello" } },
+    { "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+      "5\r\nhello\r\n6;name=value\r\n world\r\n0\r\nX-Trailer: yes\r\n\r\n", 0, false,
+      1, { 200 }, { "hello world" } },
+    { "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok"
+      "HTTP/1.1 404 Not Found\r\nContent-Length: 9\r\n\r\nNot Found"
+      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n1\r\na\r\n0\r\n\r\n", 0, false,
+      3, { 200, 404, 200 }, { "ok", "Not Found", "a" } },
+    { "HTTP/1.0 200 OK\r\n\r\nuntil close", 0, true,
+      1, { 200 }, { "until close" } },
+    { "HTTP/1.1 204 No Content\r\n\r\nHTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n", 0, false,
+      2, { 204, 200 }, { "", "" } },
+    { "HTTP/1.1 200 OK\ncontent-length:   3  \nX-Ignored\n\nabc", 0, false,
+      1, { 200 }, { "abc" } },
+    { BINARY, sizeof(BINARY) - 1, false,
+      1, { 200 }, { "\0\r\n\0" }, 4 },
+    { "HTTP/1.1 200 OK\r\nTRANSFER-ENCODING: Chunked\r\n\r\nA\r\n0123456789\r\n0\r\n\r\n", 0, false,
+      1, { 200 }, { "0123456789" } },
+    { "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nabcHTTP/1.1 500 Internal", 0, false,
+      1, { 200 }, { "abc" } },
+    { NULL },
+};
+
+Case INVALID[] = {
+    { "HTTP/2 200 OK\r\n\r\n" },
+    { "HTTP/1.1 2x0 OK\r\n\r\n" },
+    { "HTTP/1.1 2000 OK\r\n\r\n" },
+    { "garbage\r\n\r\n" },
+    { "HTTP/1.1 200 OK\r\nContent-Length: -5\r\n\r\n" },
+    { "HTTP/1.1 200 OK\r\nContent-Length:\r\n\r\n" },
+    { "HTTP/1.1 200 OK\r\nContent-Length: 99999999999999999999999\r\n\r\n" },
+    { "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n" },
+    { "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3x\r\n" },
+    { "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabcX\r\n" },
+    { "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nFFFFFFFFFFFFFFFFFF\r\n" },
+    { "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nabc", 0, true },
+    { "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nab", 0, true },
+    { "HTTP/1.1 200", 0, true },
+    { NULL },
+};
+
+/* Functions */
+
+size_t case_size(Case *c) {
+    return c->size ? c->size : strlen(c->input);
+}
+
+/**
+ * Feed input to a fresh parser in pieces of at most split bytes, recording
+ * each event in result.
+ */
+void parse(const char *input, size_t size, size_t split, bool eof, Result *result) {
+    Parser p;
+    parser_init(&p);
+    memset(result, 0, sizeof(Result));
+
+    for (size_t offset = 0; offset < size && !result->error; offset += split) {
+        const char *piece = input + offset;
+        size_t      left  = size - offset < split ? size - offset : split;
+
+        while (true) {
+            const char *data;
+            size_t      length;
+            size_t      consumed;
+            ParserEvent event = parser_execute(&p, piece, left, &consumed, &data, &length);
+            assert(consumed <= left);
+            piece += consumed;
+            left  -= consumed;
+
+            if (event == PARSER_MORE) {
+                assert(left == 0);
+                break;
+            }
+
+            size_t r = result->nheads - 1;
+            switch (event) {
+                case PARSER_HEAD:
+                    assert(result->nheads == result->nresponses);
+                    r = result->nheads++;
+                    if (r < RESPONSES) {
+                        result->status[r] = p.status;
+                    }
+                    break;
+                case PARSER_BODY:
+                    assert(result->nheads == result->nresponses + 1);
+                    assert(data >= input && data + length <= input + size);
+                    if (r < RESPONSES) {
+                        size_t n = length < BODY - result->length[r] ? length : BODY - result->length[r];
+                        memcpy(result->body[r] + result->length[r], data, n);
+                        result->length[r] += n;
+                    }
+                    break;
+                case PARSER_DONE:
+                    assert(result->nheads == result->nresponses + 1);
+                    if (r < RESPONSES) {
+                        result->persistent[r] = p.persistent;
+                    }
+                    result->nresponses++;
+                    break;
+                default:
+                    result->error = true;
+                    break;
+            }
+
+            if (result->error) {
+                // Errors are sticky
+                assert(parser_execute(&p, "", 0, &consumed, &data, &length) == PARSER_ERROR);
+                break;
+            }
+        }
+    }
+
+    if (eof && !result->error) {
+        ParserEvent event = parser_finish(&p);
+        if (event == PARSER_DONE) {
+            if (result->nresponses < RESPONSES) {
+                result->persistent[result->nresponses] = p.persistent;
+            }
+            result->nresponses++;
+        } else if (event == PARSER_ERROR) {
+            result->error = true;
+        }
+    }
+}
+
+bool result_equal(Result *a, Result *b) {
+    if (a->error != b->error || a->nheads != b->nheads || a->nresponses != b->nresponses) {
+        return false;
+    }
+
+    for (size_t r = 0; r < a->nheads && r < RESPONSES; r++) {
+        if (a->status[r] != b->status[r] || a->length[r] != b->length[r] ||
+            memcmp(a->body[r], b->body[r], a->length[r]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool result_matches(Result *result, Case *c) {
+    if (result->error || result->nresponses != c->nresponses) {
+        return false;
+    }
+
+    for (size_t r = 0; r < c->nresponses; r++) {
+        size_t length = r == 0 && c->body_size ? c->body_size : strlen(c->body[r]);
+        if (result->status[r] != c->status[r] || result->length[r] != length ||
+            memcmp(result->body[r], c->body[r], length) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Test Cases */
+
+int test_00_parser_valid() {
+    for (Case *c = VALID; c->input; c++) {
+        Result result;
+        parse(c->input, case_size(c), case_size(c), c->eof, &result);
+        if (!result_matches(&result, c)) {
+            fprintf(stderr, "Case %ld failed\n", c - VALID);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Framing and persistence are recorded from the head
+    Result result;
+    parse(VALID[3].input, case_size(&VALID[3]), 1, true, &result);
+    assert(!result.persistent[0]);
+    parse(VALID[2].input, case_size(&VALID[2]), 1, false, &result);
+    assert(result.persistent[0] && result.persistent[1] && result.persistent[2]);
+
+    const char *close = "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+    parse(close, strlen(close), strlen(close), false, &result);
+    assert(result.nresponses == 1 && !result.persistent[0]);
+
+    return EXIT_SUCCESS;
+}
+
+int test_01_parser_split() {
+    for (Case *c = VALID; c->input; c++) {
+        size_t size = case_size(c);
+
+        for (size_t split = 1; split <= size; split++) {
+            Result result;
+            parse(c->input, size, split, c->eof, &result);
+            if (!result_matches(&result, c)) {
+                fprintf(stderr, "Case %ld failed with pieces of %zu bytes\n", c - VALID, split);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int test_02_parser_invalid() {
+    for (Case *c = INVALID; c->input; c++) {
+        Result whole;
+        Result bytes;
+        parse(c->input, case_size(c), case_size(c), c->eof, &whole);
+        parse(c->input, case_size(c), 1, c->eof, &bytes);
+        if (!whole.error || !bytes.error) {
+            fprintf(stderr, "Case %ld was accepted\n", c - INVALID);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Lines longer than PARSER_LINE are rejected however they arrive
+    size_t size  = 2*PARSER_LINE;
+    char  *input = malloc(size);
+    assert(input);
+    memset(input, 'x', size);
+    memcpy(input, "HTTP/1.1 200 OK\r\nX-Long: ", 25);
+
+    Result result;
+    parse(input, size, size, false, &result);
+    assert(result.error);
+    parse(input, size, 7, false, &result);
+    assert(result.error);
+    free(input);
+
+    return EXIT_SUCCESS;
+}
+
+int test_03_parser_fuzz() {
+    const char ALPHABET[] = "HTTP/1.0 \r\n:;-0123456789abcdefABCDEFchunked\0";
+    char       buffer[BUFSIZ];
+
+    srand(0x6d71);
+    for (size_t m = 0; m < MUTATIONS; m++) {
+        Case  *c    = &VALID[rand() % (sizeof(VALID) / sizeof(Case) - 1)];
+        size_t size = case_size(c);
+        memcpy(buffer, c->input, size);
+
+        // Replace, insert or remove a few bytes (or send random bytes)
+        for (int edits = 1 + rand() % 4; edits > 0; edits--) {
+            size_t offset = size ? rand() % size : 0;
+            char   byte   = rand() % 2 ? ALPHABET[rand() % (sizeof(ALPHABET) - 1)] : rand();
+
+            switch (rand() % 4) {
+                case 0:
+                    if (size) buffer[offset] = byte;
+                    break;
+                case 1:
+                    memmove(buffer + offset + 1, buffer + offset, size - offset);
+                    buffer[offset] = byte;
+                    size++;
+                    break;
+                case 2:
+                    if (size) {
+                        memmove(buffer + offset, buffer + offset + 1, size - offset - 1);
+                        size--;
+                    }
+                    break;
+                case 3:
+                    size = rand() % 64;
+                    for (size_t b = 0; b < size; b++) buffer[b] = rand();
+                    break;
+            }
+        }
+
+        // However the input is split, the outcome must be the same
+        bool   eof   = rand() % 2;
+        size_t split = 1 + rand() % (size + 1);
+        Result whole;
+        Result pieces;
+        parse(buffer, size, size ? size : 1, eof, &whole);
+        parse(buffer, size, split, eof, &pieces);
+        if (!result_equal(&whole, &pieces)) {
+            fprintf(stderr, "Mutation %zu differs with pieces of %zu bytes\n", m, split);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test parser_valid\n");
+        fprintf(stderr, "    1. Test parser_split\n");
+        fprintf(stderr, "    2. Test parser_invalid\n");
+        fprintf(stderr, "    3. Test parser_fuzz\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_parser_valid(); break;
+        case 1:  status = test_01_parser_split(); break;
+        case 2:  status = test_02_parser_invalid(); break;
+        case 3:  status = test_03_parser_fuzz(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -6,6 +6,8 @@
 #include "mq/string.h"
 
 #include <assert.h>
+#include <poll.h>
+#include <unistd.h>
 
 /* Constants */
 
@@ -18,6 +20,59 @@ Request REQUESTS[] = {
     { NULL, NULL, NULL },
 };
 
+#define PRODUCERS   4
+#define PRODUCED    (1<<12)
+
+Request PRODUCTS[PRODUCERS][PRODUCED];
+
+/* Threads */
+
+typedef struct Producer Producer;
+struct Producer {
+    Queue * queue;
+    size_t  index;
+    Thread  thread;
+};
+
+void * ring_producer(void *arg) {
+    Producer *p = arg;
+
+    for (size_t r = 0; r < PRODUCED; r++) {
+        queue_push(p->queue, &PRODUCTS[p->index][r]);
+    }
+
+    return NULL;
+}
+
+/**
+ * Run nproducers threads pushing PRODUCTS to ring while this thread pops
+ * them, checking each producer's requests arrive once and in order.
+ */
+void ring_produce_consume(Queue *q, size_t nproducers) {
+    Producer producers[PRODUCERS];
+    size_t   next[PRODUCERS] = {0};
+
+    for (size_t p = 0; p < nproducers; p++) {
+        producers[p].queue = q;
+        producers[p].index = p;
+        thread_create(&producers[p].thread, NULL, ring_producer, &producers[p]);
+    }
+
+    for (size_t popped = 0; popped < nproducers * PRODUCED; popped++) {
+        Request *r = queue_pop(q);
+        size_t   p = (r - &PRODUCTS[0][0]) / PRODUCED;
+        assert(p < nproducers);
+        assert(r == &PRODUCTS[p][next[p]]);
+        next[p]++;
+    }
+
+    for (size_t p = 0; p < nproducers; p++) {
+        thread_join(producers[p].thread, NULL);
+        assert(next[p] == PRODUCED);
+    }
+    assert(queue_try_pop(q) == NULL);
+}
+
 /* Functions */
 
 int test_00_queue_create() {
@@ -85,6 +140,400 @@ int test_03_queue_delete() {
     return EXIT_SUCCESS;
 }
 
+int test_04_queue_try_pop() {
+    Queue *q = queue_create();
+    assert(q);
+    assert(queue_try_pop(q) == NULL);
+
+    for (size_t r = 0; REQUESTS[r].method; r++) {
+    	queue_push(q, &REQUESTS[r]);
+    }
+
+    for (size_t r = 0; REQUESTS[r].method; r++) {
+    	assert(queue_try_pop(q) == &REQUESTS[r]);
+    	assert(q->size == 4 - r);
+    }
+
+    assert(queue_try_pop(q) == NULL);
+    assert(q->size == 0);
+
+    free(q);
+    return EXIT_SUCCESS;
+}
+
+int test_05_queue_pop_timed() {
+    Queue *q = queue_create();
+    assert(q);
+    assert(queue_pop_timed(q, 0) == NULL);
+    assert(queue_pop_timed(q, 10) == NULL);
+
+    for (size_t r = 0; REQUESTS[r].method; r++) {
+    	queue_push(q, &REQUESTS[r]);
+    }
+
+    for (size_t r = 0; REQUESTS[r].method; r++) {
+    	assert(queue_pop_timed(q, 10) == &REQUESTS[r]);
+    }
+
+    assert(queue_pop_timed(q, 10) == NULL);
+    assert(q->size == 0);
+
+    free(q);
+    return EXIT_SUCCESS;
+}
+
+int test_06_queue_pop_batch() {
+    Queue *q = queue_create();
+    Request *out[8];
+    assert(q);
+    assert(queue_pop_batch(q, out, 8, 0) == 0);
+    assert(queue_pop_batch(q, out, 8, 10) == 0);
+
+    for (size_t r = 0; REQUESTS[r].method; r++) {
+    	queue_push(q, &REQUESTS[r]);
+    }
+
+    assert(queue_pop_batch(q, out, 2, -1) == 2);
+    assert(out[0] == &REQUESTS[0]);
+    assert(out[1] == &REQUESTS[1]);
+    assert(q->size == 3);
+
+    assert(queue_pop_batch(q, out, 8, -1) == 3);
+    assert(out[0] == &REQUESTS[2]);
+    assert(out[1] == &REQUESTS[3]);
+    assert(out[2] == &REQUESTS[4]);
+    assert(q->size == 0);
+
+    free(q);
+    return EXIT_SUCCESS;
+}
+
+int ring_basic(QueueType type) {
+    Queue   *q = queue_create_ring(type, 3);
+    Request *out[8];
+    assert(q);
+    assert(q->type == type);
+    assert(q->mask == 3);
+    assert(queue_try_pop(q) == NULL);
+    assert(queue_pop_timed(q, 0) == NULL);
+    assert(queue_pop_timed(q, 10) == NULL);
+
+    for (size_t r = 0; r < 4; r++) {
+    	queue_push(q, &REQUESTS[r]);
+    }
+
+    assert(queue_pop(q) == &REQUESTS[0]);
+    assert(queue_try_pop(q) == &REQUESTS[1]);
+    assert(queue_pop_timed(q, 10) == &REQUESTS[2]);
+
+    // Wrap around the end of the ring
+    queue_push(q, &REQUESTS[4]);
+    queue_push(q, &REQUESTS[0]);
+    assert(queue_pop_batch(q, out, 8, -1) == 3);
+    assert(out[0] == &REQUESTS[3]);
+    assert(out[1] == &REQUESTS[4]);
+    assert(out[2] == &REQUESTS[0]);
+    assert(queue_try_pop(q) == NULL);
+    assert(queue_pop_batch(q, out, 8, 10) == 0);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int test_07_queue_mpsc() {
+    return ring_basic(QUEUE_MPSC);
+}
+
+int test_08_queue_spsc() {
+    return ring_basic(QUEUE_SPSC);
+}
+
+int test_09_queue_mpsc_producers() {
+    Queue *q = queue_create_ring(QUEUE_MPSC, 8);
+    assert(q);
+
+    ring_produce_consume(q, PRODUCERS);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int test_10_queue_spsc_producer() {
+    Queue *q = queue_create_ring(QUEUE_SPSC, 8);
+    assert(q);
+
+    ring_produce_consume(q, 1);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int bounded_fill(Queue *q, size_t n) {
+    for (size_t r = 0; r < n; r++) {
+        char body[BUFSIZ];
+        snprintf(body, sizeof(body), "b%lu", r);
+        if (!queue_push(q, request_create("PUT", "/topic/t", body))) {
+            return r;
+        }
+    }
+    return n;
+}
+
+int test_11_queue_bounded_fail() {
+    Queue *q = queue_create_bounded(3, 0, QUEUE_FAIL);
+    assert(q);
+
+    assert(bounded_fill(q, 5) == 3);
+    assert(q->size == 3);
+    assert(queue_rejected(q) == 1);
+    assert(!queue_try_push(q, request_create("PUT", "/topic/t", "b3")));
+    assert(queue_rejected(q) == 2);
+    assert(queue_dropped(q) == 0);
+
+    Request *r = queue_pop(q);
+    assert(streq(r->body, "b0"));
+    request_delete(r);
+    assert(queue_try_push(q, request_create("PUT", "/topic/t", "b3")));
+    assert(q->size == 3);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int test_12_queue_bounded_drop() {
+    Queue *q = queue_create_bounded(3, 0, QUEUE_DROP_OLDEST);
+    assert(q);
+
+    assert(bounded_fill(q, 5) == 5);
+    assert(q->size == 3);
+    assert(queue_dropped(q) == 2);
+    assert(streq(q->head->body, "b2"));
+    assert(streq(q->tail->body, "b4"));
+    queue_delete(q);
+
+    // Forced requests (subscriptions, the SENTINEL) are never the ones dropped
+    q = queue_create_bounded(3, 0, QUEUE_DROP_OLDEST);
+    assert(q);
+
+    queue_push_force(q, request_create("PUT", "/subscription/q/t", NULL));
+    assert(bounded_fill(q, 4) == 4);
+    queue_push_force(q, request_create("PUT", "/topic/SHUTDOWN", "SENTINEL"));
+    assert(bounded_fill(q, 2) == 2);
+    assert(q->size == 3 && queue_dropped(q) == 5);
+    assert(streq(q->head->uri, "/subscription/q/t"));
+    assert(streq(q->head->next->body, "SENTINEL"));
+    assert(streq(q->tail->body, "b1") && q->tail == q->head->next->next);
+
+    // With only forced requests left, the request being pushed is dropped
+    queue_push_force(q, request_create("PUT", "/subscription/q/u", NULL));
+    queue_push_force(q, request_create("PUT", "/subscription/q/v", NULL));
+    assert(bounded_fill(q, 1) == 0);
+    assert(q->size == 4 && queue_dropped(q) == 7);
+    assert(streq(q->tail->uri, "/subscription/q/v"));
+    queue_delete(q);
+
+    q = queue_create_bounded(3, 0, QUEUE_DROP_NEWEST);
+    assert(q);
+
+    assert(bounded_fill(q, 5) == 3);
+    assert(q->size == 3);
+    assert(queue_dropped(q) == 1);
+    assert(!queue_try_push(q, request_create("PUT", "/topic/t", "b3")));
+    assert(queue_dropped(q) == 2);
+    assert(queue_rejected(q) == 0);
+    assert(streq(q->head->body, "b0"));
+    assert(streq(q->tail->body, "b2"));
+
+    queue_push_force(q, request_create("PUT", "/topic/t", "b5"));
+    assert(q->size == 4);
+    assert(streq(q->tail->body, "b5"));
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int test_13_queue_bounded_bytes() {
+    Queue *q = queue_create_bounded(0, 8, QUEUE_FAIL);
+    assert(q);
+
+    assert(queue_push(q, request_create("PUT", "/topic/t", "12345")));
+    assert(q->bytes == 5);
+    assert(queue_push(q, request_create("PUT", "/topic/t", "123")));
+    assert(q->bytes == 8);
+    assert(!queue_push(q, request_create("PUT", "/topic/t", "1")));
+    assert(queue_push(q, request_create("PUT", "/topic/t", NULL)));
+    assert(q->size == 3);
+
+    request_delete(queue_pop(q));
+    request_delete(queue_pop(q));
+    request_delete(queue_pop(q));
+    assert(q->bytes == 0);
+
+    // An empty queue accepts a body larger than max_bytes
+    assert(queue_push(q, request_create("PUT", "/topic/t", "1234567890")));
+    assert(q->bytes == 10);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+void * bounded_producer(void *arg) {
+    Queue *q = arg;
+    bounded_fill(q, PRODUCED);
+    return NULL;
+}
+
+int test_14_queue_bounded_block() {
+    Queue *q = queue_create_bounded(4, 0, QUEUE_BLOCK);
+    Thread t;
+    assert(q);
+
+    thread_create(&t, NULL, bounded_producer, q);
+    for (size_t r = 0; r < PRODUCED; r++) {
+        char body[BUFSIZ];
+        snprintf(body, sizeof(body), "b%lu", r);
+
+        Request *n = queue_pop(q);
+        assert(streq(n->body, body));
+        assert(q->size <= 4);
+        request_delete(n);
+    }
+    thread_join(t, NULL);
+
+    assert(q->size == 0);
+    assert(queue_dropped(q) == 0);
+    assert(queue_rejected(q) == 0);
+    assert(queue_try_push(q, request_create("PUT", "/topic/t", "b")));
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+Request * batch_list(size_t first, size_t n) {
+    Request *head = NULL;
+
+    while (n-- > 0) {
+        char body[BUFSIZ];
+        snprintf(body, sizeof(body), "b%lu", first + n);
+
+        Request *r = request_create("PUT", "/topic/t", body);
+        r->next = head;
+        head    = r;
+    }
+    return head;
+}
+
+int batch_check(Queue *q, size_t first, size_t n) {
+    Request *out[8];
+    size_t   popped = queue_pop_batch(q, out, n, 0);
+
+    for (size_t r = 0; r < popped; r++) {
+        char body[BUFSIZ];
+        snprintf(body, sizeof(body), "b%lu", first + r);
+        assert(streq(out[r]->body, body));
+        request_delete(out[r]);
+    }
+    return popped;
+}
+
+void * batch_consumer(void *arg) {
+    Queue *q = arg;
+    for (size_t r = 0; r < 8; r++) {
+        char body[BUFSIZ];
+        snprintf(body, sizeof(body), "b%lu", r);
+
+        Request *n = queue_pop(q);
+        assert(streq(n->body, body));
+        request_delete(n);
+    }
+    return NULL;
+}
+
+int test_15_queue_push_batch() {
+    Queue *q = queue_create();
+    assert(q);
+    assert(queue_push_batch(q, NULL) == 0);
+
+    assert(queue_push_batch(q, batch_list(0, 3)) == 3);
+    assert(queue_push_batch(q, batch_list(3, 2)) == 2);
+    assert(q->size == 5);
+    assert(q->tail->next == NULL);
+    assert(batch_check(q, 0, 5) == 5);
+    assert(q->size == 0);
+    queue_delete(q);
+
+    q = queue_create_bounded(3, 0, QUEUE_DROP_OLDEST);
+    assert(q);
+    assert(queue_push_batch(q, batch_list(0, 5)) == 5);
+    assert(queue_dropped(q) == 2);
+    assert(batch_check(q, 2, 8) == 3);
+    queue_delete(q);
+
+    q = queue_create_bounded(3, 0, QUEUE_FAIL);
+    assert(q);
+    assert(queue_push_batch(q, batch_list(0, 5)) == 3);
+    assert(queue_rejected(q) == 2);
+    assert(batch_check(q, 0, 8) == 3);
+    queue_delete(q);
+
+    // A batch that fills a blocking queue wakes consumers before it waits
+    q = queue_create_bounded(3, 0, QUEUE_BLOCK);
+    assert(q);
+    Thread t;
+    thread_create(&t, NULL, batch_consumer, q);
+    usleep(10000);
+    assert(queue_push_batch(q, batch_list(0, 8)) == 8);
+    thread_join(t, NULL);
+    assert(q->size == 0);
+    queue_delete(q);
+
+    q = queue_create_ring(QUEUE_MPSC, 8);
+    assert(q);
+    assert(queue_push_batch(q, batch_list(0, 5)) == 5);
+    assert(batch_check(q, 0, 8) == 5);
+    queue_delete(q);
+
+    return EXIT_SUCCESS;
+}
+
+bool readable(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+int fd_basic(Queue *q) {
+    Request *out[8];
+    assert(q);
+
+    queue_push(q, &REQUESTS[0]);
+    int fd = queue_fd(q);
+    assert(fd >= 0);
+    assert(queue_fd(q) == fd);
+    assert(readable(fd));
+
+    assert(queue_try_pop(q) == &REQUESTS[0]);
+    assert(queue_try_pop(q) == NULL);
+    assert(!readable(fd));
+
+    queue_push(q, &REQUESTS[1]);
+    queue_push(q, &REQUESTS[2]);
+    assert(readable(fd));
+    assert(queue_pop_timed(q, 10) == &REQUESTS[1]);
+    assert(queue_pop_batch(q, out, 8, 0) == 1);
+    assert(queue_pop_timed(q, 0) == NULL);
+    assert(!readable(fd));
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int test_16_queue_fd() {
+    fd_basic(queue_create());
+    fd_basic(queue_create_ring(QUEUE_MPSC, 4));
+    fd_basic(queue_create_ring(QUEUE_SPSC, 4));
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -95,6 +544,19 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    1. Test queue_push\n");
         fprintf(stderr, "    2. Test queue_pop\n");
         fprintf(stderr, "    3. Test queue_delete\n");
+        fprintf(stderr, "    4. Test queue_try_pop\n");
+        fprintf(stderr, "    5. Test queue_pop_timed\n");
+        fprintf(stderr, "    6. Test queue_pop_batch\n");
+        fprintf(stderr, "    7. Test queue_mpsc\n");
+        fprintf(stderr, "    8. Test queue_spsc\n");
+        fprintf(stderr, "    9. Test queue_mpsc_producers\n");
+        fprintf(stderr, "    10. Test queue_spsc_producer\n");
+        fprintf(stderr, "    11. Test queue_bounded_fail\n");
+        fprintf(stderr, "    12. Test queue_bounded_drop\n");
+        fprintf(stderr, "    13. Test queue_bounded_bytes\n");
+        fprintf(stderr, "    14. Test queue_bounded_block\n");
+        fprintf(stderr, "    15. Test queue_push_batch\n");
+        fprintf(stderr, "    16. Test queue_fd\n");
         return EXIT_FAILURE;
     }
 
@@ -106,6 +568,19 @@ int main(int argc, char *argv[]) {
         case 1:  status = test_01_queue_push(); break;
         case 2:  status = test_02_queue_pop(); break;
         case 3:  status = test_03_queue_delete(); break;
+        case 4:  status = test_04_queue_try_pop(); break;
+        case 5:  status = test_05_queue_pop_timed(); break;
+        case 6:  status = test_06_queue_pop_batch(); break;
+        case 7:  status = test_07_queue_mpsc(); break;
+        case 8:  status = test_08_queue_spsc(); break;
+        case 9:  status = test_09_queue_mpsc_producers(); break;
+        case 10: status = test_10_queue_spsc_producer(); break;
+        case 11: status = test_11_queue_bounded_fail(); break;
+        case 12: status = test_12_queue_bounded_drop(); break;
+        case 13: status = test_13_queue_bounded_bytes(); break;
+        case 14: status = test_14_queue_bounded_block(); break;
+        case 15: status = test_15_queue_push_batch(); break;
+        case 16: status = test_16_queue_fd(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }   
 
@@ -11,14 +11,16 @@
 /* Constants */
 
 Request REQUESTS[] = {
-    { "PUT", "/topic/HOT" , "SOME LIKE IT" },
-    { "GET", "/queue/LIVE", "FOREVER" },
+    { "PUT", "/topic/HOT" , "SOME LIKE IT", 12 },
+    { "GET", "/queue/LIVE", "FOREVER", 7 },
     { "DELETE", "/subscription/LIVE/FOREVER", NULL },
     { NULL, NULL, NULL },
 };
 
 /* Functions */
 
+Request * mq_parse_records(char *body, size_t length, size_t *consumed, bool *invalid);
+
 int test_00_request_create() {
     for (Request *r = REQUESTS; r->method; r++) {
         Request *n = request_create(r->method, r->uri, r->body);
@@ -28,13 +30,17 @@ int test_00_request_create() {
 
         if (n->body) {
             assert(streq(n->body, r->body));
+            assert(n->length == r->length);
         } else {
             assert(n->body == r->body);
         }
 
-        free(n->method);
-        free(n->uri);
-        free(n->body);
+        // Strings are laid out in the same allocation as the structure
+        assert(n->method == (char *)(n + 1));
+        assert(n->uri == n->method + strlen(n->method) + 1);
+        assert(!n->body || n->body == n->uri + strlen(n->uri) + 1);
+        assert(n->capacity >= sizeof(Request) + strlen(n->method) + strlen(n->uri) + n->length + 3);
+
         free(n);
     }
 
@@ -76,12 +82,21 @@ int test_02_request_write() {
         goto failure;
     }
 
-    request_write(&REQUESTS[0], fs);
+    request_write(&REQUESTS[0], "localhost:9620", fs);
     fseek(fs, 0, SEEK_SET);
 
     char buffer[BUFSIZ];
 
-    char *target = "PUT /topic/HOT HTTP/1.0\r\n";
+    char *target = "PUT /topic/HOT HTTP/1.1\r\n";
+    if (!fgets(buffer, BUFSIZ, fs)) {
+        goto failure;
+    }
+    if (!streq(buffer, target)) {
+        fprintf(stderr, "%s != %s\n", buffer, target);
+        goto failure;
+    }
+
+    target = "Host: localhost:9620\r\n";
     if (!fgets(buffer, BUFSIZ, fs)) {
         goto failure;
     }
@@ -141,12 +156,21 @@ int test_03_request_write() {
         goto failure;
     }
 
-    request_write(&REQUESTS[2], fs);
+    request_write(&REQUESTS[2], "localhost:9620", fs);
     fseek(fs, 0, SEEK_SET);
 
     char buffer[BUFSIZ];
 
-    char *target = "DELETE /subscription/LIVE/FOREVER HTTP/1.0\r\n";
+    char *target = "DELETE /subscription/LIVE/FOREVER HTTP/1.1\r\n";
+    if (!fgets(buffer, BUFSIZ, fs)) {
+        goto failure;
+    }
+    if (!streq(buffer, target)) {
+        fprintf(stderr, "%s != %s\n", buffer, target);
+        goto failure;
+    }
+
+    target = "Host: localhost:9620\r\n";
     if (!fgets(buffer, BUFSIZ, fs)) {
         goto failure;
     }
@@ -172,6 +196,223 @@ failure:
     return status;
 }
 
+int test_04_request_reserve() {
+    Request *r = request_reserve("PUT", "/batch", 5);
+    assert(r);
+    assert(streq(r->method, "PUT"));
+    assert(streq(r->uri, "/batch"));
+    assert(r->length == 5);
+    assert(r->body[5] == 0);
+    memcpy(r->body, "a\0b\nc", 5);
+
+    // Body is taken as a separate copy (NULs and all)
+    char *body = request_take_body(r);
+    assert(body);
+    assert(memcmp(body, "a\0b\nc", 6) == 0);
+    assert(r->body == NULL);
+    assert(r->length == 0);
+    request_delete(r);
+    free(body);
+
+    // A separately allocated body is handed over as is
+    r = request_create("GET", "/queue/LIVE", NULL);
+    assert(r);
+    r->body   = strdup("FOREVER");
+    r->length = 7;
+    body = r->body;
+    assert(request_take_body(r) == body);
+    request_delete(r);
+    free(body);
+
+    // Or freed with the request
+    r = request_create("GET", "/queue/LIVE", NULL);
+    assert(r);
+    r->body   = strdup("FOREVER");
+    r->length = 7;
+    request_delete(r);
+
+    return EXIT_SUCCESS;
+}
+
+int test_05_request_pool() {
+    Request *requests[256];
+
+    // Allocations are recycled once the pool is warm
+    for (size_t r = 0; r < 256; r++) {
+        requests[r] = request_create("PUT", "/topic/HOT", "SOME LIKE IT");
+    }
+    for (size_t r = 0; r < 256; r++) {
+        request_delete(requests[r]);
+    }
+
+    size_t allocations = request_allocations();
+    for (size_t round = 0; round < 16; round++) {
+        for (size_t r = 0; r < 32; r++) {
+            requests[r] = request_create("PUT", "/topic/HOT", "SOME LIKE IT");
+            assert(streq(requests[r]->body, "SOME LIKE IT"));
+        }
+        for (size_t r = 0; r < 32; r++) {
+            request_delete(requests[r]);
+        }
+    }
+    assert(request_allocations() == allocations);
+
+    // Requests too large to pool take only what they need, every time
+    allocations = request_allocations();
+    for (size_t round = 0; round < 2; round++) {
+        Request *r = request_reserve("PUT", "/topic/HOT", 1<<20);
+        assert(r && r->capacity < (1<<20) + 256);
+        request_delete(r);
+    }
+    assert(request_allocations() == allocations + 2);
+
+    // Requests too large to pool are still freed
+    char *large = malloc(8<<20);
+    assert(large);
+    memset(large, 'x', (8<<20) - 1);
+    large[(8<<20) - 1] = 0;
+    Request *r = request_create("PUT", "/topic/HOT", large);
+    assert(r);
+    assert(r->length == (8<<20) - 1);
+    request_delete(r);
+    free(large);
+
+    return EXIT_SUCCESS;
+}
+
+int test_06_request_create_bytes() {
+    const char data[] = "\0BINARY\0\r\n\0";
+    size_t length     = sizeof(data) - 1;
+
+    Request *r = request_create_bytes("PUT", "/topic/HOT", data, length);
+    assert(r);
+    assert(r->length == length);
+    assert(memcmp(r->body, data, length) == 0);
+
+    // Write body in full to a stream
+    char  *buffer = NULL;
+    size_t size   = 0;
+    FILE  *fs     = open_memstream(&buffer, &size);
+    assert(fs);
+    request_write(r, NULL, fs);
+    fclose(fs);
+
+    const char *head = "PUT /topic/HOT HTTP/1.1\r\nContent-Length: 11\r\n\r\n";
+    assert(length == 11);
+    assert(size == strlen(head) + length);
+    assert(memcmp(buffer, head, strlen(head)) == 0);
+    assert(memcmp(buffer + strlen(head), data, length) == 0);
+    free(buffer);
+    request_delete(r);
+
+    // Large bodies with zeros are copied whole
+    size_t large = 64<<20;
+    char  *body  = calloc(1, large);
+    assert(body);
+    body[large - 1] = 'x';
+    r = request_create_bytes("PUT", "/topic/HOT", body, large);
+    assert(r);
+    assert(r->length == large);
+    assert(r->body[large - 1] == 'x' && r->body[large] == 0);
+    request_delete(r);
+    free(body);
+
+    return EXIT_SUCCESS;
+}
+
+int test_07_request_head() {
+    char buffer[BUFSIZ];
+
+    // Head with body length (body itself is not included)
+    const char *head = "PUT /topic/HOT HTTP/1.1\r\nContent-Length: 12\r\n\r\n";
+    size_t length    = request_head(&REQUESTS[0], NULL, buffer, sizeof(buffer));
+    assert(length == strlen(head));
+    assert(memcmp(buffer, head, length) == 0);
+
+    // Host header follows the request line
+    head   = "PUT /topic/HOT HTTP/1.1\r\nHost: [::1]:9620\r\nContent-Length: 12\r\n\r\n";
+    length = request_head(&REQUESTS[0], "[::1]:9620", buffer, sizeof(buffer));
+    assert(length == strlen(head));
+    assert(memcmp(buffer, head, length) == 0);
+
+    // Too small a buffer is left untouched and the needed length returned
+    memset(buffer, '#', sizeof(buffer));
+    assert(request_head(&REQUESTS[0], "[::1]:9620", buffer, length - 1) == length);
+    assert(buffer[0] == '#');
+
+    // Head without body
+    Request *r = request_create("GET", "/queue/LIVE", NULL);
+    assert(r);
+    head   = "GET /queue/LIVE HTTP/1.1\r\n\r\n";
+    length = request_head(r, NULL, buffer, sizeof(buffer));
+    assert(length == strlen(head));
+    assert(memcmp(buffer, head, length) == 0);
+    request_delete(r);
+
+    // Empty body still has a Content-Length
+    r = request_create_bytes("PUT", "/topic/HOT", "", 0);
+    assert(r);
+    head   = "PUT /topic/HOT HTTP/1.1\r\nContent-Length: 0\r\n\r\n";
+    length = request_head(r, NULL, buffer, sizeof(buffer));
+    assert(length == strlen(head));
+    assert(memcmp(buffer, head, length) == 0);
+    request_delete(r);
+
+    // Nothing without method or uri
+    Request empty = {0};
+    assert(request_head(&empty, "localhost", buffer, sizeof(buffer)) == 0);
+
+    // Heads longer than the stack buffer are still written in full
+    char uri[2*BUFSIZ];
+    memset(uri, 'x', sizeof(uri) - 1);
+    uri[0] = '/';
+    uri[sizeof(uri) - 1] = 0;
+    r = request_create("GET", uri, NULL);
+    assert(r);
+
+    char  *output = NULL;
+    size_t size   = 0;
+    FILE  *fs     = open_memstream(&output, &size);
+    assert(fs);
+    request_write(r, NULL, fs);
+    fclose(fs);
+    assert(size == strlen("GET  HTTP/1.1\r\n\r\n") + strlen(uri));
+    assert(memcmp(output + 4, uri, strlen(uri)) == 0);
+    free(output);
+    request_delete(r);
+
+    return EXIT_SUCCESS;
+}
+
+int test_08_mq_parse_records() {
+    size_t consumed;
+    bool   invalid;
+
+    // Complete records become messages and a trailing partial one is left
+    char records[] = "HOT 3\nabcLIVE 0\nFOREVER 5\nab";
+    Request *head  = mq_parse_records(records, strlen(records), &consumed, &invalid);
+    assert(!invalid && consumed == strlen("HOT 3\nabcLIVE 0\n"));
+    assert(head && streq(head->uri, "/topic/HOT") && head->length == 3 && memcmp(head->body, "abc", 3) == 0);
+    assert(head->next && streq(head->next->uri, "/topic/LIVE") && head->next->length == 0);
+    assert(head->next->next == NULL);
+    request_delete(head->next);
+    request_delete(head);
+
+    // A length that is not a plain decimal number stops parsing there
+    const char *invalids[] = { "HOT x\nabc", "HOT\nabc", "HOT -1\nabc", "HOT 3x\nabc", "HOT \nabc",
+                               "HOT 99999999999999999999999\nabc", NULL };
+    for (const char **bad = invalids; *bad; bad++) {
+        char record[BUFSIZ];
+        snprintf(record, sizeof(record), "LIVE 1\nx%s", *bad);
+        head = mq_parse_records(record, strlen(record), &consumed, &invalid);
+        assert(invalid && consumed == strlen("LIVE 1\nx"));
+        assert(head && head->next == NULL && head->length == 1);
+        request_delete(head);
+    }
+
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -182,6 +423,11 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    1. Test request_delete\n");
         fprintf(stderr, "    2. Test request_write (w/ body)\n");
         fprintf(stderr, "    3. Test request_write (w/out body)\n");
+        fprintf(stderr, "    4. Test request_reserve\n");
+        fprintf(stderr, "    5. Test request_pool\n");
+        fprintf(stderr, "    6. Test request_create_bytes\n");
+        fprintf(stderr, "    7. Test request_head\n");
+        fprintf(stderr, "    8. Test mq_parse_records\n");
         return EXIT_FAILURE;
     }
 
@@ -193,6 +439,11 @@ int main(int argc, char *argv[]) {
         case 1:  status = test_01_request_delete(); break;
         case 2:  status = test_02_request_write(); break;
         case 3:  status = test_03_request_write(); break;
+        case 4:  status = test_04_request_reserve(); break;
+        case 5:  status = test_05_request_pool(); break;
+        case 6:  status = test_06_request_create_bytes(); break;
+        case 7:  status = test_07_request_head(); break;
+        case 8:  status = test_08_mq_parse_records(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }   
 
@@ -0,0 +1,455 @@
+/* test_socket_unit.c: Test Socket functions (Unit) */
+
+#include "mq/connection.h"
+#include "mq/socket.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Functions */
+
+double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Listen on an ephemeral loopback port.
+ * @param   backlog     Backlog of listening socket.
+ * @param   address     Where to store address (for socket_race).
+ * @param   port        Where to store port number (as a string).
+ * @return  Listening socket.
+ */
+int listener(int backlog, SocketAddress *address, char port[NI_MAXSERV]) {
+    struct sockaddr_in in = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t length      = sizeof(in);
+    int fd                = socket(AF_INET, SOCK_STREAM, 0);
+
+    assert(fd >= 0);
+    assert(bind(fd, (struct sockaddr *)&in, sizeof(in)) == 0);
+    assert(listen(fd, backlog) == 0);
+    assert(getsockname(fd, (struct sockaddr *)&in, &length) == 0);
+
+    if (address) {
+        memcpy(&address->address, &in, sizeof(in));
+        address->length = sizeof(in);
+    }
+    if (port) {
+        snprintf(port, NI_MAXSERV, "%d", ntohs(in.sin_port));
+    }
+    return fd;
+}
+
+/**
+ * Return address of a loopback port nothing listens on.
+ */
+SocketAddress refused() {
+    SocketAddress address;
+    close(listener(1, &address, NULL));
+    return address;
+}
+
+/**
+ * Listen on a loopback port whose backlog is full, so connecting to it hangs
+ * (the kernel drops the handshake).
+ * @param   address     Where to store address.
+ * @param   filler      Where to store socket filling the backlog.
+ * @return  Listening socket.
+ */
+int blackhole(SocketAddress *address, int *filler) {
+    int fd  = listener(0, address, NULL);
+    *filler = socket(AF_INET, SOCK_STREAM, 0);
+    assert(*filler >= 0);
+    assert(connect(*filler, (struct sockaddr *)&address->address, address->length) == 0);
+    return fd;
+}
+
+/**
+ * Read one request (without body) from client and answer it with 200.
+ * @param   client      Socket to client.
+ * @param   answer      Whether or not to answer.
+ * @return  Whether or not a whole request was read.
+ */
+bool serve_request(int client, bool answer) {
+    char   buffer[BUFSIZ];
+    size_t size = 0;
+
+    while (size < sizeof(buffer) - 1) {
+        ssize_t nread = read(client, buffer + size, sizeof(buffer) - 1 - size);
+        if (nread <= 0) {
+            return false;
+        }
+        size += nread;
+        buffer[size] = 0;
+        if (strstr(buffer, "\r\n\r\n")) {
+            break;
+        }
+    }
+
+    const char *response = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+    return !answer || write(client, response, strlen(response)) == (ssize_t)strlen(response);
+}
+
+/**
+ * Count connections made to server_fd within timeout.
+ */
+int extra_connects(int server_fd, int timeout) {
+    struct pollfd pfd = { .fd = server_fd, .events = POLLIN };
+    int count = 0;
+    while (poll(&pfd, 1, timeout) > 0) {
+        close(accept(server_fd, NULL, NULL));
+        count++;
+    }
+    return count;
+}
+
+/* Tests */
+
+int test_00_socket_resolve() {
+    SocketAddress addresses[SOCKET_ADDRESSES];
+    size_t        lookups = socket_lookups();
+
+    // localhost comes from /etc/hosts, and is only looked up once
+    size_t n = socket_resolve("localhost", "9620", addresses, SOCKET_ADDRESSES);
+    assert(n >= 1);
+    assert(socket_lookups() == lookups + 1);
+    for (size_t i = 0; i < 8; i++) {
+        assert(socket_resolve("localhost", "9620", addresses, SOCKET_ADDRESSES) == n);
+    }
+    assert(socket_lookups() == lookups + 1);
+
+    bool loopback = false;
+    for (size_t i = 0; i < n; i++) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addresses[i].address;
+        loopback |= in->sin_family == AF_INET && in->sin_addr.s_addr == htonl(INADDR_LOOPBACK) && ntohs(in->sin_port) == 9620;
+    }
+    assert(loopback);
+
+    // Each port is its own entry
+    assert(socket_resolve("localhost", "9621", addresses, SOCKET_ADDRESSES) == n);
+    assert(socket_lookups() == lookups + 2);
+
+    // Entries expire after their TTL
+    socket_cache_ttl(50);
+    assert(socket_resolve("localhost", "9620", addresses, SOCKET_ADDRESSES) == n);
+    assert(socket_resolve("localhost", "9620", addresses, SOCKET_ADDRESSES) == n);
+    assert(socket_lookups() == lookups + 3);
+    usleep(100000);
+    assert(socket_resolve("localhost", "9620", addresses, SOCKET_ADDRESSES) == n);
+    assert(socket_lookups() == lookups + 4);
+
+    // Without a TTL every call looks up
+    socket_cache_ttl(0);
+    assert(socket_resolve("localhost", "9620", addresses, SOCKET_ADDRESSES) == n);
+    assert(socket_resolve("localhost", "9620", addresses, SOCKET_ADDRESSES) == n);
+    assert(socket_lookups() == lookups + 6);
+    socket_cache_ttl(SOCKET_CACHE_TTL);
+
+    // Names that do not resolve are not cached
+    assert(socket_resolve("mq.invalid", "9620", addresses, SOCKET_ADDRESSES) == 0);
+    assert(socket_resolve("mq.invalid", "9620", addresses, SOCKET_ADDRESSES) == 0);
+    assert(socket_lookups() == lookups + 8);
+    return EXIT_SUCCESS;
+}
+
+int test_01_socket_connect() {
+    char port[NI_MAXSERV];
+    int  server_fd = listener(16, NULL, port);
+    size_t lookups = socket_lookups();
+
+    // Reconnecting reuses the resolved address
+    for (size_t i = 0; i < 4; i++) {
+        int fd = socket_connect("localhost", port);
+        assert(fd >= 0);
+        assert(!(fcntl(fd, F_GETFL) & O_NONBLOCK));
+
+        int accepted = accept(server_fd, NULL, NULL);
+        assert(accepted >= 0);
+        assert(write(fd, "ping", 4) == 4);
+
+        char buffer[4];
+        assert(read(accepted, buffer, sizeof(buffer)) == 4 && memcmp(buffer, "ping", 4) == 0);
+        close(accepted);
+        close(fd);
+    }
+    assert(socket_lookups() == lookups + 1);
+
+    // A non-blocking connection finishes later
+    int fd = socket_connect_nonblocking("localhost", port);
+    assert(fd >= 0);
+    assert(fcntl(fd, F_GETFL) & O_NONBLOCK);
+
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    assert(poll(&pfd, 1, 1000) == 1);
+    int       status = -1;
+    socklen_t size   = sizeof(status);
+    assert(getsockopt(fd, SOL_SOCKET, SO_ERROR, &status, &size) == 0 && status == 0);
+    close(fd);
+    assert(socket_lookups() == lookups + 1);
+
+    // Nothing listening fails at once
+    close(server_fd);
+    double start = timestamp();
+    assert(socket_connect("localhost", port) < 0);
+    assert(timestamp() - start < 1.0);
+    return EXIT_SUCCESS;
+}
+
+int test_02_socket_race() {
+    SocketAddress good;
+    int    server_fd = listener(16, &good, NULL);
+    size_t winner    = SOCKET_ADDRESSES;
+
+    // A refused address hands over to the next one at once
+    SocketAddress candidates[] = { refused(), refused(), good };
+    double start = timestamp();
+    int    fd    = socket_race(candidates, 3, 1000, &winner);
+    assert(fd >= 0 && winner == 2);
+    assert(timestamp() - start < SOCKET_ATTEMPT_DELAY / 1000.0);
+    close(fd);
+
+    // A hanging address gets a head start, then the next one races it
+    SocketAddress hanging;
+    int    filler;
+    int    blackhole_fd = blackhole(&hanging, &filler);
+    SocketAddress slow[] = { hanging, good };
+    start = timestamp();
+    fd    = socket_race(slow, 2, 5000, &winner);
+    assert(fd >= 0 && winner == 1);
+    assert(timestamp() - start >= SOCKET_ATTEMPT_DELAY / 1000.0 * 0.9);
+    assert(timestamp() - start < 2.0);
+    close(fd);
+
+    // Nothing answering times out
+    start = timestamp();
+    assert(socket_race(&hanging, 1, 300, &winner) < 0 && errno == ETIMEDOUT);
+    assert(timestamp() - start >= 0.25 && timestamp() - start < 2.0);
+    close(filler);
+    close(blackhole_fd);
+
+    // Every address refused fails without waiting for the timeout
+    SocketAddress none[] = { refused(), refused() };
+    start = timestamp();
+    assert(socket_race(none, 2, 1000, &winner) < 0 && errno == ECONNREFUSED);
+    assert(timestamp() - start < 0.5);
+
+    close(server_fd);
+    return EXIT_SUCCESS;
+}
+
+int test_03_socket_prefer() {
+    SocketAddress addresses[SOCKET_ADDRESSES];
+    size_t        n = socket_resolve("localhost", "9622", addresses, SOCKET_ADDRESSES);
+    assert(n >= 1);
+
+    // A failed address goes to the back, and a preferred one to the front
+    SocketAddress first = addresses[0];
+    socket_failed("localhost", "9622");
+    assert(socket_resolve("localhost", "9622", addresses, SOCKET_ADDRESSES) == n);
+    assert(memcmp(&addresses[n - 1], &first, sizeof(first)) == 0);
+
+    socket_prefer("localhost", "9622", &first);
+    assert(socket_resolve("localhost", "9622", addresses, SOCKET_ADDRESSES) == n);
+    assert(memcmp(&addresses[0], &first, sizeof(first)) == 0);
+    return EXIT_SUCCESS;
+}
+
+int test_04_socket_endpoint() {
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+
+    assert(socket_endpoint("localhost:9620", host, sizeof(host), port, sizeof(port)));
+    assert(streq(host, "localhost") && streq(port, "9620"));
+
+    assert(socket_endpoint("[::1]:9621", host, sizeof(host), port, sizeof(port)));
+    assert(streq(host, "::1") && streq(port, "9621"));
+
+    assert(socket_endpoint("unix:/tmp/mq.sock", host, sizeof(host), port, sizeof(port)));
+    assert(streq(host, "unix:/tmp/mq.sock") && streq(port, ""));
+
+    // Both a host and a port are needed (and have to fit)
+    assert(!socket_endpoint("localhost", host, sizeof(host), port, sizeof(port)));
+    assert(!socket_endpoint(":9620", host, sizeof(host), port, sizeof(port)));
+    assert(!socket_endpoint("localhost:", host, sizeof(host), port, sizeof(port)));
+    assert(!socket_endpoint("[]:9620", host, sizeof(host), port, sizeof(port)));
+    assert(!socket_endpoint("localhost:9620", host, 4, port, sizeof(port)));
+    return EXIT_SUCCESS;
+}
+
+int test_05_socket_authority() {
+    char authority[SOCKET_AUTHORITY];
+
+    socket_authority("localhost", "9620", authority, sizeof(authority));
+    assert(streq(authority, "localhost:9620"));
+
+    socket_authority("::1", "9621", authority, sizeof(authority));
+    assert(streq(authority, "[::1]:9621"));
+
+    socket_authority("unix:/tmp/mq.sock", "", authority, sizeof(authority));
+    assert(streq(authority, "localhost"));
+
+    socket_authority("example.com", "", authority, sizeof(authority));
+    assert(streq(authority, "example.com"));
+    return EXIT_SUCCESS;
+}
+
+int test_06_connection_request() {
+    char port[NI_MAXSERV];
+    int  server_fd = listener(16, NULL, port);
+    int  status;
+
+    // A request that was sent is not sent again when its response is lost
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        int client = accept(server_fd, NULL, NULL);
+        assert(serve_request(client, true));
+        assert(serve_request(client, false));
+        close(client);
+        _exit(extra_connects(server_fd, 500));
+    }
+
+    Connection *c = connection_create("localhost", port, true);
+    Request    *r = request_create("GET", "/queue/LIVE", NULL);
+    assert(c && r);
+    assert(connection_request(c, r, NULL, NULL) == 200);
+    assert(connection_request(c, r, NULL, NULL) == -1);
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(c->connects == 1);
+    connection_delete(c);
+
+    // An idle socket the server closed is replaced before sending
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        int client = accept(server_fd, NULL, NULL);
+        assert(serve_request(client, true));
+        close(client);
+        client = accept(server_fd, NULL, NULL);
+        assert(serve_request(client, true));
+        close(client);
+        _exit(extra_connects(server_fd, 500));
+    }
+
+    c = connection_create("localhost", port, true);
+    assert(c);
+    assert(connection_request(c, r, NULL, NULL) == 200);
+    usleep(100000);
+    assert(connection_request(c, r, NULL, NULL) == 200);
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(c->connects == 2);
+    connection_delete(c);
+
+    request_delete(r);
+    close(server_fd);
+    return EXIT_SUCCESS;
+}
+
+int test_07_connection_send() {
+    char port[NI_MAXSERV];
+    int  server_fd = listener(16, NULL, port);
+    int  status;
+
+    // The server reads past the small requests, then hangs up in the middle
+    // of the large one
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        int    client = accept(server_fd, NULL, NULL);
+        char   buffer[BUFSIZ];
+        size_t total  = 0;
+        while (total < 64 * 1024) {
+            ssize_t nread = read(client, buffer, sizeof(buffer));
+            if (nread <= 0) {
+                _exit(EXIT_FAILURE);
+            }
+            total += nread;
+        }
+        close(client);
+        _exit(EXIT_SUCCESS);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    size_t  size = 8 << 20;
+    char   *body = calloc(1, size);
+    assert(body);
+
+    // Three small publishes followed by one too large for socket buffers
+    Request  *list = NULL;
+    Request **tail = &list;
+    for (size_t i = 0; i < 4; i++) {
+        *tail = request_create_bytes("PUT", "/topic/partial", body, i < 3 ? 64 : size);
+        assert(*tail);
+        tail = &(*tail)->next;
+    }
+
+    Connection *c = connection_create("localhost", port, true);
+    assert(c && connection_open(c) >= 0);
+    assert(connection_send(c, list) == -1);
+    assert(c->sent == 3);
+
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+    while (list) {
+        Request *next = list->next;
+        request_delete(list);
+        list = next;
+    }
+    connection_delete(c);
+    free(body);
+    close(server_fd);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test socket_resolve\n");
+        fprintf(stderr, "    1. Test socket_connect\n");
+        fprintf(stderr, "    2. Test socket_race\n");
+        fprintf(stderr, "    3. Test socket_prefer\n");
+        fprintf(stderr, "    4. Test socket_endpoint\n");
+        fprintf(stderr, "    5. Test socket_authority\n");
+        fprintf(stderr, "    6. Test connection_request\n");
+        fprintf(stderr, "    7. Test connection_send\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_socket_resolve(); break;
+        case 1:  status = test_01_socket_connect(); break;
+        case 2:  status = test_02_socket_race(); break;
+        case 3:  status = test_03_socket_prefer(); break;
+        case 4:  status = test_04_socket_endpoint(); break;
+        case 5:  status = test_05_socket_authority(); break;
+        case 6:  status = test_06_connection_request(); break;
+        case 7:  status = test_07_connection_send(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,136 @@
+/* test_table_unit.c: Test Hash Table of strings to values (Unit) */
+
+#include "mq/table.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+/* Constants */
+
+char * KEYS[] = {
+    "k0", "k1", "k2", "k3", "k4", NULL,
+};
+
+/* Functions */
+
+int test_00_table_create() {
+    Table *t = table_create(0);
+    assert(t);
+    assert(t->buckets);
+    assert(t->capacity > 0);
+    assert(t->size == 0);
+
+    table_delete(t, NULL);
+    return EXIT_SUCCESS;
+}
+
+int test_01_table_insert() {
+    Table *t = table_create(2);
+    assert(t);
+
+    for (size_t k = 0; KEYS[k]; k++) {
+        table_insert(t, KEYS[k], KEYS[k]);
+        assert(t->size == k + 1);
+    }
+
+    // Replacing a value does not add an entry
+    table_insert(t, KEYS[0], KEYS[1]);
+    assert(t->size == 5);
+
+    table_delete(t, NULL);
+    return EXIT_SUCCESS;
+}
+
+int test_02_table_search() {
+    Table *t = table_create(2);
+    assert(t);
+
+    for (size_t k = 0; KEYS[k]; k++) {
+        assert(table_search(t, KEYS[k]) == NULL);
+        table_insert(t, KEYS[k], KEYS[k]);
+    }
+
+    for (size_t k = 0; KEYS[k]; k++) {
+        assert(table_search(t, KEYS[k]) == KEYS[k]);
+    }
+    assert(table_search(t, "k5") == NULL);
+
+    table_insert(t, KEYS[0], KEYS[1]);
+    assert(table_search(t, KEYS[0]) == KEYS[1]);
+
+    table_delete(t, NULL);
+    return EXIT_SUCCESS;
+}
+
+int test_03_table_remove() {
+    Table *t = table_create(2);
+    assert(t);
+
+    for (size_t k = 0; KEYS[k]; k++) {
+        table_insert(t, KEYS[k], KEYS[k]);
+    }
+
+    for (size_t k = 0; KEYS[k]; k++) {
+        assert(table_remove(t, KEYS[k]) == KEYS[k]);
+        assert(table_remove(t, KEYS[k]) == NULL);
+        assert(table_search(t, KEYS[k]) == NULL);
+        assert(t->size == 4 - k);
+    }
+
+    table_delete(t, NULL);
+    return EXIT_SUCCESS;
+}
+
+int test_04_table_resize() {
+    Table *t = table_create(1);
+    char   key[BUFSIZ];
+    assert(t);
+
+    for (size_t k = 0; k < 1<<12; k++) {
+        snprintf(key, sizeof(key), "key%lu", k);
+        table_insert(t, key, strdup(key));
+    }
+    assert(t->size == 1<<12);
+    assert(t->capacity >= (1<<12) / 2);
+
+    for (size_t k = 0; k < 1<<12; k++) {
+        snprintf(key, sizeof(key), "key%lu", k);
+        char *value = table_search(t, key);
+        assert(value && streq(value, key));
+    }
+
+    table_delete(t, free);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test table_create\n");
+        fprintf(stderr, "    1. Test table_insert\n");
+        fprintf(stderr, "    2. Test table_search\n");
+        fprintf(stderr, "    3. Test table_remove\n");
+        fprintf(stderr, "    4. Test table_resize\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_table_create(); break;
+        case 1:  status = test_01_table_insert(); break;
+        case 2:  status = test_02_table_search(); break;
+        case 3:  status = test_03_table_remove(); break;
+        case 4:  status = test_04_table_resize(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */